@@ -10,9 +10,13 @@
 #include "memory.h"
 #include "vmm.h"
 #include "pmm.h"
+#include "pit.h"
+#include "util.h"
 
 #define APIC_BASE_MSR	0x1B
 
+#define APIC_REG_ID 0x20
+#define APIC_REG_EOI 0xB0
 #define APIC_REG_SPIV 0xF0
 #define APIC_REG_ICR_LOW 0x300
 #define APIC_REG_ICR_HIGH 0x310
@@ -23,9 +27,19 @@
 #define APIC_REG_LVT_LINT0 0x350
 #define APIC_REG_LVT_LINT1 0x360
 #define APIC_REG_LVT_ERROR 0x370
+#define APIC_REG_TIMER_INIT 0x380
+#define APIC_REG_TIMER_CURRENT 0x390
+
+#define APIC_ICR_PENDING		(1 << 12)
+#define APIC_ICR_SELF			(1 << 18)
+#define APIC_ICR_ALL_BUT_SELF	(3 << 18)
+
+#define APIC_TIMER_MASKED		(1 << 16)
+#define APIC_TIMER_DIV_16		0x3
 
 static paddr_t apic_base_phys;
 void *apic_base_virt;
+static uint32_t apic_timerTicksPerMs;		//Timerticks pro ms bei Teiler 16
 
 extern void *getFreePages(void *start, void *end, size_t pages);
 
@@ -44,10 +58,119 @@ void apic_Init()
 	vmm_Map(apic_base_virt, apic_base_phys,
 			VMM_FLAGS_GLOBAL | VMM_FLAGS_NX | VMM_FLAGS_WRITE | VMM_FLAGS_NO_CACHE, 0);
 
+	apic_InitLocal();
+}
+
+/*
+ * Aktiviert den lokalen APIC der aktuellen CPU
+ */
+void apic_InitLocal()
+{
 	//APIC aktivieren
 	apic_Write(APIC_REG_SPIV, 1 << 8);
 }
 
+/*
+ * Gibt die ID des lokalen APICs der aktuellen CPU zurück
+ */
+uint8_t apic_getId()
+{
+	return apic_Read(APIC_REG_ID) >> 24;
+}
+
+/*
+ * Signalisiert dem lokalen APIC das Ende eines von ihm ausgelösten Interrupts
+ */
+void apic_EOI()
+{
+	apic_Write(APIC_REG_EOI, 0);
+}
+
+/*
+ * Sendet einen Inter-Prozessor-Interrupt und wartet, bis er zugestellt wurde
+ *
+ * Parameter:	dest = APIC-ID der Ziel-CPU
+ * 				command = Unterer Teil des ICR (Vektor und Zustellmodus)
+ */
+void apic_SendIPI(uint8_t dest, uint32_t command)
+{
+	apic_Write(APIC_REG_ICR_HIGH, (uint32_t)dest << 24);
+	apic_Write(APIC_REG_ICR_LOW, command);
+	while(apic_Read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING) asm volatile("pause");
+}
+
+/*
+ * Sendet einen Interrupt an alle CPUs ausser der aktuellen
+ *
+ * Parameter:	vector = Interruptvektor
+ */
+void apic_BroadcastIPI(uint8_t vector)
+{
+	apic_Write(APIC_REG_ICR_LOW, APIC_ICR_ALL_BUT_SELF | vector);
+	while(apic_Read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING) asm volatile("pause");
+}
+
+/*
+ * Sendet einen Interrupt an die aktuelle CPU. Er wird ausgelöst, sobald die
+ * Interrupts wieder aktiviert sind.
+ *
+ * Parameter:	vector = Interruptvektor
+ */
+void apic_SendSelfIPI(uint8_t vector)
+{
+	apic_Write(APIC_REG_ICR_LOW, APIC_ICR_SELF | vector);
+	while(apic_Read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING) asm volatile("pause");
+}
+
+/*
+ * Misst die Frequenz des APIC-Timers anhand des PIT. Interrupts müssen
+ * aktiviert sein.
+ */
+void apic_CalibrateTimer()
+{
+	apic_Write(APIC_REG_DIV_CONFIG, APIC_TIMER_DIV_16);
+	apic_Write(APIC_REG_LVT_TIMER, APIC_TIMER_MASKED);
+
+	//Auf den Anfang einer ms warten, damit die Messung genauer wird
+	uint64_t start = pit_getUptime();
+	while(pit_getUptime() == start) asm volatile("hlt");
+
+	apic_Write(APIC_REG_TIMER_INIT, 0xFFFFFFFF);
+	Sleep(10);
+	uint32_t elapsed = 0xFFFFFFFF - apic_Read(APIC_REG_TIMER_CURRENT);
+	apic_Write(APIC_REG_TIMER_INIT, 0);
+
+	apic_timerTicksPerMs = elapsed / 10 ? : 1;
+}
+
+/*
+ * Lässt den APIC-Timer der aktuellen CPU einmalig nach msec Millisekunden einen
+ * Interrupt auslösen. Ein vorher gestarteter Timer wird dabei ersetzt.
+ * apic_CalibrateTimer() muss vorher aufgerufen worden sein.
+ *
+ * Parameter:	vector = Interruptvektor, der ausgelöst werden soll
+ * 				msec = Zeit bis zum Interrupt in ms
+ */
+void apic_StartTimer(uint8_t vector, uint64_t msec)
+{
+	//Zu lange Zeiten werden gekürzt, der Interrupt kommt dann einfach zu früh
+	if(msec > 0xFFFFFFFF / apic_timerTicksPerMs)
+		msec = 0xFFFFFFFF / apic_timerTicksPerMs;
+
+	apic_Write(APIC_REG_DIV_CONFIG, APIC_TIMER_DIV_16);
+	apic_Write(APIC_REG_LVT_TIMER, vector);
+	apic_Write(APIC_REG_TIMER_INIT, apic_timerTicksPerMs * msec);
+}
+
+/*
+ * Stoppt den APIC-Timer der aktuellen CPU
+ */
+void apic_StopTimer()
+{
+	apic_Write(APIC_REG_LVT_TIMER, APIC_TIMER_MASKED);
+	apic_Write(APIC_REG_TIMER_INIT, 0);
+}
+
 /*
  * Ein APIC-Register auslesen
  *
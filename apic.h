@@ -12,7 +12,16 @@
 #include "stdint.h"
 
 void apic_Init();
+void apic_InitLocal();
 bool apic_available();
+uint8_t apic_getId();
+void apic_EOI();
+void apic_SendIPI(uint8_t dest, uint32_t command);
+void apic_BroadcastIPI(uint8_t vector);
+void apic_SendSelfIPI(uint8_t vector);
+void apic_CalibrateTimer();
+void apic_StartTimer(uint8_t vector, uint64_t msec);
+void apic_StopTimer();
 uint32_t apic_Read(uintptr_t offset);
 void apic_Write(uintptr_t offset, uint32_t value);
 
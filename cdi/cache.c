@@ -7,26 +7,58 @@
 
 #include "cache.h"
 #include "stdbool.h"
-#include "lists.h"
 #include "stdlib.h"
+#include "pmm.h"
+#include "memory.h"
+#include "lock.h"
+#include "shrinker.h"
+#include "scheduler.h"
 
-typedef struct{
+#define CACHE_MIN_BLOCKS		256		//So viele Blöcke darf ein Cache immer belegen, darüber nur bei genügend freiem Speicher
+#define CACHE_MEMORY_SHARE		32		//Die Hashtabelle ist für 1/32 des freien Speichers ausgelegt
+#define CACHE_HASH_MULTIPLIER	0x9E3779B97F4A7C15ULL
+
+#define MAX(a, b)				((a > b) ? a : b)
+
+typedef struct block{
 		struct cdi_cache_block block;
 
 		bool dirty;
 
+		//Der Block wird gerade gelesen oder geschrieben, der Lock ist dabei nicht gehalten
+		bool busy;
+
+		//Lesen ist fehlgeschlagen, der Block ist nicht mehr in der Hashtabelle
+		bool failed;
+
 		size_t ref_count;
+
+		//Nächster Block im selben Hashbucket
+		struct block *hash_next;
+
+		//LRU-Liste der unbenutzten Blöcke (ref_count == 0)
+		struct block *lru_prev, *lru_next;
+
+		//Liste der veränderten Blöcke
+		struct block *dirty_prev, *dirty_next;
 }block_t;
 
 typedef struct{
 		struct cdi_cache cache;
 
 		size_t private_len;
-		size_t block_count;
 		size_t block_used;
+		size_t lru_count;
+
+		//Hashtabelle über die Blocknummern
+		block_t **buckets;
+		size_t bucket_mask;
+
+		//Unbenutzte Blöcke, lru_head wurde zuletzt verwendet, lru_tail am längsten nicht mehr
+		block_t *lru_head, *lru_tail;
 
-		//Liste aller Blöcke
-		cdi_list_t blocks;
+		//Veränderte Blöcke
+		block_t *dirty_head;
 
 		/** Callback zum Lesen eines Blocks */
 		cdi_cache_read_block_t* read_block;
@@ -36,11 +68,228 @@ typedef struct{
 
 		//Letzter Parameter für die Callbacks
 		void *prv_data;
+
+		//Schützt die Listen und die Hashtabelle, wird während Ein- und Ausgaben nicht gehalten
+		lock_t lock;
+		shrinker_t shrinker;
 }cache_t;
 
+//Von allen Caches belegter Speicher in Bytes
+static volatile size_t cache_totalSize = 0;
+
+static inline size_t hash_index(cache_t *c, uint64_t blocknum)
+{
+	return (blocknum * CACHE_HASH_MULTIPLIER >> 32) & c->bucket_mask;
+}
+
+static block_t *hash_find(cache_t *c, uint64_t blocknum)
+{
+	block_t *b;
+	for(b = c->buckets[hash_index(c, blocknum)]; b != NULL; b = b->hash_next)
+	{
+		if(b->block.number == blocknum)
+			return b;
+	}
+	return NULL;
+}
+
+static void hash_insert(cache_t *c, block_t *b)
+{
+	block_t **bucket = &c->buckets[hash_index(c, b->block.number)];
+	b->hash_next = *bucket;
+	*bucket = b;
+}
+
+static void hash_remove(cache_t *c, block_t *b)
+{
+	block_t **p;
+	for(p = &c->buckets[hash_index(c, b->block.number)]; *p != NULL; p = &(*p)->hash_next)
+	{
+		if(*p == b)
+		{
+			*p = b->hash_next;
+			b->hash_next = NULL;
+			return;
+		}
+	}
+}
+
+static void lru_remove(cache_t *c, block_t *b)
+{
+	if(b->lru_prev != NULL)
+		b->lru_prev->lru_next = b->lru_next;
+	else
+		c->lru_head = b->lru_next;
+	if(b->lru_next != NULL)
+		b->lru_next->lru_prev = b->lru_prev;
+	else
+		c->lru_tail = b->lru_prev;
+	b->lru_prev = b->lru_next = NULL;
+	c->lru_count--;
+}
+
+static void lru_push(cache_t *c, block_t *b)
+{
+	b->lru_prev = NULL;
+	b->lru_next = c->lru_head;
+	if(c->lru_head != NULL)
+		c->lru_head->lru_prev = b;
+	else
+		c->lru_tail = b;
+	c->lru_head = b;
+	c->lru_count++;
+}
+
+//Fügt einen Block als am längsten nicht mehr verwendet ein
+static void lru_append(cache_t *c, block_t *b)
+{
+	b->lru_next = NULL;
+	b->lru_prev = c->lru_tail;
+	if(c->lru_tail != NULL)
+		c->lru_tail->lru_next = b;
+	else
+		c->lru_head = b;
+	c->lru_tail = b;
+	c->lru_count++;
+}
+
+static void dirty_add(cache_t *c, block_t *b)
+{
+	if(b->dirty)
+		return;
+	b->dirty = true;
+	b->dirty_prev = NULL;
+	b->dirty_next = c->dirty_head;
+	if(c->dirty_head != NULL)
+		c->dirty_head->dirty_prev = b;
+	c->dirty_head = b;
+}
+
+static void dirty_remove(cache_t *c, block_t *b)
+{
+	if(!b->dirty)
+		return;
+	b->dirty = false;
+	if(b->dirty_prev != NULL)
+		b->dirty_prev->dirty_next = b->dirty_next;
+	else
+		c->dirty_head = b->dirty_next;
+	if(b->dirty_next != NULL)
+		b->dirty_next->dirty_prev = b->dirty_prev;
+	b->dirty_prev = b->dirty_next = NULL;
+}
+
+//Benutzte Blöcke dürfen nicht verdrängt werden
+static void block_ref(cache_t *c, block_t *b)
+{
+	if(b->ref_count++ == 0)
+		lru_remove(c, b);
+}
+
+static void block_unref(cache_t *c, block_t *b)
+{
+	if(--b->ref_count == 0)
+		lru_push(c, b);
+}
+
+/*
+ * Wartet, bis die laufende Ein- oder Ausgabe eines Blocks fertig ist. Der Aufrufer hält den Lock
+ * und eine Referenz auf den Block.
+ */
+static void block_wait(cache_t *c, block_t *b)
+{
+	while(b->busy)
+	{
+		unlock(&c->lock);
+		yield();
+		lock(&c->lock);
+	}
+}
+
+/*
+ * Schreibt einen einzelnen Block zurück, falls er verändert wurde. Der Aufrufer hält den Lock und
+ * eine Referenz auf den Block. Während des Schreibens wird der Lock freigegeben, wird der Block
+ * dabei erneut verändert, bleibt er in der Liste der veränderten Blöcke.
+ *
+ * @return true bei Erfolg, false im Fehlerfall
+ */
+static bool block_writeback(cache_t *c, block_t *b)
+{
+	bool success;
+
+	block_wait(c, b);
+	if(!b->dirty)
+		return true;
+	dirty_remove(c, b);
+	b->busy = true;
+	unlock(&c->lock);
+
+	success = c->write_block(&c->cache, b->block.number, 1, b->block.data, c->prv_data);
+
+	lock(&c->lock);
+	b->busy = false;
+	if(!success)
+		dirty_add(c, b);
+	return success;
+}
+
+static size_t block_size(cache_t *c)
+{
+	return sizeof(block_t) + c->cache.block_size + c->private_len;
+}
+
+static void block_free(cache_t *c, block_t *b)
+{
+	free(b->block.data);
+	free(b->block.private);
+	free(b);
+	c->block_used--;
+	__sync_fetch_and_sub(&cache_totalSize, block_size(c));
+}
+
+/*
+ * Shrinker: Anzahl Pages der unbenutzten Blöcke
+ */
+static size_t cache_shrink_count(void *opaque)
+{
+	cache_t *c = opaque;
+	return c->lru_count * block_size(c) / MM_BLOCK_SIZE;
+}
+
+/*
+ * Shrinker: Gibt unbenutzte, unveränderte Blöcke frei, die am längsten nicht verwendet wurden.
+ * Veränderte Blöcke werden nicht zurückgeschrieben, weil dabei blockiert werden könnte.
+ */
+static size_t cache_shrink_scan(size_t pages, void *opaque)
+{
+	cache_t *c = opaque;
+	size_t freed = 0;
+	block_t *b, *prev;
+
+	if(!try_lock(&c->lock))
+		return 0;
+	for(b = c->lru_tail; b != NULL && freed < pages * MM_BLOCK_SIZE; b = prev)
+	{
+		prev = b->lru_prev;
+		if(b->dirty)
+			continue;
+		lru_remove(c, b);
+		hash_remove(c, b);
+		block_free(c, b);
+		freed += block_size(c);
+	}
+	unlock(&c->lock);
+
+	return (freed + MM_BLOCK_SIZE - 1) / MM_BLOCK_SIZE;
+}
+
 /**
  * Cache erstellen
  *
+ * Der Cache wächst, solange genügend physischer Speicher frei ist, und wird bei
+ * Speichermangel über den Shrinker wieder verkleinert. Mindestens CACHE_MIN_BLOCKS
+ * Blöcke darf er immer belegen.
+ *
  * @param block_size    Groesse der Blocks die der Cache verwalten soll
  * @param blkpriv_len   Groesse der privaten Daten die fuer jeden Block
  *                      alloziert werden und danach vom aurfrufer frei benutzt
@@ -59,7 +308,10 @@ struct cdi_cache* cdi_cache_create(size_t block_size, size_t blkpriv_len,
     void* prv_data)
 {
 		cache_t *cache;
+		size_t block_count, buckets;
 		cache = malloc(sizeof(*cache));
+		if(cache == NULL)
+			return NULL;
 
 		cache->cache.block_size = block_size;
 		cache->prv_data = prv_data;
@@ -67,9 +319,32 @@ struct cdi_cache* cdi_cache_create(size_t block_size, size_t blkpriv_len,
 		cache->read_block = read_block;
 		cache->write_block = write_block;
 
-		cache->block_count = 256;
+		block_count = MAX((size_t)CACHE_MIN_BLOCKS,
+				pmm_getFreePages() * MM_BLOCK_SIZE / CACHE_MEMORY_SHARE / block_size);
 		cache->block_used = 0;
-		cache->blocks = cdi_list_create();
+		cache->lru_count = 0;
+
+		//Anzahl Buckets ist die nächste Zweierpotenz >= block_count
+		for(buckets = 1; buckets < block_count; buckets <<= 1);
+		cache->buckets = calloc(buckets, sizeof(*cache->buckets));
+		if(cache->buckets == NULL)
+		{
+			free(cache);
+			return NULL;
+		}
+		cache->bucket_mask = buckets - 1;
+
+		cache->lru_head = cache->lru_tail = NULL;
+		cache->dirty_head = NULL;
+
+		cache->lock = LOCK_UNLOCKED;
+		cache->shrinker = (shrinker_t){
+			.name = "cdi_cache",
+			.count = cache_shrink_count,
+			.scan = cache_shrink_scan,
+			.opaque = cache
+		};
+		shrinker_Register(&cache->shrinker);
 
 		return (struct cdi_cache*)cache;
 }
@@ -80,21 +355,24 @@ struct cdi_cache* cdi_cache_create(size_t block_size, size_t blkpriv_len,
 void cdi_cache_destroy(struct cdi_cache* cache)
 {
 	cache_t *c;
+	size_t i;
 	c = (cache_t*)cache;
 
+	shrinker_Unregister(&c->shrinker);
 	cdi_cache_sync(cache);
 
 	//Erst reservierte Blocks freigeben
-	while(c->block_used)
+	for(i = 0; i <= c->bucket_mask; i++)
 	{
-		block_t *b = (block_t*)cdi_list_pop(c->blocks);
-		free(b->block.data);
-		free(b->block.private);
-		free(b);
-		c->block_used--;
+		block_t *b;
+		while((b = c->buckets[i]) != NULL)
+		{
+			c->buckets[i] = b->hash_next;
+			block_free(c, b);
+		}
 	}
 
-	cdi_list_destroy(c->blocks);
+	free(c->buckets);
 	free(c);
 }
 
@@ -117,70 +395,103 @@ struct cdi_cache_block* cdi_cache_block_get(struct cdi_cache* cache,
 {
 	cache_t *c;
 	block_t *b;
+	bool success;
 	c = (cache_t*)cache;
 
+	lock(&c->lock);
+
 	//Erst suchen, ob er nicht schon vorhanden ist
-	size_t i = 0;
-	while((b = cdi_list_get(c->blocks, i++)))
+	while((b = hash_find(c, blocknum)) == NULL)
 	{
-		if(b->block.number == blocknum)
-			goto end;
-	}
+		if(c->block_used < CACHE_MIN_BLOCKS || c->lru_tail == NULL || shrinker_canGrow())
+			break;
 
-	if(c->block_used < c->block_count)
-	{
-		//Neuen Block in Cache legen
-		b = calloc(1, sizeof(*b));
-		b->block.data = malloc(c->cache.block_size);
-		b->block.private = malloc(c->private_len);
-		b->block.number = blocknum;
-		cdi_list_push(c->blocks, b);
-		c->block_used++;
+		//Den am längsten nicht mehr verwendeten Block wiederverwenden
+		b = c->lru_tail;
+		if(!b->dirty)
+		{
+			lru_remove(c, b);
+			hash_remove(c, b);
+			goto load;
+		}
+
+		//Nur diesen Block zurückschreiben, nicht den ganzen Cache. Danach neu suchen, weil
+		//sich der Cache währenddessen verändert haben kann.
+		block_ref(c, b);
+		success = block_writeback(c, b);
+		//Der Block wurde nicht verwendet und bleibt deshalb als Nächster zum Verdrängen am Ende
+		if(--b->ref_count == 0)
+			lru_append(c, b);
+		if(!success)
+		{
+			unlock(&c->lock);
+			return NULL;
+		}
 	}
-	else
+
+	if(b != NULL)
 	{
-		//Nach einem Block suchen, der nicht mehr verwendet wird
-		size_t i = 0;
-		while((b = cdi_list_get(c->blocks, i)))
+		block_ref(c, b);
+		block_wait(c, b);
+		if(b->failed)
 		{
-			if(!b->ref_count)
-				break;
+			if(--b->ref_count == 0)
+				block_free(c, b);
+			b = NULL;
 		}
-		if(b == NULL)
-			return NULL;
+		unlock(&c->lock);
+		return b ? &b->block : NULL;
+	}
 
-		if(b->dirty)
-			cdi_cache_sync(cache);
-		b->block.number = blocknum;
+	//Neuen Block in Cache legen
+	b = calloc(1, sizeof(*b));
+	if(b == NULL)
+	{
+		unlock(&c->lock);
+		return NULL;
+	}
+	b->block.data = malloc(c->cache.block_size);
+	b->block.private = malloc(c->private_len);
+	if(b->block.data == NULL || (b->block.private == NULL && c->private_len > 0))
+	{
+		free(b->block.data);
+		free(b->block.private);
+		free(b);
+		unlock(&c->lock);
+		return NULL;
 	}
+	c->block_used++;
+	__sync_fetch_and_add(&cache_totalSize, block_size(c));
+
+	load:
+	//Der Block ist schon in der Hashtabelle, damit andere auf das Einlesen warten
+	b->block.number = blocknum;
+	b->ref_count = 1;
+	b->failed = false;
+	hash_insert(c, b);
 
 	//Block einlesen, wenn nötig
 	if(!noread)
 	{
-		if(!c->read_block(cache, blocknum, 1, b->block.data, c->prv_data))
+		b->busy = true;
+		unlock(&c->lock);
+		success = c->read_block(cache, blocknum, 1, b->block.data, c->prv_data);
+		lock(&c->lock);
+		b->busy = false;
+
+		if(!success)
 		{
-			//Fehler: Cacheblock wieder freigeben
-			block_t *tmp;
-			size_t i = 0;
-			while((tmp = cdi_list_get(c->blocks, i)))
-			{
-				if(tmp == b)
-				{
-					free(b->block.data);
-					free(b->block.private);
-					free(b);
-					cdi_list_remove(c->blocks, i);
-					c->block_used--;
-					return NULL;
-				}
-				i++;
-			}
+			//Fehler: Cacheblock wieder freigeben, sobald ihn niemand mehr verwendet
+			hash_remove(c, b);
+			b->failed = true;
+			if(--b->ref_count == 0)
+				block_free(c, b);
+			unlock(&c->lock);
+			return NULL;
 		}
 	}
 
-	end:
-	b->ref_count++;
-
+	unlock(&c->lock);
 	return &b->block;
 }
 
@@ -193,8 +504,9 @@ struct cdi_cache_block* cdi_cache_block_get(struct cdi_cache* cache,
 void cdi_cache_block_release(struct cdi_cache* cache,
     struct cdi_cache_block* block)
 {
+	cache_t *c = (cache_t*)cache;
 	block_t *b = (block_t*)block;
-	b->ref_count--;
+	LOCKED_TASK(c->lock, block_unref(c, b));
 }
 
 /**
@@ -205,19 +517,25 @@ void cdi_cache_block_release(struct cdi_cache* cache,
 int cdi_cache_sync(struct cdi_cache* cache)
 {
 	cache_t *c = (cache_t*)cache;
-	block_t *b;
-	size_t i = 0;
+	int result = 1;
 
-	while((b = (block_t*)cdi_list_get(c->blocks, i++)))
+	lock(&c->lock);
+	while(c->dirty_head != NULL)
 	{
-		if(b->dirty)
+		block_t *b = c->dirty_head;
+		bool success;
+
+		block_ref(c, b);
+		success = block_writeback(c, b);
+		block_unref(c, b);
+		if(!success)
 		{
-			if(!c->write_block(cache, b->block.number, 1, b->block.data, c->prv_data))
-				return 0;
-			b->dirty = false;
+			result = 0;
+			break;
 		}
 	}
-	return 1;
+	unlock(&c->lock);
+	return result;
 }
 
 /**
@@ -228,6 +546,14 @@ int cdi_cache_sync(struct cdi_cache* cache)
  */
 void cdi_cache_block_dirty(struct cdi_cache* cache, struct cdi_cache_block* block)
 {
-	block_t *b = (block_t*)block;
-	b->dirty = true;
+	cache_t *c = (cache_t*)cache;
+	LOCKED_TASK(c->lock, dirty_add(c, (block_t*)block));
+}
+
+/*
+ * Gibt den von allen Caches belegten Speicher in Bytes zurück (nicht Teil von CDI)
+ */
+size_t cdi_cache_getTotalSize(void)
+{
+	return cache_totalSize;
 }
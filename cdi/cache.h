@@ -112,6 +112,11 @@ void cdi_cache_block_release(struct cdi_cache* cache,
 void cdi_cache_block_dirty(struct cdi_cache* cache,
     struct cdi_cache_block* block);
 
+/**
+ * Gesamter von allen Caches belegter Speicher in Bytes (kernelspezifisch)
+ */
+size_t cdi_cache_getTotalSize(void);
+
 #ifdef __cplusplus
 }; // extern "C"
 #endif
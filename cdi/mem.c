@@ -160,5 +160,76 @@ struct cdi_mem_area* cdi_mem_map(uintptr_t paddr, size_t size)
  */
 void cdi_mem_free(struct cdi_mem_area* p)
 {
-	vmm_SysFree((uintptr_t)p->vaddr, p->size / 4096);
+	//Speicher von cdi_mem_alloc liegt in der Direct Map
+	if(vmm_isDirectMapped(p->vaddr))
+		vmm_FreeDMA(p->vaddr, p->size / MM_BLOCK_SIZE);
+	else
+		vmm_SysFree((uintptr_t)p->vaddr, p->size / 4096);
+}
+
+/**
+ * \german
+ * Erstellt eine Scatter/Gather-Liste für einen bereits gemappten virtuellen
+ * Speicherbereich im aktuellen Kontext
+ * \endgerman
+ * \english
+ * Creates a scatter/gather list for an already mapped area of virtual memory
+ * in the current context
+ * \endenglish
+ *
+ * Nur Kernelspeicher wird unterstützt: Userspace-Pages können während der
+ * Übertragung ausgelagert, migriert oder per Copy-on-write ersetzt werden.
+ */
+int cdi_mem_sg_from_buffer(void* vaddr, size_t size, struct cdi_mem_sg_list* list)
+{
+	struct cdi_mem_sg_item *items;
+	uintptr_t addr = (uintptr_t)vaddr;
+	uintptr_t end = addr + size;
+	size_t num = 0;
+
+	if(size == 0 || end < addr || end - 1 > KERNELSPACE_END)
+		return -1;
+
+	//Höchstens ein Eintrag pro angefangene Page
+	items = malloc(((end - 1) / MM_BLOCK_SIZE - addr / MM_BLOCK_SIZE + 1) * sizeof(*items));
+	if(items == NULL)
+		return -1;
+
+	while(addr < end)
+	{
+		void *page = (void*)(addr & ~(MM_BLOCK_SIZE - 1));
+		uintptr_t page_end = (uintptr_t)page + MM_BLOCK_SIZE;
+		size_t len = ((page_end < end) ? page_end : end) - addr;
+		paddr_t paddr;
+
+		if(vmm_getPageStatus(page))
+		{
+			free(items);
+			return -1;
+		}
+
+		//Ungenutzte Pages werden durch den Zugriff vom Pagefault-Handler eingelagert
+		*(volatile uint8_t*)page;
+
+		paddr = vmm_getPhysAddress(page) + (addr - (uintptr_t)page);
+
+		if(num > 0 && items[num - 1].start + items[num - 1].size == paddr)
+		{
+			items[num - 1].size += len;
+		}
+		else
+		{
+			items[num++] = (struct cdi_mem_sg_item){
+				.start = paddr,
+				.size = len
+			};
+		}
+
+		addr += len;
+	}
+
+	list->num = num;
+	list->items = items;
+
+	return 0;
 }
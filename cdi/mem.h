@@ -247,6 +247,43 @@ struct cdi_mem_area* cdi_mem_require_flags(struct cdi_mem_area* p,
  */
 int cdi_mem_copy(struct cdi_mem_area* dest, struct cdi_mem_area* src);
 
+/**
+ * \german
+ * Erstellt eine Scatter/Gather-Liste für einen bereits gemappten virtuellen
+ * Speicherbereich im Kernelspace (z.B. einen Puffer auf dem Kernel-Heap), so
+ * dass ein Treiber direkt dorthin DMA machen kann. Noch nicht benutzte Pages
+ * werden dabei eingelagert, physisch aufeinanderfolgende Pages werden zu
+ * einem Eintrag zusammengefasst.
+ *
+ * Puffer des Userspaces und Adressen in der Direct Map werden abgelehnt: Pages
+ * des Userspaces können während der Übertragung ausgelagert, verschoben oder
+ * per Copy-on-write ersetzt werden. Für solche Puffer muss der Treiber einen
+ * Bounce-Buffer verwenden.
+ *
+ * Die Einträge müssen mit free(list->items) freigegeben werden.
+ *
+ * @return 0 bei Erfolg, -1 wenn der Bereich nicht im Kernelspace liegt oder
+ * ein Teil davon nicht gemappt ist
+ * \endgerman
+ * \english
+ * Creates a scatter/gather list for an already mapped area of virtual memory
+ * in kernel space (e.g. a buffer on the kernel heap), so that a driver can
+ * DMA to it directly. Pages that are not in use yet are faulted in,
+ * physically adjacent pages are merged into one entry.
+ *
+ * User space buffers and addresses in the direct map are rejected: user pages
+ * can be swapped out, migrated or replaced by copy-on-write while the transfer
+ * is running. For such buffers the driver has to use a bounce buffer.
+ *
+ * The entries must be freed with free(list->items).
+ *
+ * @return 0 on success, -1 if the area is not in kernel space or a part of it
+ * is not mapped
+ * \endenglish
+ */
+int cdi_mem_sg_from_buffer(void* vaddr, size_t size,
+    struct cdi_mem_sg_list* list);
+
 #ifdef __cplusplus
 }; // extern "C"
 #endif
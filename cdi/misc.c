@@ -9,6 +9,10 @@
 #include "isr.h"
 #include "stdlib.h"
 #include "util.h"
+#include "pit.h"
+#include "cpu.h"
+#include "lock.h"
+#include "scheduler.h"
 
 typedef struct{
 		uint8_t IRQ;
@@ -16,9 +20,49 @@ typedef struct{
 		struct cdi_device *Device;
 }Handler_t;
 
+//Eintrag in der Warteschlange eines IRQs. Liegt auf dem Stack des wartenden Threads.
+typedef struct irq_waiter{
+		thread_t *thread;
+		uint8_t irq;
+		uint64_t deadline;
+		struct irq_waiter *next;
+}irq_waiter_t;
+
 cdi_list_t IRQHandlers;
 uint64_t IRQCount[NUM_IRQ];
 
+static irq_waiter_t *IRQWaiters[NUM_IRQ];
+static lock_t IRQWaiters_lock = LOCK_UNLOCKED;
+
+/*
+ * Weckt alle Threads auf, die auf den IRQ warten. Wird im Interruptkontext
+ * aufgerufen. Kann ein Thread nicht aufgeweckt werden, so weckt ihn spätestens
+ * sein Timeout auf.
+ */
+static void cdi_wake_irq_waiters(uint8_t irq)
+{
+	irq_waiter_t *waiter;
+
+	if(IRQWaiters[irq] == NULL)
+		return;
+
+	//Der Lock wird nur mit deaktivierten Interrupts gehalten, es kann also nur
+	//eine andere CPU sein, die ihn kurz hält
+	lock(&IRQWaiters_lock);
+	for(waiter = IRQWaiters[irq]; waiter != NULL; waiter = waiter->next)
+		thread_try_unblock(waiter->thread);
+	unlock(&IRQWaiters_lock);
+}
+
+/*
+ * Prüft, ob ein Thread nicht mehr auf seinen IRQ warten muss
+ */
+static bool cdi_irq_wait_done(void *w)
+{
+	irq_waiter_t *waiter = w;
+	return IRQCount[waiter->irq] || pit_getUptime() >= waiter->deadline;
+}
+
 void cdi_irq_handler(uint8_t irq)
 {
 	IRQCount[irq]++;
@@ -34,6 +78,8 @@ void cdi_irq_handler(uint8_t irq)
 				Handler->Handler(Handler->Device);
 		}
 	}
+
+	cdi_wake_irq_waiters(irq);
 }
 
 /**
@@ -95,18 +141,64 @@ int cdi_reset_wait_irq(uint8_t irq)
  */
 int cdi_wait_irq(uint8_t irq, uint32_t timeout)
 {
-	uint64_t Time = 0;
-	if(irq > NUM_IRQ)
+	irq_waiter_t waiter, **prev;
+	uint64_t deadline;
+	void *timer;
+	bool enabled;
+
+	if(irq >= NUM_IRQ)
 		return -1;
 
-	while(!IRQCount[irq])
+	if(IRQCount[irq])
+		return 0;
+	if(timeout == 0)
+		return -1;
+
+	//Ohne Scheduler kann nicht blockiert werden
+	if(currentThread == NULL)
 	{
-		cdi_sleep_ms(10);
-		Time += 10;
-		if(Time > timeout)
-			return -1;
+		uint64_t start = pit_getUptime();
+		while(!IRQCount[irq])
+		{
+			if(pit_getUptime() - start >= timeout)
+				return -1;
+			asm volatile("hlt");
+		}
+		return 0;
 	}
-	return 0;
+
+	deadline = pit_getUptime() + timeout;
+	timer = pit_RegisterTimeout(currentThread, timeout);
+
+	//Bis der Thread blockiert ist, darf der IRQ nicht kommen, sonst würde das
+	//Aufwecken verloren gehen
+	enabled = cpu_disableInterrupts();
+
+	waiter = (irq_waiter_t){
+		.thread = currentThread,
+		.irq = irq,
+		.deadline = deadline
+	};
+	lock(&IRQWaiters_lock);
+	waiter.next = IRQWaiters[irq];
+	IRQWaiters[irq] = &waiter;
+	unlock(&IRQWaiters_lock);
+
+	//Der IRQ kann auch auf einer anderen CPU kommen, deshalb wird die Bedingung
+	//erst nach dem Blockieren nochmals geprüft
+	while(!cdi_irq_wait_done(&waiter))
+		thread_block_self_unless(cdi_irq_wait_done, &waiter, THREAD_BLOCKED_WAIT_IRQ);
+
+	lock(&IRQWaiters_lock);
+	for(prev = &IRQWaiters[irq]; *prev != &waiter; prev = &(*prev)->next);
+	*prev = waiter.next;
+	unlock(&IRQWaiters_lock);
+
+	cpu_restoreInterrupts(enabled);
+
+	pit_CancelTimeout(timer);
+
+	return IRQCount[irq] ? 0 : -1;
 }
 
 //TODO: Eventuell ist es besser die Ports auch zu verwalten
@@ -136,5 +228,17 @@ int cdi_ioports_free(uint16_t start, uint16_t count)
  */
 void cdi_sleep_ms(uint32_t ms)
 {
-	Sleep((uint64_t)ms);
+	//Vor dem Start des Schedulers und in Interrupthandlern kann nur aktiv gewartet werden
+	if(currentThread != NULL && cpu_interruptsEnabled())
+		pit_RegisterTimer(currentThread, ms);
+	else
+		Sleep((uint64_t)ms);
+}
+
+/**
+ * Gibt die Anzahl Millisekunden seit dem Start des Systems zurueck
+ */
+uint64_t cdi_elapsed_ms(void)
+{
+	return pit_getUptime();
 }
@@ -77,6 +77,18 @@ struct cdi_storage_device {
      * \endenglish
      */
     uint64_t            block_count;
+
+    /**
+     * \german
+     * Der Treiber kann für dieses Gerät mehrere Lesezugriffe gleichzeitig
+     * bearbeiten. Schreibzugriffe werden trotzdem nacheinander ausgeführt.
+     * \endgerman
+     * \english
+     * The driver can handle several concurrent reads for this device. Writes
+     * are still issued one after another.
+     * \endenglish
+     */
+    bool                concurrent;
 };
 
 /**
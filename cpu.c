@@ -79,6 +79,7 @@ void cpu_Init()
 	cpuInfo.sse3 = Temp & 0x1;
 	cpuInfo.ssse3 = Temp & 0x200;
 	cpuInfo.sse4_1 = Temp & 0x80000;
+	cpuInfo.pcid = Temp & 0x20000;
 	if(cpuInfo.Vendor == INTEL)
 	{
 		cpuInfo.sse4_2 = Temp & 0x100000;
@@ -96,12 +97,19 @@ void cpu_Init()
 	cpuInfo.HyperThreading = Temp & 0x10000000;
 	cpuInfo.fxsr = Temp & (1 << 24);
 
+	//Ohne Global Pages müssten Kernelmappings in allen PCIDs invalidiert werden
+	cpuInfo.pcid = cpuInfo.pcid && cpuInfo.GlobalPage;
+
 	//Erweiterte Funktionen
 	cpuInfo.maxextCPUID = cpu_CPUID(0x80000000, EAX);
 
 	Temp = cpu_CPUID(0x80000001, EDX);
 	cpuInfo.nx = Temp & (1 << 20);
 	cpuInfo.syscall = Temp & (1 << 11);
+	cpuInfo.page1GB = Temp & (1 << 26);
+
+	if(cpuInfo.maxextCPUID >= 0x80000007)
+		cpuInfo.invariantTSC = cpu_CPUID(0x80000007, EDX) & (1 << 8);
 
 	//Namen des Prozessors
 	if(cpuInfo.maxextCPUID >= 0x80000003 && cpuInfo.Vendor == INTEL)
@@ -170,6 +178,17 @@ void cpu_Init()
 		printf("%s\n", cpuInfo.Name);
 	}
 
+	cpu_InitLocal();
+
+	SysLog("CPU", "Initialisierung abgeschlossen");
+}
+
+/*
+ * Aktiviert die von cpu_Init erkannten Features auf der aktuellen CPU. Wird auf
+ * der BSP von cpu_Init und auf jeder AP beim Start aufgerufen.
+ */
+void cpu_InitLocal()
+{
 	//Wenn AVX verfügbar ist, dann aktivieren wir es jetzt
 	if(cpuInfo.avx)
 	{
@@ -200,15 +219,23 @@ void cpu_Init()
 				"mov %%rax,%%cr4;"
 				: : :"rax");
 
+	//PCIDs aktivieren (CR3 enthält hier immer PCID 0)
+	if(cpuInfo.pcid)
+		asm volatile(
+				"mov %%cr4,%%rax;"
+				"or $1<<17,%%rax;"
+				"mov %%rax,%%cr4;"
+				: : :"rax");
+
 	//Caching aktivieren
 	asm volatile(
 			"mov %%cr0,%%rax;"
 			"btr $30,%%rax;"	//Cache disable bit deaktivieren
 			"btr $29,%%rax;"	//Write through auch deaktivieren sonst gibt es eine #GP-Exception
+			"bts $16,%%rax;"	//Write protect: Auch der Kernel löst beim Schreiben auf schreibgeschützte
+								//(z.B. copy-on-write) Pages einen Page Fault aus
 			"mov %%rax,%%cr0;"
 			: : :"rax");
-
-	SysLog("CPU", "Initialisierung abgeschlossen");
 }
 
 /*
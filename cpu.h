@@ -59,13 +59,63 @@ struct{
 		bool nx;
 		bool syscall;
 		bool fxsr;				//FXSAVE/FXRSTORE werden unterstützt
+		bool invariantTSC;		//TSC läuft unabhängig vom Energiezustand mit konstanter Frequenz
+		bool page1GB;			//1GB-Pages werden unterstützt
+		bool pcid;				//Process-Context Identifiers werden unterstützt (und verwendet)
 }cpuInfo;
 
 void cpu_Init(void);
+void cpu_InitLocal(void);
 uint32_t cpu_CPUID(uint32_t Funktion, CPU_REGISTER Register);
 uint64_t cpu_MSRread(uint32_t msr);
 void cpu_MSRwrite(uint32_t msr, uint64_t Value);
 
+#define CPU_MAX		32		//Maximale Anzahl unterstützter CPUs
+#define CPU_TSS_ENTRY	5		//GDT-Index der TSS der BSP, jede weitere CPU belegt die nächsten 2 Einträge
+
+//Gibt die Nummer der aktuellen CPU zurück (0 bis CPU_MAX - 1)
+//Die Nummer ergibt sich aus dem Selektor der geladenen TSS, da jede CPU ihre eigene TSS hat.
+//Damit das Ergebnis gültig bleibt, muss der Aufrufer Interrupts deaktiviert haben.
+static inline uint32_t cpu_getId(void)
+{
+	uint16_t tr;
+	asm volatile("str %0" : "=r"(tr));
+	uint32_t id = (uint32_t)(tr - (CPU_TSS_ENTRY << 3)) >> 4;
+	//Vor dem Laden des Taskregisters gibt es nur die BSP
+	return (id < CPU_MAX) ? id : 0;
+}
+
+//Liest den Time Stamp Counter
+static inline uint64_t cpu_readTSC(void)
+{
+	uint32_t low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+//Gibt zurück, ob Interrupts aktiviert sind
+static inline bool cpu_interruptsEnabled(void)
+{
+	uint64_t flags;
+	asm volatile("pushfq; pop %0" : "=r"(flags));
+	return flags & (1 << 9);
+}
+
+//Deaktiviert Interrupts und gibt zurück, ob sie vorher aktiviert waren
+static inline bool cpu_disableInterrupts(void)
+{
+	uint64_t flags;
+	asm volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+	return flags & (1 << 9);
+}
+
+//Aktiviert Interrupts wieder, wenn sie vor cpu_disableInterrupts() aktiviert waren
+static inline void cpu_restoreInterrupts(bool enabled)
+{
+	if(enabled)
+		asm volatile("sti" : : : "memory");
+}
+
 #endif /* CPU_H_ */
 
 #endif
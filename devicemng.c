@@ -34,6 +34,7 @@ void dmng_registerDevice(struct cdi_device *dev)
 	device->partitions = list_create();
 	device->device = dev;
 	semaphore_init(&device->semaphore, 1);
+	device->concurrent = dev->bus_data->bus_type == CDI_STORAGE && ((struct cdi_storage_device*)dev)->concurrent;
 
 	vfs_device_t *vfs_dev = malloc(sizeof(vfs_device_t));
 	vfs_dev->opaque = device;
@@ -71,14 +72,17 @@ size_t dmng_Read(void *d, uint64_t start, size_t size, void *buffer)
 			block_count = device->block_count - block_start;
 		void *block_buffer = malloc(device->block_size * block_count);
 
-		//Gerät reservieren
-		semaphore_acquire(&dev->semaphore);
+		//Gerät reservieren, wenn der Treiber nur eine Anfrage auf einmal bearbeiten kann
+		if(!dev->concurrent)
+			semaphore_acquire(&dev->semaphore);
 		if(driver->read_blocks(device, block_start, block_count, block_buffer))
 		{
-			semaphore_release(&dev->semaphore);
+			if(!dev->concurrent)
+				semaphore_release(&dev->semaphore);
 			return 0;
 		}
-		semaphore_release(&dev->semaphore);
+		if(!dev->concurrent)
+			semaphore_release(&dev->semaphore);
 
 		memcpy(buffer, block_buffer + start_offset, size);
 		free(block_buffer);
@@ -143,10 +147,14 @@ size_t dmng_Write(void *d, uint64_t start, size_t size, const void *buffer)
 		if(block_start + block_count > device->block_count)
 			block_count = device->block_count - block_start;
 		void *block_buffer = malloc(device->block_size * block_count);
+		//Nur angeschnittene Blöcke müssen vorher gelesen werden
+		bool partial = start_offset != 0 || size % device->block_size != 0;
 
-		//Gerät reservieren
+		//Gerät reservieren. Schreibzugriffe werden auch bei Treibern, die mehrere Anfragen annehmen,
+		//nacheinander ausgeführt, damit kein Schreibzugriff zwischen Lesen und Schreiben eines
+		//angeschnittenen Blocks verloren geht.
 		semaphore_acquire(&dev->semaphore);
-		if(driver->read_blocks(device, block_start, block_count, block_buffer))
+		if(partial && driver->read_blocks(device, block_start, block_count, block_buffer))
 		{
 			semaphore_release(&dev->semaphore);
 			return 0;
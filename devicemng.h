@@ -21,6 +21,7 @@ typedef struct{
 	struct cdi_device *device;
 	list_t partitions;
 	semaphore_t semaphore;
+	bool concurrent;			//Der Treiber nimmt mehrere Leseanfragen gleichzeitig an
 }device_t;
 
 void dmng_Init(void);
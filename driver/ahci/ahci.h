@@ -35,17 +35,26 @@
 #define BIT(x) (1 << x)
 
 #define MAX_PORTS 32
+#define MAX_CMD_SLOTS 32
 #define FIS_BYTES 256
 #define CMD_LIST_BYTES 1024
-#define CMD_TABLE_BYTES (sizeof(struct cmd_table) * sizeof(struct ahci_prd))
+#define CMD_TABLE_PRDS 120
+#define CMD_TABLE_BYTES \
+    (sizeof(struct cmd_table) + CMD_TABLE_PRDS * sizeof(struct ahci_prd))
+
+/* Largest transfer that is issued as a single command */
+#define AHCI_MAX_REQUEST_BYTES (128 * 1024)
 
 #define AHCI_IRQ_TIMEOUT 5000 /* ms */
+#define AHCI_POLL_INTERVAL 10 /* ms */
 
 enum {
     ATA_CMD_READ_DMA            = 0xc8,
     ATA_CMD_READ_DMA_EXT        = 0x25,
     ATA_CMD_WRITE_DMA           = 0xca,
     ATA_CMD_WRITE_DMA_EXT       = 0x35,
+    ATA_CMD_READ_FPDMA_QUEUED   = 0x60,
+    ATA_CMD_WRITE_FPDMA_QUEUED  = 0x61,
     ATA_CMD_PACKET              = 0xa0,
     ATA_CMD_IDENTIFY_DEVICE     = 0xec,
 };
@@ -71,12 +80,15 @@ enum {
     REG_PxSSTS  = 0x28, /* Serial ATA Status */
     REG_PxSCTL  = 0x2c, /* Serial ATA Control */
     REG_PxSERR  = 0x30, /* Serial ATA Error */
+    REG_PxSACT  = 0x34, /* Serial ATA Active (NCQ) */
     REG_PxCI    = 0x38, /* Command Issue */
 };
 
 enum {
     CAP_NCS_SHIFT   = 8,
     CAP_NCS_MASK    = (0x1f << CAP_NCS_SHIFT),
+    CAP_SNCQ        = (1 << 30), /* Supports Native Command Queuing */
+    CAP_S64A        = (1 << 31), /* Supports 64-bit Addressing */
 };
 
 enum {
@@ -90,6 +102,8 @@ enum {
     PxIS_HBDS   = (1 << 28), /* Host Bus Data Error Status */
     PxIS_HBFS   = (1 << 29), /* Host Bus Fatal Error Status */
     PxIS_TFES   = (1 << 30), /* Task File Error Status */
+
+    PxIS_ERRORS = PxIS_IFS | PxIS_HBDS | PxIS_HBFS | PxIS_TFES,
 };
 
 enum {
@@ -134,6 +148,20 @@ enum {
     SATA_SIG_QEMU_CD    = 0xeb140000, /* Broken value in qemu < 2.2 */
 };
 
+/**
+ * An asynchronous command. The request must stay valid until the command
+ * has completed, i.e. until done is set and the callback (if any) was called.
+ */
+struct ahci_request {
+    /* 0 on success, -1 if the command failed */
+    int                         status;
+    volatile bool               done;
+
+    /* Called from interrupt context when the command has completed */
+    void                        (*complete)(struct ahci_request* req);
+    void*                       opaque;
+};
+
 struct ahci_port {
     struct cdi_mem_area*        fis;
     uint64_t                    fis_phys;
@@ -142,12 +170,24 @@ struct ahci_port {
     struct cdi_mem_area*        cmd_list_mem;
     uint64_t                    cmd_list_phys;
 
-    /* TODO More than one command with one PRDT entry */
-    struct cmd_table*           cmd_table;
+    /* One command table per command slot, CMD_TABLE_BYTES apart */
     struct cdi_mem_area*        cmd_table_mem;
     uint64_t                    cmd_table_phys;
 
-    uint32_t                    last_is;
+    /* Slots that are allocated by a request */
+    volatile uint32_t           slots_busy;
+    /* Slots that have been issued to the HBA and are not yet completed */
+    volatile uint32_t           slots_issued;
+    /* Slots whose commands were aborted by error recovery */
+    volatile uint32_t           slots_failed;
+
+    struct ahci_request*        requests[MAX_CMD_SLOTS];
+
+    /* PxIS error bits seen by the IRQ handler, not yet recovered from */
+    volatile uint32_t           pending_errors;
+    volatile int                recovering;
+    /* Submitters that are between their recovering check and slots_issued */
+    volatile int                submitting;
 };
 
 struct ahci_device {
@@ -157,6 +197,8 @@ struct ahci_device {
 
     uint32_t                    ports;
     uint32_t                    cmd_slots;
+    bool                        sncq;
+    bool                        s64a;
 
     struct ahci_port            port[MAX_PORTS];
 };
@@ -173,6 +215,10 @@ struct ahci_disk {
     int                         port;
 
     bool                        lba48;
+
+    /* Use READ/WRITE FPDMA QUEUED, tags are limited to queue_depth */
+    bool                        ncq;
+    uint32_t                    queue_depth;
 };
 
 struct ahci_atapi {
@@ -345,10 +391,18 @@ static inline uint32_t pxreg_inl(struct ahci_device* ahci, int port, int reg)
     return *mmio;
 }
 
+static inline struct cmd_table* ahci_cmd_table(struct ahci_port* port,
+                                               int slot)
+{
+    return (struct cmd_table*) ((uint8_t*) port->cmd_table_mem->vaddr +
+        slot * CMD_TABLE_BYTES);
+}
+
 /* ahci/main.c */
 void ahci_port_comreset(struct ahci_device* ahci, int port);
 
 /* ahci/disk.c */
+void ahci_port_complete(struct ahci_device* ahci, int port, uint32_t is);
 extern struct cdi_storage_driver ahci_disk_driver;
 extern struct cdi_scsi_driver ahci_atapi_driver;
 
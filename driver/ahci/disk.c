@@ -35,61 +35,216 @@
 #define DISK_DRIVER_NAME "ahci-disk"
 #define ATAPI_DRIVER_NAME "ahci-cd"
 
+static uint32_t ahci_port_slot_count(struct ahci_device* ahci)
+{
+    /* CAP.NCS is zero-based */
+    return ahci->cmd_slots + 1;
+}
+
+/**
+ * Completes all requests whose command slots the HBA has cleared in both PxCI
+ * and PxSACT. This is called from the IRQ handler, but also by waiters in
+ * order not to depend on the IRQ arriving after they started waiting.
+ *
+ * Each slot is claimed atomically in slots_issued, so every request is
+ * completed exactly once even if this races with itself.
+ */
+void ahci_port_complete(struct ahci_device* ahci, int port, uint32_t is)
+{
+    struct ahci_port* p = &ahci->port[port];
+    uint32_t issued, active, done;
+
+    if (is & PxIS_ERRORS) {
+        __sync_fetch_and_or(&p->pending_errors, is & PxIS_ERRORS);
+    }
+
+    /* Read slots_issued first: A slot only becomes issued after its PxCI bit
+     * was written, so the register values we read afterwards include it. */
+    issued = p->slots_issued;
+    if (issued == 0) {
+        return;
+    }
+
+    active = pxreg_inl(ahci, port, REG_PxCI) |
+             pxreg_inl(ahci, port, REG_PxSACT);
+    done = issued & ~active;
+
+    while (done) {
+        int slot = __builtin_ctz(done);
+        uint32_t bit = 1u << slot;
+        struct ahci_request* req;
+        bool failed;
+
+        done &= ~bit;
+        if (!(__sync_fetch_and_and(&p->slots_issued, ~bit) & bit)) {
+            continue;
+        }
+
+        req = p->requests[slot];
+        p->requests[slot] = NULL;
+        failed = __sync_fetch_and_and(&p->slots_failed, ~bit) & bit;
+        __sync_fetch_and_and(&p->slots_busy, ~bit);
+
+        req->status = failed ? -1 : 0;
+        if (req->complete) {
+            req->complete(req);
+        }
+        __sync_synchronize();
+        req->done = true;
+    }
+}
+
 /**
- * This function is called for any requests (even succeeding ones). Its job is
- * to recover from any failures and decide whether a request must return
- * failues.
+ * Recovers the port from a fatal error or a timeout. Everything that is still
+ * outstanding on the port is aborted and completed with failure; with NCQ the
+ * HBA doesn't tell which of the queued commands actually caused the error.
  *
- * @return 0 if the command can still be completed successfully, -1 if failure
- * should be returned.
+ * Slots that are allocated, but not issued yet, are failed as well. Their
+ * submitters notice this in ahci_request_submit() and don't issue them.
  */
-static int ahci_request_handle_error(struct ahci_disk* disk, uint32_t is)
+static void ahci_port_recover(struct ahci_disk* disk)
 {
+    struct ahci_port* p = &disk->ahci->port[disk->port];
+    uint32_t cmd, tfd;
+
+    if (!__sync_bool_compare_and_swap(&p->recovering, 0, 1)) {
+        return;
+    }
+
+    /* A command issued while PxCMD.ST is clear would never run, but would
+     * still be completed successfully. Let running submissions finish. */
+    while (p->submitting) {
+        __sync_synchronize();
+    }
+
+    __sync_fetch_and_or(&p->slots_failed, p->slots_busy);
+
     /* AHCI 1.3: "6.2.2 Software Error Recovery" */
-    if (is & (PxIS_HBFS | PxIS_HBDS | PxIS_IFS | PxIS_TFES)) {
-        /* Fatal errors. Restart the port and return failure. */
-        uint32_t cmd, tfd;
-
-        /* Stor processing of the command queue */
-        cmd = pxreg_inl(disk->ahci, disk->port, REG_PxCMD);
-        pxreg_outl(disk->ahci, disk->port, REG_PxCMD, cmd & ~PxCMD_ST);
-        while (pxreg_inl(disk->ahci, disk->port, REG_PxCMD) & PxCMD_CR);
-
-        /* Reset SATA error register */
-        pxreg_outl(disk->ahci, disk->port, REG_PxSERR, 0xffffffff);
-
-        /* COMRESET if PxTFD.STS.(BSY|DRQ) == 1 */
-        tfd = pxreg_inl(disk->ahci, disk->port, REG_PxTFD);
-        if (tfd & (PxTFD_BSY | PxTFD_DRQ)) {
-            ahci_port_comreset(disk->ahci, disk->port);
+
+    /* Stop processing of the command queue. This clears PxCI and PxSACT. */
+    cmd = pxreg_inl(disk->ahci, disk->port, REG_PxCMD);
+    pxreg_outl(disk->ahci, disk->port, REG_PxCMD, cmd & ~PxCMD_ST);
+    while (pxreg_inl(disk->ahci, disk->port, REG_PxCMD) & PxCMD_CR);
+
+    /* Reset SATA error register */
+    pxreg_outl(disk->ahci, disk->port, REG_PxSERR, 0xffffffff);
+
+    /* COMRESET if PxTFD.STS.(BSY|DRQ) == 1 */
+    tfd = pxreg_inl(disk->ahci, disk->port, REG_PxTFD);
+    if (tfd & (PxTFD_BSY | PxTFD_DRQ)) {
+        ahci_port_comreset(disk->ahci, disk->port);
+    }
+
+    /* Fail all aborted requests */
+    __sync_fetch_and_or(&p->slots_failed, p->slots_busy);
+    ahci_port_complete(disk->ahci, disk->port, 0);
+
+    /* Restart port */
+    pxreg_outl(disk->ahci, disk->port, REG_PxCMD, cmd | PxCMD_ST);
+
+    __sync_synchronize();
+    p->recovering = 0;
+}
+
+/**
+ * Reaps completed commands and recovers from errors reported by the IRQ
+ * handler. Must be called from thread context.
+ */
+static void ahci_port_poll(struct ahci_disk* disk)
+{
+    struct ahci_port* p = &disk->ahci->port[disk->port];
+
+    ahci_port_complete(disk->ahci, disk->port, 0);
+    if (__sync_fetch_and_and(&p->pending_errors, 0)) {
+        ahci_port_recover(disk);
+    }
+}
+
+/**
+ * Allocates a free command slot. With NCQ, the slot number is the tag, so only
+ * the first queue_depth slots may be used. Waits if all slots are busy.
+ */
+static int ahci_slot_alloc(struct ahci_disk* disk)
+{
+    struct ahci_port* p = &disk->ahci->port[disk->port];
+    uint32_t mask, busy, avail;
+    uint64_t start = cdi_elapsed_ms();
+    int slot;
+
+    mask = disk->queue_depth >= 32 ? 0xffffffff
+                                   : (1u << disk->queue_depth) - 1;
+
+    while (1) {
+        busy = p->slots_busy;
+        avail = ~busy & mask;
+
+        if (avail == 0 || p->recovering) {
+            ahci_port_poll(disk);
+            if (cdi_elapsed_ms() - start >= AHCI_IRQ_TIMEOUT) {
+                ahci_port_recover(disk);
+                start = cdi_elapsed_ms();
+            }
+            cdi_sleep_ms(1);
+            continue;
         }
 
-        /* Restart port */
-        pxreg_outl(disk->ahci, disk->port, REG_PxCMD, cmd | PxCMD_ST);
-        return -1;
+        slot = __builtin_ctz(avail);
+        if (__sync_bool_compare_and_swap(&p->slots_busy, busy,
+                                         busy | (1u << slot)))
+        {
+            /* Forget failures of the previous user of the slot */
+            __sync_fetch_and_and(&p->slots_failed, ~(1u << slot));
+            return slot;
+        }
     }
+}
 
-    return 0;
+static bool ahci_cmd_is_ncq(int cmd)
+{
+    return cmd == ATA_CMD_READ_FPDMA_QUEUED ||
+           cmd == ATA_CMD_WRITE_FPDMA_QUEUED;
 }
 
-static int ahci_request(struct ahci_disk* disk, int cmd, uint64_t lba,
-                        uint64_t bytes, struct cdi_mem_area* buf, void* acmd)
+/**
+ * Issues a command without waiting for its completion. The data buffer is
+ * described by a list of physically contiguous pieces, each of which becomes
+ * one PRD (at most CMD_TABLE_PRDS).
+ *
+ * @return 0 if the command was issued, -1 otherwise. On success, req is
+ * completed later by ahci_port_complete().
+ */
+static int ahci_request_submit(struct ahci_disk* disk, int cmd, uint64_t lba,
+                               uint64_t bytes, struct cdi_mem_sg_item* sg,
+                               size_t sg_num, void* acmd,
+                               struct ahci_request* req)
 {
     struct ahci_port *port = &disk->ahci->port[disk->port];
-    uint32_t flags, device;
+    struct cmd_table* table;
+    uint32_t flags, device, count, bit;
+    size_t i;
+    int slot;
 
-    if (buf->paddr.num != 1) {
+    if (sg_num > CMD_TABLE_PRDS) {
         return -1;
     }
 
+    req->done = false;
+    req->status = 0;
+
+    slot = ahci_slot_alloc(disk);
+    bit = 1u << slot;
+    table = ahci_cmd_table(port, slot);
+    count = bytes / disk->storage.block_size;
+
     device = 0;
     if (cmd == ATA_CMD_READ_DMA || cmd == ATA_CMD_READ_DMA_EXT ||
-        cmd == ATA_CMD_WRITE_DMA || cmd == ATA_CMD_WRITE_DMA_EXT)
+        cmd == ATA_CMD_WRITE_DMA || cmd == ATA_CMD_WRITE_DMA_EXT ||
+        ahci_cmd_is_ncq(cmd))
     {
         device |= 0x40;
     }
 
-    port->cmd_table->cfis = (struct h2d_fis) {
+    table->cfis = (struct h2d_fis) {
         .type           = FIS_TYPE_H2D,
         .flags          = H2D_FIS_F_COMMAND,
         .command        = cmd,
@@ -100,50 +255,184 @@ static int ahci_request(struct ahci_disk* disk, int cmd, uint64_t lba,
         .lba_mid_exp    = (lba >> 32) & 0xff,
         .lba_high_exp   = (lba >> 40) & 0xff,
         .device         = device,
-        .sector_count   = bytes / disk->storage.block_size,
-    };
-    port->cmd_table->prdt[0] = (struct ahci_prd) {
-        .dba        = buf->paddr.items[0].start,
-        .dbc        = bytes - 1,
+        .sector_count   = count,
     };
 
+    /* FPDMA QUEUED: The sector count moves to the features fields, the
+     * sector count field carries the tag instead */
+    if (ahci_cmd_is_ncq(cmd)) {
+        table->cfis.features        = count & 0xff;
+        table->cfis.features_exp    = (count >> 8) & 0xff;
+        table->cfis.sector_count    = slot << 3;
+    }
+
+    for (i = 0; i < sg_num; i++) {
+        table->prdt[i] = (struct ahci_prd) {
+            .dba        = sg[i].start,
+            .dbau       = (uint64_t) sg[i].start >> 32,
+            .dbc        = sg[i].size - 1,
+        };
+    }
+
     if (acmd != NULL) {
-        memcpy(port->cmd_table->acmd, acmd, 16);
+        memcpy(table->acmd, acmd, 16);
     }
 
     flags = CMD_HEADER_F_FIS_LENGTH_5_DW;
-    if (cmd == ATA_CMD_WRITE_DMA || cmd == ATA_CMD_WRITE_DMA_EXT) {
+    if (cmd == ATA_CMD_WRITE_DMA || cmd == ATA_CMD_WRITE_DMA_EXT ||
+        cmd == ATA_CMD_WRITE_FPDMA_QUEUED)
+    {
         flags |= CMD_HEADER_F_WRITE;
     }
     if (cmd == ATA_CMD_PACKET) {
         flags |= CMD_HEADER_F_ATAPI;
     }
 
-    port->cmd_list[0] = (struct cmd_header) {
+    port->cmd_list[slot] = (struct cmd_header) {
         .flags      = flags,
-        .prdtl      = 1,
-        .prdbc      = buf->size,
-        .ctba0      = port->cmd_table_phys,
+        .prdtl      = sg_num,
+        .prdbc      = 0,
+        .ctba0      = port->cmd_table_phys + slot * CMD_TABLE_BYTES,
     };
 
-    cdi_reset_wait_irq(disk->ahci->irq);
-    pxreg_outl(disk->ahci, disk->port, REG_PxCI, 0x1);
+    port->requests[slot] = req;
+    __sync_synchronize();
 
-    do {
-        cdi_wait_irq(disk->ahci->irq, AHCI_IRQ_TIMEOUT);
-        if (ahci_request_handle_error(disk, port->last_is) < 0) {
-            return -1;
+    /* Recovery must not stop the port between the check and slots_issued */
+    while (1) {
+        __sync_fetch_and_add(&port->submitting, 1);
+        if (!port->recovering) {
+            break;
         }
-        cdi_reset_wait_irq(disk->ahci->irq);
-    } while (pxreg_inl(disk->ahci, disk->port, REG_PxCI) & 0x1);
+        __sync_fetch_and_sub(&port->submitting, 1);
+        cdi_sleep_ms(1);
+    }
 
-    if (ahci_request_handle_error(disk, port->last_is) < 0) {
+    /* A recovery that ran since ahci_slot_alloc() has failed the slot */
+    if (__sync_fetch_and_and(&port->slots_failed, ~bit) & bit) {
+        __sync_fetch_and_sub(&port->submitting, 1);
+        port->requests[slot] = NULL;
+        __sync_fetch_and_and(&port->slots_busy, ~bit);
         return -1;
     }
 
+    /* PxSACT must be set before PxCI for queued commands */
+    if (ahci_cmd_is_ncq(cmd)) {
+        pxreg_outl(disk->ahci, disk->port, REG_PxSACT, bit);
+    }
+    pxreg_outl(disk->ahci, disk->port, REG_PxCI, bit);
+    __sync_fetch_and_or(&port->slots_issued, bit);
+    __sync_fetch_and_sub(&port->submitting, 1);
+
+    /* The completion IRQ may have come before slots_issued was updated */
+    ahci_port_complete(disk->ahci, disk->port, 0);
+
     return 0;
 }
 
+/**
+ * Waits until req is completed. Commands that don't complete within
+ * AHCI_IRQ_TIMEOUT are aborted.
+ *
+ * @return 0 on success, -1 if the command failed.
+ */
+static int ahci_request_wait(struct ahci_disk* disk, struct ahci_request* req)
+{
+    uint64_t start = cdi_elapsed_ms();
+    bool timed_out = false;
+
+    while (!req->done) {
+        cdi_reset_wait_irq(disk->ahci->irq);
+        ahci_port_poll(disk);
+        if (req->done) {
+            break;
+        }
+
+        /* If another recovery is already running, this one returns at once;
+         * the request is completed when the running one is done. */
+        if (cdi_elapsed_ms() - start >= AHCI_IRQ_TIMEOUT) {
+            if (!timed_out) {
+                printf("ahci: Command timed out on port %d\n", disk->port);
+                timed_out = true;
+            }
+            ahci_port_recover(disk);
+            start = cdi_elapsed_ms();
+            continue;
+        }
+
+        /* Several requests may be waiting for the same IRQ, so don't rely on
+         * being woken up and check again after a short time. */
+        cdi_wait_irq(disk->ahci->irq, AHCI_POLL_INTERVAL);
+    }
+
+    return req->status;
+}
+
+/**
+ * Takes the next bytes from an S/G list, starting at (*idx, *offset), and
+ * stores them as at most max items in out. The position is advanced.
+ *
+ * @return The number of items in out, or -1 if more than max are needed.
+ */
+static int ahci_sg_slice(struct cdi_mem_sg_list* sg, size_t* idx,
+                         size_t* offset, uint64_t bytes,
+                         struct cdi_mem_sg_item* out, size_t max)
+{
+    size_t num = 0;
+
+    while (bytes > 0) {
+        struct cdi_mem_sg_item* item;
+        size_t len;
+
+        if (*idx >= sg->num || num >= max) {
+            return -1;
+        }
+
+        item = &sg->items[*idx];
+        len = item->size - *offset;
+        if (len > bytes) {
+            len = bytes;
+        }
+
+        out[num++] = (struct cdi_mem_sg_item) {
+            .start  = item->start + *offset,
+            .size   = len,
+        };
+
+        bytes -= len;
+        *offset += len;
+        if (*offset == item->size) {
+            (*idx)++;
+            *offset = 0;
+        }
+    }
+
+    return num;
+}
+
+static int ahci_request(struct ahci_disk* disk, int cmd, uint64_t lba,
+                        uint64_t bytes, struct cdi_mem_area* buf, void* acmd)
+{
+    struct ahci_request req = { 0 };
+    struct cdi_mem_sg_item sg[CMD_TABLE_PRDS];
+    size_t idx = 0, offset = 0;
+    int sg_num;
+
+    sg_num = ahci_sg_slice(&buf->paddr, &idx, &offset, bytes,
+                           sg, CMD_TABLE_PRDS);
+    if (sg_num < 0) {
+        return -1;
+    }
+
+    if (ahci_request_submit(disk, cmd, lba, bytes, sg, sg_num, acmd,
+                            &req) < 0)
+    {
+        return -1;
+    }
+
+    return ahci_request_wait(disk, &req);
+}
+
 static int ahci_identify(struct ahci_disk* disk)
 {
     struct cdi_mem_area* buf;
@@ -165,6 +454,16 @@ static int ahci_identify(struct ahci_disk* disk)
         } else {
             disk->storage.block_count = *(uint32_t*) &words[60];
         }
+
+        /* Word 76 bit 8: NCQ supported, word 75: queue depth - 1 */
+        disk->ncq = disk->ahci->sncq && disk->lba48 &&
+                    (words[76] & (1 << 8));
+        if (disk->ncq) {
+            uint32_t depth = (words[75] & 0x1f) + 1;
+            if (depth < disk->queue_depth) {
+                disk->queue_depth = depth;
+            }
+        }
     }
 
     cdi_mem_free(buf);
@@ -172,35 +471,117 @@ static int ahci_identify(struct ahci_disk* disk)
     return ret;
 }
 
+/**
+ * Builds an S/G list for the caller's buffer so that the HBA can DMA directly
+ * into it. Fails if the buffer can't be described by PRDs (odd addresses, or
+ * memory above 4 GB on an HBA without 64-bit addressing).
+ */
+static int ahci_buffer_sg(struct ahci_disk* disk, void* buffer, size_t size,
+                          struct cdi_mem_sg_list* sg)
+{
+    size_t i;
+
+    if (cdi_mem_sg_from_buffer(buffer, size, sg) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < sg->num; i++) {
+        uint64_t start = sg->items[i].start;
+        uint64_t end = start + sg->items[i].size;
+
+        if ((start & 1) || (end & 1) ||
+            (!disk->ahci->s64a && end > 0x100000000ULL))
+        {
+            free(sg->items);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int ahci_rw_blocks(struct cdi_storage_device* device, uint64_t start,
                           uint64_t count, void* buffer, bool read)
 {
     struct ahci_disk* disk = (struct ahci_disk*) device;
     uint64_t bs = disk->storage.block_size;
-    struct cdi_mem_area* buf;
+    uint64_t chunk_blocks = AHCI_MAX_REQUEST_BYTES / bs;
+    struct cdi_mem_sg_item items[CMD_TABLE_PRDS];
+    struct cdi_mem_area* bounce = NULL;
+    struct cdi_mem_sg_list sg;
+    struct ahci_request* reqs;
+    size_t num_reqs, issued, i;
+    size_t sg_idx = 0, sg_offset = 0;
     int cmd;
     int ret;
 
-    buf = cdi_mem_alloc(count * bs,
-                        CDI_MEM_PHYS_CONTIGUOUS | CDI_MEM_DMA_4G | 1);
-    if (buf == NULL) {
-        return -1;
+    /* Only if the buffer can't be used for DMA, go through a bounce buffer */
+    if (ahci_buffer_sg(disk, buffer, count * bs, &sg) < 0) {
+        bounce = cdi_mem_alloc(count * bs,
+                               CDI_MEM_PHYS_CONTIGUOUS | CDI_MEM_DMA_4G | 1);
+        if (bounce == NULL) {
+            return -1;
+        }
+        sg = bounce->paddr;
+        if (!read) {
+            memcpy(bounce->vaddr, buffer, bs * count);
+        }
     }
 
-    if (read) {
+    num_reqs = (count + chunk_blocks - 1) / chunk_blocks;
+    reqs = calloc(num_reqs, sizeof(*reqs));
+    if (reqs == NULL) {
+        ret = -1;
+        goto out;
+    }
+
+    if (disk->ncq) {
+        cmd = read ? ATA_CMD_READ_FPDMA_QUEUED : ATA_CMD_WRITE_FPDMA_QUEUED;
+    } else if (read) {
         cmd = disk->lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
     } else {
         cmd = disk->lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
-        memcpy(buf->vaddr, buffer, bs * count);
     }
 
-    ret = ahci_request(disk, cmd, start, bs * count, buf, NULL);
+    /* Issue all chunks at once so that the disk can reorder them */
+    ret = 0;
+    for (issued = 0; issued < num_reqs; issued++) {
+        uint64_t offset = issued * chunk_blocks;
+        uint64_t blocks = count - offset;
+        int sg_num;
 
-    if (ret == 0 && read) {
-        memcpy(buffer, buf->vaddr, bs * count);
+        if (blocks > chunk_blocks) {
+            blocks = chunk_blocks;
+        }
+
+        sg_num = ahci_sg_slice(&sg, &sg_idx, &sg_offset, blocks * bs,
+                               items, CMD_TABLE_PRDS);
+        if (sg_num < 0 ||
+            ahci_request_submit(disk, cmd, start + offset, blocks * bs,
+                                items, sg_num, NULL, &reqs[issued]) < 0)
+        {
+            ret = -1;
+            break;
+        }
     }
 
-    cdi_mem_free(buf);
+    for (i = 0; i < issued; i++) {
+        if (ahci_request_wait(disk, &reqs[i]) < 0) {
+            ret = -1;
+        }
+    }
+
+    free(reqs);
+
+out:
+    if (bounce != NULL) {
+        if (ret == 0 && read) {
+            memcpy(buffer, bounce->vaddr, bs * count);
+        }
+        cdi_mem_free(bounce);
+    } else {
+        free(sg.items);
+    }
     return ret;
 }
 
@@ -257,18 +638,24 @@ static int ahci_disk_init(struct ahci_disk* disk)
     pxreg_outl(ahci, port, REG_PxCLB, p->cmd_list_phys);
     pxreg_outl(ahci, port, REG_PxCLBU, 0); /* TODO Support 64 bit */
 
-    /* Command tables must be 128-byte aligned */
+    /* Command tables must be 128-byte aligned; CMD_TABLE_BYTES is a multiple
+     * of 128, so one area with a table for each slot works. */
     p->cmd_table_mem =
-        cdi_mem_alloc(CMD_TABLE_BYTES,
+        cdi_mem_alloc(ahci_port_slot_count(ahci) * CMD_TABLE_BYTES,
                       CDI_MEM_PHYS_CONTIGUOUS | CDI_MEM_DMA_4G | 7);
     if (p->cmd_table_mem == NULL) {
         printf("ahci: Could not allocate Command Table\n");
         goto fail;
     }
 
-    p->cmd_table = p->cmd_table_mem->vaddr;
     p->cmd_table_phys = p->cmd_table_mem->paddr.items[0].start;
 
+    p->slots_busy = 0;
+    p->slots_issued = 0;
+    p->slots_failed = 0;
+    p->pending_errors = 0;
+    disk->queue_depth = ahci_port_slot_count(ahci);
+
     /* Enable FIS Receive and start processing command list */
     cmd = pxreg_inl(ahci, port, REG_PxCMD);
     pxreg_outl(ahci, port, REG_PxCMD, cmd | PxCMD_FRE | PxCMD_ST);
@@ -310,6 +697,8 @@ static struct cdi_device* disk_init_device(struct cdi_bus_data* bus_data)
     disk->ahci = ahci_bus_data->ahci;
     disk->port = ahci_bus_data->port;
     disk->storage.block_size = 512;
+    /* Requests are queued in the command slots, see ahci_request_submit() */
+    disk->storage.concurrent = true;
     disk->storage.dev.driver = &ahci_disk_driver.drv;
     asprintf((char**) &disk->storage.dev.name, "ahci%d", disk->port);
 
@@ -88,6 +88,8 @@ static int ahci_init_hardware(struct ahci_device* ahci)
 
     /* Determine number of command slots */
     ahci->cmd_slots = (reg_inl(ahci, REG_CAP) & CAP_NCS_MASK) >> CAP_NCS_SHIFT;
+    ahci->sncq = !!(reg_inl(ahci, REG_CAP) & CAP_SNCQ);
+    ahci->s64a = !!(reg_inl(ahci, REG_CAP) & CAP_S64A);
 
     /* All ports: Power On Device, Spin-Up Device, Link Active */
     for (port = 0; port < MAX_PORTS; port++) {
@@ -218,10 +220,13 @@ static void irq_handler(struct cdi_device* dev)
 
         port_is = pxreg_inl(ahci, port, REG_PxIS);
         pxreg_outl(ahci, port, REG_PxIS, port_is);
-        p->last_is = port_is;
+
+        /* Error recovery is left to the waiting threads */
+        if (p->cmd_list != NULL) {
+            ahci_port_complete(ahci, port, port_is);
+        }
     }
 
-    /* For the actual interrupt handling, we use cdi_wait_irq(). */
     reg_outl(ahci, REG_IS, is);
 }
 
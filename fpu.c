@@ -11,6 +11,15 @@
 #include "display.h"
 
 void fpu_Init()
+{
+	fpu_InitLocal();
+	SysLog("FPU", "Initialisierung abgeschlossen");
+}
+
+/*
+ * Aktiviert die FPU auf der aktuellen CPU
+ */
+void fpu_InitLocal()
 {
 	//FPU aktivieren
 	/*
@@ -27,7 +36,6 @@ void fpu_Init()
 			"mov %rax,%cr4;"
 			"finit;"			//FPU initialisieren
 	);
-	SysLog("FPU", "Initialisierung abgeschlossen");
 }
 
 #endif
@@ -11,6 +11,7 @@
 #define FPU_H_
 
 void fpu_Init(void);
+void fpu_InitLocal(void);
 
 #endif /* FPU_H_ */
 
@@ -14,7 +14,6 @@ static uint64_t gdt[GDT_ENTRIES];
 
 void GDT_Init()
 {
-	gdtr_t gdtr;
 	GDT_SetEntry(0, 0, 0, 0, 0);				//NULL-Deskriptor
 	//Ring 0
 	GDT_SetEntry(1, 0, 0xFFFFF, 0x9A, 0xA);	//Codesegment, ausführ- und lesbar, 64-bit, Ring 0
@@ -23,6 +22,17 @@ void GDT_Init()
 	GDT_SetEntry(3, 0, 0xFFFFF, 0xF2, 0xC);	//Datensegment, les- und schreibbar, Ring 3
 	GDT_SetEntry(4, 0, 0xFFFFF, 0xFA, 0xA);	//Codesegment, ausführ- und lesbar, 64-bit, Ring 3
 
+	GDT_Load();
+	SysLog("GDT", "Initialisierung abgeschlossen");
+}
+
+/*
+ * Lädt die GDT auf der aktuellen CPU und setzt die Segmentregister neu. Alle
+ * CPUs teilen sich dieselbe GDT.
+ */
+void GDT_Load()
+{
+	gdtr_t gdtr;
 	gdtr.limit = GDT_ENTRIES *8 - 1;
 	gdtr.pointer = gdt;
 	asm volatile("lgdt %0": :"m"(gdtr));
@@ -34,11 +44,10 @@ void GDT_Init()
 			"mov %ax,%fs;"
 			"mov %ax,%gs;"
 			"push $0x8;"	//Compiler akzeptiert keinen farjump also machen wir es auf diese
-			"push $(.1);"	//Art. So holt sich die CPU den Codesegmentindex vom Stack
+			"push $1f;"	//Art. So holt sich die CPU den Codesegmentindex vom Stack
 			"lretq;"
-			".1:"
+			"1:"
 	);
-	SysLog("GDT", "Initialisierung abgeschlossen");
 }
 
 void GDT_SetEntry(int i, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags)
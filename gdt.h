@@ -10,9 +10,11 @@
 #ifndef GDT_H_
 #define GDT_H_
 
-#define GDT_ENTRIES	7
-
 #include "stdint.h"
+#include "cpu.h"
+
+//Die TSS-Deskriptoren aller CPUs liegen am Ende der GDT
+#define GDT_ENTRIES	(CPU_TSS_ENTRY + 2 * CPU_MAX)
 
 typedef struct{
 		uint16_t	limit;
@@ -39,6 +41,7 @@ typedef struct{
 
 //Funktionen
 void GDT_Init(void);
+void GDT_Load(void);
 void GDT_SetEntry(int i, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags);
 void GDT_SetSystemDescriptor(int i, uint64_t base, uint32_t limit, uint8_t access, uint8_t flags);
 
@@ -51,10 +51,12 @@ extern int46;
 extern int47;
 //Syscalls
 extern int48;
+//Lokaler APIC
+extern int49;
+extern int50;
 extern int255;
 void IDT_Init(void)
 {
-	idtr_t idtr;
 
 	//Exceptions
 	IDT_SetEntry(0, 0x8, IDT_TYPE_INTERRUPT | IDT_DPL_KERNEL | IDT_PRESENT, (uintptr_t)&int0);
@@ -97,12 +99,25 @@ void IDT_Init(void)
 
 	//Syscall
 	IDT_SetEntry(48, 0x8, IDT_TYPE_TRAP_GATE | IDT_DPL_USER | IDT_PRESENT, (uintptr_t)&int48);
+	//Lokaler APIC
+	IDT_SetEntry(49, 0x8, IDT_TYPE_INTERRUPT | IDT_DPL_KERNEL | IDT_PRESENT, (uintptr_t)&int49);
+	IDT_SetEntry(50, 0x8, IDT_TYPE_INTERRUPT | IDT_DPL_KERNEL | IDT_PRESENT, (uintptr_t)&int50);
 	IDT_SetEntry(255, 0x8, IDT_TYPE_INTERRUPT | IDT_DPL_USER | IDT_PRESENT, (uintptr_t)&int255);
 
+	IDT_Load();
+	SysLog("IDT", "Initialisierung abgeschlossen");
+}
+
+/*
+ * Lädt die IDT auf der aktuellen CPU. Alle CPUs teilen sich dieselbe IDT.
+ */
+void IDT_Load()
+{
+	idtr_t idtr;
+
 	idtr.limit = sizeof(idt) - 1;
 	idtr.pointer = idt;
 	asm volatile("lidt %0" : :"m"(idtr));
-	SysLog("IDT", "Initialisierung abgeschlossen");
 }
 
 /*
@@ -30,6 +30,7 @@ typedef struct{
 
 //Funktionen
 void IDT_Init(void);
+void IDT_Load(void);
 void IDT_SetEntry(uint8_t i, uint16_t Selector, uint16_t Flags, uintptr_t Offset);
 
 #endif /* IDT_H_ */
@@ -26,6 +26,12 @@ typedef enum{
 	VFS_INFO_FILESIZE, VFS_INFO_BLOCKSIZE, VFS_INFO_USEDBLOCKS, VFS_INFO_CREATETIME, VFS_INFO_ACCESSTIME, VFS_INFO_CHANGETIME, VFS_INFO_ATTRIBUTES
 }vfs_fileinfo_t;
 
+//Flags für syscall_mmap und syscall_mprotect
+typedef enum{
+	PROT_READ = 0x1, PROT_WRITE = 0x2, PROT_EXEC = 0x4,
+	MAP_PRIVATE = 0x10, MAP_SHARED = 0x20, MAP_FIXED = 0x40, MAP_ANONYMOUS = 0x80
+}mmap_flags_t;
+
 typedef enum{
 	UDT_UNKNOWN, UDT_DIR, UDT_FILE, UDT_LINK, UDT_DEV
 }vfs_userspace_direntry_type_t;
@@ -36,10 +42,31 @@ typedef struct{
 	char name[];
 }vfs_userspace_direntry_t;
 
+typedef enum{
+	THREAD_PRIORITY_REALTIME, THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_IDLE
+}thread_priority_t;
+
 typedef struct{
 	uint64_t	physSpeicher;
 	uint64_t	physFree;
 	uint64_t	Uptime;
+	//Speicherverbrauch des Kernels in Bytes
+	uint64_t	heapSize;		//Vom Kernelheap belegte Pages
+	uint64_t	heapUsed;		//Davon mit malloc reserviert
+	uint64_t	blockCache;		//Blöcke in den Caches der Treiber (im Heap enthalten)
+	uint64_t	vfsResources;	//Geladene Ressourcen des VFS (Anzahl)
+	uint64_t	swapTotal;
+	uint64_t	swapUsed;
 }SIS;
 
+//Speicherverbrauch eines Prozesses (syscall_getMemInfo), Grössen in Pages
+typedef struct{
+	uint64_t	residentPages;	//Im phys. Speicher
+	uint64_t	mappedPages;	//Belegt, inkl. noch nicht benutzter und ausgelagerter Pages
+	uint64_t	tablePages;		//Page-Tabellen
+	uint64_t	minorFaults;
+	uint64_t	majorFaults;	//Aus dem Auslagerungsbereich gelesen
+	uint64_t	zeroFillFaults;	//Mit Nullen gefüllte anonyme Pages
+}process_meminfo_t;
+
 #endif /* BITS_SYS_TYPES_H_ */
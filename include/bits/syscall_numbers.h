@@ -12,12 +12,19 @@ enum{
 SYSCALL_ALLOC_PAGES		= 0,
 SYSCALL_FREE_PAGES		= 1,
 SYSCALL_UNUSE_PAGES		= 2,
+SYSCALL_MMAP			= 3,
+SYSCALL_MUNMAP			= 4,
+SYSCALL_MPROTECT		= 5,
+SYSCALL_MSYNC			= 6,
 
 SYSCALL_EXEC			= 10,
 SYSCALL_EXIT			= 11,
 SYSCALL_WAIT			= 12,
 SYSCALL_THREAD_CREATE	= 13,
 SYSCALL_THREAD_EXIT		= 14,
+SYSCALL_THREAD_SET_TIMESLICE	= 15,
+SYSCALL_THREAD_SET_PRIORITY	= 16,
+SYSCALL_FORK			= 17,
 
 SYSCALL_GET_TIMESTAMP	= 30,
 SYSCALL_SLEEP			= 31,
@@ -35,6 +42,7 @@ SYSCALL_MOUNT			= 50,
 SYSCALL_UNMOUNT			= 51,
 
 SYSCALL_SYSINF_GET		= 60,
+SYSCALL_MEMINFO_GET		= 61,
 
 _SYSCALL_NUM
 };
@@ -18,12 +18,19 @@
 void *syscall_allocPages(size_t Pages);
 void syscall_freePages(void *Address, size_t Pages);
 void syscall_unusePages(void *Address, size_t Pages);
+void *syscall_mmap(void *address, size_t length, mmap_flags_t flags, uint64_t stream, uint64_t offset);
+int syscall_munmap(void *address, size_t length);
+int syscall_mprotect(void *address, size_t length, mmap_flags_t prot);
+int syscall_msync(void *address, size_t length);
 
 pid_t syscall_createProcess(const char *path, const char *cmd, const char **env, const char *stdin, const char *stdout, const char *stderr);
 void syscall_exit(int status);
 pid_t syscall_wait(pid_t pid, int *status);
+pid_t syscall_fork();
 tid_t syscall_createThread(void *entry, void *arg);
 void syscall_exitThread(int status);
+void syscall_setTimeslice(uint32_t msec);
+int syscall_setPriority(thread_priority_t priority);
 
 uint64_t syscall_fopen(char *path, vfs_mode_t mode);
 void syscall_fclose(uint64_t stream);
@@ -40,6 +47,7 @@ time_t syscall_getTimestamp();
 void syscall_sleep(uint64_t msec);
 
 void syscall_getSysInfo(SIS *Struktur);
+int syscall_getMemInfo(pid_t pid, process_meminfo_t *info);
 
 #endif /* SYSCALL_H_ */
 
@@ -63,9 +63,6 @@ static ihs_t *nop(ihs_t *ihs);
 
 static irqHandlers *Handlers[NUM_IRQ];
 
-thread_t *fpuThread = NULL;
-extern thread_t *currentThread;
-
 static interrupt_handler interrupt_handlers[NUM_INTERRUPTS] = {
 /* 0*/			exception_DivideByZero,
 /* 1*/			exception_Debug,
@@ -136,21 +133,12 @@ ihs_t *isr_Handler(ihs_t *ihs)
 
 static ihs_t *irq_handler(ihs_t *ihs)
 {
-	ihs_t *new_ihs = ihs;
-
 	uint8_t irq = ihs->interrupt - 32;
 	switch(ihs->interrupt)
 	{
 		case 32:
-		{
-			static uint64_t nextSchedule = 50;
+			//Der Task wird über den APIC-Timer gewechselt (siehe scheduler_activate())
 			pit_Handler();
-			if(Uptime == nextSchedule)
-			{
-				new_ihs = scheduler_schedule(ihs);
-				nextSchedule += 50;				//Alle 50ms wird der Task gewechselt
-			}
-		}
 		break;
 		case 33:
 			keyboard_Handler(ihs);
@@ -160,7 +148,7 @@ static ihs_t *irq_handler(ihs_t *ihs)
 	cdi_irq_handler(irq);
 	pic_SendEOI(irq);		//PIC sagen, dass IRQ behandelt wurde
 
-	return new_ihs;
+	return ihs;
 }
 
 //Divide by Zero
@@ -221,11 +209,10 @@ static ihs_t *exception_DeviceNotAvailable(ihs_t *ihs)
 
 	if(cpuInfo.fxsr)
 	{
-		//Speichere aktuellen FPU Status, wenn ein Prozess gelaufen ist
-		if(fpuThread != NULL)
-			asm volatile("fxsave (%0)": :"r"((((uintptr_t)fpuThread->fpuState) + 15) & ~0xF));
-
-		fpuThread = currentThread;
+		//Der Scheduler sichert den FPU-Status beim Threadwechsel, deshalb liegt in den
+		//Registern höchstens der Zustand des aktuellen Threads
+		scheduler_cpu_t *cpu = &scheduler_cpus[cpu_getId()];
+		thread_t *fpuThread = cpu->fpuThread = cpu->thread;
 
 		//FPU Status laden
 		if(fpuThread->fpuState == NULL)
@@ -318,12 +305,16 @@ static ihs_t *exception_PageFault(ihs_t *ihs)
 	PD = (void*)PD + ((PML4i << 21) | (PDPi << 12));
 	PT = (void*)PT + (((uint64_t)PML4i << 30) | (PDPi << 21) | (PDi << 12));
 
-	//Wenn diese Page eine unused page ist, dann wird diese aktiviert
-	if(!vmm_getPageStatus((void*)CR2) && (PG_AVL(PT->PTE[PTi]) & VMM_UNUSED_PAGE))
-	{
-		vmm_usePages((void*)CR2, 1);
-	}
-	else
+	//Während die Page eingeblendet wird, muss die CPU TLB-Shootdowns anderer
+	//CPUs bearbeiten können, sonst kann es zu einem Deadlock kommen. Ausserdem
+	//müssen Pages eventuell aus einer Datei gelesen werden.
+	if(ihs->rflags & (1 << 9))
+		asm volatile("sti");
+	bool handled = vmm_handlePageFault((void*)CR2, ihs->error & 0x2, ihs->error & 0x4);
+	asm volatile("cli");
+
+	//Unused Pages und Pages aus Dateien werden beim ersten Zugriff eingeblendet
+	if(!handled)
 	{
 		console_switch(0);
 		printf("\e[31mException 14: Page Fault\e[37m  ");
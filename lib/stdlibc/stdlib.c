@@ -63,6 +63,11 @@ atexit_list_t *Atexit_List_Base = NULL;
 static heap_t *lastHeap = NULL;
 static heap_empty_t *base_emptyHeap = NULL;
 static char **real_environ;
+#ifdef BUILD_KERNEL
+//Grösse des Kernelheaps und davon reservierte Bytes
+static volatile size_t heap_size = 0;
+static volatile size_t heap_used = 0;
+#endif
 
 //Global visible
 char **environ;
@@ -767,6 +772,9 @@ void free(void *ptr)
 	//Ist dies eine gültige Addresse
 	if(heap->Flags == (HEAP_FLAGS | HEAP_RESERVED))
 	{
+#ifdef BUILD_KERNEL
+		__sync_fetch_and_sub(&heap_used, heap->Length);
+#endif
 		//Wenn möglich Speicherbereiche zusammenführen
 		if(heap->Prev != NULL)
 		{
@@ -865,6 +873,9 @@ void *malloc(size_t size)
 		node = syscall_allocPages(pages);
 #endif
 		if(node == NULL) return NULL;
+#ifdef BUILD_KERNEL
+		__sync_fetch_and_add(&heap_size, pages * 4096);
+#endif
 		node->heap_base.Next = NULL;
 		if(lastHeap == NULL)
 			node->heap_base.Prev = NULL;
@@ -896,6 +907,9 @@ void *malloc(size_t size)
 			lastHeap = tmp_heap;
 	}
 	heap->Flags |= HEAP_RESERVED;		//Als reserviert markieren
+#ifdef BUILD_KERNEL
+	__sync_fetch_and_add(&heap_used, heap->Length);
+#endif
 
 	assert(((uintptr_t)Address & (HEAP_ALIGNMENT - 1)) == 0);
 
@@ -922,6 +936,9 @@ void *realloc(void *ptr, size_t size)
 	//Ist dieser Heap gültig?
 	if(Heap->Flags == (HEAP_FLAGS | HEAP_RESERVED))
 	{
+#ifdef BUILD_KERNEL
+		const size_t oldLength = Heap->Length;
+#endif
 		Address = ptr;
 		//TODO: Vielleicht könnte man hier auch Speicherplatz freigeben?
 		//Wenn der PLatz noch da ist müssen wir nichts untenehmen
@@ -993,6 +1010,11 @@ void *realloc(void *ptr, size_t size)
 				}
 			}
 		}
+#ifdef BUILD_KERNEL
+		//Der Eintrag wurde an Ort und Stelle vergrössert
+		if(Address == ptr)
+			__sync_fetch_and_add(&heap_used, Heap->Length - oldLength);
+#endif
 	}
 
 	assert(((uintptr_t)Address & (HEAP_ALIGNMENT - 1)) == 0);
@@ -1000,6 +1022,19 @@ void *realloc(void *ptr, size_t size)
 	return Address;
 }
 
+#ifdef BUILD_KERNEL
+/*
+ * Gibt die Grösse und Belegung des Kernelheaps zurück
+ * Parameter:	size = Vom Heap belegte Bytes
+ * 				used = Davon mit malloc reservierte Bytes
+ */
+void mm_getHeapInfo(size_t *size, size_t *used)
+{
+	*size = heap_size;
+	*used = heap_used;
+}
+#endif
+
 int abs(int x)
 {
 	return (x < 0) ? -x : x;
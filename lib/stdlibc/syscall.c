@@ -27,6 +27,26 @@ void syscall_unusePages(void *Address, size_t Pages)
 	_syscall(SYSCALL_UNUSE_PAGES, Address, Pages);
 }
 
+void *syscall_mmap(void *address, size_t length, mmap_flags_t flags, uint64_t stream, uint64_t offset)
+{
+	return (void*)_syscall(SYSCALL_MMAP, address, length, flags, stream, offset);
+}
+
+int syscall_munmap(void *address, size_t length)
+{
+	return _syscall(SYSCALL_MUNMAP, address, length);
+}
+
+int syscall_mprotect(void *address, size_t length, mmap_flags_t prot)
+{
+	return _syscall(SYSCALL_MPROTECT, address, length, prot);
+}
+
+int syscall_msync(void *address, size_t length)
+{
+	return _syscall(SYSCALL_MSYNC, address, length);
+}
+
 pid_t syscall_createProcess(const char *path, const char *cmd, const char **env, const char *stdin, const char *stdout, const char *stderr)
 {
 	const char *stddevs[3] = {stdin, stdout, stderr};
@@ -45,6 +65,14 @@ pid_t syscall_wait(pid_t pid, int *status)
 	return (pid_t)_syscall(SYSCALL_WAIT, pid, status);
 }
 
+pid_t syscall_fork()
+{
+	//Dieser syscall funktioniert nur über Interrupts
+	pid_t pid;
+	asm volatile("int $0x30" : "=a"(pid) : "D"(SYSCALL_FORK) : "memory");
+	return pid;
+}
+
 tid_t syscall_createThread(void *entry, void *arg)
 {
 	return (tid_t)_syscall(SYSCALL_THREAD_CREATE, entry, arg);
@@ -55,6 +83,16 @@ void __attribute__((noreturn)) syscall_exitThread(int status)
 	asm volatile("int $0x30" : : "D"(SYSCALL_THREAD_EXIT), "S"(status));
 }
 
+void syscall_setTimeslice(uint32_t msec)
+{
+	_syscall(SYSCALL_THREAD_SET_TIMESLICE, msec);
+}
+
+int syscall_setPriority(thread_priority_t priority)
+{
+	return _syscall(SYSCALL_THREAD_SET_PRIORITY, priority);
+}
+
 uint64_t syscall_fopen(char *path, vfs_mode_t mode)
 {
 	return (void*)_syscall(SYSCALL_OPEN, path, mode);
@@ -120,4 +158,9 @@ void syscall_getSysInfo(SIS *Struktur)
 	_syscall(SYSCALL_SYSINF_GET, Struktur);
 }
 
+int syscall_getMemInfo(pid_t pid, process_meminfo_t *info)
+{
+	return _syscall(SYSCALL_MEMINFO_GET, pid, info);
+}
+
 #endif
@@ -12,6 +12,8 @@
 #include "vmm.h"
 #include "stdlib.h"
 #include "assert.h"
+#include "scheduler.h"
+#include "filemap.h"
 
 typedef uint64_t	elf64_addr;
 typedef uint16_t 	elf64_half;
@@ -174,14 +176,18 @@ static char elfCheck(elf_header *ELFHeader)
 	return -1;
 }
 
-pid_t elfLoad(FILE *fp, const char *cmd, const char **env, const char *stdin, const char *stdout, const char *stderr)
+/*
+ * Lädt ein Programm. Die Segmente werden nicht sofort gelesen, sondern erst beim ersten Zugriff
+ * vom Page-Fault-Handler. Nicht beschreibbare Segmente teilen sich die Pages mit allen Prozessen,
+ * die dieselbe Datei ausführen.
+ * Parameter:	file = geöffnete Datei
+ * 				path = Pfad der Datei, identifiziert die gemeinsamen Pages
+ */
+pid_t elfLoad(vfs_file_t file, const char *path, const char *cmd, const char **env, const char *stdin, const char *stdout, const char *stderr)
 {
 	elf_header Header;
 
-	//Zurücksetzen des Dateizeigers
-	fseek(fp, 0, SEEK_SET);
-
-	if(fread(&Header, 1, sizeof(elf_header), fp) < sizeof(elf_header))
+	if(vfs_Read(file, 0, sizeof(elf_header), &Header) < sizeof(elf_header))
 		return -1;
 
 	//Header überprüfen
@@ -198,8 +204,8 @@ pid_t elfLoad(FILE *fp, const char *cmd, const char **env, const char *stdin, co
 	{
 		return -1;
 	}
-	fseek(fp, Header.e_phoff, SEEK_SET);
-	if(fread(ProgramHeader, sizeof(elf_program_header_entry), Header.e_phnum, fp) < Header.e_phnum)
+	if(vfs_Read(file, Header.e_phoff, Header.e_phnum * sizeof(elf_program_header_entry), ProgramHeader)
+			< Header.e_phnum * sizeof(elf_program_header_entry))
 	{
 		free(ProgramHeader);
 		return -1;
@@ -213,22 +219,14 @@ pid_t elfLoad(FILE *fp, const char *cmd, const char **env, const char *stdin, co
 		return -1;
 	}
 
+	//Die Bereiche halten eigene Referenzen auf das Image
+	filemap_image_t *image = filemap_getImage(path, file);
+
 	int i;
 	for(i = 0; i < Header.e_phnum; i++)
 	{
 		//Wenn kein ladbares Segment, dann Springe zum nächsten Segment
-		if(ProgramHeader[i].p_type != ELF_PT_LOAD) continue;
-
-		size_t pages = ProgramHeader[i].p_memsz / 4096;
-		pages += (ProgramHeader[i].p_memsz % 4096) ? 1 : 0;
-		void *dest = mm_SysAlloc(pages);
-		assert(dest != NULL);
-		uintptr_t dest_off = ProgramHeader[i].p_vaddr % 0x1000;
-		fseek(fp, ProgramHeader[i].p_offset, SEEK_SET);						//Position der Daten in der Datei
-		fread(dest + dest_off, 1, ProgramHeader[i].p_filesz, fp);
-
-		//Eventuell mit nullen auffüllen
-		memset(dest + dest_off + ProgramHeader[i].p_filesz, 0, ProgramHeader[i].p_memsz - ProgramHeader[i].p_filesz);
+		if(ProgramHeader[i].p_type != ELF_PT_LOAD || ProgramHeader[i].p_memsz == 0) continue;
 
 		uint16_t flags = VMM_FLAGS_USER;
 		if(ProgramHeader[i].p_flags & ELF_PF_W)
@@ -236,11 +234,14 @@ pid_t elfLoad(FILE *fp, const char *cmd, const char **env, const char *stdin, co
 		if(!(ProgramHeader[i].p_flags & ELF_PF_X))
 			flags |= VMM_FLAGS_NX;
 
-		//Speicherbereich an die richtige Addresse mappen
-		vmm_ReMap(&kernel_context, dest, task->Context, (void*)ProgramHeader[i].p_vaddr, pages, flags, 0);
+		//Segment wird beim ersten Zugriff aus der Datei gelesen
+		void *mapped = filemap_map(task->Context, file, image, (void*)ProgramHeader[i].p_vaddr, ProgramHeader[i].p_memsz,
+				ProgramHeader[i].p_offset, ProgramHeader[i].p_filesz, flags, 0);
+		assert(mapped != NULL);
 	}
 
 	//Temporäre Daten wieder freigeben
+	filemap_releaseImage(image);
 	free(ProgramHeader);
 
 	//Prozess aktivieren
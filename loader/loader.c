@@ -8,6 +8,7 @@
 #include "loader.h"
 #include "stdio.h"
 #include "elf.h"
+#include "vfs.h"
 #include "string.h"
 
 pid_t loader_load(const char *path, const char *cmd, const char **env, const char *stdin, const char *stdout, const char *stderr)
@@ -30,13 +31,13 @@ pid_t loader_load(const char *path, const char *cmd, const char **env, const cha
 	binpath[strlen(binpath)] = '/';
 	strcat(binpath, cmdline);
 
-	//Jetzt können wir die Datei öffnen
-	FILE *fp = fopen(binpath, "rb");
-	if(fp == NULL)
+	//Jetzt können wir die Datei öffnen. Die geladenen Segmente behalten eigene Referenzen darauf.
+	vfs_file_t file = vfs_Open(binpath, (vfs_mode_t){.read = true});
+	if(file == (vfs_file_t)-1)
 		return 0;
 
-	pid = elfLoad(fp, cmd, env, stdin, stdout, stderr);
-	fclose(fp);
+	pid = elfLoad(file, binpath, cmd, env, stdin, stdout, stderr);
+	vfs_Close(file);
 	return pid;
 }
 
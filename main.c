@@ -41,6 +41,9 @@
 #include "syscalls.h"
 #include "string.h"
 #include <dispatcher.h>
+#include "smp.h"
+#include "swap.h"
+#include "system.h"
 
 static multiboot_structure static_MBS;
 
@@ -59,6 +62,8 @@ void __attribute__((noreturn)) main(void *mbsAdresse)
 	else
 	{
 		const char **env = {NULL};
+		//Optionaler Auslagerungsbereich
+		swap_Enable("/swap", 0);
 		loader_load("/bin", "init", env, "/dev/tty01", "/dev/tty01", "/dev/tty01");
 		scheduler_activate();
 	}
@@ -101,6 +106,7 @@ void Init()
 	dmng_Init();
 	pm_Init();			//Tasks initialisieren
 	console_Init();
+	system_Init();		//Systeminformationen unter /dev/meminfo
 	dispatcher_init(100);
 
 	//MBS an einen richtigen Ort sichern
@@ -112,6 +118,7 @@ void Init()
 	printf("Aktiviere Interrupts\n\r");
 	#endif
 	asm volatile("sti");	//Interrupts aktivieren
+	smp_Init();			//Weitere CPUs starten
 	cdi_init();			//CDI und -Treiber initialisieren
 }
 
@@ -0,0 +1,645 @@
+/*
+ * filemap.c
+ *
+ *  Created on: 17.10.2026
+ */
+
+#include "filemap.h"
+#include "pmm.h"
+#include "memory.h"
+#include "paging.h"
+#include "stdlib.h"
+#include "string.h"
+#include "lock.h"
+#include "hashmap.h"
+#include "list.h"
+
+#define NULL (void*)0
+
+#define MIN(a, b)	((a < b) ? a : b)
+#define MAX(a, b)	((a > b) ? a : b)
+
+/*
+ * Gelesene Pages eines Programms werden zwischen allen Prozessen geteilt, die dieselbe Datei
+ * ausführen, und erst beim Schreiben kopiert. Die Pages einer mit filemap_getFileImage geöffneten
+ * Datei werden über ihre Position in der Datei zugeordnet und auch von gemeinsamen Bereichen
+ * (FILEMAP_SHARED) beschrieben. Die Pages bleiben bestehen, bis kein Bereich mehr auf das Image
+ * verweist.
+ */
+struct filemap_image{
+	struct filemap_image *next;
+	char *path;						//Nur bei Programmen
+	const void *resource;			//Nur bei Dateien, siehe vfs_getResource
+	uint64_t changeTime, size;		//Eine veränderte Datei bekommt ein neues Image
+	size_t refs;
+	hashmap_t *pages;				//virt. Adresse bzw. Position in der Datei -> phys. Adresse der Page
+	lock_t lock;
+};
+
+static filemap_image_t *filemap_images;
+static lock_t filemap_imagesLock = LOCK_UNLOCKED;
+
+//Schützt die Listen der Bereiche aller Kontexte
+static lock_t filemap_lock = LOCK_UNLOCKED;
+
+static paddr_t filemap_zeroPage;
+
+static uint64_t filemap_pageHash(const void *key, __attribute__((unused)) void *context)
+{
+	return (uintptr_t)key >> 12;
+}
+
+static bool filemap_pageEqual(const void *a, const void *b, __attribute__((unused)) void *context)
+{
+	return a == b;
+}
+
+static void filemap_freePage(__attribute__((unused)) const void *key, const void *obj, __attribute__((unused)) void *context)
+{
+	pmm_Free((paddr_t)obj);
+}
+
+/*
+ * Gibt die Page zurück, die für alle Pages ohne Daten aus der Datei eingeblendet wird.
+ * Sie wird beim ersten Aufruf angelegt und nie freigegeben.
+ */
+static paddr_t filemap_getZeroPage(void)
+{
+	if(filemap_zeroPage == 0)
+	{
+		paddr_t page = pmm_AllocZeroed();
+		if(page == 1)
+			return 1;
+		if(!__sync_bool_compare_and_swap(&filemap_zeroPage, 0, page))
+			pmm_Free(page);
+	}
+	return filemap_zeroPage;
+}
+
+/*
+ * Gibt true zurück, wenn die phys. Adresse die der Nullpage ist
+ */
+bool filemap_isZeroPage(paddr_t page)
+{
+	return filemap_zeroPage != 0 && page == filemap_zeroPage;
+}
+
+//Sucht ein Image oder legt es an, path bzw. resource ist NULL
+static filemap_image_t *filemap_findImage(const char *path, const void *resource, vfs_file_t file)
+{
+	uint64_t changeTime = vfs_getFileinfo(file, VFS_INFO_CHANGETIME);
+	uint64_t size = vfs_getFileinfo(file, VFS_INFO_FILESIZE);
+	filemap_image_t *image;
+
+	lock(&filemap_imagesLock);
+	for(image = filemap_images; image != NULL; image = image->next)
+	{
+		if(resource != NULL ? image->resource == resource
+				: (image->resource == NULL && image->changeTime == changeTime && image->size == size && strcmp(image->path, path) == 0))
+		{
+			image->refs++;
+			unlock(&filemap_imagesLock);
+			return image;
+		}
+	}
+
+	image = malloc(sizeof(filemap_image_t));
+	if(image != NULL)
+	{
+		image->path = (path != NULL) ? strdup(path) : NULL;
+		image->pages = hashmap_create_min(filemap_pageHash, filemap_pageEqual);
+		if((path != NULL && image->path == NULL) || image->pages == NULL)
+		{
+			if(image->pages != NULL)
+				hashmap_destroy(image->pages);
+			free(image->path);
+			free(image);
+			unlock(&filemap_imagesLock);
+			return NULL;
+		}
+		image->resource = resource;
+		image->changeTime = changeTime;
+		image->size = size;
+		image->refs = 1;
+		image->lock = LOCK_UNLOCKED;
+		image->next = filemap_images;
+		filemap_images = image;
+	}
+	unlock(&filemap_imagesLock);
+
+	return image;
+}
+
+/*
+ * Sucht das Image eines Programms oder legt es an
+ * Parameter:	path = Pfad der Datei
+ * 				file = geöffnete Datei
+ * Rückgabe:	Image (muss mit filemap_releaseImage freigegeben werden) oder NULL
+ */
+filemap_image_t *filemap_getImage(const char *path, vfs_file_t file)
+{
+	return filemap_findImage(path, NULL, file);
+}
+
+/*
+ * Sucht das Image einer Datei, die mit mmap eingeblendet wird, oder legt es an. Alle Streams
+ * derselben Datei bekommen dasselbe Image.
+ * Parameter:	file = geöffnete Datei
+ * Rückgabe:	Image (muss mit filemap_releaseImage freigegeben werden) oder NULL, wenn die
+ * 				Datei keine normale Datei ist
+ */
+filemap_image_t *filemap_getFileImage(vfs_file_t file)
+{
+	const void *resource = vfs_getResource(file);
+	if(resource == NULL)
+		return NULL;
+	return filemap_findImage(NULL, resource, file);
+}
+
+/*
+ * Gibt eine Referenz auf ein Image frei. Mit der letzten Referenz werden auch die Pages freigegeben.
+ */
+void filemap_releaseImage(filemap_image_t *image)
+{
+	filemap_image_t **prev;
+
+	if(image == NULL)
+		return;
+
+	lock(&filemap_imagesLock);
+	if(--image->refs > 0)
+	{
+		unlock(&filemap_imagesLock);
+		return;
+	}
+	for(prev = &filemap_images; *prev != image; prev = &(*prev)->next);
+	*prev = image->next;
+	unlock(&filemap_imagesLock);
+
+	hashmap_visit(image->pages, filemap_freePage, NULL);
+	hashmap_destroy(image->pages);
+	free(image->path);
+	free(image);
+}
+
+//Wird aufgerufen, wenn die letzte Referenz auf einen Bereich freigegeben wurde
+static void filemap_free(const void *obj)
+{
+	filemap_t *map = (filemap_t*)obj;
+	vfs_Close(map->file);
+	filemap_releaseImage(map->image);
+	free(map);
+}
+
+/*
+ * Legt einen Bereich an, der beim Zugriff aus einer Datei gefüllt wird. Die Pages werden als
+ * unbenutzt gemappt und erst vom Page-Fault-Handler eingeblendet.
+ * Parameter:	context = Kontext
+ * 				file = Datei, die Datei bleibt geöffnet solange der Bereich besteht
+ * 				image = Image für die gemeinsamen Pages (darf NULL sein)
+ * 				address = virt. Adresse des Bereichs oder NULL, wenn eine freie Adresse gesucht werden soll
+ * 				memsz = Grösse des Bereichs
+ * 				offset = Position der Daten in der Datei
+ * 				filesz = Anzahl Bytes aus der Datei, der Rest wird mit Nullen gefüllt
+ * 				flags = VMM_FLAGS_* der Pages
+ * 				mode = FILEMAP_*
+ * Rückgabe:	Anfang des Bereichs oder NULL bei einem Fehler
+ */
+void *filemap_map(context_t *context, vfs_file_t file, filemap_image_t *image, void *address, size_t memsz,
+		uint64_t offset, size_t filesz, uint8_t flags, uint8_t mode)
+{
+	filemap_t *map = malloc(sizeof(filemap_t));
+	if(map == NULL || memsz == 0)
+	{
+		free(map);
+		return NULL;
+	}
+
+	if(address == NULL)
+	{
+		address = vma_alloc(&context->vmas, PG_PAGE_ALIGN_ROUND_UP(memsz));
+		if(address == NULL)
+		{
+			free(map);
+			return NULL;
+		}
+	}
+	else if(!vma_reserve(&context->vmas, (void*)((uintptr_t)address & ~0xFFF),
+			PG_PAGE_ALIGN_ROUND_UP((uintptr_t)address + memsz) - ((uintptr_t)address & ~0xFFF)))
+	{
+		free(map);
+		return NULL;
+	}
+
+	map->start = (uintptr_t)address & ~0xFFF;
+	map->end = PG_PAGE_ALIGN_ROUND_UP((uintptr_t)address + memsz);
+	map->dataStart = (uintptr_t)address;
+	map->dataEnd = (uintptr_t)address + MIN(filesz, memsz);
+	map->offset = offset;
+	map->flags = flags;
+	map->mode = mode;
+	map->file = vfs_Reopen(file, (vfs_mode_t){.read = true, .write = !!(mode & FILEMAP_FILE_WRITE)});
+	if(map->file == (vfs_file_t)-1)
+	{
+		vma_release(&context->vmas, (void*)map->start, map->end - map->start);
+		free(map);
+		return NULL;
+	}
+
+	if(vmm_MapRange(context, (void*)map->start, 0, (map->end - map->start) / MM_BLOCK_SIZE, flags, VMM_UNUSED_PAGE) != 0)
+	{
+		vma_release(&context->vmas, (void*)map->start, map->end - map->start);
+		vfs_Close(map->file);
+		free(map);
+		return NULL;
+	}
+
+	//Private Bereiche kopieren die gemeinsamen Pages beim Schreiben
+	map->image = NULL;
+	if(image != NULL)
+	{
+		LOCKED_TASK(filemap_imagesLock, image->refs++);
+		map->image = image;
+	}
+	REFCOUNT_INIT(map, filemap_free);
+
+	lock(&filemap_lock);
+	map->next = context->filemaps;
+	context->filemaps = map;
+	unlock(&filemap_lock);
+
+	return (void*)map->start;
+}
+
+/*
+ * Teilt einen Bereich an einer Adresse in zwei Bereiche auf. filemap_lock muss gesperrt sein.
+ * Parameter:	map = Bereich
+ * 				address = Anfang des neuen zweiten Bereichs, auf Pages ausgerichtet
+ * Rückgabe:	false, wenn zu wenig Speicher vorhanden ist
+ */
+static bool filemap_split(filemap_t *map, uintptr_t address)
+{
+	filemap_t *tail = malloc(sizeof(filemap_t));
+	if(tail == NULL)
+		return false;
+
+	memcpy(tail, map, sizeof(filemap_t));
+	tail->file = vfs_Reopen(map->file, (vfs_mode_t){.read = true, .write = !!(map->mode & FILEMAP_FILE_WRITE)});
+	if(tail->file == (vfs_file_t)-1)
+	{
+		free(tail);
+		return false;
+	}
+	if(tail->image != NULL)
+		LOCKED_TASK(filemap_imagesLock, tail->image->refs++);
+	REFCOUNT_INIT(tail, filemap_free);
+
+	tail->start = address;
+	map->end = address;
+	map->next = tail;
+
+	return true;
+}
+
+//Teilt alle Bereiche so auf, dass keiner über start oder end hinausragt. filemap_lock muss gesperrt sein.
+static bool filemap_splitRange(context_t *context, uintptr_t start, uintptr_t end)
+{
+	filemap_t *map;
+
+	for(map = context->filemaps; map != NULL; map = map->next)
+	{
+		if(map->start < start && start < map->end && !filemap_split(map, start))
+			return false;
+		if(map->start < end && end < map->end && !filemap_split(map, end))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Schreibt die veränderten Pages eines gemeinsamen Bereichs zwischen start und end in die Datei
+ */
+static void filemap_writeback(context_t *context, filemap_t *map, uintptr_t start, uintptr_t end)
+{
+	uintptr_t address;
+	paddr_t page;
+
+	for(address = MAX(start, map->start) & ~0xFFF; address < MIN(end, map->end); address += MM_BLOCK_SIZE)
+	{
+		uintptr_t from = MAX(address, map->dataStart);
+		uintptr_t to = MIN(address + MM_BLOCK_SIZE, map->dataEnd);
+
+		//Die Datei wird nicht über dataEnd hinaus verlängert
+		if(from >= to)
+			continue;
+		if(vmm_clearDirty(context, (void*)address, &page) && !filemap_isZeroPage(page))
+			vfs_Write(map->file, map->offset + (from - map->dataStart), to - from, vmm_PhysToVirt(page) + (from - address));
+	}
+}
+
+/*
+ * Entfernt alle Bereiche zwischen start und end, angeschnittene Bereiche werden verkleinert.
+ * Veränderte Pages gemeinsamer Bereiche werden vorher in die Datei geschrieben. Die Pages selber
+ * muss der Aufrufer entfernen.
+ * Rückgabe:	false, wenn zu wenig Speicher vorhanden ist, um einen Bereich aufzuteilen
+ */
+bool filemap_unmap(context_t *context, uintptr_t start, uintptr_t end)
+{
+	filemap_t **prev, *map, *removed = NULL;
+
+	lock(&filemap_lock);
+	if(!filemap_splitRange(context, start, end))
+	{
+		unlock(&filemap_lock);
+		return false;
+	}
+	prev = &context->filemaps;
+	while((map = *prev) != NULL)
+	{
+		if(start <= map->start && map->end <= end)
+		{
+			*prev = map->next;
+			map->next = removed;
+			removed = map;
+		}
+		else
+			prev = &map->next;
+	}
+	unlock(&filemap_lock);
+
+	while(removed != NULL)
+	{
+		map = removed;
+		removed = map->next;
+		if(map->mode & FILEMAP_SHARED)
+			filemap_writeback(context, map, map->start, map->end);
+		REFCOUNT_RELEASE(map);
+	}
+
+	return true;
+}
+
+/*
+ * Ändert die Flags aller Bereiche zwischen start und end. Die Einträge der Pages muss der
+ * Aufrufer anpassen.
+ * Rückgabe:	false, wenn ein gemeinsamer Bereich beschreibbar werden soll, dessen Datei nicht
+ * 				beschrieben werden darf oder zu wenig Speicher vorhanden ist
+ */
+bool filemap_protect(context_t *context, uintptr_t start, uintptr_t end, uint8_t flags)
+{
+	filemap_t *map;
+
+	lock(&filemap_lock);
+	for(map = context->filemaps; map != NULL; map = map->next)
+	{
+		if(map->start < end && start < map->end && (flags & VMM_FLAGS_WRITE)
+				&& (map->mode & FILEMAP_SHARED) && !(map->mode & FILEMAP_FILE_WRITE))
+		{
+			unlock(&filemap_lock);
+			return false;
+		}
+	}
+	if(!filemap_splitRange(context, start, end))
+	{
+		unlock(&filemap_lock);
+		return false;
+	}
+	for(map = context->filemaps; map != NULL; map = map->next)
+		if(start <= map->start && map->end <= end)
+			map->flags = flags;
+	unlock(&filemap_lock);
+
+	return true;
+}
+
+/*
+ * Schreibt die veränderten Pages aller gemeinsamen Bereiche zwischen start und end in die Datei
+ */
+void filemap_sync(context_t *context, uintptr_t start, uintptr_t end)
+{
+	list_t maps = list_create();
+	filemap_t *map;
+
+	if(maps == NULL)
+		return;
+
+	//Das Schreiben kann dauern, deshalb werden die Bereiche nur referenziert
+	lock(&filemap_lock);
+	for(map = context->filemaps; map != NULL; map = map->next)
+		if(map->start < end && start < map->end && (map->mode & FILEMAP_SHARED) && REFCOUNT_RETAIN(map) != NULL)
+			list_push(maps, map);
+	unlock(&filemap_lock);
+
+	while((map = list_pop(maps)) != NULL)
+	{
+		filemap_writeback(context, map, start, end);
+		REFCOUNT_RELEASE(map);
+	}
+	list_destroy(maps);
+}
+
+/*
+ * Entfernt alle Bereiche eines Kontextes. Veränderte Pages gemeinsamer Bereiche werden in die
+ * Datei geschrieben, die Pages selber gibt deleteContext frei.
+ */
+void filemap_unmapAll(context_t *context)
+{
+	filemap_t *map;
+
+	lock(&filemap_lock);
+	map = context->filemaps;
+	context->filemaps = NULL;
+	unlock(&filemap_lock);
+
+	while(map != NULL)
+	{
+		filemap_t *next = map->next;
+		if(map->mode & FILEMAP_SHARED)
+			filemap_writeback(context, map, map->start, map->end);
+		REFCOUNT_RELEASE(map);
+		map = next;
+	}
+}
+
+/*
+ * Kopiert alle Bereiche eines Kontextes in einen neuen Kontext, z.B. bei fork
+ * Parameter:	dst = neuer Kontext ohne Bereiche
+ * 				src = zu kopierender Kontext
+ * Rückgabe:	false, wenn zu wenig Speicher vorhanden ist. Die schon kopierten Bereiche
+ * 				werden mit dem Kontext entfernt.
+ */
+bool filemap_cloneAll(context_t *dst, context_t *src)
+{
+	filemap_t *map, **tail = &dst->filemaps;
+	bool success = true;
+
+	lock(&filemap_lock);
+	for(map = src->filemaps; map != NULL; map = map->next)
+	{
+		filemap_t *copy = malloc(sizeof(filemap_t));
+		if(copy == NULL)
+		{
+			success = false;
+			break;
+		}
+
+		memcpy(copy, map, sizeof(filemap_t));
+		copy->file = vfs_Reopen(map->file, (vfs_mode_t){.read = true, .write = !!(map->mode & FILEMAP_FILE_WRITE)});
+		if(copy->file == (vfs_file_t)-1)
+		{
+			free(copy);
+			success = false;
+			break;
+		}
+		if(copy->image != NULL)
+			LOCKED_TASK(filemap_imagesLock, copy->image->refs++);
+		REFCOUNT_INIT(copy, filemap_free);
+
+		copy->next = NULL;
+		*tail = copy;
+		tail = &copy->next;
+	}
+	unlock(&filemap_lock);
+
+	return success;
+}
+
+/*
+ * Sucht den Bereich, in dem eine Adresse liegt
+ * Rückgabe:	Bereich (muss mit filemap_release freigegeben werden) oder NULL
+ */
+filemap_t *filemap_find(context_t *context, uintptr_t address)
+{
+	filemap_t *map;
+
+	lock(&filemap_lock);
+	for(map = context->filemaps; map != NULL; map = map->next)
+		if(map->start <= address && address < map->end)
+			break;
+	if(map != NULL)
+		map = REFCOUNT_RETAIN(map);
+	unlock(&filemap_lock);
+
+	return map;
+}
+
+/*
+ * Gibt eine Referenz auf einen Bereich frei
+ */
+void filemap_release(filemap_t *map)
+{
+	if(map != NULL)
+		REFCOUNT_RELEASE(map);
+}
+
+/*
+ * Prüft, ob sich ein Bereich [start, end) mit einem Bereich einer Datei überschneidet
+ */
+bool filemap_overlaps(context_t *context, uintptr_t start, uintptr_t end)
+{
+	filemap_t *map;
+
+	lock(&filemap_lock);
+	for(map = context->filemaps; map != NULL; map = map->next)
+		if(map->start < end && start < map->end)
+			break;
+	unlock(&filemap_lock);
+
+	return map != NULL;
+}
+
+//Füllt eine neue Page mit den Daten aus der Datei
+static void filemap_fill(filemap_t *map, uintptr_t address, paddr_t page)
+{
+	void *dest = vmm_PhysToVirt(page);
+	uintptr_t from = MAX(address, map->dataStart);
+	uintptr_t to = MIN(address + MM_BLOCK_SIZE, map->dataEnd);
+
+	memset(dest, 0, MM_BLOCK_SIZE);
+	if(from < to)
+		vfs_Read(map->file, map->offset + (from - map->dataStart), to - from, dest + (from - address));
+}
+
+//Schlüssel einer Page im Image: Programme über die virt. Adresse, Dateien über die Position in der Datei
+static uintptr_t filemap_pageKey(filemap_t *map, uintptr_t address)
+{
+	return (map->image->resource != NULL) ? map->offset + (address - map->dataStart) : address;
+}
+
+/*
+ * Gibt die Page für eine Adresse in einem Bereich zurück. Pages ohne Daten aus der Datei werden
+ * beim Lesen auf die Nullpage gemappt. Pages mit Daten werden über das Image geteilt, ausser ein
+ * privater Bereich wird beschrieben, dann bekommt er eine eigene Kopie.
+ * Parameter:	map = Bereich
+ * 				address = Adresse der Page
+ * 				write = Die Page wird beschrieben
+ * 				shared = wird auf true gesetzt, wenn die Page nicht dem Prozess gehört
+ * Rückgabe:	phys. Adresse der Page oder 1, wenn kein Speicher vorhanden ist
+ */
+paddr_t filemap_getPage(filemap_t *map, uintptr_t address, bool write, bool *shared)
+{
+	paddr_t page, cached;
+	uintptr_t key;
+
+	address &= ~0xFFF;
+
+	if(address >= map->dataEnd || address + MM_BLOCK_SIZE <= map->dataStart)
+	{
+		if(!write)
+		{
+			*shared = true;
+			return filemap_getZeroPage();
+		}
+		*shared = false;
+		return pmm_AllocZeroed();
+	}
+
+	if(map->image == NULL)
+	{
+		*shared = false;
+		if((page = pmm_Alloc()) != 1)
+			filemap_fill(map, address, page);
+		return page;
+	}
+
+	key = filemap_pageKey(map, address);
+	if(write && !(map->mode & FILEMAP_SHARED))
+	{
+		//Private Kopie, wenn möglich von der schon gelesenen Page
+		*shared = false;
+		if((page = pmm_Alloc()) == 1)
+			return 1;
+		lock(&map->image->lock);
+		if(hashmap_search(map->image->pages, (void*)key, (void**)&cached))
+			memcpy(vmm_PhysToVirt(page), vmm_PhysToVirt(cached), MM_BLOCK_SIZE);
+		else
+			cached = 1;
+		unlock(&map->image->lock);
+		if(cached == 1)
+			filemap_fill(map, address, page);
+		return page;
+	}
+
+	*shared = true;
+	if(LOCKED_RESULT(map->image->lock, hashmap_search(map->image->pages, (void*)key, (void**)&cached)))
+		return cached;
+
+	if((page = pmm_Alloc()) == 1)
+		return 1;
+	filemap_fill(map, address, page);
+
+	//Die Page könnte inzwischen von einem anderen Prozess gelesen worden sein
+	lock(&map->image->lock);
+	if(hashmap_search(map->image->pages, (void*)key, (void**)&cached))
+	{
+		pmm_Free(page);
+		page = cached;
+	}
+	else if(hashmap_set(map->image->pages, (void*)key, (void*)page) < 0)
+	{
+		*shared = false;
+	}
+	unlock(&map->image->lock);
+
+	return page;
+}
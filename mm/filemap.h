@@ -0,0 +1,55 @@
+/*
+ * filemap.h
+ *
+ *  Created on: 17.10.2026
+ */
+
+#ifndef FILEMAP_H_
+#define FILEMAP_H_
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "vmm.h"
+#include "vfs.h"
+#include "refcount.h"
+
+#define FILEMAP_SHARED		(1 << 0)	//Änderungen werden in die Datei geschrieben, ansonsten copy-on-write
+#define FILEMAP_FILE_WRITE	(1 << 1)	//Die Datei darf über den Bereich beschrieben werden
+
+typedef struct filemap_image filemap_image_t;
+
+/*
+ * Bereich eines Adressraums, dessen Pages erst beim ersten Zugriff aus einer Datei gefüllt werden.
+ * Ausserhalb von [dataStart, dataEnd) ist der Bereich mit Nullen gefüllt.
+ */
+typedef struct filemap{
+	struct filemap *next;
+	uintptr_t start, end;			//Bereich [start, end), auf Pages ausgerichtet
+	uintptr_t dataStart, dataEnd;	//Bereich, der aus der Datei gelesen wird
+	uint64_t offset;				//Position von dataStart in der Datei
+	uint8_t flags;					//VMM_FLAGS_* der Pages
+	uint8_t mode;					//FILEMAP_*
+	vfs_file_t file;
+	filemap_image_t *image;			//Gemeinsame Pages, NULL wenn alle Pages dem Prozess gehören
+	REFCOUNT_FIELD;
+}filemap_t;
+
+filemap_image_t *filemap_getImage(const char *path, vfs_file_t file);
+filemap_image_t *filemap_getFileImage(vfs_file_t file);
+void filemap_releaseImage(filemap_image_t *image);
+
+void *filemap_map(context_t *context, vfs_file_t file, filemap_image_t *image, void *address, size_t memsz,
+		uint64_t offset, size_t filesz, uint8_t flags, uint8_t mode);
+bool filemap_unmap(context_t *context, uintptr_t start, uintptr_t end);
+bool filemap_protect(context_t *context, uintptr_t start, uintptr_t end, uint8_t flags);
+void filemap_sync(context_t *context, uintptr_t start, uintptr_t end);
+void filemap_unmapAll(context_t *context);
+bool filemap_cloneAll(context_t *dst, context_t *src);
+
+filemap_t *filemap_find(context_t *context, uintptr_t address);
+void filemap_release(filemap_t *map);
+bool filemap_overlaps(context_t *context, uintptr_t start, uintptr_t end);
+paddr_t filemap_getPage(filemap_t *map, uintptr_t address, bool write, bool *shared);
+bool filemap_isZeroPage(paddr_t page);
+
+#endif /* FILEMAP_H_ */
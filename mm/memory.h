@@ -14,7 +14,11 @@
 
 //Userspace
 #define USERSPACE_START		(KERNELSPACE_END + 1)	//Userspace Anfang
-#define USERSPACE_END		0xFFFFFF7FFFFFFFFF		//Userspace Ende
+#define USERSPACE_END		0xFFFFFEFFFFFFFFFF		//Userspace Ende
+//Direct Map des gesamten phys. Speichers (vorletzter PML4-Eintrag)
+#define DIRECTMAP_START		(USERSPACE_END + 1)		//Direct Map Anfang
+#define DIRECTMAP_END		0xFFFFFF7FFFFFFFFF		//Direct Map Ende (512GB)
+
 #define MAX_ADDRESS			0xFFFFFFFFFFFFFFFF		//Maximale Adresse
 
 #define MM_USER_STACK		USERSPACE_END			//Stackaddresse für Prozesse
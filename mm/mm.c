@@ -11,11 +11,13 @@
 #include "vmm.h"
 #include "pmm.h"
 #include "memory.h"
+#include "filemap.h"
+#include "scheduler.h"
 
 //Speicherverwaltung
 bool mm_Init()
 {
-	return vmm_Init() && pmm_Init();
+	return vmm_Init() && pmm_Init() && vmm_InitDirectMap();
 }
 
 /*
@@ -34,6 +36,139 @@ void mm_Free(void *Address, uint64_t Pages)
 	vmm_Free(Address, Pages);
 }
 
+//Wandelt PROT_* in VMM_FLAGS_* um, die Pages sind immer lesbar
+static uint8_t mm_protFlags(uint64_t prot)
+{
+	uint8_t flags = VMM_FLAGS_USER;
+	if(prot & PROT_WRITE)
+		flags |= VMM_FLAGS_WRITE;
+	if(!(prot & PROT_EXEC))
+		flags |= VMM_FLAGS_NX;
+	return flags;
+}
+
+/*
+ * Blendet anonymen Speicher oder eine Datei in den Adressraum des aktuellen Prozesses ein. Die
+ * Pages werden erst beim Zugriff angelegt bzw. aus der Datei gelesen. Private Bereiche einer Datei
+ * teilen sich die gelesenen Pages mit allen anderen Bereichen derselben Datei und kopieren sie beim
+ * Schreiben, gemeinsame Bereiche schreiben direkt in diese Pages.
+ * Parameter:	address = Adresse des Bereichs, wird nur mit MAP_FIXED beachtet
+ * 				length = Grösse des Bereichs in Bytes
+ * 				flags = PROT_* und MAP_*, MAP_SHARED oder MAP_PRIVATE muss gesetzt sein
+ * 				streamid = Stream der Datei (ohne MAP_ANONYMOUS)
+ * 				offset = Position in der Datei, auf Pages ausgerichtet
+ * Rückgabewert:	Adresse des Bereichs oder NULL bei einem Fehler
+ */
+void *mm_syscall_mmap(void *address, size_t length, uint64_t flags, uint64_t streamid, uint64_t offset)
+{
+	context_t *context = currentProcess->Context;
+	filemap_image_t *image;
+	vfs_mode_t mode;
+	vfs_file_t file;
+	uint64_t size;
+
+	if(length == 0 || (offset & 0xFFF) || !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+		return NULL;
+	if(!(flags & MAP_FIXED))
+		address = NULL;
+	else if(((uintptr_t)address & 0xFFF) || !vmm_userspacePointerValid(address, PG_PAGE_ALIGN_ROUND_UP(length)))
+		return NULL;
+
+	if(flags & MAP_ANONYMOUS)
+	{
+		//Ohne gemeinsame Adressräume verhält sich MAP_SHARED hier wie MAP_PRIVATE
+		size = PG_PAGE_ALIGN_ROUND_UP(length);
+		if(address == NULL && size >= PG_LARGE_PAGE_SIZE)
+			address = vma_allocAligned(&context->vmas, size, PG_LARGE_PAGE_SIZE);
+		else if(address == NULL)
+			address = vma_alloc(&context->vmas, size);
+		else if(!vma_reserve(&context->vmas, address, size))
+			address = NULL;
+		if(address == NULL)
+			return NULL;
+		if(vmm_MapRange(context, address, 0, size / MM_BLOCK_SIZE, mm_protFlags(flags), VMM_UNUSED_PAGE) != 0)
+		{
+			vma_release(&context->vmas, address, size);
+			return NULL;
+		}
+		return address;
+	}
+
+	file = vfs_getUserspaceStream(streamid, &mode);
+	if(file == (vfs_file_t)-1 || !mode.read)
+		return NULL;
+	//Ein gemeinsamer Bereich darf nur beschrieben werden, wenn die Datei beschrieben werden darf
+	if((flags & MAP_SHARED) && (flags & PROT_WRITE) && !mode.write)
+		return NULL;
+
+	if((image = filemap_getFileImage(file)) == NULL)
+		return NULL;
+	size = vfs_getFileinfo(file, VFS_INFO_FILESIZE);
+	address = filemap_map(context, file, image, address, length, offset, (offset < size) ? size - offset : 0, mm_protFlags(flags),
+			(flags & MAP_SHARED) ? FILEMAP_SHARED | (mode.write ? FILEMAP_FILE_WRITE : 0) : 0);
+	filemap_releaseImage(image);
+
+	return address;
+}
+
+/*
+ * Entfernt einen Bereich aus dem Adressraum des aktuellen Prozesses. Veränderte Pages gemeinsamer
+ * Bereiche werden vorher in die Datei geschrieben.
+ * Parameter:	address = Anfang des Bereichs, auf Pages ausgerichtet
+ * 				length = Grösse des Bereichs in Bytes
+ * Rückgabewert:	0 bei Erfolg, -1 bei einem Fehler
+ */
+int mm_syscall_munmap(void *address, size_t length)
+{
+	context_t *context = currentProcess->Context;
+	size_t size = PG_PAGE_ALIGN_ROUND_UP(length);
+
+	if(length == 0 || ((uintptr_t)address & 0xFFF) || !vmm_userspacePointerValid(address, size))
+		return -1;
+	if(!filemap_unmap(context, (uintptr_t)address, (uintptr_t)address + size))
+		return -1;
+	vmm_UnMapRange(context, address, size / MM_BLOCK_SIZE, true);
+	vma_release(&context->vmas, address, size);
+
+	return 0;
+}
+
+/*
+ * Ändert die Zugriffsrechte eines Bereichs im Adressraum des aktuellen Prozesses
+ * Parameter:	address = Anfang des Bereichs, auf Pages ausgerichtet
+ * 				length = Grösse des Bereichs in Bytes
+ * 				prot = PROT_*
+ * Rückgabewert:	0 bei Erfolg, -1 bei einem Fehler
+ */
+int mm_syscall_mprotect(void *address, size_t length, uint64_t prot)
+{
+	context_t *context = currentProcess->Context;
+	size_t size = PG_PAGE_ALIGN_ROUND_UP(length);
+
+	if(length == 0 || ((uintptr_t)address & 0xFFF) || !vmm_userspacePointerValid(address, size))
+		return -1;
+	if(!filemap_protect(context, (uintptr_t)address, (uintptr_t)address + size, mm_protFlags(prot)))
+		return -1;
+	vmm_ProtectRange(context, address, size / MM_BLOCK_SIZE, mm_protFlags(prot));
+
+	return 0;
+}
+
+/*
+ * Schreibt die veränderten Pages aller gemeinsamen Bereiche in einem Bereich in die Dateien. Es
+ * wird immer synchron geschrieben.
+ * Parameter:	address = Anfang des Bereichs
+ * 				length = Grösse des Bereichs in Bytes
+ * Rückgabewert:	0 bei Erfolg, -1 bei einem Fehler
+ */
+int mm_syscall_msync(void *address, size_t length)
+{
+	if(!vmm_userspacePointerValid(address, length))
+		return -1;
+	filemap_sync(currentProcess->Context, (uintptr_t)address & ~0xFFF, (uintptr_t)address + length);
+	return 0;
+}
+
 //System
 /*
  * Reserviert Speicher für das System
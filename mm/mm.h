@@ -9,6 +9,7 @@
 #define MM_H_
 
 #include "stdint.h"
+#include "stddef.h"
 #include "paging.h"
 #include "stdbool.h"
 
@@ -17,7 +18,15 @@ bool mm_Init(void);
 void *mm_Alloc(uint64_t Size);
 void mm_Free(void *Address, uint64_t Size);
 
+void *mm_syscall_mmap(void *address, size_t length, uint64_t flags, uint64_t streamid, uint64_t offset);
+int mm_syscall_munmap(void *address, size_t length);
+int mm_syscall_mprotect(void *address, size_t length, uint64_t prot);
+int mm_syscall_msync(void *address, size_t length);
+
 void *mm_SysAlloc(uint64_t Size);
 bool mm_SysFree(void *Address, uint64_t Size);
 
+//Implementiert in stdlib.c
+void mm_getHeapInfo(size_t *size, size_t *used);
+
 #endif /* MM_H_ */
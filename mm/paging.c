@@ -7,6 +7,10 @@
 
 #include "paging.h"
 #include "cpu.h"
+#include "smp.h"
+#include "memory.h"
+
+#define PG_TLB_FLUSH_THRESHOLD	32	//Ab so vielen Pages wird der ganze TLB statt einzelner Einträge geleert
 
 inline void FlushTLB(void);
 
@@ -89,6 +93,50 @@ void setPTEntry(uint16_t i, PT_t *PT, uint8_t Present, uint8_t RW, uint8_t US, u
 	PT->PTE[i] |= ((NX & cpuInfo.nx) & 1LL) << 63;
 }
 
+/*
+ * Die folgenden Einträge beschreiben eine 1GB- bzw. 2MB-Page (PS = 1). Das PAT-Bit liegt
+ * bei diesen an Bit 12, die Adresse muss entsprechend ausgerichtet sein.
+ */
+void setPDPLargeEntry(uint16_t i, PDP_t *PDP, uint8_t Present, uint8_t RW, uint8_t US, uint8_t PWT,
+		uint8_t PCD, uint8_t A, uint8_t D, uint8_t G, uint16_t AVL,
+		uint8_t PAT, uint8_t NX, paddr_t Address)
+{
+	PDP->PDPE[i] = (Present & 1);
+	PDP->PDPE[i] |= (RW & 1) << 1;
+	PDP->PDPE[i] |= (US & 1) << 2;
+	PDP->PDPE[i] |= (PWT & 1) << 3;
+	PDP->PDPE[i] |= (PCD & 1) << 4;
+	PDP->PDPE[i] |= (A & 1) << 5;
+	PDP->PDPE[i] |= (D & 1) << 6;
+	PDP->PDPE[i] |= PG_PS;
+	PDP->PDPE[i] |= ((G & cpuInfo.GlobalPage) & 1LL) << 8;
+	PDP->PDPE[i] |= (AVL & 0x7LL) << 9;
+	PDP->PDPE[i] |= (PAT & 1LL) << 12;
+	PDP->PDPE[i] |= Address & PG_ADDRESS_1G;
+	PDP->PDPE[i] |= ((AVL >> 3) & 0x7FFLL) << 52;
+	PDP->PDPE[i] |= ((NX & cpuInfo.nx) & 1LL) << 63;
+}
+
+void setPDLargeEntry(uint16_t i, PD_t *PD, uint8_t Present, uint8_t RW, uint8_t US, uint8_t PWT,
+		uint8_t PCD, uint8_t A, uint8_t D, uint8_t G, uint16_t AVL,
+		uint8_t PAT, uint8_t NX, paddr_t Address)
+{
+	PD->PDE[i] = (Present & 1);
+	PD->PDE[i] |= (RW & 1) << 1;
+	PD->PDE[i] |= (US & 1) << 2;
+	PD->PDE[i] |= (PWT & 1) << 3;
+	PD->PDE[i] |= (PCD & 1) << 4;
+	PD->PDE[i] |= (A & 1) << 5;
+	PD->PDE[i] |= (D & 1) << 6;
+	PD->PDE[i] |= PG_PS;
+	PD->PDE[i] |= ((G & cpuInfo.GlobalPage) & 1LL) << 8;
+	PD->PDE[i] |= (AVL & 0x7LL) << 9;
+	PD->PDE[i] |= (PAT & 1LL) << 12;
+	PD->PDE[i] |= Address & PG_ADDRESS_2M;
+	PD->PDE[i] |= ((AVL >> 3) & 0x7FFLL) << 52;
+	PD->PDE[i] |= ((NX & cpuInfo.nx) & 1LL) << 63;
+}
+
 //XXX
 void clearPML4Entry(uint16_t i, PML4_t *PML4)
 {
@@ -117,9 +165,65 @@ void clearPTEntry(uint16_t i, PT_t *PT)
 void InvalidateTLBEntry(void *Address)
 {
 	asm volatile("invlpg (%0)" : :"r" (Address));
+
+	//Die anderen CPUs könnten den Eintrag ebenfalls zwischengespeichert haben
+	if(smp_cpuCount > 1)
+		smp_InvalidateTLBEntry(Address);
 }
 
 inline void FlushTLB()
 {
 	asm volatile("mov %%cr3,%%rax; mov %%rax,%%cr3;" : : :"rax");
 }
+
+/*
+ * Leert den ganzen TLB inklusive der globalen Pages. Dazu wird CR4.PGE kurz gelöscht,
+ * was auch die Einträge aller PCIDs entfernt.
+ */
+static void FlushGlobalTLB(void)
+{
+	asm volatile(
+			"mov %%cr4,%%rax;"
+			"btr $7,%%rax;"
+			"mov %%rax,%%cr4;"
+			"bts $7,%%rax;"
+			"mov %%rax,%%cr4;"
+			: : :"rax", "memory");
+}
+
+/*
+ * Invalidiert einen Bereich im TLB der aktuellen CPU. Ab PG_TLB_FLUSH_THRESHOLD Pages wird
+ * der ganze TLB geleert, für Bereiche im Kernelspace auch die globalen Pages.
+ * Parameter:	Address = virt. Addresse der ersten Page
+ * 				Pages = Anzahl Pages
+ */
+void InvalidateLocalTLBRange(void *Address, size_t Pages)
+{
+	size_t i;
+
+	if(Pages > PG_TLB_FLUSH_THRESHOLD)
+	{
+		if((uintptr_t)Address <= KERNELSPACE_END && cpuInfo.GlobalPage)
+			FlushGlobalTLB();
+		else
+			FlushTLB();
+	}
+	else
+	{
+		for(i = 0; i < Pages; i++)
+			asm volatile("invlpg (%0)" : :"r" (Address + i * PG_PAGE_SIZE) : "memory");
+	}
+}
+
+/*
+ * Invalidiert einen Bereich im TLB aller CPUs
+ * Parameter:	Address = virt. Addresse der ersten Page
+ * 				Pages = Anzahl Pages
+ */
+void InvalidateTLBRange(void *Address, size_t Pages)
+{
+	InvalidateLocalTLBRange(Address, Pages);
+
+	if(smp_cpuCount > 1)
+		smp_InvalidateTLBRange(Address, Pages);
+}
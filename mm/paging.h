@@ -9,6 +9,7 @@
 #define PAGING_H_
 
 #include "stdint.h"
+#include "stddef.h"
 #include "pmm.h"
 
 /*Pagingstrukturen
@@ -31,13 +32,17 @@
 //Nur in PTE vorhanden
 #define PG_D		0x40
 #define PG_PAT		0x80
+#define PG_PS		0x80		//Nur in PDP- und PD-Einträgen (an dieser Stelle ist in der PT das PAT-Bit)
 #define PG_G		0x100LL
 //Allgemein
 #define PG_AVL1		0xE00LL
 #define PG_ADDRESS	0xFFFFFFFFFF000LL
 #define PG_AVL2		0x7FF0000000000000LL
 #define PG_NX		0x8000000000000000LL
+#define PG_ADDRESS_2M	0xFFFFFFFE00000LL
+#define PG_ADDRESS_1G	0xFFFFFC0000000LL
 #define PG_AVL(Entry)	(((Entry & PG_AVL1) | ((Entry & PG_AVL2) >> 40)) >> 9)
+#define PG_AVL_BITS(avl)	((((uint64_t)(avl) & 0x7) << 9) | ((((uint64_t)(avl) >> 3) & 0x7FF) << 52))	//Umkehrung von PG_AVL
 
 //Indices der Tabellen in der virtuellen Addresse
 #define PG_PML4_INDEX	0xFF8000000000
@@ -46,6 +51,8 @@
 #define PG_PT_INDEX		0x1FF000
 
 #define PG_PAGE_SIZE				4096
+#define PG_LARGE_PAGE_SIZE			0x200000	//2MB-Page (PS-Bit in der PD)
+#define PG_HUGE_PAGE_SIZE			0x40000000	//1GB-Page (PS-Bit in der PDP)
 #define PG_PAGE_ALIGN_ROUND_DOWN(n)	((n) & PG_ADDRESS)
 #define PG_PAGE_ALIGN_ROUND_UP(n)	(((n) + ~PG_ADDRESS) & PG_ADDRESS)
 #define PG_NUM_PAGES(size)			(PG_PAGE_ALIGN_ROUND_UP(size) / PG_PAGE_SIZE)
@@ -93,10 +100,18 @@ void setPDEntry(uint16_t i, PD_t *PD, uint8_t Present, uint8_t RW, uint8_t US, u
 void setPTEntry(uint16_t i, PT_t *PT, uint8_t Present, uint8_t RW, uint8_t US, uint8_t PWT,
 		uint8_t PCD, uint8_t A, uint8_t D, uint8_t G, uint16_t AVL,
 		uint8_t PAT, uint8_t NX, paddr_t Address);
+void setPDPLargeEntry(uint16_t i, PDP_t *PDP, uint8_t Present, uint8_t RW, uint8_t US, uint8_t PWT,
+		uint8_t PCD, uint8_t A, uint8_t D, uint8_t G, uint16_t AVL,
+		uint8_t PAT, uint8_t NX, paddr_t Address);
+void setPDLargeEntry(uint16_t i, PD_t *PD, uint8_t Present, uint8_t RW, uint8_t US, uint8_t PWT,
+		uint8_t PCD, uint8_t A, uint8_t D, uint8_t G, uint16_t AVL,
+		uint8_t PAT, uint8_t NX, paddr_t Address);
 void clearPML4Entry(uint16_t i, PML4_t *PML4);
 void clearPDPEntry(uint16_t i, PDP_t *PDP);
 void clearPDEntry(uint16_t i, PD_t *PD);
 void clearPTEntry(uint16_t i, PT_t *PT);
 
 void InvalidateTLBEntry(void *Address);
+void InvalidateTLBRange(void *Address, size_t Pages);
+void InvalidateLocalTLBRange(void *Address, size_t Pages);
 #endif /* PAGING_H_ */
@@ -16,9 +16,8 @@
 #include "stdlib.h"
 #include "lock.h"
 #include "assert.h"
-#ifdef DEBUGMODE
+#include "cpu.h"
 #include "stdio.h"
-#endif
 
 #define PMM_BITS_PER_ELEMENT	(sizeof(*Map) * 8)
 #define PMM_MAP_ALIGN_SIZE(x)	((x + (sizeof(*Map) - 1)) & ~(sizeof(*Map) - 1))
@@ -32,7 +31,8 @@ extern uint8_t kernel_end;
 
 static uint64_t pmm_totalMemory;		//Maximal verfügbarer RAM (physisch)
 static uint64_t pmm_totalPages;			//Gesamtanzahl an phys. Pages
-static uint64_t pmm_freePages;			//Verfügbarer (freier) physischer Speicher (4kb)
+static paddr_t pmm_maxAddress;			//Höchste phys. Adresse laut Memory Map
+static uint64_t pmm_freePages;			//Verfügbarer (freier) physischer Speicher (4kb), ohne die Pages in den Magazinen
 static uint64_t pmm_Kernelsize;			//Grösse des Kernels in Bytes
 
 //32768 byte grosse Bitmap (für die ersten 1GB Speicher)
@@ -41,6 +41,86 @@ static uint64_t tmpMap[4096] __attribute__((aligned(MM_BLOCK_SIZE)));
 static uint64_t *Map = tmpMap;
 static size_t mapSize = 4096;			//Grösse der Bitmap
 
+/*
+ * Buddy-Allokator: Für jede Ordnung gibt es eine Freimap, in der ein Bit für jeden
+ * freien Block von 2^order Pages gesetzt ist. Die Bitmap oben bleibt zusätzlich
+ * erhalten und dient zur Kontrolle.
+ */
+#define PMM_MAX_ORDER		10		//Grösster Block: 4MB
+#define PMM_FREEMAP_LEVELS	4
+#define PMM_FIRST_PFN		256		//Die ersten 1MB werden nicht vergeben
+
+typedef struct{
+	uint64_t *level[PMM_FREEMAP_LEVELS];
+	size_t words[PMM_FREEMAP_LEVELS];
+}pmm_freeMap_t;
+
+static pmm_freeMap_t freeMaps[PMM_MAX_ORDER + 1];
+static bool buddyReady = false;
+static lock_t pmm_lock = LOCK_UNLOCKED;
+
+/*
+ * Pro CPU ein kleiner Stapel freier Pages ("Magazin"), aus dem pmm_Alloc() und
+ * pmm_Free() ohne pmm_lock bedient werden. Er wird blockweise aus dem Buddy-Allokator
+ * aufgefüllt bzw. in ihn geleert. Die Pages im Magazin sind in der Bitmap als
+ * belegt markiert.
+ */
+#define PMM_MAGAZINE_SIZE	64
+#define PMM_MAGAZINE_BATCH	32
+
+typedef struct{
+	size_t count;
+	size_t pages[PMM_MAGAZINE_SIZE];	//Pagenummern
+}pmm_magazine_t;
+
+static pmm_magazine_t magazines[CPU_MAX];
+
+/*
+ * Vorrat an bereits gelöschten Pages für Page Faults. Er wird von den Idle-Threads mit
+ * nicht-temporalen Speicherzugriffen aufgefüllt, damit die Caches nicht verdrängt werden.
+ * Die Pages im Vorrat sind in der Bitmap als belegt markiert.
+ */
+#define PMM_ZERO_POOL_SIZE		256
+#define PMM_ZERO_POOL_RESERVE	1024	//So viele Pages bleiben immer für normale Allokationen frei
+
+static size_t zeroPool[PMM_ZERO_POOL_SIZE];	//Pagenummern
+static size_t zeroPoolCount;
+static lock_t zeroPoolLock = LOCK_UNLOCKED;
+
+/*
+ * Referenzzähler für Pages, die sich mehrere Kontexte teilen (copy-on-write nach fork). Gezählt
+ * werden nur die zusätzlichen Besitzer, eine Page mit nur einem Besitzer hat also den Wert 0.
+ * pmm_Free gibt eine Page erst frei, wenn kein weiterer Besitzer mehr vorhanden ist.
+ */
+static uint32_t *pmm_refs;
+static size_t pmm_refsSize;
+
+/*
+ * CMA-Bereich: Beim Start wird unterhalb von 4GB ein zusammenhängender Bereich reserviert, der
+ * nicht im Buddy-Allokator liegt. Verschiebbare Pages (anonyme Pages des Userspaces) dürfen ihn
+ * ausleihen. Braucht ein Treiber zusammenhängenden Speicher für DMA, werden die Pages eines
+ * Fensters verschoben, indem ihre Page Table Einträge auf eine Kopie umgebogen werden. Die für
+ * DMA vergebenen Pages sind markiert und werden nie verschoben.
+ */
+#define PMM_CMA_PAGES		4096		//16MB
+#define PMM_CMA_LIMIT		0x100000000	//Der Bereich liegt unterhalb von 4GB
+#define PMM_CMA_ATTEMPTS	4			//So viele Fenster werden höchstens freigeräumt
+
+static size_t cma_start, cma_end;		//Bereich [cma_start, cma_end) in Pagenummern
+static size_t cma_next;					//Ab hier wird nach einer freien Page gesucht
+static uint64_t cma_freePages;
+static size_t cma_isolateStart, cma_isolateEnd;	//Fenster, das gerade für DMA freigeräumt wird
+static uint64_t cma_pinned[PMM_CMA_PAGES / 64];	//Für DMA vergebene Pages
+static lock_t cma_lock = LOCK_UNLOCKED;			//Es wird nur ein Fenster gleichzeitig freigeräumt
+
+static void pmm_buddyInit(void);
+static size_t pmm_mapFindRun(size_t maxPfn, size_t count);
+
+static inline bool pmm_isCMA(size_t pfn)
+{
+	return pfn >= cma_start && pfn < cma_end;
+}
+
 /*
  * Initialisiert die physikalische Speicherverwaltung
  */
@@ -67,6 +147,7 @@ bool pmm_Init()
 	}
 
 	pmm_totalPages = pmm_totalMemory / MM_BLOCK_SIZE;
+	pmm_maxAddress = maxAddress;
 	assert(pmm_totalMemory % MM_BLOCK_SIZE == 0);
 
 	i = 0;
@@ -124,145 +205,713 @@ bool pmm_Init()
 	}
 	list_destroy(reservedPages);
 
+	pmm_buddyInit();
+
+	pmm_refsSize = maxAddress / MM_BLOCK_SIZE;
+	pmm_refs = calloc(pmm_refsSize, sizeof(*pmm_refs));
+	if(pmm_refs == NULL)
+		Panic("PMM", "Zu wenig Speicher fuer die Referenzzaehler");
+
 	SysLog("PMM", "Initialisierung abgeschlossen");
 	return true;
 }
 
+static void pmm_mapMark(size_t pfn, size_t count, bool free)
+{
+	size_t end = pfn + count;
+	while(pfn < end)
+	{
+		if(pfn % PMM_BITS_PER_ELEMENT == 0 && end - pfn >= PMM_BITS_PER_ELEMENT)
+		{
+			assert(Map[pfn / PMM_BITS_PER_ELEMENT] == (free ? 0 : ~0ull));
+			Map[pfn / PMM_BITS_PER_ELEMENT] = free ? ~0ull : 0;
+			pfn += PMM_BITS_PER_ELEMENT;
+		}
+		else
+		{
+			uint64_t mask = 1ull << (pfn % PMM_BITS_PER_ELEMENT);
+			assert(!!(Map[pfn / PMM_BITS_PER_ELEMENT] & mask) != free);
+			if(free)
+				Map[pfn / PMM_BITS_PER_ELEMENT] |= mask;
+			else
+				Map[pfn / PMM_BITS_PER_ELEMENT] &= ~mask;
+			pfn++;
+		}
+	}
+}
+
+static bool pmm_mapTest(size_t pfn)
+{
+	return Map[pfn / PMM_BITS_PER_ELEMENT] & (1ull << (pfn % PMM_BITS_PER_ELEMENT));
+}
+
 /*
- * Reserviert eine Speicherstelle
- * Rückgabewert:	phys. Addresse der Speicherstelle
- * 					1 = Kein phys. Speicherplatz mehr vorhanden
+ * Operationen auf den Freimaps des Buddy-Allokators. Jede Ebene fasst 64 Bits der
+ * darunterliegenden Ebene zu einem Bit zusammen, dadurch findet pmm_freeMapFirst()
+ * einen freien Block in O(log n).
  */
-paddr_t pmm_Alloc()
+static void pmm_freeMapSet(pmm_freeMap_t *fm, size_t block)
+{
+	uint8_t l;
+	for(l = 0; l < PMM_FREEMAP_LEVELS; l++)
+	{
+		uint64_t old = fm->level[l][block / 64];
+		fm->level[l][block / 64] = old | (1ull << (block % 64));
+		if(old)
+			break;
+		block /= 64;
+	}
+}
+
+static void pmm_freeMapClear(pmm_freeMap_t *fm, size_t block)
+{
+	uint8_t l;
+	for(l = 0; l < PMM_FREEMAP_LEVELS; l++)
+	{
+		if((fm->level[l][block / 64] &= ~(1ull << (block % 64))))
+			break;
+		block /= 64;
+	}
+}
+
+static bool pmm_freeMapTest(pmm_freeMap_t *fm, size_t block)
+{
+	return block / 64 < fm->words[0] && (fm->level[0][block / 64] & (1ull << (block % 64)));
+}
+
+//Gibt den ersten freien Block zurück oder -1, wenn keiner frei ist
+static size_t pmm_freeMapFirst(pmm_freeMap_t *fm)
+{
+	const uint8_t top = PMM_FREEMAP_LEVELS - 1;
+	size_t i;
+	int l;
+
+	for(i = 0; i < fm->words[top]; i++)
+	{
+		if(fm->level[top][i])
+			break;
+	}
+	if(i == fm->words[top])
+		return -1;
+
+	for(l = top; l >= 0; l--)
+		i = i * 64 + __builtin_ctzll(fm->level[l][i]);
+
+	return i;
+}
+
+/*
+ * Fügt einen freien Block in die Freimaps ein und verschmilzt ihn dabei so weit
+ * wie möglich mit seinen Buddies. Die Bitmap wird nicht verändert.
+ */
+static void pmm_buddyInsert(size_t pfn, uint8_t order)
+{
+	size_t block = pfn >> order;
+	while(order < PMM_MAX_ORDER && pmm_freeMapTest(&freeMaps[order], block ^ 1))
+	{
+		pmm_freeMapClear(&freeMaps[order], block ^ 1);
+		block >>= 1;
+		order++;
+	}
+	pmm_freeMapSet(&freeMaps[order], block);
+}
+
+/*
+ * Nimmt einen Block der Grösse 2^order aus den Freimaps, der vollständig unterhalb
+ * von maxPfn liegt. Grössere Blöcke werden dafür geteilt.
+ * Rückgabewert:	Erste Page des Blocks, -1 wenn kein passender Block frei ist
+ */
+static size_t pmm_buddyTake(size_t maxPfn, uint8_t order)
 {
-	while(pmm_freePages > 0)
+	uint8_t o;
+	for(o = order; o <= PMM_MAX_ORDER; o++)
 	{
-		size_t i;
-		for(i = 4; i < mapSize; i++)
+		size_t block = pmm_freeMapFirst(&freeMaps[o]);
+		if(block == (size_t)-1 || ((block + 1) << o) > maxPfn)
+			continue;
+
+		pmm_freeMapClear(&freeMaps[o], block);
+
+		//Nicht benötigte obere Hälften wieder freigeben
+		while(o > order)
 		{
-			uint16_t tmp;
-			while((tmp = __builtin_ffsl(Map[i])) > 0)
-			{
-				uint16_t j;
-				bool status;
-				j = tmp - 1;
-				asm volatile("lock btr %2,%0;"
-							"setc %1": "=m"(Map[i]), "=r"(status): "r"(j): "cc", "memory");
-				if(status)
-				{
-					locked_dec(&pmm_freePages);
-					return (i * PMM_BITS_PER_ELEMENT + j) * MM_BLOCK_SIZE;
-				}
-			}
+			o--;
+			block <<= 1;
+			pmm_freeMapSet(&freeMaps[o], block + 1);
 		}
+		return block << order;
 	}
-	return 1;
+	return -1;
 }
 
 /*
- * Gibt eine Speicherstelle frei, dabei wird wenn möglich in der Bitmap kontrolliert, ob diese schon mal freigegeben wurde
- * Params: phys. Addresse der Speicherstelle
- * Rückgabewert:	true = Aktion erfolgreich
- * 					false = Aktion fehlgeschlagen (zu wenig Speicher)
+ * Entfernt eine einzelne freie Page aus den Freimaps. Der Block, in dem sie liegt,
+ * wird dafür geteilt.
  */
-void pmm_Free(paddr_t Address)
+static void pmm_buddyRemovePage(size_t pfn)
 {
-	uint8_t bit_status;
-	//entsprechendes Bit in der Bitmap zurücksetzen
-	size_t i = Address / MM_BLOCK_SIZE / PMM_BITS_PER_ELEMENT;
-	uint8_t bit = (Address / MM_BLOCK_SIZE) % PMM_BITS_PER_ELEMENT;
-	asm volatile("lock bts %1,%2;"
-				"setc %0": "=r"(bit_status): "r"(bit & 0xFF), "m"(Map[i]): "cc", "memory");
-	if(bit_status == 0)
-		locked_inc(&pmm_freePages);
-	else
-		printf("\e[33;mWarning:\e[0m Freed page which was already freed (0x%X)\n", Address);
+	uint8_t order;
+	size_t base;
+
+	for(order = 0; order <= PMM_MAX_ORDER; order++)
+	{
+		if(pmm_freeMapTest(&freeMaps[order], pfn >> order))
+			break;
+	}
+	assert(order <= PMM_MAX_ORDER);
+
+	pmm_freeMapClear(&freeMaps[order], pfn >> order);
+	base = (pfn >> order) << order;
+	while(order > 0)
+	{
+		order--;
+		if(pfn >= base + (1ul << order))
+		{
+			pmm_freeMapSet(&freeMaps[order], base >> order);
+			base += 1ul << order;
+		}
+		else
+		{
+			pmm_freeMapSet(&freeMaps[order], (base >> order) + 1);
+		}
+	}
 }
 
-//Für DMA erforderlich
-paddr_t pmm_AllocDMA(paddr_t maxAddress, size_t size)
+/*
+ * Legt die Freimaps für die ganze Bitmap an und trägt alle freien Pages ein. Bis
+ * dahin wird nur die Bitmap benutzt.
+ */
+static void pmm_buddyInit(void)
+{
+	size_t pages = mapSize * PMM_BITS_PER_ELEMENT;
+	uint8_t order;
+	size_t pfn, cmaPages;
+
+	for(order = 0; order <= PMM_MAX_ORDER; order++)
+	{
+		pmm_freeMap_t *fm = &freeMaps[order];
+		size_t words = ((pages >> order) + 63) / 64;
+		uint8_t l;
+		for(l = 0; l < PMM_FREEMAP_LEVELS; l++)
+		{
+			fm->words[l] = words;
+			fm->level[l] = calloc(words, sizeof(uint64_t));
+			assert(fm->level[l] != NULL);
+			words = (words + 63) / 64;
+		}
+	}
+
+	//CMA-Bereich reservieren, er wird nicht in die Freimaps eingetragen. Er belegt höchstens 1/8 des Speichers.
+	cmaPages = MIN((uint64_t)PMM_CMA_PAGES, pmm_freePages / 8);
+	if(cmaPages > 0 && (pfn = pmm_mapFindRun(PMM_CMA_LIMIT / MM_BLOCK_SIZE, cmaPages)) != (size_t)-1)
+	{
+		cma_start = cma_next = pfn;
+		cma_end = pfn + cmaPages;
+		cma_freePages = cmaPages;
+		pmm_freePages -= cmaPages;
+	}
+
+	//Die Pages für die Freimaps wurden schon aus der Bitmap genommen
+	for(pfn = 0; pfn < pages; pfn++)
+	{
+		if(pmm_mapTest(pfn) && !pmm_isCMA(pfn))
+			pmm_buddyInsert(pfn, 0);
+	}
+
+	buddyReady = true;
+}
+
+/*
+ * Sucht linear in der Bitmap nach count freien, zusammenhängenden Pages unterhalb
+ * von maxPfn. Wird vor der Initialisierung des Buddy-Allokators und für Blöcke
+ * grösser als 2^PMM_MAX_ORDER Pages benutzt. pmm_lock muss gehalten werden.
+ */
+static size_t pmm_mapFindRun(size_t maxPfn, size_t count)
 {
-	size_t maxIndex = maxAddress / MM_BLOCK_SIZE / PMM_BITS_PER_ELEMENT;
-	uint8_t maxBit = (maxAddress / MM_BLOCK_SIZE) % PMM_BITS_PER_ELEMENT;
-	size_t i, bitCount, bitAlloc, startIndex, lastIndex;
-	uint8_t startBit;
-	uint8_t lastBit;
-	size_t bitFreed;
-	search:
-	while(pmm_freePages >= size)
+	size_t pfn, run = 0;
+	maxPfn = MIN(maxPfn, mapSize * PMM_BITS_PER_ELEMENT);
+	for(pfn = PMM_FIRST_PFN; pfn < maxPfn; pfn++)
 	{
-		size_t maxI = MIN(mapSize - 1, maxIndex);
-		bitCount = 0;
-		startIndex = lastIndex = -1;
-		startBit = lastBit = -1;
-		for(i = 4; i <= maxI; i++)
+		if(run == 0 && count == 1 && Map[pfn / PMM_BITS_PER_ELEMENT] == 0)
 		{
-			uint8_t bit;
-			uint8_t maxBitIndex = (i == maxI) ? maxBit : PMM_BITS_PER_ELEMENT - 1;
-			for(bit = 0; bit <= maxBitIndex; bit++)
+			pfn |= PMM_BITS_PER_ELEMENT - 1;
+			continue;
+		}
+		run = (pmm_mapTest(pfn) && !pmm_isCMA(pfn)) ? run + 1 : 0;
+		if(run == count)
+			return pfn + 1 - count;
+	}
+	return -1;
+}
+
+static paddr_t pmm_allocPages(size_t maxPfn, size_t count)
+{
+	size_t pfn = -1;
+	bool enabled;
+	uint8_t order = 0;
+
+	while((1ul << order) < count)
+		order++;
+
+	enabled = cpu_disableInterrupts();
+	lock(&pmm_lock);
+
+	if(pmm_freePages >= count)
+	{
+		if(buddyReady && order <= PMM_MAX_ORDER)
+		{
+			pfn = pmm_buddyTake(maxPfn, order);
+			if(pfn != (size_t)-1)
 			{
-				bool status;
-				asm volatile(
-						"bt %2,%1;"
-						"setc %0"
-						: "=r"(status) : "m"(Map[i]), "r"((uint16_t)bit): "cc");
-				if(status)
-				{
-					if(((lastIndex == i && lastBit == bit - 1) || (lastIndex == i - 1 && lastBit == PMM_BITS_PER_ELEMENT - 1 && bit == 0))
-							&& bitCount > 0)
-					{
-						lastIndex = i;
-						lastBit = bit;
-						bitCount++;
-					}
-					else
-					{
-						bitCount = 1;
-						startIndex = lastIndex = i;
-						startBit = lastBit = bit;
-					}
-					if(bitCount == size)
-						goto found;
-				}
+				size_t i;
+				//Überzählige Pages am Ende des Blocks zurückgeben
+				for(i = count; i < (1ul << order); i++)
+					pmm_buddyInsert(pfn + i, 0);
+			}
+		}
+		else
+		{
+			pfn = pmm_mapFindRun(maxPfn, count);
+			if(pfn != (size_t)-1 && buddyReady)
+			{
+				size_t i;
+				for(i = 0; i < count; i++)
+					pmm_buddyRemovePage(pfn + i);
 			}
 		}
+
+		if(pfn != (size_t)-1)
+		{
+			pmm_mapMark(pfn, count, false);
+			pmm_freePages -= count;
+		}
+	}
+
+	unlock(&pmm_lock);
+	cpu_restoreInterrupts(enabled);
+
+	return (pfn == (size_t)-1) ? 1 : pfn * MM_BLOCK_SIZE;
+}
+
+//Füllt das Magazin mit bis zu count Pages aus dem Buddy-Allokator. Interrupts müssen deaktiviert sein.
+static void pmm_magazineRefill(pmm_magazine_t *mag, size_t count)
+{
+	lock(&pmm_lock);
+	while(count-- > 0 && pmm_freePages > 0)
+	{
+		size_t pfn = pmm_buddyTake(-1, 0);
+		if(pfn == (size_t)-1)
+			break;
+		pmm_mapMark(pfn, 1, false);
+		pmm_freePages--;
+		mag->pages[mag->count++] = pfn;
 	}
+	unlock(&pmm_lock);
+}
+
+//Gibt bis zu count Pages aus dem Magazin an den Buddy-Allokator zurück. Interrupts müssen deaktiviert sein.
+static void pmm_magazineDrain(pmm_magazine_t *mag, size_t count)
+{
+	lock(&pmm_lock);
+	while(count-- > 0 && mag->count > 0)
+	{
+		size_t pfn = mag->pages[--mag->count];
+		pmm_mapMark(pfn, 1, true);
+		pmm_buddyInsert(pfn, 0);
+		pmm_freePages++;
+	}
+	unlock(&pmm_lock);
+}
+
+//Nimmt eine freie Page aus dem CMA-Bereich, die nicht im gerade freigeräumten Fenster liegt
+static paddr_t pmm_cmaTake(void)
+{
+	size_t pfn, i, count = cma_end - cma_start;
+	paddr_t page = 1;
+	bool enabled;
+
+	if(cma_freePages == 0)
+		return 1;
+
+	enabled = cpu_disableInterrupts();
+	lock(&pmm_lock);
+	for(i = 0, pfn = cma_next; i < count && cma_freePages > 0; i++, pfn++)
+	{
+		if(pfn >= cma_end)
+			pfn = cma_start;
+		if(pmm_mapTest(pfn) && !(pfn >= cma_isolateStart && pfn < cma_isolateEnd))
+		{
+			pmm_mapMark(pfn, 1, false);
+			cma_freePages--;
+			cma_next = pfn + 1;
+			page = pfn * MM_BLOCK_SIZE;
+			break;
+		}
+	}
+	unlock(&pmm_lock);
+	cpu_restoreInterrupts(enabled);
+
+	return page;
+}
+
+static void pmm_cmaFree(size_t pfn)
+{
+	bool enabled = cpu_disableInterrupts();
+	lock(&pmm_lock);
+	if(pmm_mapTest(pfn))
+	{
+		unlock(&pmm_lock);
+		cpu_restoreInterrupts(enabled);
+		printf("\e[33;mWarning:\e[0m Freed page which was already freed (0x%X)\n", pfn * MM_BLOCK_SIZE);
+		return;
+	}
+	pmm_mapMark(pfn, 1, true);
+	cma_pinned[(pfn - cma_start) / 64] &= ~(1ull << ((pfn - cma_start) % 64));
+	cma_freePages++;
+	unlock(&pmm_lock);
+	cpu_restoreInterrupts(enabled);
+}
+
+/*
+ * Räumt ein Fenster im CMA-Bereich für DMA frei. Verschiebbare Pages im Fenster werden in andere
+ * Pages kopiert, Fenster mit für DMA vergebenen Pages werden übersprungen.
+ * Rückgabewert:	phys. Addresse des Fensters, 1 wenn keines freigeräumt werden konnte
+ */
+static paddr_t pmm_cmaAllocDMA(size_t maxPfn, size_t count)
+{
+	size_t start = cma_start, end = MIN(cma_end, maxPfn);
+	uint8_t attempts = 0;
+	bool enabled;
+
+	lock(&cma_lock);
+	while(start + count <= end && attempts < PMM_CMA_ATTEMPTS)
+	{
+		size_t pfn;
+
+		enabled = cpu_disableInterrupts();
+		lock(&pmm_lock);
+		for(pfn = start; pfn < start + count; pfn++)
+		{
+			if(cma_pinned[(pfn - cma_start) / 64] & (1ull << ((pfn - cma_start) % 64)))
+				break;
+		}
+		if(pfn < start + count)
+		{
+			unlock(&pmm_lock);
+			cpu_restoreInterrupts(enabled);
+			start = pfn + 1;
+			continue;
+		}
+		//Freie Pages im Fenster dürfen nicht mehr ausgeliehen werden
+		cma_isolateStart = start;
+		cma_isolateEnd = start + count;
+		unlock(&pmm_lock);
+		cpu_restoreInterrupts(enabled);
+
+		attempts++;
+		vmm_migrateRange(start * MM_BLOCK_SIZE, count);
+
+		enabled = cpu_disableInterrupts();
+		lock(&pmm_lock);
+		for(pfn = start; pfn < start + count; pfn++)
+		{
+			if(!pmm_mapTest(pfn))
+				break;
+		}
+		cma_isolateStart = cma_isolateEnd = 0;
+		if(pfn == start + count)
+		{
+			pmm_mapMark(start, count, false);
+			cma_freePages -= count;
+			for(pfn = start; pfn < start + count; pfn++)
+				cma_pinned[(pfn - cma_start) / 64] |= 1ull << ((pfn - cma_start) % 64);
+			unlock(&pmm_lock);
+			cpu_restoreInterrupts(enabled);
+			unlock(&cma_lock);
+			return start * MM_BLOCK_SIZE;
+		}
+		unlock(&pmm_lock);
+		cpu_restoreInterrupts(enabled);
+
+		//Eine Page konnte nicht verschoben werden, dahinter weitersuchen
+		start = pfn + 1;
+	}
+	unlock(&cma_lock);
 	return 1;
+}
+
+/*
+ * Reserviert eine Speicherstelle
+ * Rückgabewert:	phys. Addresse der Speicherstelle
+ * 					1 = Kein phys. Speicherplatz mehr vorhanden
+ */
+paddr_t pmm_Alloc()
+{
+	pmm_magazine_t *mag;
+	paddr_t page = 1;
+	bool enabled;
+
+	if(!buddyReady)
+		return pmm_allocPages(-1, 1);
 
-	found:
-	bitAlloc = 0;
-	for(i = startIndex; i <= lastIndex; i++)
+	enabled = cpu_disableInterrupts();
+	mag = &magazines[cpu_getId()];
+
+	if(mag->count == 0)
+		pmm_magazineRefill(mag, PMM_MAGAZINE_BATCH);
+	if(mag->count > 0)
+		page = mag->pages[--mag->count] * MM_BLOCK_SIZE;
+
+	cpu_restoreInterrupts(enabled);
+
+	return page;
+}
+
+/*
+ * Gibt eine Speicherstelle frei, dabei wird in der Bitmap kontrolliert, ob diese schon mal freigegeben wurde
+ * Params: phys. Addresse der Speicherstelle
+ */
+void pmm_Free(paddr_t Address)
+{
+	size_t pfn = Address / MM_BLOCK_SIZE;
+	pmm_magazine_t *mag;
+	bool enabled;
+
+	//Hat die Page noch weitere Besitzer, wird nur deren Anzahl verringert
+	if(pmm_refs != NULL && pfn < pmm_refsSize)
 	{
-		uint8_t bit;
-		uint8_t lastBitIndex = (i == lastIndex) ? lastBit : PMM_BITS_PER_ELEMENT - 1;
-		uint8_t startBitIndex = (i == startIndex) ? startBit : 0;
-		for(bit = startBitIndex; bit <= lastBitIndex; bit++)
+		uint32_t refs;
+		while((refs = pmm_refs[pfn]) > 0)
 		{
-			bool status;
-			asm volatile(
-					"lock btr %2,%1;"
-					"setc %0"
-					: "=r"(status), "=m"(Map[i]): "r"((uint16_t)bit): "cc");
-			if(!status)
-				goto failure;
-			else
-				bitAlloc++;
+			if(__sync_bool_compare_and_swap(&pmm_refs[pfn], refs, refs - 1))
+				return;
+		}
+	}
+
+	if(pmm_isCMA(pfn))
+	{
+		pmm_cmaFree(pfn);
+		return;
+	}
+
+	if(buddyReady)
+	{
+		//Pages im Magazin sind in der Bitmap belegt, nur doppelte Freigaben an
+		//den Buddy-Allokator werden hier erkannt
+		if(pmm_mapTest(pfn))
+		{
+			printf("\e[33;mWarning:\e[0m Freed page which was already freed (0x%X)\n", Address);
+			return;
 		}
+
+		enabled = cpu_disableInterrupts();
+		mag = &magazines[cpu_getId()];
+
+		if(mag->count == PMM_MAGAZINE_SIZE)
+			pmm_magazineDrain(mag, PMM_MAGAZINE_BATCH);
+		mag->pages[mag->count++] = pfn;
+
+		cpu_restoreInterrupts(enabled);
+		return;
 	}
-	__sync_fetch_and_add(&pmm_freePages, -size);
-	return (startIndex * PMM_BITS_PER_ELEMENT + startBit) * MM_BLOCK_SIZE;
 
-	failure:
-	bitFreed = bitAlloc;
-	//Alles rückgängig machen
-	for(i = startIndex; bitAlloc > 0; i++)
+	enabled = cpu_disableInterrupts();
+	lock(&pmm_lock);
+
+	if(pmm_mapTest(pfn))
 	{
-		uint8_t bit;
-		for(bit = (i == startIndex) ? startBit : 0; bit < PMM_BITS_PER_ELEMENT && bitAlloc > 0; bit++, bitAlloc--)
-			asm volatile("lock bts %1,%0": "=m"(Map[i]): "r"((uint16_t)bit): "cc");
+		unlock(&pmm_lock);
+		cpu_restoreInterrupts(enabled);
+		printf("\e[33;mWarning:\e[0m Freed page which was already freed (0x%X)\n", Address);
+		return;
 	}
-	__sync_fetch_and_add(&pmm_freePages, bitFreed);
-	goto search;
+
+	pmm_mapMark(pfn, 1, true);
+	pmm_freePages++;
+
+	unlock(&pmm_lock);
+	cpu_restoreInterrupts(enabled);
+}
+
+/*
+ * Fügt einer belegten Speicherstelle einen weiteren Besitzer hinzu. Jeder Besitzer gibt sie mit
+ * pmm_Free wieder frei.
+ * Params: phys. Addresse der Speicherstelle
+ */
+void pmm_Retain(paddr_t Address)
+{
+	size_t pfn = Address / MM_BLOCK_SIZE;
+	if(pfn < pmm_refsSize)
+		__sync_fetch_and_add(&pmm_refs[pfn], 1);
+}
+
+/*
+ * Prüft, ob eine Speicherstelle mehr als einen Besitzer hat
+ * Params: phys. Addresse der Speicherstelle
+ */
+bool pmm_isShared(paddr_t Address)
+{
+	size_t pfn = Address / MM_BLOCK_SIZE;
+	return pfn < pmm_refsSize && pmm_refs[pfn] > 0;
+}
+
+static inline void pmm_clearPage(paddr_t page)
+{
+	asm volatile("rep stosq" : :"c"(MM_BLOCK_SIZE / sizeof(uint64_t)), "D"(vmm_PhysToVirt(page)), "a"(0) :"memory");
+}
+
+//Löscht eine Page über die Direct Map, ohne sie in den Cache zu laden
+static void pmm_clearPageNT(paddr_t page)
+{
+	uint64_t *dest = vmm_PhysToVirt(page);
+	size_t i;
+
+	for(i = 0; i < MM_BLOCK_SIZE / sizeof(uint64_t); i += 4)
+	{
+		asm volatile(
+			"movnti %1,0(%0);"
+			"movnti %1,8(%0);"
+			"movnti %1,16(%0);"
+			"movnti %1,24(%0)"
+			: :"r"(&dest[i]), "r"(0ul) :"memory");
+	}
+	//Die Stores müssen sichtbar sein bevor die Page herausgegeben wird
+	asm volatile("sfence" : : :"memory");
+}
+
+/*
+ * Reserviert eine mit Nullen gefüllte Speicherstelle. Sie wird wenn möglich aus dem Vorrat
+ * genommen, ansonsten wird sie hier gelöscht.
+ * Rückgabewert:	phys. Addresse der Speicherstelle
+ * 					1 = Kein phys. Speicherplatz mehr vorhanden
+ */
+paddr_t pmm_AllocZeroed()
+{
+	paddr_t page = 1;
+	bool enabled;
+
+	enabled = cpu_disableInterrupts();
+	lock(&zeroPoolLock);
+	if(zeroPoolCount > 0)
+		page = zeroPool[--zeroPoolCount] * MM_BLOCK_SIZE;
+	unlock(&zeroPoolLock);
+	cpu_restoreInterrupts(enabled);
+
+	if(page == 1 && (page = pmm_Alloc()) != 1)
+		pmm_clearPage(page);
+
+	return page;
+}
+
+/*
+ * Reserviert eine verschiebbare Speicherstelle. Sie darf nur über Page Table Einträge des
+ * Userspaces verwendet werden, weil sie aus dem CMA-Bereich stammen kann und dann bei Bedarf
+ * verschoben wird.
+ * Params:	zeroed = Speicherstelle mit Nullen füllen
+ * Rückgabewert:	phys. Addresse der Speicherstelle
+ * 					1 = Kein phys. Speicherplatz mehr vorhanden
+ */
+paddr_t pmm_AllocMovable(bool zeroed)
+{
+	paddr_t page = 1;
+	bool cma;
+
+	//Der CMA-Bereich wird bevorzugt, sobald er mehr als die Hälfte des freien Speichers ausmacht
+	cma = cma_freePages > pmm_freePages && (page = pmm_cmaTake()) != 1;
+	if(!cma && (page = zeroed ? pmm_AllocZeroed() : pmm_Alloc()) == 1)
+		cma = (page = pmm_cmaTake()) != 1;
+	if(cma && zeroed)
+		pmm_clearPage(page);
+
+	return page;
+}
+
+/*
+ * Reserviert einen auf 2MB ausgerichteten Block von 2MB für eine grosse Page des Userspaces. Der
+ * Block kommt immer aus dem Buddy-Allokator und nie aus dem CMA-Bereich, er muss also nicht
+ * verschoben werden können. Die Speicherstellen werden danach einzeln mit pmm_Free freigegeben.
+ * Rückgabewert:	phys. Addresse des Blocks
+ * 					1 = Kein passender Block frei
+ */
+paddr_t pmm_AllocLarge()
+{
+	if(!buddyReady)
+		return 1;
+	return pmm_allocPages(-1, PG_LARGE_PAGE_SIZE / MM_BLOCK_SIZE);
+}
+
+/*
+ * Legt eine gelöschte Page in den Vorrat. Wird vom Idle-Thread aufgerufen.
+ * Rückgabewert:	true, wenn eine Page hinzugefügt wurde, false wenn der Vorrat voll ist oder
+ * 					zu wenig Speicher frei ist
+ */
+bool pmm_ZeroPoolRefill()
+{
+	paddr_t page;
+	bool enabled, added = false;
+
+	if(!buddyReady || !vmm_directMapReady || zeroPoolCount >= PMM_ZERO_POOL_SIZE || pmm_freePages < PMM_ZERO_POOL_RESERVE)
+		return false;
+
+	if((page = pmm_Alloc()) == 1)
+		return false;
+	pmm_clearPageNT(page);
+
+	enabled = cpu_disableInterrupts();
+	lock(&zeroPoolLock);
+	if(zeroPoolCount < PMM_ZERO_POOL_SIZE)
+	{
+		zeroPool[zeroPoolCount++] = page / MM_BLOCK_SIZE;
+		added = true;
+	}
+	unlock(&zeroPoolLock);
+	cpu_restoreInterrupts(enabled);
+
+	if(!added)
+		pmm_Free(page);
+	return added;
+}
+
+//Gibt alle Pages im Vorrat an den Buddy-Allokator zurück
+static void pmm_zeroPoolDrain(void)
+{
+	bool enabled = cpu_disableInterrupts();
+	lock(&zeroPoolLock);
+	lock(&pmm_lock);
+	while(zeroPoolCount > 0)
+	{
+		size_t pfn = zeroPool[--zeroPoolCount];
+		pmm_mapMark(pfn, 1, true);
+		pmm_buddyInsert(pfn, 0);
+		pmm_freePages++;
+	}
+	unlock(&pmm_lock);
+	unlock(&zeroPoolLock);
+	cpu_restoreInterrupts(enabled);
+}
+
+//Für DMA erforderlich
+paddr_t pmm_AllocDMA(paddr_t maxAddress, size_t size)
+{
+	paddr_t page;
+	bool enabled;
+
+	if(size == 0)
+		return 1;
+
+	page = pmm_allocPages(maxAddress / MM_BLOCK_SIZE, size);
+	if(page == 1 && buddyReady)
+	{
+		//Die Pages im Magazin dieser CPU und im Vorrat könnten zum passenden Block fehlen
+		enabled = cpu_disableInterrupts();
+		pmm_magazineDrain(&magazines[cpu_getId()], PMM_MAGAZINE_SIZE);
+		cpu_restoreInterrupts(enabled);
+		pmm_zeroPoolDrain();
+		page = pmm_allocPages(maxAddress / MM_BLOCK_SIZE, size);
+	}
+	if(page == 1)
+		page = pmm_cmaAllocDMA(maxAddress / MM_BLOCK_SIZE, size);
+	return page;
 }
 
 uint64_t pmm_getTotalPages()
@@ -270,7 +919,16 @@ uint64_t pmm_getTotalPages()
 	return pmm_totalPages;
 }
 
+paddr_t pmm_getMaxAddress()
+{
+	return pmm_maxAddress;
+}
+
 uint64_t pmm_getFreePages()
 {
-	return pmm_freePages;
+	uint64_t pages = pmm_freePages + cma_freePages + zeroPoolCount;
+	size_t i;
+	for(i = 0; i < CPU_MAX; i++)
+		pages += magazines[i].count;
+	return pages;
 }
@@ -20,8 +20,15 @@ typedef uintptr_t paddr_t;
 bool pmm_Init(void);					//Initialisiert die physikalische Speicherverwaltung
 paddr_t pmm_Alloc(void);				//Allokiert eine Speicherstelle
 void pmm_Free(paddr_t Address);		//Gibt eine Speicherstelle frei
+void pmm_Retain(paddr_t Address);		//Fügt einer Speicherstelle einen Besitzer hinzu
+bool pmm_isShared(paddr_t Address);		//Prüft, ob eine Speicherstelle mehrere Besitzer hat
+paddr_t pmm_AllocZeroed(void);			//Allokiert eine mit Nullen gefüllte Speicherstelle
+paddr_t pmm_AllocMovable(bool zeroed);	//Allokiert eine Speicherstelle für anonyme Pages des Userspaces
+paddr_t pmm_AllocLarge(void);			//Allokiert 2MB am Stück für eine grosse Page des Userspaces
+bool pmm_ZeroPoolRefill(void);			//Füllt den Vorrat an gelöschten Speicherstellen auf
 paddr_t pmm_AllocDMA(paddr_t maxAddress, size_t Size);
 uint64_t pmm_getTotalPages();
 uint64_t pmm_getFreePages();
+paddr_t pmm_getMaxAddress();
 
 #endif /* PMM_H_ */
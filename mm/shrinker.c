@@ -0,0 +1,106 @@
+/*
+ * shrinker.c
+ *
+ *  Created on: 17.10.2026
+ */
+
+#include "shrinker.h"
+#include "pmm.h"
+#include "lock.h"
+
+#define NULL (void*)0
+
+#define MAX(a, b)	((a > b) ? a : b)
+
+/*
+ * Caches melden sich hier an und dürfen so viel Speicher belegen, wie frei ist. Fällt der
+ * freie Speicher unter SHRINKER_WATERMARK_LOW, werden sie vom Idle-Thread bis
+ * SHRINKER_WATERMARK_HIGH geschrumpft, der Page Fault Handler schrumpft sie bei Speichermangel
+ * direkt. Jeder Cache gibt dabei einen Anteil entsprechend seiner Grösse frei.
+ */
+static shrinker_t *shrinkers;
+static lock_t shrinker_lock = LOCK_UNLOCKED;
+
+/*
+ * Meldet einen Cache an
+ * Parameter:	shrinker = Beschreibung des Caches, muss bis zum Abmelden gültig bleiben
+ */
+void shrinker_Register(shrinker_t *shrinker)
+{
+	lock(&shrinker_lock);
+	shrinker->next = shrinkers;
+	shrinkers = shrinker;
+	unlock(&shrinker_lock);
+}
+
+/*
+ * Meldet einen Cache ab. Danach werden seine Callbacks nicht mehr aufgerufen.
+ * Parameter:	shrinker = Beschreibung des Caches
+ */
+void shrinker_Unregister(shrinker_t *shrinker)
+{
+	shrinker_t **s;
+
+	lock(&shrinker_lock);
+	for(s = &shrinkers; *s != NULL; s = &(*s)->next)
+	{
+		if(*s == shrinker)
+		{
+			*s = shrinker->next;
+			break;
+		}
+	}
+	unlock(&shrinker_lock);
+}
+
+/*
+ * Lässt die angemeldeten Caches Speicher freigeben
+ * Parameter:	pages = Anzahl Pages, die frei werden sollen
+ * Rückgabe:	Anzahl freigegebener Pages, 0 wenn gerade schon geschrumpft wird
+ */
+size_t shrinker_Shrink(size_t pages)
+{
+	size_t total = 0, freed = 0;
+	shrinker_t *s;
+
+	//Wer gerade schrumpft, gibt schon Speicher frei. Verhindert auch Rekursion aus den Callbacks.
+	if(!try_lock(&shrinker_lock))
+		return 0;
+
+	for(s = shrinkers; s != NULL; s = s->next)
+		total += s->count(s->opaque);
+
+	for(s = shrinkers; s != NULL && freed < pages && total > 0; s = s->next)
+	{
+		size_t count = s->count(s->opaque);
+		if(count == 0)
+			continue;
+		freed += s->scan(MAX(pages * count / total, (size_t)1), s->opaque);
+	}
+
+	unlock(&shrinker_lock);
+	return freed;
+}
+
+/*
+ * Schrumpft die Caches, wenn der freie Speicher unter SHRINKER_WATERMARK_LOW liegt. Wird vom
+ * Idle-Thread aufgerufen.
+ * Rückgabe:	true, wenn Speicher freigegeben wurde
+ */
+bool shrinker_Balance(void)
+{
+	uint64_t freePages = pmm_getFreePages();
+
+	if(freePages >= SHRINKER_WATERMARK_LOW)
+		return false;
+	return shrinker_Shrink(SHRINKER_WATERMARK_HIGH - freePages) > 0;
+}
+
+/*
+ * Prüft, ob Caches noch wachsen dürfen
+ * Rückgabe:	true, wenn genügend Speicher frei ist
+ */
+bool shrinker_canGrow(void)
+{
+	return pmm_getFreePages() > SHRINKER_WATERMARK_HIGH;
+}
@@ -0,0 +1,36 @@
+/*
+ * shrinker.h
+ *
+ *  Created on: 17.10.2026
+ */
+
+#ifndef SHRINKER_H_
+#define SHRINKER_H_
+
+#include "stdint.h"
+#include "stddef.h"
+#include "stdbool.h"
+
+#define SHRINKER_WATERMARK_LOW	2048	//Darunter wird im Hintergrund geschrumpft
+#define SHRINKER_WATERMARK_HIGH	4096	//Bis hierhin wird geschrumpft, darüber dürfen Caches wachsen
+
+/*
+ * Cache, der bei Speichermangel Speicher freigeben kann. Die Callbacks werden auch aus dem
+ * Idle-Thread und aus Page Faults aufgerufen und dürfen deshalb weder blockieren noch auf
+ * Locks warten, die beim Allozieren gehalten werden können (try_lock verwenden).
+ */
+typedef struct shrinker{
+	struct shrinker *next;
+	const char *name;
+	size_t (*count)(void *opaque);					//Anzahl Pages, die freigegeben werden könnten
+	size_t (*scan)(size_t pages, void *opaque);		//Gibt bis zu pages Pages frei, Rückgabe: freigegebene Pages
+	void *opaque;
+}shrinker_t;
+
+void shrinker_Register(shrinker_t *shrinker);
+void shrinker_Unregister(shrinker_t *shrinker);
+size_t shrinker_Shrink(size_t pages);
+bool shrinker_Balance(void);
+bool shrinker_canGrow(void);
+
+#endif /* SHRINKER_H_ */
@@ -0,0 +1,167 @@
+/*
+ * swap.c
+ *
+ *  Created on: 17.10.2026
+ */
+
+#include "swap.h"
+#include "vmm.h"
+#include "vfs.h"
+#include "memory.h"
+#include "stdlib.h"
+#include "lock.h"
+#include "display.h"
+
+#define NULL (void*)0
+
+/*
+ * Auslagerungsbereich für anonyme Pages des Userspaces. Der Bereich ist eine Datei oder ein
+ * Gerät, das über das VFS angesprochen wird, und wird in Slots von einer Page aufgeteilt. Ein
+ * Slot kann nach fork von mehreren Kontexten verwendet werden, deshalb wird für jeden Slot die
+ * Anzahl Benutzer gezählt (0 = frei).
+ */
+static vfs_file_t swap_file = -1;
+static uint16_t *swap_refs;
+static size_t swap_slots;
+static size_t swap_used;
+static size_t swap_next;			//Ab hier wird nach einem freien Slot gesucht
+static lock_t swap_lock = LOCK_UNLOCKED;
+
+/*
+ * Aktiviert einen Auslagerungsbereich. Es kann nur ein Bereich aktiv sein.
+ * Parameter:	path = Pfad zu einer Datei oder einem Gerät
+ * 				size = Grösse des Bereichs in Bytes, 0 = Grösse der Datei
+ * Rückgabe:	true, wenn der Bereich verwendet wird
+ */
+bool swap_Enable(const char *path, uint64_t size)
+{
+	vfs_file_t file;
+	uint16_t *refs;
+	size_t slots;
+
+	if(swap_isEnabled())
+		return false;
+
+	file = vfs_Open(path, (vfs_mode_t){.read = true, .write = true});
+	if(file == (vfs_file_t)-1)
+		return false;
+
+	if(size == 0)
+		size = vfs_getFileinfo(file, VFS_INFO_FILESIZE);
+	slots = size / MM_BLOCK_SIZE;
+	if(slots == 0 || (refs = calloc(slots, sizeof(*refs))) == NULL)
+	{
+		vfs_Close(file);
+		return false;
+	}
+
+	lock(&swap_lock);
+	if(swap_refs != NULL)
+	{
+		unlock(&swap_lock);
+		free(refs);
+		vfs_Close(file);
+		return false;
+	}
+	swap_file = file;
+	swap_slots = slots;
+	swap_used = 0;
+	swap_next = 0;
+	swap_refs = refs;
+	unlock(&swap_lock);
+
+	SysLog("SWAP", "Auslagerungsbereich aktiviert");
+	return true;
+}
+
+bool swap_isEnabled(void)
+{
+	return swap_refs != NULL;
+}
+
+/*
+ * Gibt die Grösse und Belegung des Auslagerungsbereichs zurück
+ * Parameter:	slots = Anzahl Slots (Pages)
+ * 				used = Anzahl belegter Slots
+ */
+void swap_getInfo(size_t *slots, size_t *used)
+{
+	lock(&swap_lock);
+	*slots = swap_slots;
+	*used = swap_used;
+	unlock(&swap_lock);
+}
+
+/*
+ * Belegt einen freien Slot
+ * Rückgabe:	Nummer des Slots oder SWAP_NO_SLOT, wenn der Bereich voll ist
+ */
+uint64_t swap_Alloc(void)
+{
+	uint64_t slot = SWAP_NO_SLOT;
+	size_t i;
+
+	lock(&swap_lock);
+	if(swap_used < swap_slots)
+	{
+		for(i = 0; i < swap_slots; i++)
+		{
+			size_t s = (swap_next + i) % swap_slots;
+			if(swap_refs[s] == 0)
+			{
+				swap_refs[s] = 1;
+				swap_used++;
+				swap_next = s + 1;
+				slot = s;
+				break;
+			}
+		}
+	}
+	unlock(&swap_lock);
+
+	return slot;
+}
+
+/*
+ * Fügt einem belegten Slot einen weiteren Benutzer hinzu (z.B. bei fork)
+ */
+void swap_Retain(uint64_t slot)
+{
+	lock(&swap_lock);
+	if(slot < swap_slots && swap_refs[slot] > 0)
+		swap_refs[slot]++;
+	unlock(&swap_lock);
+}
+
+/*
+ * Gibt einen Slot frei, sobald ihn kein Benutzer mehr verwendet
+ */
+void swap_Free(uint64_t slot)
+{
+	lock(&swap_lock);
+	if(slot < swap_slots && swap_refs[slot] > 0 && --swap_refs[slot] == 0)
+	{
+		swap_used--;
+		if(slot < swap_next)
+			swap_next = slot;
+	}
+	unlock(&swap_lock);
+}
+
+/*
+ * Schreibt eine Page in einen Slot. Die Page wird über die Direct Map gelesen.
+ * Rückgabe:	true, wenn die ganze Page geschrieben wurde
+ */
+bool swap_Write(uint64_t slot, paddr_t page)
+{
+	return vfs_Write(swap_file, slot * MM_BLOCK_SIZE, MM_BLOCK_SIZE, vmm_PhysToVirt(page)) == MM_BLOCK_SIZE;
+}
+
+/*
+ * Liest einen Slot in eine Page
+ * Rückgabe:	true, wenn die ganze Page gelesen wurde
+ */
+bool swap_Read(uint64_t slot, paddr_t page)
+{
+	return vfs_Read(swap_file, slot * MM_BLOCK_SIZE, MM_BLOCK_SIZE, vmm_PhysToVirt(page)) == MM_BLOCK_SIZE;
+}
@@ -0,0 +1,27 @@
+/*
+ * swap.h
+ *
+ *  Created on: 17.10.2026
+ */
+
+#ifndef SWAP_H_
+#define SWAP_H_
+
+#include "stdint.h"
+#include "stddef.h"
+#include "stdbool.h"
+#include "pmm.h"
+
+#define SWAP_NO_SLOT	((uint64_t)-1)
+
+bool swap_Enable(const char *path, uint64_t size);
+bool swap_isEnabled(void);
+void swap_getInfo(size_t *slots, size_t *used);
+
+uint64_t swap_Alloc(void);
+void swap_Retain(uint64_t slot);
+void swap_Free(uint64_t slot);
+bool swap_Write(uint64_t slot, paddr_t page);
+bool swap_Read(uint64_t slot, paddr_t page);
+
+#endif /* SWAP_H_ */
@@ -0,0 +1,516 @@
+/*
+ * vma.c
+ *
+ *  Created on: 17.10.2026
+ */
+
+#include "vma.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "memory.h"
+#include "display.h"
+
+#define NULL (void*)0
+
+#define MAX(a, b)	((a > b) ? a : b)
+
+//Knoten bis die Direct Map steht (die Kernelbereiche werden schon vorher angelegt)
+#define VMA_BOOT_NODES		64
+
+static vma_t vma_bootNodes[VMA_BOOT_NODES];
+static size_t vma_bootNodesUsed;
+static vma_t *vma_freeNodes;			//Über left verkettet
+static lock_t vma_nodeLock = LOCK_UNLOCKED;
+
+/*
+ * Die Knoten kommen nicht aus dem Heap, weil der Heap selber über vmm_SysAlloc wächst und
+ * damit den Baum des Kernels verändert. Stattdessen werden ganze Pages über die Direct Map
+ * in Knoten aufgeteilt.
+ */
+static vma_t *vma_allocNode(void)
+{
+	vma_t *node;
+
+	lock(&vma_nodeLock);
+	if(vma_freeNodes != NULL)
+	{
+		node = vma_freeNodes;
+		vma_freeNodes = node->left;
+	}
+	else if(vma_bootNodesUsed < VMA_BOOT_NODES)
+	{
+		node = &vma_bootNodes[vma_bootNodesUsed++];
+	}
+	else
+	{
+		paddr_t page;
+		size_t i;
+
+		if(!vmm_directMapReady)
+			Panic("VMA", "Zu wenig Knoten fuer die Initialisierung");
+		if((page = pmm_Alloc()) == 1)
+		{
+			unlock(&vma_nodeLock);
+			return NULL;
+		}
+
+		node = vmm_PhysToVirt(page);
+		for(i = 1; i < MM_BLOCK_SIZE / sizeof(vma_t); i++)
+		{
+			node[i].left = vma_freeNodes;
+			vma_freeNodes = &node[i];
+		}
+	}
+	unlock(&vma_nodeLock);
+
+	return node;
+}
+
+static void vma_freeNode(vma_t *node)
+{
+	lock(&vma_nodeLock);
+	node->left = vma_freeNodes;
+	vma_freeNodes = node;
+	unlock(&vma_nodeLock);
+}
+
+static inline uint8_t vma_height(vma_t *node)
+{
+	return node ? node->height : 0;
+}
+
+static inline uintptr_t vma_maxGap(vma_t *node)
+{
+	return node ? node->maxGap : 0;
+}
+
+//Berechnet Höhe und grösste Lücke eines Knotens aus seinen Kindern neu
+static void vma_update(vma_t *node)
+{
+	node->height = MAX(vma_height(node->left), vma_height(node->right)) + 1;
+	node->maxGap = MAX(node->gap, MAX(vma_maxGap(node->left), vma_maxGap(node->right)));
+}
+
+static vma_t *vma_rotateLeft(vma_t *node)
+{
+	vma_t *right = node->right;
+	node->right = right->left;
+	right->left = node;
+	vma_update(node);
+	vma_update(right);
+	return right;
+}
+
+static vma_t *vma_rotateRight(vma_t *node)
+{
+	vma_t *left = node->left;
+	node->left = left->right;
+	left->right = node;
+	vma_update(node);
+	vma_update(left);
+	return left;
+}
+
+static vma_t *vma_balance(vma_t *node)
+{
+	vma_update(node);
+	int balance = vma_height(node->right) - vma_height(node->left);
+	if(balance > 1)
+	{
+		if(vma_height(node->right->left) > vma_height(node->right->right))
+			node->right = vma_rotateRight(node->right);
+		return vma_rotateLeft(node);
+	}
+	else if(balance < -1)
+	{
+		if(vma_height(node->left->right) > vma_height(node->left->left))
+			node->left = vma_rotateLeft(node->left);
+		return vma_rotateRight(node);
+	}
+	return node;
+}
+
+static vma_t *vma_insertNode(vma_t *root, vma_t *node)
+{
+	if(root == NULL)
+		return node;
+
+	if(node->start < root->start)
+		root->left = vma_insertNode(root->left, node);
+	else
+		root->right = vma_insertNode(root->right, node);
+	return vma_balance(root);
+}
+
+static vma_t *vma_removeMin(vma_t *root, vma_t **min)
+{
+	if(root->left == NULL)
+	{
+		*min = root;
+		return root->right;
+	}
+	root->left = vma_removeMin(root->left, min);
+	return vma_balance(root);
+}
+
+/*
+ * Entfernt einen Knoten. Der Nachfolger liegt entweder auf dem Pfad zum Knoten oder ersetzt
+ * ihn, deshalb wird seine geänderte Lücke hier mit aktualisiert.
+ */
+static vma_t *vma_removeNode(vma_t *root, vma_t *node)
+{
+	if(root == node)
+	{
+		vma_t *min;
+		if(node->right == NULL)
+			return node->left;
+		node->right = vma_removeMin(node->right, &min);
+		min->left = node->left;
+		min->right = node->right;
+		return vma_balance(min);
+	}
+
+	if(node->start < root->start)
+		root->left = vma_removeNode(root->left, node);
+	else
+		root->right = vma_removeNode(root->right, node);
+	return vma_balance(root);
+}
+
+//Aktualisiert alle Knoten auf dem Pfad zum Knoten mit der Startadresse start
+static void vma_updatePath(vma_t *root, uintptr_t start)
+{
+	if(root == NULL)
+		return;
+	if(start < root->start)
+		vma_updatePath(root->left, start);
+	else if(start > root->start)
+		vma_updatePath(root->right, start);
+	vma_update(root);
+}
+
+//Gibt den Bereich mit der grössten Startadresse <= address zurück
+static vma_t *vma_lookupPrev(vma_t *root, uintptr_t address)
+{
+	vma_t *found = NULL;
+	while(root != NULL)
+	{
+		if(root->start <= address)
+		{
+			found = root;
+			root = root->right;
+		}
+		else
+			root = root->left;
+	}
+	return found;
+}
+
+//Gibt den Bereich mit der kleinsten Startadresse > address zurück
+static vma_t *vma_lookupNext(vma_t *root, uintptr_t address)
+{
+	vma_t *found = NULL;
+	while(root != NULL)
+	{
+		if(root->start > address)
+		{
+			found = root;
+			root = root->left;
+		}
+		else
+			root = root->right;
+	}
+	return found;
+}
+
+//Gibt den Bereich mit der tiefsten Adresse zurück, vor dem eine Lücke von mindestens size liegt
+static vma_t *vma_firstFit(vma_t *root, size_t size)
+{
+	if(vma_maxGap(root) < size)
+		return NULL;
+
+	while(root != NULL)
+	{
+		if(vma_maxGap(root->left) >= size)
+			root = root->left;
+		else if(root->gap >= size)
+			return root;
+		else
+			root = root->right;
+	}
+	return NULL;
+}
+
+static vma_t *vma_last(vma_t *root)
+{
+	if(root != NULL)
+		while(root->right != NULL)
+			root = root->right;
+	return root;
+}
+
+static void vma_insert(vma_tree_t *tree, vma_t *node, uintptr_t start, uintptr_t end, uintptr_t gap)
+{
+	node->left = node->right = NULL;
+	node->start = start;
+	node->end = end;
+	node->gap = gap;
+	vma_update(node);
+	tree->root = vma_insertNode(tree->root, node);
+}
+
+/*
+ * Initialisiert einen leeren Baum
+ * Parameter:	start = erste verwaltete Adresse
+ * 				end = erste Adresse nach dem verwalteten Bereich
+ */
+void vma_initTree(vma_tree_t *tree, uintptr_t start, uintptr_t end)
+{
+	tree->root = NULL;
+	tree->start = start;
+	tree->end = end;
+	tree->lock = LOCK_UNLOCKED;
+}
+
+static void vma_freeTree(vma_t *root)
+{
+	if(root == NULL)
+		return;
+	vma_freeTree(root->left);
+	vma_freeTree(root->right);
+	vma_freeNode(root);
+}
+
+/*
+ * Gibt alle Knoten eines Baumes frei. Die Pages der Bereiche werden nicht angefasst.
+ */
+void vma_destroyTree(vma_tree_t *tree)
+{
+	lock(&tree->lock);
+	vma_freeTree(tree->root);
+	tree->root = NULL;
+	unlock(&tree->lock);
+}
+
+static vma_t *vma_copyTree(vma_t *root, bool *failed)
+{
+	vma_t *node;
+
+	if(root == NULL || *failed)
+		return NULL;
+	if((node = vma_allocNode()) == NULL)
+	{
+		*failed = true;
+		return NULL;
+	}
+	*node = *root;
+	node->left = vma_copyTree(root->left, failed);
+	node->right = vma_copyTree(root->right, failed);
+	return node;
+}
+
+/*
+ * Kopiert alle Bereiche eines Baumes in einen leeren Baum
+ * Parameter:	dst = leerer Zielbaum
+ * 				src = zu kopierender Baum
+ * Rückgabe:	false, wenn zu wenig Speicher vorhanden war. dst ist dann leer.
+ */
+bool vma_cloneTree(vma_tree_t *dst, vma_tree_t *src)
+{
+	bool failed = false;
+
+	lock(&src->lock);
+	dst->root = vma_copyTree(src->root, &failed);
+	dst->start = src->start;
+	dst->end = src->end;
+	unlock(&src->lock);
+
+	if(failed)
+	{
+		vma_freeTree(dst->root);
+		dst->root = NULL;
+	}
+	return !failed;
+}
+
+/*
+ * Belegt einen freien Bereich mit der tiefsten passenden Adresse (first fit)
+ * Parameter:	tree = Baum des Adressraums
+ * 				size = Grösse des Bereichs in Bytes
+ * Rückgabe:	Anfang des Bereichs oder NULL, wenn kein Platz vorhanden ist
+ */
+void *vma_alloc(vma_tree_t *tree, size_t size)
+{
+	vma_t *node = vma_allocNode();
+	vma_t *next;
+	uintptr_t start;
+
+	if(node == NULL || size == 0)
+	{
+		if(node != NULL)
+			vma_freeNode(node);
+		return NULL;
+	}
+
+	lock(&tree->lock);
+	if((next = vma_firstFit(tree->root, size)) != NULL)
+	{
+		//Der neue Bereich kommt an den Anfang der Lücke vor next
+		start = next->start - next->gap;
+		next->gap -= size;
+	}
+	else
+	{
+		//Platz nach dem letzten Bereich
+		vma_t *last = vma_last(tree->root);
+		start = last ? last->end : tree->start;
+		if(tree->end - start < size)
+		{
+			unlock(&tree->lock);
+			vma_freeNode(node);
+			return NULL;
+		}
+	}
+	vma_insert(tree, node, start, start + size, 0);
+	unlock(&tree->lock);
+
+	return (void*)start;
+}
+
+/*
+ * Belegt einen freien Bereich, dessen Anfang auf align ausgerichtet ist. Dazu wird ein um align
+ * grösserer Bereich belegt und der Überschuss davor und danach wieder freigegeben. Ist dafür kein
+ * Platz vorhanden, wird ein nicht ausgerichteter Bereich belegt.
+ * Parameter:	tree = Baum des Adressraums
+ * 				size = Grösse des Bereichs in Bytes
+ * 				align = Ausrichtung in Bytes, Zweierpotenz und mindestens 4kB
+ * Rückgabe:	Anfang des Bereichs oder NULL, wenn kein Platz vorhanden ist
+ */
+void *vma_allocAligned(vma_tree_t *tree, size_t size, size_t align)
+{
+	uintptr_t start, aligned;
+
+	if(align <= 0x1000 || size + align - 0x1000 < size)
+		return vma_alloc(tree, size);
+
+	if((start = (uintptr_t)vma_alloc(tree, size + align - 0x1000)) == 0)
+		return vma_alloc(tree, size);
+
+	aligned = (start + align - 1) & ~(align - 1);
+	if(aligned > start)
+		vma_release(tree, (void*)start, aligned - start);
+	if(align - 0x1000 > aligned - start)
+		vma_release(tree, (void*)(aligned + size), align - 0x1000 - (aligned - start));
+
+	return (void*)aligned;
+}
+
+/*
+ * Belegt einen Bereich an einer festen Adresse
+ * Parameter:	tree = Baum des Adressraums
+ * 				address = Anfang des Bereichs
+ * 				size = Grösse des Bereichs in Bytes
+ * Rückgabe:	false, wenn sich der Bereich mit einem belegten überschneidet
+ */
+bool vma_reserve(vma_tree_t *tree, void *address, size_t size)
+{
+	uintptr_t start = (uintptr_t)address;
+	uintptr_t end = start + size;
+	vma_t *prev, *next, *node;
+
+	if(size == 0 || start < tree->start || end > tree->end || end < start)
+		return false;
+
+	if((node = vma_allocNode()) == NULL)
+		return false;
+
+	lock(&tree->lock);
+	prev = vma_lookupPrev(tree->root, start);
+	next = vma_lookupNext(tree->root, start);
+	if((prev != NULL && prev->end > start) || (next != NULL && next->start < end))
+	{
+		unlock(&tree->lock);
+		vma_freeNode(node);
+		return false;
+	}
+
+	//Der Nachfolger liegt auf dem Einfügepfad und wird dabei aktualisiert
+	if(next != NULL)
+		next->gap = next->start - end;
+	vma_insert(tree, node, start, end, start - (prev ? prev->end : tree->start));
+	unlock(&tree->lock);
+
+	return true;
+}
+
+/*
+ * Gibt einen Bereich frei. Er darf mehrere belegte Bereiche überdecken oder nur Teile davon.
+ * Parameter:	tree = Baum des Adressraums
+ * 				address = Anfang des Bereichs
+ * 				size = Grösse des Bereichs in Bytes
+ */
+void vma_release(vma_tree_t *tree, void *address, size_t size)
+{
+	uintptr_t start = (uintptr_t)address;
+	uintptr_t end = start + size;
+	vma_t *node, *next, *tail = NULL;
+
+	lock(&tree->lock);
+	while(true)
+	{
+		node = vma_lookupPrev(tree->root, start);
+		if(node == NULL || node->end <= start)
+			node = vma_lookupNext(tree->root, start);
+		if(node == NULL || node->start >= end)
+			break;
+
+		if(node->start < start && node->end > end)
+		{
+			//Bereich wird in zwei Teile aufgeteilt
+			if(tail == NULL)
+			{
+				unlock(&tree->lock);
+				if((tail = vma_allocNode()) == NULL)
+					Panic("VMA", "Zu wenig Speicher um einen Bereich aufzuteilen");
+				lock(&tree->lock);
+				continue;
+			}
+			uintptr_t oldEnd = node->end;
+			node->end = start;
+			vma_insert(tree, tail, end, oldEnd, end - start);
+			tail = NULL;
+			break;
+		}
+		else if(node->start < start)
+		{
+			//Ende des Bereichs abschneiden
+			next = vma_lookupNext(tree->root, node->start);
+			if(next != NULL)
+			{
+				next->gap += node->end - start;
+				vma_updatePath(tree->root, next->start);
+			}
+			node->end = start;
+		}
+		else if(node->end > end)
+		{
+			//Anfang des Bereichs abschneiden
+			node->gap += end - node->start;
+			node->start = end;
+			vma_updatePath(tree->root, node->start);
+		}
+		else
+		{
+			//Ganzer Bereich wird frei
+			next = vma_lookupNext(tree->root, node->start);
+			if(next != NULL)
+				next->gap += node->gap + (node->end - node->start);
+			tree->root = vma_removeNode(tree->root, node);
+			vma_freeNode(node);
+		}
+	}
+	unlock(&tree->lock);
+
+	if(tail != NULL)
+		vma_freeNode(tail);
+}
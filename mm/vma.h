@@ -0,0 +1,42 @@
+/*
+ * vma.h
+ *
+ *  Created on: 17.10.2026
+ */
+
+#ifndef VMA_H_
+#define VMA_H_
+
+#include "stdint.h"
+#include "stddef.h"
+#include "stdbool.h"
+#include "lock.h"
+
+/*
+ * Belegter Bereich [start, end) eines virtuellen Adressraums. Die Bereiche sind in einem
+ * AVL-Baum nach der Startadresse sortiert. Jeder Knoten kennt die Lücke vor sich und die
+ * grösste Lücke in seinem Teilbaum, womit ein freier Bereich in O(log n) gefunden wird.
+ */
+typedef struct vma{
+	struct vma *left, *right;
+	uintptr_t start, end;
+	uintptr_t gap;					//Freier Platz zwischen dem vorherigen Bereich und diesem
+	uintptr_t maxGap;				//Grösste Lücke in diesem Teilbaum
+	uint8_t height;
+}vma_t;
+
+typedef struct{
+	vma_t *root;
+	uintptr_t start, end;			//Verwalteter Bereich [start, end)
+	lock_t lock;
+}vma_tree_t;
+
+void vma_initTree(vma_tree_t *tree, uintptr_t start, uintptr_t end);
+void vma_destroyTree(vma_tree_t *tree);
+bool vma_cloneTree(vma_tree_t *dst, vma_tree_t *src);
+void *vma_alloc(vma_tree_t *tree, size_t size);
+void *vma_allocAligned(vma_tree_t *tree, size_t size, size_t align);
+bool vma_reserve(vma_tree_t *tree, void *address, size_t size);
+void vma_release(vma_tree_t *tree, void *address, size_t size);
+
+#endif /* VMA_H_ */
@@ -16,9 +16,17 @@
 #include "stdlib.h"
 #include "string.h"
 #include "lock.h"
+#include "cpu.h"
+#include "vma.h"
+#include "scheduler.h"
+#include "filemap.h"
+#include "swap.h"
+#include "shrinker.h"
 
 #define NULL (void*)0
 
+#define MIN(a, b)	((a < b) ? a : b)
+
 #define VMM_SIZE_PER_PAGE	MM_BLOCK_SIZE
 #define VMM_SIZE_PER_TABLE	4096
 #define VMM_MAX_ADDRESS		MAX_ADDRESS
@@ -34,24 +42,42 @@
 #define VMM_POINTER_TO_PML4	0x2
 #define VMM_PAGE_FULL		(1 << 4)
 
-#define VMM_PAGES_PER_PML4		PAGE_ENTRIES * PAGE_ENTRIES * PAGE_ENTRIES * PAGE_ENTRIES
-#define VMM_PAGES_PER_PDP		PAGE_ENTRIES * PAGE_ENTRIES * PAGE_ENTRIES
-#define VMM_PAGES_PER_PD		PAGE_ENTRIES * PAGE_ENTRIES
-#define VMM_PAGES_PER_PT		PAGE_ENTRIES
-
-#define VMM_EXTEND(address)	((int64_t)((address) << 16) >> 16)
-#define VMM_GET_ADDRESS(PML4i, PDPi, PDi, PTi)	(void*)VMM_EXTEND(((uint64_t)PML4i << 39) | ((uint64_t)PDPi << 30) | (PDi << 21) | (PTi << 12))
-#define VMM_ALLOCATED(entry) ((entry & PG_P) || (PG_AVL(entry) & VMM_UNUSED_PAGE))	//Prüft, ob diese Page schon belegt ist
+#define VMM_ALLOCATED(entry) ((entry & PG_P) || (PG_AVL(entry) & (VMM_UNUSED_PAGE | VMM_SWAPPED_PAGE | VMM_SWAPOUT_PAGE)))	//Prüft, ob diese Page schon belegt ist
+#define VMM_RESIDENT(entry) (((entry) & PG_P) || (PG_AVL(entry) & VMM_SWAPOUT_PAGE) ? 1 : 0)	//Prüft, ob die Page im phys. Speicher liegt
 
 const uint16_t PML4e = ((KERNELSPACE_END & PG_PML4_INDEX) >> 39) + 1;
 const uint16_t PDPe = ((KERNELSPACE_END & PG_PDP_INDEX) >> 30) + 1;
 const uint16_t PDe = ((KERNELSPACE_END & PG_PD_INDEX) >> 21) + 1;
 const uint16_t PTe = ((KERNELSPACE_END & PG_PT_INDEX) >> 12) + 1;
 
-static lock_t vmm_lock = LOCK_LOCKED;
-
 context_t kernel_context;
 
+static vma_tree_t vmm_kernelVMAs;		//Belegte Bereiche im Kernelspace (in allen Kontexten gleich)
+static vmm_faultStats_t vmm_faultStats;
+bool vmm_directMapReady = false;
+
+#define VMM_PCID_SLOTS	16					//PCIDs pro CPU, PCID 0 wird nur beim Booten verwendet
+#define VMM_CR3_NOFLUSH	(1ul << 63)			//Einträge der PCID beim Laden von CR3 behalten
+
+/*
+ * Jede CPU ordnet ihre PCIDs selber den Kontexten zu. Gespeichert wird auch die TLB-Generation
+ * des Kontextes beim letzten Leeren der PCID. Ist sie seither erhöht worden, so können noch
+ * entfernte Mappings im TLB sein und die PCID muss beim nächsten Aktivieren geleert werden.
+ */
+typedef struct{
+	uint64_t contextId;
+	uint64_t tlbGeneration;
+}vmm_pcid_slot_t;
+
+typedef struct{
+	vmm_pcid_slot_t slots[VMM_PCID_SLOTS];
+	uint8_t next;							//Slot, der als nächstes ersetzt wird
+}vmm_pcids_t;
+
+static vmm_pcids_t vmm_pcids[CPU_MAX];
+
+static uint64_t vmm_nextContextId = 1;		//0 markiert einen freien Slot
+
 //Funktionen, die nur in dieser Datei aufgerufen werden sollen
 uint8_t vmm_UnMap(void *vAddress);
 uint8_t vmm_ChangeMap(void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t avl);
@@ -94,9 +120,13 @@ bool vmm_Init()
 	//PML4 in Kernelkontext eintragen
 	kernel_context.physAddress = (uintptr_t)PML4;
 	kernel_context.virtualAddress = (void*)VMM_PML4_ADDRESS;
+	kernel_context.id = __sync_fetch_and_add(&vmm_nextContextId, 1);
 
 	PML4 = (PML4_t*)VMM_PML4_ADDRESS;
 
+	vma_initTree(&vmm_kernelVMAs, KERNELSPACE_START, KERNELSPACE_END + 1);
+	vma_initTree(&kernel_context.vmas, USERSPACE_START, USERSPACE_END + 1);
+
 	//Speicher bis 1MB bearbeiten
 	//Addresse 0 ist nicht gemappt
 	vmm_UnMap(NULL);
@@ -122,13 +152,156 @@ bool vmm_Init()
 		i += 0x1000;
 	}
 
-	//Lock der Speicherverwaltung freigeben
-	unlock(&vmm_lock);
+	//Alles bis zum Ende des Kernels ist belegt
+	vma_reserve(&vmm_kernelVMAs, (void*)KERNELSPACE_START, (((uintptr_t)&kernel_end & ~0xFFF) + 0x1000) - KERNELSPACE_START);
 
 	SysLog("VMM", "Initialisierung abgeschlossen");
 	return true;
 }
 
+/*
+ * Mappt den gesamten phys. Speicher permanent ab DIRECTMAP_START. Falls die CPU es unterstützt
+ * werden dazu 1GB-Pages verwendet, ansonsten 2MB-Pages. Braucht die initialisierte phys.
+ * Speicherverwaltung für die Tabellen.
+ */
+bool vmm_InitDirectMap()
+{
+	PML4_t *PML4 = (PML4_t*)VMM_PML4_ADDRESS;
+	size_t pageSize = cpuInfo.page1GB ? PG_HUGE_PAGE_SIZE : PG_LARGE_PAGE_SIZE;
+	paddr_t end = pmm_getMaxAddress();
+	paddr_t pAddress;
+
+	if(end > DIRECTMAP_END - DIRECTMAP_START + 1)
+		end = DIRECTMAP_END - DIRECTMAP_START + 1;
+
+	//Als Kernelspace markieren, damit der Eintrag in jeden neuen Kontext übernommen wird
+	setPML4Entry((DIRECTMAP_START & PG_PML4_INDEX) >> 39, PML4, 0, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, 0);
+
+	for(pAddress = 0; pAddress < end; pAddress += pageSize)
+	{
+		if(vmm_MapLarge(vmm_PhysToVirt(pAddress), pAddress, pageSize, VMM_FLAGS_GLOBAL | VMM_FLAGS_WRITE | VMM_FLAGS_NX, 0) != 0)
+			return false;
+	}
+
+	vmm_directMapReady = true;
+	return true;
+}
+
+/*
+ * Gibt den Kontext des aktuellen Prozesses zurück
+ */
+static context_t *vmm_currentContext(void)
+{
+	process_t *process = currentProcess;
+	return (process != NULL) ? process->Context : &kernel_context;
+}
+
+/*
+ * Gibt den Baum zurück, der die Adresse im angegebenen Kontext verwaltet
+ */
+static vma_tree_t *vmm_getVMAs(context_t *context, const void *address)
+{
+	return ((uintptr_t)address <= KERNELSPACE_END) ? &vmm_kernelVMAs : &context->vmas;
+}
+
+/*
+ * Entfernt einen Bereich aus dem TLB. Bei Adressen im Userspace wird zusätzlich die
+ * TLB-Generation des Kontextes erhöht, damit CPUs, die den Kontext im Moment nicht aktiv haben,
+ * die PCID vor der nächsten Verwendung leeren.
+ * Parameter:	context = Kontext, dessen Mappings entfernt oder eingeschränkt wurden
+ * 				address = virtuelle Adresse der ersten Page
+ * 				pages = Anzahl Pages
+ */
+static void vmm_invalidateRange(context_t *context, void *address, size_t pages)
+{
+	if((uintptr_t)address > KERNELSPACE_END)
+		__sync_fetch_and_add(&context->tlbGeneration, 1);
+	InvalidateTLBRange(address, pages);
+}
+
+static inline void vmm_invalidate(context_t *context, void *address)
+{
+	vmm_invalidateRange(context, address, 1);
+}
+
+/*
+ * Sperren der Tabellen eines Kontextes. Tabellen werden nur beim Entfernen von Bereichen im
+ * Userspace freigegeben. Alle anderen Operationen ändern einzelne Einträge atomar und legen
+ * fehlende Tabellen mit CAS an, sie dürfen also gleichzeitig laufen und zählen sich nur im Lock
+ * des Kontextes. Wer Tabellen freigibt, sperrt den Kontext exklusiv. Die Tabellen des
+ * Kernelspaces werden nie freigegeben, dort wird gar nicht gesperrt.
+ * Parameter:	context = Kontext
+ * 				address = Adresse im Bereich, der bearbeitet wird
+ */
+#define VMM_TABLES_EXCLUSIVE	(1ul << 63)
+
+static void vmm_lockTables(context_t *context, uintptr_t address)
+{
+	uint64_t value;
+
+	if(address <= KERNELSPACE_END)
+		return;
+	do
+	{
+		while((value = context->tablesLock) & VMM_TABLES_EXCLUSIVE)
+			asm volatile("pause");
+	}
+	while(!__sync_bool_compare_and_swap(&context->tablesLock, value, value + 1));
+}
+
+static void vmm_unlockTables(context_t *context, uintptr_t address)
+{
+	if(address > KERNELSPACE_END)
+		__sync_fetch_and_sub(&context->tablesLock, 1);
+}
+
+static void vmm_lockTablesExclusive(context_t *context, uintptr_t address)
+{
+	uint64_t value;
+
+	if(address <= KERNELSPACE_END)
+		return;
+	//Neue Benutzer abweisen und dann warten, bis die bisherigen fertig sind
+	do
+	{
+		while((value = context->tablesLock) & VMM_TABLES_EXCLUSIVE)
+			asm volatile("pause");
+	}
+	while(!__sync_bool_compare_and_swap(&context->tablesLock, value, value | VMM_TABLES_EXCLUSIVE));
+	while(context->tablesLock != VMM_TABLES_EXCLUSIVE)
+		asm volatile("pause");
+}
+
+static void vmm_unlockTablesExclusive(context_t *context, uintptr_t address)
+{
+	if(address > KERNELSPACE_END)
+		__sync_fetch_and_and(&context->tablesLock, ~VMM_TABLES_EXCLUSIVE);
+}
+
+/*
+ * Führt den Speicherverbrauch eines Kontextes nach, wenn ein Eintrag im Userspace von old auf new
+ * geändert wurde. Pages, die gerade ausgelagert oder verschoben werden, liegen noch im Speicher.
+ */
+static inline void vmm_accountEntry(context_t *context, uintptr_t address, uint64_t old, uint64_t new)
+{
+	int64_t resident, mapped;
+
+	if(address <= KERNELSPACE_END)
+		return;
+	resident = (int64_t)VMM_RESIDENT(new) - VMM_RESIDENT(old);
+	mapped = (int64_t)!!VMM_ALLOCATED(new) - !!VMM_ALLOCATED(old);
+	if(resident != 0)
+		__sync_fetch_and_add(&context->residentPages, resident);
+	if(mapped != 0)
+		__sync_fetch_and_add(&context->mappedPages, mapped);
+}
+
+static inline void vmm_accountTables(context_t *context, uintptr_t address, int64_t tables)
+{
+	if(address > KERNELSPACE_END)
+		__sync_fetch_and_add(&context->tablePages, tables);
+}
+
 //Userspace Funktionen
 /*
  * Reserviert ein Speicherblock mit der Blockgrösse Length (in Pages)
@@ -138,32 +311,16 @@ bool vmm_Init()
  */
 void *vmm_Alloc(size_t Length)
 {
-	size_t i, j;
-	uint8_t error;
-
-	lock(&vmm_lock);
-
 	void *vAddress = getFreePages((void*)USERSPACE_START, (void*)USERSPACE_END, Length);
 	if(vAddress == NULL)
-	{
-		unlock(&vmm_lock);
 		return NULL;
-	}
 
 	//Mappen
-	for(i = 0; i < Length; i++)
+	if(vmm_MapRange(vmm_currentContext(), vAddress, 0, Length, VMM_FLAGS_WRITE | VMM_FLAGS_USER | VMM_FLAGS_NX, VMM_UNUSED_PAGE) != 0)
 	{
-		error = vmm_Map(vAddress + i * VMM_SIZE_PER_PAGE, 0, VMM_FLAGS_WRITE | VMM_FLAGS_USER | VMM_FLAGS_NX, VMM_UNUSED_PAGE);
-		if(error != 0)
-		{
-			//Mapping rückgängig machen
-			for(j = 0; j < i; j++)
-				vmm_UnMap(vAddress + j * VMM_SIZE_PER_PAGE);
-			unlock(&vmm_lock);
-			return NULL;
-		}
+		vma_release(&vmm_currentContext()->vmas, vAddress, Length * VMM_SIZE_PER_PAGE);
+		return NULL;
 	}
-	unlock(&vmm_lock);
 	return vAddress;
 }
 
@@ -174,15 +331,8 @@ void *vmm_Alloc(size_t Length)
  */
 void vmm_Free(void *vAddress, size_t Pages)
 {
-	void *i;
-	for(i = vAddress; i < vAddress + Pages * MM_BLOCK_SIZE; i += VMM_SIZE_PER_PAGE)
-	{
-		paddr_t pAddress = vmm_getPhysAddress(vAddress);
-		uint8_t Fehler = vmm_UnMap(i);
-		if(Fehler == 2) Panic("VMM", "Zu wenig physikalischer Speicher vorhanden");
-		if(Fehler != 1)
-			pmm_Free(pAddress);
-	}
+	vmm_UnMapRange(vmm_currentContext(), vAddress, Pages, true);
+	vma_release(&vmm_currentContext()->vmas, vAddress, Pages * MM_BLOCK_SIZE);
 }
 
 //------------------------Systemfunktionen---------------------------
@@ -199,33 +349,17 @@ void vmm_Free(void *vAddress, size_t Pages)
  */
 void *vmm_SysAlloc(size_t Length)
 {
-	size_t i, j;
-	uint8_t error;
-
-	lock(&vmm_lock);
-
 	void *vAddress = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, Length);
 	if(vAddress == NULL)
-	{
-		unlock(&vmm_lock);
 		return NULL;
-	}
 
 	//Mappen
-	for(i = 0; i < Length; i++)
+	if(vmm_MapRange(&kernel_context, vAddress, 0, Length, VMM_FLAGS_WRITE | VMM_FLAGS_GLOBAL | VMM_FLAGS_NX,
+			VMM_KERNELSPACE | VMM_UNUSED_PAGE) != 0)
 	{
-		error = vmm_Map(vAddress + i * VMM_SIZE_PER_PAGE, 0, VMM_FLAGS_WRITE | VMM_FLAGS_GLOBAL | VMM_FLAGS_NX,
-				VMM_KERNELSPACE | VMM_UNUSED_PAGE);
-		if(error != 0)
-		{
-			//Mapping rückgängig machen
-			for(j = 0; j < i; j++)
-				vmm_UnMap(vAddress + j * VMM_SIZE_PER_PAGE);
-			unlock(&vmm_lock);
-			return NULL;
-		}
+		vma_release(&vmm_kernelVMAs, vAddress, Length * VMM_SIZE_PER_PAGE);
+		return NULL;
 	}
-	unlock(&vmm_lock);
 	return vAddress;
 }
 
@@ -238,89 +372,37 @@ void *vmm_SysAlloc(size_t Length)
  */
 void vmm_SysFree(void *vAddress, size_t Length)
 {
-	void *i;
-	lock(&vmm_lock);
-	for(i = vAddress; i < vAddress + Length * MM_BLOCK_SIZE; i += VMM_SIZE_PER_PAGE)
-	{
-		paddr_t pAddress = vmm_getPhysAddress(vAddress);
-		uint8_t Fehler = vmm_UnMap(i);
-		if(Fehler == 2) Panic("VMM", "Zu wenig physikalischer Speicher vorhanden");
-		if(Fehler != 1)
-			pmm_Free(pAddress);
-	}
-	unlock(&vmm_lock);
+	vmm_UnMapRange(&kernel_context, vAddress, Length, true);
+	vma_release(&vmm_kernelVMAs, vAddress, Length * MM_BLOCK_SIZE);
 }
 
 /*
- * Reserviert Speicher für DMA und mappt diesen
+ * Reserviert Speicher für DMA. Der Speicher muss nicht extra gemappt werden, weil er über die
+ * Direct Map erreichbar ist.
  * Params:	maxAddress = maximale physische Adresse für den Speicherbereich
  * 			size = Anzahl Pages des Speicherbereichs
  * 			phys = Zeiger auf Variable, in der die phys. Adresse geschrieben wird
  */
 void *vmm_AllocDMA(paddr_t maxAddress, size_t Size, paddr_t *Phys)
 {
-	void *startAddress = NULL;
-	void *i;
-	uintptr_t j;
-	uint64_t k = 0;						//Zähler für Anzahl Addressen
-	uint8_t Fehler;
-
-	//Freie virt. Adresse finden
-	uint64_t Pages = Size;
-
 	//Physischen Speicher allozieren
 	*Phys = pmm_AllocDMA(maxAddress, Size);
-		if(*Phys == 1) return NULL;
+	if(*Phys == 1) return NULL;
 
-	lock(&vmm_lock);
-	for(i = (void*)KERNELSPACE_START; i <= (void*)KERNELSPACE_END; i += VMM_SIZE_PER_PAGE)
-	{
-		if(vmm_getPageStatus(i))	//Wenn Page frei ist,
-		{
-			if(k == 0)				//und k = 0 ist,
-			{
-				startAddress = i;	//dann speichere die Addresse (i) in startAddress
-				k = 1;
-			}
-			else if(k < Pages)
-			{
-				if(i == startAddress + k * VMM_SIZE_PER_PAGE)
-					k++;
-				else
-					k = 0;
-			}
-			else
-			{
-				if(i == startAddress + k * VMM_SIZE_PER_PAGE)
-				{
-					//Physischen Speicher mappen
-					for(j = 0; j < k; j++)
-					{
-						Fehler = vmm_Map(startAddress + j * VMM_SIZE_PER_PAGE, *Phys + j * MM_BLOCK_SIZE, 0, 0);
-						if(Fehler == 1)
-						{
-							unlock(&vmm_lock);
-							return (void*)1;
-						}
-						if(Fehler == 2)		//Virt. Adresse schon belegt? Also weiter suchen
-						{
-							k = 0;
-							continue;
-						}
-					}
-				}
-				else
-					k = 0;
-				if(k)
-				{
-					unlock(&vmm_lock);
-					return (void*)startAddress;	//Virtuelle Addresse zurückgeben
-				}
-			}
-		}
-	}
-	unlock(&vmm_lock);
-	return NULL;
+	return vmm_PhysToVirt(*Phys);
+}
+
+/*
+ * Gibt einen mit vmm_AllocDMA reservierten Speicherbereich frei
+ * Params:	vAddress = Adresse des Speicherbereichs in der Direct Map
+ * 			size = Anzahl Pages des Speicherbereichs
+ */
+void vmm_FreeDMA(void *vAddress, size_t Size)
+{
+	paddr_t pAddress = (uintptr_t)vAddress - DIRECTMAP_START;
+	size_t i;
+	for(i = 0; i < Size; i++)
+		pmm_Free(pAddress + i * MM_BLOCK_SIZE);
 }
 
 list_t vmm_getTables(context_t *context)
@@ -348,8 +430,8 @@ list_t vmm_getTables(context_t *context)
 		//Danach die PDP nach Einträgen durchsuchen
 		for(PDPi = 0; PDPi < 512; PDPi++)
 		{
-			//Wenn PD nicht vorhanden dann auch nicht auflisten
-			if(!(PDP->PDPE[PDPi] & PG_P))
+			//Wenn PD nicht vorhanden oder eine 1GB-Page ist dann auch nicht auflisten
+			if(!(PDP->PDPE[PDPi] & PG_P) || (PDP->PDPE[PDPi] & PG_PS))
 				continue;
 
 			//PD auf die Liste setzen
@@ -360,8 +442,8 @@ list_t vmm_getTables(context_t *context)
 			//Danach PD durchsuchen
 			for(PDi = 0; PDi < 512; PDi++)
 			{
-				//Wenn PT nicht vorhanden dann auch nicht auflisten
-				if(!(PD->PDE[PDi] & PG_P))
+				//Wenn PT nicht vorhanden oder eine 2MB-Page ist dann auch nicht auflisten
+				if(!(PD->PDE[PDi] & PG_P) || (PD->PDE[PDi] & PG_PS))
 					continue;
 
 				//PT auf die Liste setzen
@@ -376,7 +458,9 @@ list_t vmm_getTables(context_t *context)
 //----------------------Allgemeine Funktionen------------------------
 
 /*
- * Mappt eine physikalische Speicherstelle an eine virtuelle Speicherstelle
+ * Mappt eine physikalische Speicherstelle an eine virtuelle Speicherstelle. Sobald die Direct Map
+ * vorhanden ist, geht das über vmm_MapRange, das fehlende Tabellen atomar anlegt. Vorher läuft nur
+ * die BSP und die Tabellen werden über das rekursive Mapping bearbeitet.
  * Params:
  * vAddres = Virtuelle Addresse, an die die Speicherstelle gemappt werden soll
  * pAddress = Physikalische Addresse der Speicherstelle
@@ -393,6 +477,10 @@ uint8_t vmm_Map(void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t avl)
 	PT_t *PT = (PT_t*)VMM_PT_ADDRESS;
 	paddr_t Address;
 
+	if(vmm_directMapReady)
+		return vmm_MapRange(((uintptr_t)vAddress <= KERNELSPACE_END) ? &kernel_context : vmm_currentContext(),
+				vAddress, pAddress, 1, flags, avl);
+
 	//Einträge in die Page Tabellen
 	uint16_t PML4i = ((uintptr_t)vAddress & PG_PML4_INDEX) >> 39;
 	uint16_t PDPi = ((uintptr_t)vAddress & PG_PDP_INDEX) >> 30;
@@ -443,6 +531,8 @@ uint8_t vmm_Map(void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t avl)
 		InvalidateTLBEntry(PD);
 		clearPage(PD);
 	}
+	else if(PDP->PDPE[PDPi] & PG_PS)		//Adresse liegt in einer 1GB-Page
+		return 2;
 
 	//PD Tabelle bearbeiten
 	if((PD->PDE[PDi] & PG_P) == 0)			//Eintrag in die PD schon vorhanden?
@@ -459,6 +549,8 @@ uint8_t vmm_Map(void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t avl)
 		InvalidateTLBEntry(PT);
 		clearPage(PT);
 	}
+	else if(PD->PDE[PDi] & PG_PS)			//Adresse liegt in einer 2MB-Page
+		return 2;
 
 	//PT Tabelle bearbeiten
 	if((PT->PTE[PTi] & PG_P) == 0)			//Eintrag in die PT schon vorhanden?
@@ -522,6 +614,102 @@ uint8_t vmm_Map(void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t avl)
 	return 0;
 }
 
+/*
+ * Mappt eine 2MB- oder 1GB-Page. Der Eintrag wird mit gesetztem PS-Bit direkt in die PD bzw. PDP
+ * geschrieben, es wird also keine PT benötigt.
+ * Params:
+ * vAddres = Virtuelle Addresse, an die die Page gemappt werden soll
+ * pAddress = Physikalische Addresse der Page
+ * size = PG_LARGE_PAGE_SIZE oder PG_HUGE_PAGE_SIZE, beide Adressen müssen darauf ausgerichtet sein
+ *
+ * Rückgabewert:	0 = Operation erfolgreich abgeschlossen
+ * 					1 = Nicht genug Speicherplatz vorhanden um eine Tabelle anzulegen
+ * 					2 = virt. Addresse ist schon belegt
+ * 					3 = Grösse oder Ausrichtung ungültig
+ */
+uint8_t vmm_MapLarge(void *vAddress, paddr_t pAddress, size_t size, uint8_t flags, uint16_t avl)
+{
+	PML4_t *PML4 = (PML4_t*)VMM_PML4_ADDRESS;
+	PDP_t *PDP = (PDP_t*)VMM_PDP_ADDRESS;
+	PD_t *PD = (PD_t*)VMM_PD_ADDRESS;
+	paddr_t Address;
+
+	//Einträge in die Page Tabellen
+	uint16_t PML4i = ((uintptr_t)vAddress & PG_PML4_INDEX) >> 39;
+	uint16_t PDPi = ((uintptr_t)vAddress & PG_PDP_INDEX) >> 30;
+	uint16_t PDi = ((uintptr_t)vAddress & PG_PD_INDEX) >> 21;
+
+	PDP = (void*)PDP + ((uint64_t)PML4i << 12);
+	PD = (void*)PD + (((uint64_t)PML4i << 21) | ((uint64_t)PDPi << 12));
+
+	if(size != PG_LARGE_PAGE_SIZE && (size != PG_HUGE_PAGE_SIZE || !cpuInfo.page1GB))
+		return 3;
+	if((((uintptr_t)vAddress | pAddress) & (size - 1)) != 0)
+		return 3;
+
+	//Flags auslesen
+	bool US = (flags & VMM_FLAGS_USER);
+	bool G = (flags & VMM_FLAGS_GLOBAL);
+	bool RW = (flags & VMM_FLAGS_WRITE);
+	bool NX = (flags & VMM_FLAGS_NX);
+	bool PCD = (flags & VMM_FLAGS_NO_CACHE);
+	bool PWT = (flags & VMM_FLAGS_PWT);
+
+	//PML4 Tabelle bearbeiten
+	if((PML4->PML4E[PML4i] & PG_P) == 0)		//Eintrag für die PML4 schon vorhanden?
+	{											//Erstelle neuen Eintrag
+		if((Address = pmm_Alloc()) == 1)		//Speicherplatz für die PDP reservieren
+			return 1;							//Kein Speicherplatz vorhanden
+
+		//Eintrag in die PML4
+		if(PG_AVL(PML4->PML4E[PML4i]) == VMM_KERNELSPACE)
+			setPML4Entry(PML4i, PML4, 1, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, Address);
+		else
+			setPML4Entry(PML4i, PML4, 1, 1, 1, 1, 0, 0, 0, 0, Address);
+		//Könnte gecacht sein
+		InvalidateTLBEntry(PDP);
+		clearPage(PDP);
+	}
+
+	if(size == PG_HUGE_PAGE_SIZE)
+	{
+		if(PDP->PDPE[PDPi] & PG_P)
+			return 2;							//virtuelle Addresse schon besetzt
+		setPDPLargeEntry(PDPi, PDP, 1, RW, US, PWT, PCD, 0, 0, G, avl, 0, NX, pAddress);
+	}
+	else
+	{
+		//PDP Tabelle bearbeiten
+		if((PDP->PDPE[PDPi] & PG_P) == 0)		//Eintrag in die PDP schon vorhanden?
+		{										//Neuen Eintrag erstellen
+			if((Address = pmm_Alloc()) == 1)	//Speicherplatz für die PD reservieren
+				return 1;						//Kein Speicherplatz vorhanden
+
+			//Eintrag in die PDP
+			if(PG_AVL(PDP->PDPE[PDPi]) == VMM_KERNELSPACE)
+				setPDPEntry(PDPi, PDP, 1, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, Address);
+			else
+				setPDPEntry(PDPi, PDP, 1, 1, 1, 1, 0, 0, 0, 0, Address);
+			//Könnte gecacht sein
+			InvalidateTLBEntry(PD);
+			clearPage(PD);
+		}
+		else if(PDP->PDPE[PDPi] & PG_PS)
+			return 2;							//Adresse liegt in einer 1GB-Page
+
+		if(PD->PDE[PDi] & PG_P)
+			return 2;							//virtuelle Addresse schon besetzt
+		setPDLargeEntry(PDi, PD, 1, RW, US, PWT, PCD, 0, 0, G, avl, 0, NX, pAddress);
+		PDP->PDPE[PDPi] &= ~0x1C0;
+	}
+	//Könnte gecacht sein
+	InvalidateTLBEntry(vAddress);
+
+	//Reserved-Bits zurücksetzen
+	PML4->PML4E[PML4i] &= ~0x1C0;
+	return 0;
+}
+
 /*
  * Gibt eine physikalischer Addresse zu einer virtuellen Addresse frei
  * Params:	vAddress = virt. Addresse der freizugebenden Speicherstelle
@@ -549,7 +737,7 @@ uint8_t vmm_UnMap(void *vAddress)
 	PD = (void*)PD + ((PML4i << 21) | (PDPi << 12));
 	PT = (void*)PT + ((PML4i << 30) | (PDPi << 21) | (PDi << 12));
 
-	InvalidateTLBEntry(vAddress);
+	vmm_invalidate(vmm_currentContext(), vAddress);
 
 	//PML4 Tabelle bearbeiten
 	if((PML4->PML4E[PML4i] & PG_P) == 0)	//PML4 Eintrag vorhanden?
@@ -558,10 +746,14 @@ uint8_t vmm_UnMap(void *vAddress)
 	//PDP Tabelle bearbeiten
 	if((PDP->PDPE[PDPi] & PG_P) == 0)		//PDP Eintrag vorhanden?
 		return 1;
+	if(PDP->PDPE[PDPi] & PG_PS)				//1GB-Pages werden hier nicht freigegeben
+		return 1;
 
 	//PD Tabelle bearbeiten
 	if((PD->PDE[PDi] & PG_P) == 0)			//PD Eintrag vorhanden?
 		return 1;
+	if(PD->PDE[PDi] & PG_PS)				//2MB-Pages werden hier nicht freigegeben
+		return 1;
 
 	//PT Tabelle bearbeiten
 	if((PT->PTE[PTi] & PG_P) == 1)			//Wenn PT Eintrag vorhanden
@@ -718,7 +910,7 @@ uint8_t vmm_ChangeMap(void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t
 		PDP->PDPE[PDPi] &= ~0x1C0;
 		PML4->PML4E[PML4i] &= ~0x1C0;
 
-		InvalidateTLBEntry((void*)vAddress);
+		vmm_invalidate(vmm_currentContext(), vAddress);
 	}
 	return 0;
 }
@@ -729,584 +921,1269 @@ uint8_t vmm_ChangeMap(void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t
  * Params:			src = virt. Addresse der Speicherstelle
  * 					dst = virt. Addresse an die remappt werden soll
  * 					length = Anzahl Pages, die die Speicherstelle lang ist
- * 					us = ist das Ziel ein Userspace?
  *
  * Rückgabewert:	0 = Speicherstelle wurde erfolgreich virt. verschoben
  * 					1 = zu wenig phys. Speicherplatz vorhanden
  * 					2 = Destinationaddresse ist schon belegt
- *///TODO: Bei Fehler alles Rückgängig machen
-//FIXME: getPhysAddress funktioniert nur für kernel_context
-//FIXME: correctly handle pages which are allocated but have not been mapped yet (VMM_UNUSED_PAGE)
+ */
 uint8_t vmm_ReMap(context_t *src_context, void *src, context_t *dst_context, void *dst, size_t length, uint8_t flags, uint16_t avl)
 {
-	size_t i;
-	for(i = 0; i < length; i++)
-	{
-		uint8_t r;
-		if((r = vmm_ContextMap(dst_context, dst + i * VMM_SIZE_PER_PAGE, vmm_getPhysAddress(src + i * VMM_SIZE_PER_PAGE) ? : pmm_Alloc(), flags, avl)) != 0)
-			return r;
-		if(vmm_ContextUnMap(src_context, src + i * VMM_SIZE_PER_PAGE, false) == 2)
-			return 1;
-	}
-	return 0;
+	void *dst_page = (void*)((uintptr_t)dst & ~0xFFF);
+
+	if(!vma_reserve(vmm_getVMAs(dst_context, dst_page), dst_page, length * VMM_SIZE_PER_PAGE))
+		return 2;
+	vma_release(vmm_getVMAs(src_context, src), (void*)((uintptr_t)src & ~0xFFF), length * VMM_SIZE_PER_PAGE);
+
+	return vmm_MoveRange(src_context, src, dst_context, dst, length, flags, avl);
 }
 
 /*
- * Sucht im Bereich zwischen 'start' und 'end' nach einem freien Raum, der 'pages' gross ist
+ * Reserviert einen freien Raum, der 'pages' gross ist. Ist 'start' im Kernelspace, wird der
+ * gemeinsame Baum des Kernels verwendet, ansonsten der Baum des aktuellen Prozesses.
  * Parameter:	start = Startpunkt
- * 				end = Endpunkt
+ * 				end = Endpunkt (der Baum deckt immer den ganzen Kernel- bzw. Userspace ab)
  * 				pages = Wie gross der Raum sein soll in Anzahl Pages
  */
-void *getFreePages(void *start, void *end, size_t pages)
+void *getFreePages(void *start, void *end __attribute__((unused)), size_t pages)
 {
-	PML4_t *PML4 = (PML4_t*)VMM_PML4_ADDRESS;
+	vma_tree_t *tree = vmm_getVMAs(vmm_currentContext(), start);
 
-	size_t found_pages = 0;
-
-	//Einträge in die Page Tabellen
-	uint16_t start_PML4i = ((uintptr_t)start & PG_PML4_INDEX) >> 39;
-	uint16_t start_PDPi = ((uintptr_t)start & PG_PDP_INDEX) >> 30;
-	uint16_t start_PDi = ((uintptr_t)start & PG_PD_INDEX) >> 21;
-	uint16_t start_PTi = ((uintptr_t)start & PG_PT_INDEX) >> 12;
-	uint16_t end_PML4i = ((uintptr_t)end & PG_PML4_INDEX) >> 39;
-	uint16_t end_PDPi = ((uintptr_t)end & PG_PDP_INDEX) >> 30;
-	uint16_t end_PDi = ((uintptr_t)end & PG_PD_INDEX) >> 21;
-	uint16_t end_PTi = ((uintptr_t)end & PG_PT_INDEX) >> 12;
-
-	//Anfang des zusammenhängenden Bereichs
-	uint16_t begin_PML4i = start_PML4i;
-	uint16_t begin_PDPi = start_PDPi;
-	uint16_t begin_PDi = start_PDi;
-	uint16_t begin_PTi = start_PTi;
+	//Grosse Bereiche des Userspaces können später mit grossen Pages gemappt werden
+	if((uintptr_t)start > KERNELSPACE_END && pages * VMM_SIZE_PER_PAGE >= PG_LARGE_PAGE_SIZE)
+		return vma_allocAligned(tree, pages * VMM_SIZE_PER_PAGE, PG_LARGE_PAGE_SIZE);
+	return vma_alloc(tree, pages * VMM_SIZE_PER_PAGE);
+}
 
-	uint16_t PML4i;
-	for (PML4i = start_PML4i; PML4i <= end_PML4i; PML4i++)
-	{
-		if((PML4->PML4E[PML4i] & PG_P))
-		{
-			//Es sind noch Pages frei
-			if(!(PG_AVL(PML4->PML4E[PML4i]) & VMM_PAGE_FULL))
-			{
-				PDP_t *PDP = (void*)VMM_PDP_ADDRESS + (PML4i << 12);
-				uint16_t PDPi;
-				uint16_t last_PDPi = (PML4i == end_PML4i) ? end_PDPi : PAGE_ENTRIES - 1;
-				for(PDPi = (PML4i == start_PML4i) ? start_PDPi : 0; PDPi <= last_PDPi; PDPi++)
-				{
-					if((PDP->PDPE[PDPi] & PG_P))
-					{
-						//Es sind noch Pages frei
-						if(!(PG_AVL(PDP->PDPE[PDPi]) & VMM_PAGE_FULL))
-						{
-							PD_t *PD = (void*)VMM_PD_ADDRESS + (((uint64_t)PML4i << 21) | (PDPi << 12));
-							uint16_t PDi;
-							uint16_t last_PDi = (PML4i == end_PML4i && PDPi == end_PDPi) ? end_PDi : PAGE_ENTRIES - 1;
-							for(PDi = (PML4i == start_PML4i && PDPi == start_PDPi) ? start_PDi : 0; PDi <= last_PDi; PDi++)
-							{
-								if((PD->PDE[PDi] & PG_P))
-								{
-									//Es sind noch Pages frei
-									if(!(PG_AVL(PD->PDE[PDi]) & VMM_PAGE_FULL))
-									{
-										PT_t *PT = (void*)VMM_PT_ADDRESS + (((uint64_t)PML4i << 30) | ((uint64_t)PDPi << 21) | (PDi << 12));
-										uint16_t PTi;
-										uint16_t last_PTi = (PML4i == end_PML4i && PDPi == end_PDPi && PDi == end_PDi) ? end_PTi : PAGE_ENTRIES - 1;
-										for(PTi = (PML4i == start_PML4i && PDPi == start_PDPi && PDi == start_PDi) ? start_PTi : 0;
-												PTi <= last_PTi; PTi++)
-										{
-											if(VMM_ALLOCATED(PT->PTE[PTi]))
-											{
-												found_pages = 0;
-												continue;
-											}
-											else
-											{
-												if(found_pages == 0)
-												{
-													begin_PTi = PTi;
-													begin_PDi = PDi;
-													begin_PDPi = PDPi;
-													begin_PML4i = PML4i;
-												}
-												found_pages++;
-											}
-
-											if(found_pages >= pages)
-												return VMM_GET_ADDRESS(begin_PML4i, begin_PDPi, begin_PDi, begin_PTi);
-										}
-									}
-									else
-									{
-										found_pages = 0;
-										continue;
-									}
-								}
-								else
-								{
-									if(found_pages == 0)
-									{
-										begin_PTi = 0;
-										begin_PDi = PDi;
-										begin_PDPi = PDPi;
-										begin_PML4i = PML4i;
-									}
-									found_pages += VMM_PAGES_PER_PT;
-								}
-
-								if(found_pages >= pages)
-									return VMM_GET_ADDRESS(begin_PML4i, begin_PDPi, begin_PDi, begin_PTi);
-							}
-						}
-						else
-						{
-							found_pages = 0;
-							continue;
-						}
-					}
-					else
-					{
-						if(found_pages == 0)
-						{
-							begin_PTi = 0;
-							begin_PDi = 0;
-							begin_PDPi = PDPi;
-							begin_PML4i = PML4i;
-						}
-						found_pages += VMM_PAGES_PER_PD;
-					}
+//-------------------------Bereichsfunktionen-------------------------
 
-					if(found_pages >= pages)
-						return VMM_GET_ADDRESS(begin_PML4i, begin_PDPi, begin_PDi, begin_PTi);
-				}
-			}
-			else
-			{
-				found_pages = 0;
-				continue;
-			}
-		}
-		else
-		{
-			if(found_pages == 0)
-			{
-				begin_PTi = 0;
-				begin_PDi = 0;
-				begin_PDPi = 0;
-				begin_PML4i = PML4i;
-			}
-			found_pages += VMM_PAGES_PER_PDP;
-		}
+//Bits von nicht vorhandenen Einträgen des Kernelspaces (wie von vmm_UnMap gesetzt)
+#define VMM_KERNEL_EMPTY_ENTRY	(PG_RW | PG_PWT | PG_AVL_BITS(VMM_KERNELSPACE))
 
-		if(found_pages >= pages)
-			return VMM_GET_ADDRESS(begin_PML4i, begin_PDPi, begin_PDi, begin_PTi);
-	}
+//Bits, die vmm_ProtectRange in einem Eintrag nicht verändert
+#define VMM_PROTECT_KEEP		(PG_P | PG_A | PG_D | PG_PAT | PG_AVL1 | PG_AVL2 | PG_ADDRESS)
 
-	return NULL;
+/*
+ * Berechnet die Bits eines PT-Eintrags, die von den Flags abhängen. Present-Bit, AVL und Adresse
+ * werden vom Aufrufer ergänzt.
+ */
+static uint64_t vmm_entryFlags(uint8_t flags)
+{
+	uint64_t entry = 0;
+
+	if(flags & VMM_FLAGS_WRITE)
+		entry |= PG_RW;
+	if(flags & VMM_FLAGS_USER)
+		entry |= PG_US;
+	if(flags & VMM_FLAGS_PWT)
+		entry |= PG_PWT;
+	if(flags & VMM_FLAGS_NO_CACHE)
+		entry |= PG_PCD;
+	if(flags & VMM_FLAGS_GLOBAL)
+		entry |= PG_G;
+	if((flags & VMM_FLAGS_NX) && cpuInfo.nx)
+		entry |= PG_NX;
+
+	return entry;
 }
 
 /*
- * Mappt einen Speicherbereich an die vorgegebene Address im entsprechendem Kontext
+ * Berechnet einen vorhandenen Eintrag mit neuen Flags. Nicht dem Prozess gehörende und mit einem
+ * anderen Kontext geteilte Pages bleiben schreibgeschützt: Erstere macht der Page-Fault-Handler
+ * beschreibbar, Letztere werden beim ersten Schreiben kopiert. Die Tabellen müssen gesperrt
+ * sein, damit die Page nicht gleichzeitig von cloneContext geteilt wird.
  */
-uint8_t vmm_ContextMap(context_t *context, void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t avl)
+static uint64_t vmm_protectEntry(uint64_t entry, uint64_t template)
 {
-	PML4_t *PML4 = context->virtualAddress;
-	PDP_t *PDP;
-	PD_t *PD;
-	PT_t *PT;
-	paddr_t Address;
+	entry &= VMM_PROTECT_KEEP & ~PG_AVL_BITS(VMM_COW_PAGE);
+	if(!(entry & PG_P) || !(template & PG_RW))
+		return entry | template;
+	if(PG_AVL(entry) & VMM_SHARED_PAGE)
+		return entry | (template & ~PG_RW);
+	if(pmm_isShared(entry & PG_ADDRESS))
+		return entry | (template & ~PG_RW) | PG_AVL_BITS(VMM_COW_PAGE);
+	return entry | template;
+}
 
-	//Einträge in die Page Tabellen
-	uint16_t PML4i = ((uintptr_t)vAddress & PG_PML4_INDEX) >> 39;
-	uint16_t PDPi = ((uintptr_t)vAddress & PG_PDP_INDEX) >> 30;
-	uint16_t PDi = ((uintptr_t)vAddress & PG_PD_INDEX) >> 21;
-	uint16_t PTi = ((uintptr_t)vAddress & PG_PT_INDEX) >> 12;
+//Gibt die erste Adresse zurück, die nicht mehr von der PT der Adresse abgedeckt wird
+static inline uintptr_t vmm_nextPT(uintptr_t address)
+{
+	return (address + PG_LARGE_PAGE_SIZE) & ~(PG_LARGE_PAGE_SIZE - 1);
+}
 
-	//Flags auslesen
-	bool US = (flags & VMM_FLAGS_USER);
-	bool G = (flags & VMM_FLAGS_GLOBAL);
-	bool RW = (flags & VMM_FLAGS_WRITE);
-	bool NX = (flags & VMM_FLAGS_NX);
-	bool P = !(avl & VMM_UNUSED_PAGE);
-	bool PCD = (flags & VMM_FLAGS_NO_CACHE);
-	bool PWT = (flags & VMM_FLAGS_PWT);
+//Gibt zurück, ob [address, end) die ganze PT bzw. grosse Page der Adresse abdeckt
+static inline bool vmm_coversPT(uintptr_t address, uintptr_t end)
+{
+	return (address & (PG_LARGE_PAGE_SIZE - 1)) == 0 && end - address >= PG_LARGE_PAGE_SIZE;
+}
 
-	//PML4 Tabelle bearbeiten
-	if((PML4->PML4E[PML4i] & PG_P) == 0)		//Eintrag für die PML4 schon vorhanden?
-	{											//Erstelle neuen Eintrag
-		if((Address = pmm_Alloc()) == 1)		//Speicherplatz für die PDP reservieren
+/*
+ * Grosse Pages: Anonyme Bereiche des Userspaces können mit 2MB-Pages in der PD gemappt werden.
+ * Sie entstehen beim ersten Zugriff auf einen noch ganz unbenutzten 2MB-Bereich oder werden im
+ * Idle-Thread aus vollständig belegten PTs gebildet. Alles, was einzelne Pages bearbeitet
+ * (Teile entfernen oder schützen, Auslagern, copy-on-write), teilt die grosse Page vorher
+ * wieder in eine PT mit 512 Einträgen auf.
+ */
+#define VMM_WALK_CREATE		0x1		//Fehlende Tabellen anlegen
+#define VMM_WALK_SPLIT		0x2		//Grosse Pages des Userspaces in einzelne Pages aufteilen
+
+#define VMM_LARGE_RESERVE	16384	//Unter so vielen freien Pages werden keine grossen Pages angelegt
+#define VMM_LARGE_FLAGS		(PG_RW | PG_US | PG_PWT | PG_PCD | PG_NX)	//Flags, die eine grosse Page von ihren Pages übernimmt
+
+//Gibt die Pages einer grossen Page frei
+static void vmm_freeLarge(paddr_t page)
+{
+	uint16_t i;
+	for(i = 0; i < PAGE_ENTRIES; i++)
+		pmm_Free(page + i * MM_BLOCK_SIZE);
+}
+
+/*
+ * Sucht über die Direct Map den PD-Eintrag einer Adresse im Kontext
+ * Rückgabe:	Zeiger auf den Eintrag oder NULL, wenn keine PD vorhanden ist
+ */
+static uint64_t *vmm_walkPDE(context_t *context, uintptr_t address)
+{
+	uint64_t *table = ((PML4_t*)vmm_PhysToVirt(context->physAddress))->PML4E;
+	uint8_t shift;
+
+	for(shift = 39; shift > 21; shift -= 9)
+	{
+		uint64_t value = table[(address >> shift) & (PAGE_ENTRIES - 1)];
+		if(!(value & PG_P) || (value & PG_PS))
+			return NULL;
+		table = vmm_PhysToVirt(value & PG_ADDRESS);
+	}
+	return &table[(address >> 21) & (PAGE_ENTRIES - 1)];
+}
+
+/*
+ * Teilt eine grosse Page in eine PT mit 512 Einträgen auf. Die phys. Pages bleiben dieselben.
+ * Parameter:	context = Kontext, muss gesperrt sein
+ * 				address = Adresse in der grossen Page
+ * 				PDE = Eintrag der grossen Page in der PD
+ * Rückgabe:	false, wenn zu wenig Speicher für die PT vorhanden ist
+ */
+static bool vmm_splitLarge(context_t *context, uintptr_t address, uint64_t *PDE)
+{
+	paddr_t table = pmm_Alloc();
+	uint64_t value;
+	PT_t *PT;
+	uint16_t PTi;
+
+	if(table == 1)
+		return false;
+	PT = vmm_PhysToVirt(table);
+
+	//Die CPU kann gleichzeitig das Accessed- oder Dirty-Bit setzen
+	do
+	{
+		value = *PDE;
+		if(!(value & PG_P) || !(value & PG_PS))
 		{
-			return 1;							//Kein Speicherplatz vorhanden
+			pmm_Free(table);
+			return true;
 		}
+		for(PTi = 0; PTi < PAGE_ENTRIES; PTi++)
+			PT->PTE[PTi] = ((value & PG_ADDRESS_2M) + PTi * MM_BLOCK_SIZE) | (value & (VMM_LARGE_FLAGS | PG_A | PG_D)) | PG_P;
+	}
+	//Gleiche Einträge wie bei vmm_walk
+	while(!__sync_bool_compare_and_swap(PDE, value, table | PG_P | PG_RW | PG_US | PG_PWT));
 
-		//Eintrag in die PML4
-		if(PG_AVL(PML4->PML4E[PML4i]) == VMM_KERNELSPACE)
-			setPML4Entry(PML4i, PML4, 1, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, Address);
-		else
-			setPML4Entry(PML4i, PML4, 1, 1, 1, 1, 0, 0, 0, 0, Address);
-		//PDP mappen
-		PDP = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-		vmm_Map(PDP, Address, VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
-		clearPage(PDP);
+	vmm_accountTables(context, address, 1);
+	vmm_invalidateRange(context, (void*)(address & ~(PG_LARGE_PAGE_SIZE - 1)), PAGE_ENTRIES);
+	__sync_fetch_and_add(&vmm_faultStats.largeSplits, 1);
+	return true;
+}
+
+/*
+ * Sucht über die Direct Map die PT, die eine Adresse im Kontext abdeckt.
+ * Parameter:	context = Kontext
+ * 				address = virtuelle Adresse
+ * 				flags = VMM_WALK_*
+ * 				PT = hier wird die PT gespeichert
+ * Rückgabe:	0 = PT gefunden
+ * 				1 = PT fehlt bzw. zu wenig phys. Speicher um sie anzulegen
+ * 				2 = Adresse liegt in einer 2MB- oder 1GB-Page
+ */
+static uint8_t vmm_walk(context_t *context, uintptr_t address, uint8_t flags, PT_t **PT)
+{
+	uint64_t *table = ((PML4_t*)vmm_PhysToVirt(context->physAddress))->PML4E;
+	uint8_t shift;
+
+	for(shift = 39; shift >= 21; shift -= 9)
+	{
+		uint64_t *entry = &table[(address >> shift) & (PAGE_ENTRIES - 1)];
+		uint64_t value;
+		while(((value = *entry) & PG_P) == 0)
+		{
+			paddr_t Address;
+			uint64_t newEntry;
+			if(!(flags & VMM_WALK_CREATE) || (Address = pmm_AllocZeroed()) == 1)
+				return 1;
+
+			//Gleiche Einträge wie bei vmm_Map
+			if(PG_AVL(value) == VMM_KERNELSPACE)
+				newEntry = Address | PG_P | PG_RW | PG_PWT | PG_AVL_BITS(VMM_KERNELSPACE);
+			else
+				newEntry = Address | PG_P | PG_RW | PG_US | PG_PWT;
+
+			//Hat eine andere CPU die Tabelle gleichzeitig angelegt, wird deren Tabelle verwendet
+			if(!__sync_bool_compare_and_swap(entry, value, newEntry))
+				pmm_Free(Address);
+			else
+				vmm_accountTables(context, address, 1);
+		}
+		if((value & PG_PS) && shift == 21 && (flags & VMM_WALK_SPLIT) && address > KERNELSPACE_END)
+		{
+			if(!vmm_splitLarge(context, address, entry))
+				return 1;
+			value = *entry;
+		}
+		if(value & PG_PS)
+			return 2;
+		table = vmm_PhysToVirt(value & PG_ADDRESS);
 	}
-	else
+
+	*PT = (PT_t*)table;
+	return 0;
+}
+
+/*
+ * Gibt die Tabellen über einer Adresse frei, die keine Einträge mehr enthalten. Die Tabellen des
+ * Kernelspaces bleiben immer erhalten, weil sie in allen Kontexten eingebunden sind. Die
+ * rekursiv gemappte Adresse einer Tabelle wird vor dem Freigeben invalidiert. Der Kontext muss
+ * mit vmm_lockTablesExclusive gesperrt sein.
+ */
+static void vmm_freeEmptyTables(context_t *context, uintptr_t address)
+{
+	static const uintptr_t windows[] = {VMM_PDP_ADDRESS, VMM_PD_ADDRESS, VMM_PT_ADDRESS};
+	uint64_t *tables[4];
+	int8_t level;
+	uint16_t i;
+
+	if(address <= KERNELSPACE_END)
+		return;
+
+	tables[0] = ((PML4_t*)vmm_PhysToVirt(context->physAddress))->PML4E;
+	for(level = 0; level < 3; level++)
 	{
-		//PDP mappen
-		PDP = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-		vmm_Map(PDP, PML4->PML4E[PML4i], VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
+		uint64_t entry = tables[level][(address >> (39 - level * 9)) & (PAGE_ENTRIES - 1)];
+		if((entry & PG_P) == 0 || (entry & PG_PS))
+			return;
+		tables[level + 1] = vmm_PhysToVirt(entry & PG_ADDRESS);
 	}
 
-	//PDP Tabelle bearbeiten
-	if((PDP->PDPE[PDPi] & PG_P) == 0)			//Eintrag in die PDP schon vorhanden?
-	{											//Neuen Eintrag erstellen
-		if((Address = pmm_Alloc()) == 1)		//Speicherplatz für die PD reservieren
+	for(level = 3; level > 0; level--)
+	{
+		const uint8_t shift = 39 - (level - 1) * 9;
+		uint64_t *entry = &tables[level - 1][(address >> shift) & (PAGE_ENTRIES - 1)];
+		paddr_t table = *entry & PG_ADDRESS;
+
+		for(i = 0; i < PAGE_ENTRIES; i++)
+			if(tables[level][i] != 0)
+				return;
+
+		*entry = 0;
+		vmm_invalidate(context, (void*)(windows[level - 1] + (((address & 0xFFFFFFFFFFFF) >> shift) << 12)));
+		pmm_Free(table);
+		vmm_accountTables(context, address, -1);
+	}
+}
+
+/*
+ * Mappt einen phys. zusammenhängenden Bereich. Jede PT wird dabei nur einmal gesucht und die
+ * Einträge werden aus einer Vorlage erzeugt. Mit VMM_UNUSED_PAGE in avl werden die Pages erst
+ * beim ersten Zugriff angelegt und pAddress wird ignoriert.
+ * Params:			context = Kontext, in dem gemappt wird
+ * 					vAddress = virt. Addresse der ersten Page
+ * 					pAddress = phys. Addresse der ersten Page
+ * 					pages = Anzahl Pages
+ * 					flags, avl = wie bei vmm_Map
+ * Rückgabewert:	0 = Bereich wurde gemappt
+ * 					1 = zu wenig phys. Speicher für die Tabellen vorhanden
+ * 					2 = Bereich ist schon teilweise belegt
+ */
+uint8_t vmm_MapRange(context_t *context, void *vAddress, paddr_t pAddress, size_t pages, uint8_t flags, uint16_t avl)
+{
+	const bool unused = avl & VMM_UNUSED_PAGE;
+	const uintptr_t start = (uintptr_t)vAddress & ~0xFFF;
+	const uintptr_t end = start + pages * VMM_SIZE_PER_PAGE;
+	uint64_t template = vmm_entryFlags(flags) | (unused ? 0 : PG_P);
+	uintptr_t address = start;
+	uint8_t error = 0;
+
+	if(start <= KERNELSPACE_END)
+		avl |= VMM_KERNELSPACE;
+	template |= PG_AVL_BITS(avl);
+
+	vmm_lockTables(context, start);
+	while(address < end && error == 0)
+	{
+		PT_t *PT;
+		uint16_t PTi;
+
+		if((error = vmm_walk(context, address, VMM_WALK_CREATE, &PT)) != 0)
+			break;
+
+		for(PTi = (address & PG_PT_INDEX) >> 12; PTi < PAGE_ENTRIES && address < end; PTi++)
 		{
-			vmm_UnMap(PDP);
-			return 1;							//Kein Speicherplatz vorhanden
+			if(VMM_ALLOCATED(PT->PTE[PTi]))
+			{
+				error = 2;
+				break;
+			}
+			//Nicht vorhandene Einträge werden nicht im TLB gespeichert, deshalb muss nichts invalidiert werden
+			PT->PTE[PTi] = template | (unused ? 0 : pAddress);
+			vmm_accountEntry(context, address, 0, PT->PTE[PTi]);
+			address += VMM_SIZE_PER_PAGE;
+			pAddress += VMM_SIZE_PER_PAGE;
 		}
+	}
+	vmm_unlockTables(context, start);
 
-		//Eintrag in die PDP
-		if(PG_AVL(PDP->PDPE[PDPi]) == VMM_KERNELSPACE)
-			setPDPEntry(PDPi, PDP, 1, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, Address);
-		else
-			setPDPEntry(PDPi, PDP, 1, 1, 1, 1, 0, 0, 0, 0, Address);
-		//PD mappen
-		PD = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-		vmm_Map(PD, Address, VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
-		clearPage(PD);
+	//Bei einem Fehler den bereits gemappten Teil wieder entfernen
+	if(error != 0 && address > start)
+		vmm_UnMapRange(context, (void*)start, (address - start) / VMM_SIZE_PER_PAGE, false);
+	return error;
+}
+
+/*
+ * Entfernt das Mapping eines Bereichs. Zuerst werden alle Einträge als nicht vorhanden markiert
+ * und der Bereich einmal im TLB invalidiert. Erst danach werden die Pages und leere Tabellen
+ * freigegeben, damit keine CPU mehr darauf zugreifen kann. Ganz entfernte grosse Pages werden
+ * erst im zweiten Durchgang aus der PD entfernt, teilweise entfernte vorher aufgeteilt.
+ * Params:	context = Kontext, in dem der Bereich liegt
+ * 			vAddress = virt. Addresse der ersten Page
+ * 			pages = Anzahl Pages
+ * 			free_pages = die phys. Pages ebenfalls freigeben
+ */
+void vmm_UnMapRange(context_t *context, void *vAddress, size_t pages, bool free_pages)
+{
+	const uintptr_t start = (uintptr_t)vAddress & ~0xFFF;
+	const uintptr_t end = start + pages * VMM_SIZE_PER_PAGE;
+	uintptr_t address;
+
+	vmm_lockTables(context, start);
+	for(address = start; address < end; address = vmm_nextPT(address))
+	{
+		PT_t *PT;
+		uint16_t PTi;
+		uint16_t PTe = (vmm_nextPT(address) > end) ? (end & PG_PT_INDEX) >> 12 : PAGE_ENTRIES;
+
+		if(vmm_walk(context, address, vmm_coversPT(address, end) ? 0 : VMM_WALK_SPLIT, &PT) != 0)
+			continue;
+		for(PTi = (address & PG_PT_INDEX) >> 12; PTi < PTe; PTi++)
+		{
+			uint64_t entry = __sync_fetch_and_and(&PT->PTE[PTi], ~PG_P);
+			vmm_accountEntry(context, address, entry, entry & ~PG_P);
+		}
 	}
-	else
+	vmm_unlockTables(context, start);
+
+	vmm_invalidateRange(context, (void*)start, pages);
+
+	vmm_lockTablesExclusive(context, start);
+	for(address = start; address < end; address = vmm_nextPT(address))
 	{
-		//PD mappen
-		PD = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-		vmm_Map(PD, PDP->PDPE[PDPi], VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
+		PT_t *PT;
+		uint16_t PTi;
+		uint16_t PTe = (vmm_nextPT(address) > end) ? (end & PG_PT_INDEX) >> 12 : PAGE_ENTRIES;
+		const bool whole = vmm_coversPT(address, end);
+		uint64_t *PDE;
+		uint8_t error;
+
+		//Die grosse Page kann inzwischen auch durch einen Page Fault entstanden sein
+		if((error = vmm_walk(context, address, whole ? 0 : VMM_WALK_SPLIT, &PT)) == 2 && whole
+				&& address > KERNELSPACE_END && (PDE = vmm_walkPDE(context, address)) != NULL)
+		{
+			uint64_t entry = __sync_lock_test_and_set(PDE, 0);
+			vmm_invalidateRange(context, (void*)address, PAGE_ENTRIES);
+			if(free_pages)
+				vmm_freeLarge(entry & PG_ADDRESS_2M);
+			__sync_fetch_and_sub(&context->residentPages, PAGE_ENTRIES);
+			__sync_fetch_and_sub(&context->mappedPages, PAGE_ENTRIES);
+			continue;
+		}
+		if(error != 0)
+			continue;
+		for(PTi = (address & PG_PT_INDEX) >> 12; PTi < PTe; PTi++)
+		{
+			uint64_t entry = PT->PTE[PTi];
+			if(free_pages && (PG_AVL(entry) & VMM_SWAPPED_PAGE))
+				swap_Free((entry & PG_ADDRESS) >> 12);
+			else if(free_pages && (entry & PG_ADDRESS) && !(PG_AVL(entry) & (VMM_UNUSED_PAGE | VMM_SHARED_PAGE)))
+				pmm_Free(entry & PG_ADDRESS);
+			PT->PTE[PTi] = (address <= KERNELSPACE_END) ? VMM_KERNEL_EMPTY_ENTRY : 0;
+			vmm_accountEntry(context, address, entry, 0);
+		}
+		vmm_freeEmptyTables(context, address);
 	}
+	vmm_unlockTablesExclusive(context, start);
+}
 
-	//PD Tabelle bearbeiten
-	if((PD->PDE[PDi] & PG_P) == 0)			//Eintrag in die PD schon vorhanden?
-	{										//Neuen Eintrag erstellen
-		if((Address = pmm_Alloc()) == 1)	//Speicherplatz für die PT reservieren
+/*
+ * Ändert die Flags eines Bereichs. Nicht belegte Pages werden übersprungen.
+ * Params:	context = Kontext, in dem der Bereich liegt
+ * 			vAddress = virt. Addresse der ersten Page
+ * 			pages = Anzahl Pages
+ * 			flags = neue Flags
+ */
+void vmm_ProtectRange(context_t *context, void *vAddress, size_t pages, uint8_t flags)
+{
+	const uintptr_t start = (uintptr_t)vAddress & ~0xFFF;
+	const uintptr_t end = start + pages * VMM_SIZE_PER_PAGE;
+	const uint64_t template = vmm_entryFlags(flags);
+	uintptr_t address;
+
+	vmm_lockTables(context, start);
+	for(address = start; address < end; address = vmm_nextPT(address))
+	{
+		PT_t *PT;
+		uint16_t PTi;
+		uint16_t PTe = (vmm_nextPT(address) > end) ? (end & PG_PT_INDEX) >> 12 : PAGE_ENTRIES;
+		const bool whole = vmm_coversPT(address, end);
+		uint64_t *PDE;
+		uint8_t error;
+
+		//Eine ganz abgedeckte grosse Page bekommt die Flags direkt in der PD
+		if((error = vmm_walk(context, address, whole ? 0 : VMM_WALK_SPLIT, &PT)) == 2 && whole
+				&& address > KERNELSPACE_END && (PDE = vmm_walkPDE(context, address)) != NULL)
 		{
-			vmm_UnMap(PDP);
-			vmm_UnMap(PD);
-			return 1;							//Kein Speicherplatz vorhanden
+			uint64_t entry;
+			do
+				entry = *PDE;
+			while((entry & PG_P) && !__sync_bool_compare_and_swap(PDE, entry,
+					(entry & ~VMM_LARGE_FLAGS) | (template & VMM_LARGE_FLAGS)));
+			continue;
+		}
+		if(error != 0)
+			continue;
+		for(PTi = (address & PG_PT_INDEX) >> 12; PTi < PTe; PTi++)
+		{
+			uint64_t entry;
+			do
+				entry = PT->PTE[PTi];
+			while(VMM_ALLOCATED(entry) && !__sync_bool_compare_and_swap(&PT->PTE[PTi], entry, vmm_protectEntry(entry, template)));
 		}
+	}
+	vmm_unlockTables(context, start);
 
-		//Eintrag in die PDP
-		if(PG_AVL(PD->PDE[PDi]) == VMM_KERNELSPACE)
-			setPDEntry(PDi, PD, 1, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, Address);
-		else
-			setPDEntry(PDi, PD, 1, 1, 1, 1, 0, 0, 0, 0, Address);
-		//PT mappen
-		PT = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-		vmm_Map(PT, Address, VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
-		clearPage(PT);
+	vmm_invalidateRange(context, (void*)start, pages);
+}
+
+/*
+ * Setzt das Dirty-Bit einer eingeblendeten Page zurück
+ * Parameter:	context = Kontext
+ * 				vAddress = Adresse der Page
+ * 				pAddress = bekommt die phys. Adresse der Page
+ * Rückgabe:	true, wenn die Page seit dem letzten Aufruf beschrieben wurde
+ */
+bool vmm_clearDirty(context_t *context, void *vAddress, paddr_t *pAddress)
+{
+	uint64_t *PTE, entry;
+	PT_t *PT;
+
+	vmm_lockTables(context, (uintptr_t)vAddress);
+	if(vmm_walk(context, (uintptr_t)vAddress, 0, &PT) != 0)
+	{
+		vmm_unlockTables(context, (uintptr_t)vAddress);
+		return false;
 	}
-	else
+	PTE = &PT->PTE[((uintptr_t)vAddress & PG_PT_INDEX) >> 12];
+	do
 	{
-		//PT mappen
-		PT = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-		vmm_Map(PT, PD->PDE[PDi], VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
+		entry = *PTE;
+		if(!(entry & PG_P) || !(entry & PG_D))
+		{
+			vmm_unlockTables(context, (uintptr_t)vAddress);
+			return false;
+		}
 	}
+	while(!__sync_bool_compare_and_swap(PTE, entry, entry & ~PG_D));
+	vmm_unlockTables(context, (uintptr_t)vAddress);
 
-	//PT Tabelle bearbeiten
-	if((PT->PTE[PTi] & PG_P) == 0)			//Eintrag in die PT schon vorhanden?
-	{										//Neuen Eintrag erstellen
-		//Eintrag in die PT
-		if(PG_AVL(PT->PTE[PTi]) == VMM_KERNELSPACE)
-			setPTEntry(PTi, PT, P, RW, US, PWT, PCD, 0, 0, G, VMM_KERNELSPACE | avl, 0, NX, pAddress);
-		else
-			setPTEntry(PTi, PT, P, RW, US, PWT, PCD, 0, 0, G, avl, 0, NX, pAddress);
-	}
-	else
+	//Ohne Invalidierung würde die CPU das Bit beim nächsten Schreiben nicht mehr setzen
+	vmm_invalidate(context, vAddress);
+	*pAddress = entry & PG_ADDRESS;
+	return true;
+}
+
+/*
+ * Verschiebt einen Bereich in einen anderen (oder denselben) Kontext. Die Einträge werden direkt
+ * übertragen, die phys. Pages bleiben also dieselben. Noch nicht angelegte Pages der Quelle
+ * werden im Ziel beim ersten Zugriff angelegt.
+ * Params:			src_context = Kontext der Quelle
+ * 					src = virt. Addresse der Quelle
+ * 					dst_context = Kontext des Ziels
+ * 					dst = virt. Addresse des Ziels
+ * 					pages = Anzahl Pages
+ * 					flags, avl = Flags der Pages im Ziel
+ * Rückgabewert:	0 = Bereich wurde verschoben
+ * 					1 = zu wenig phys. Speicher für die Tabellen vorhanden
+ * 					2 = Ziel ist schon belegt
+ */
+//TODO: Bei Fehler alles Rückgängig machen
+uint8_t vmm_MoveRange(context_t *src_context, void *src, context_t *dst_context, void *dst, size_t pages, uint8_t flags, uint16_t avl)
+{
+	const uintptr_t src_start = (uintptr_t)src & ~0xFFF;
+	uintptr_t src_address = src_start;
+	uintptr_t dst_address = (uintptr_t)dst & ~0xFFF;
+	const uint64_t src_empty = (src_start <= KERNELSPACE_END) ? VMM_KERNEL_EMPTY_ENTRY : 0;
+	uint64_t template;
+	size_t moved = 0;
+	uint8_t error = 0;
+
+	if(dst_address <= KERNELSPACE_END)
+		avl |= VMM_KERNELSPACE;
+	template = vmm_entryFlags(flags) | PG_AVL_BITS(avl);
+
+	//Derselbe Kontext wird nur einmal gesperrt, sonst könnte ein wartender exklusiver Benutzer alles blockieren
+	vmm_lockTables(src_context, src_start);
+	if(dst_context != src_context || src_start <= KERNELSPACE_END)
+		vmm_lockTables(dst_context, (uintptr_t)dst);
+	while(moved < pages)
 	{
-		vmm_UnMap(PDP);
-		vmm_UnMap(PD);
-		vmm_UnMap(PT);
-		return 2;							//virtuelle Addresse schon besetzt
+		PT_t *srcPT, *dstPT;
+		uint16_t srcPTi = (src_address & PG_PT_INDEX) >> 12;
+		uint16_t dstPTi = (dst_address & PG_PT_INDEX) >> 12;
+		size_t count = PAGE_ENTRIES - ((srcPTi > dstPTi) ? srcPTi : dstPTi);
+		size_t i;
+
+		if(count > pages - moved)
+			count = pages - moved;
+
+		if((error = vmm_walk(dst_context, dst_address, VMM_WALK_CREATE, &dstPT)) != 0)
+			break;
+		if(vmm_walk(src_context, src_address, VMM_WALK_SPLIT, &srcPT) != 0)
+			srcPT = NULL;
+
+		for(i = 0; i < count; i++)
+		{
+			uint64_t entry;
+
+			if(VMM_ALLOCATED(dstPT->PTE[dstPTi + i]))
+			{
+				error = 2;
+				break;
+			}
+
+			//Atomar austauschen, damit eine gleichzeitige Auslagerung den Eintrag nicht mehr ändert
+			entry = srcPT ? __sync_lock_test_and_set(&srcPT->PTE[srcPTi + i], src_empty) : 0;
+
+			//Eine Page, die gerade ausgelagert wird, bleibt eingeblendet
+			if((entry & PG_P) || (PG_AVL(entry) & VMM_SWAPOUT_PAGE))
+				dstPT->PTE[dstPTi + i] = vmm_protectEntry(PG_P | (entry & (PG_ADDRESS | PG_AVL_BITS(VMM_SHARED_PAGE))), template);
+			else if(PG_AVL(entry) & VMM_SWAPPED_PAGE)
+				dstPT->PTE[dstPTi + i] = template | (entry & (PG_ADDRESS | PG_AVL_BITS(VMM_SWAPPED_PAGE)));
+			else
+				dstPT->PTE[dstPTi + i] = template | PG_AVL_BITS(VMM_UNUSED_PAGE);
+			vmm_accountEntry(src_context, src_address + i * VMM_SIZE_PER_PAGE, entry, src_empty);
+			vmm_accountEntry(dst_context, dst_address + i * VMM_SIZE_PER_PAGE, 0, dstPT->PTE[dstPTi + i]);
+		}
+		moved += i;
+		src_address += i * VMM_SIZE_PER_PAGE;
+		dst_address += i * VMM_SIZE_PER_PAGE;
+		if(error != 0)
+			break;
 	}
+	if(dst_context != src_context || src_start <= KERNELSPACE_END)
+		vmm_unlockTables(dst_context, (uintptr_t)dst);
+	vmm_unlockTables(src_context, src_start);
 
-	//Reserved-Bits zurücksetzen
-	PD->PDE[PDi] &= ~0x1C0;
-	PDP->PDPE[PDPi] &= ~0x1C0;
-	PML4->PML4E[PML4i] &= ~0x1C0;
+	//Die Quelle nur einmal invalidieren und erst danach leere Tabellen freigeben
+	if(moved > 0)
+	{
+		vmm_invalidateRange(src_context, (void*)src_start, moved);
+		vmm_lockTablesExclusive(src_context, src_start);
+		for(src_address = src_start; src_address < src_start + moved * VMM_SIZE_PER_PAGE; src_address = vmm_nextPT(src_address))
+			vmm_freeEmptyTables(src_context, src_address);
+		vmm_unlockTablesExclusive(src_context, src_start);
+	}
 
-	//Tabellen wieder unmappen
-	vmm_UnMap(PDP);
-	vmm_UnMap(PD);
-	vmm_UnMap(PT);
+	return error;
+}
 
+/*
+ * Sucht die zugehörigen virtuelle Adresse der übergebenen phys. Adresse
+ * Parameter:		pAddress = die phys. Addresse der zu suchenden virt. Adresse
+ * Rückgabewert:	virtuelle Adresse der phys. Adresse
+ * 					0 = phys. Adresse wurde nicht gemappt
+ */
+/*uintptr_t vmm_getVirtAddress(uintptr_t pAddress)
+{
+	register uintptr_t i;
+	for(i = 0; i < VMM_MAX_ADDRESS; i += VMM_SIZE_PER_PAGE)
+	{
+		if(vmm_getPhysAddress(i) == pAddress)
+			return i;
+	}
 	return 0;
-}
+}*/
 
+//Hilfsfunktionen
 /*
- * Gibt eine physikalischer Addresse zu einer virtuellen Addresse frei
- * Params:	context = Kontext in dem die Page demapped werden soll
- * 			vAddress = virt. Addresse der freizugebenden Speicherstelle
- *
- * Rückgabewert:	0 = Page wurde freigegeben
- * 					1 = virt. Addresse nicht belegt
- * 					2 = zu wenig phys. Speicherplatz vorhanden
+ * Gibt zurück, ob die entsprechende Page belegt ist oder nicht
+ * Parameter:		Address = virtuelle Addresse
+ * Rückgabewert:	true = Page ist frei
+ * 					false = Page ist belegt
  */
-uint8_t vmm_ContextUnMap(context_t *context, void *vAddress, bool free_page)
+bool vmm_getPageStatus(void *Address)
 {
-	PML4_t *PML4 = context->virtualAddress;
-	PDP_t *PDP;
-	PD_t *PD;
-	PT_t *PT;
-	uint16_t i;
+	PML4_t *PML4 = (PML4_t*)VMM_PML4_ADDRESS;
+	PDP_t *PDP = (PDP_t*)VMM_PDP_ADDRESS;
+	PD_t *PD = (PD_t*)VMM_PD_ADDRESS;
+	PT_t *PT = (PT_t*)VMM_PT_ADDRESS;
 
 	//Einträge in die Page Tabellen
-	uint16_t PML4i = ((uintptr_t)vAddress & PG_PML4_INDEX) >> 39;
-	uint16_t PDPi = ((uintptr_t)vAddress & PG_PDP_INDEX) >> 30;
-	uint16_t PDi = ((uintptr_t)vAddress & PG_PD_INDEX) >> 21;
-	uint16_t PTi = ((uintptr_t)vAddress & PG_PT_INDEX) >> 12;
+	const uint16_t PML4i = ((uintptr_t)Address & PG_PML4_INDEX) >> 39;
+	const uint16_t PDPi = ((uintptr_t)Address & PG_PDP_INDEX) >> 30;
+	const uint16_t PDi = ((uintptr_t)Address & PG_PD_INDEX) >> 21;
+	const uint16_t PTi = ((uintptr_t)Address & PG_PT_INDEX) >> 12;
 
-	InvalidateTLBEntry(vAddress);
+	PDP = (void*)PDP + (PML4i << 12);
+	PD = (void*)PD + (((uint64_t)PML4i << 21) | (PDPi << 12));
+	PT = (void*)PT + (((uint64_t)PML4i << 30) | ((uint64_t)PDPi << 21) | (PDi << 12));
 
-	//PML4 Tabelle bearbeiten
-	if((PML4->PML4E[PML4i] & PG_P) == 0)	//PML4 Eintrag vorhanden?
+	//PML4 Eintrag überprüfen
+	if((PML4->PML4E[PML4i] & PG_P) == 0)	//Wenn PML4-Eintrag vorhanden ist
+		return true;
+	//Ansonsten überprüfe PDP-Eintrag
+	else if((PDP->PDPE[PDPi] & PG_P) == 0)	//Wenn PDP-Eintrag vorhanden ist
+		return true;
+	else if(PDP->PDPE[PDPi] & PG_PS)		//1GB-Page
+		return false;
+	//Ansonsten überprüfe PD-Eintrag
+	else if((PD->PDE[PDi] & PG_P) == 0)		//Wenn PD-Eintrag vorhanden ist
+		return true;
+	else if(PD->PDE[PDi] & PG_PS)			//2MB-Page
+		return false;
+	//Ansonsten überprüfe PT-Eintrag
+	else if(!VMM_ALLOCATED(PT->PTE[PTi]))	//Wenn PT-Eintrag vorhanden ist
+		return true;
+	else									//Ansonsten ist die Page schon belegt
+		return false;
+}
+
+paddr_t vmm_getPhysAddress(void *virtualAddress)
+{
+	PDP_t *PDP = (PDP_t*)VMM_PDP_ADDRESS;
+	PD_t *PD = (PD_t*)VMM_PD_ADDRESS;
+	PT_t *PT = (PT_t*)VMM_PT_ADDRESS;
+
+	if(vmm_getPageStatus(virtualAddress))
+		return 0;
+
+	//Einträge in die Page Tabellen
+	uint16_t PML4i = ((uintptr_t)virtualAddress & PG_PML4_INDEX) >> 39;
+	uint16_t PDPi = ((uintptr_t)virtualAddress & PG_PDP_INDEX) >> 30;
+	uint16_t PDi = ((uintptr_t)virtualAddress & PG_PD_INDEX) >> 21;
+	uint16_t PTi = ((uintptr_t)virtualAddress & PG_PT_INDEX) >> 12;
+
+	//Adressen in der Direct Map können direkt umgerechnet werden
+	if(vmm_isDirectMapped(virtualAddress))
+		return ((uintptr_t)virtualAddress - DIRECTMAP_START) & PG_ADDRESS;
+
+	PDP = (void*)PDP + ((uint64_t)PML4i << 12);
+	PD = (void*)PD + (((uint64_t)PML4i << 21) | ((uint64_t)PDPi << 12));
+	PT = (void*)PT + ((PML4i << 30) | (PDPi << 21) | (PDi << 12));
+
+	if(PDP->PDPE[PDPi] & PG_PS)
+		return (paddr_t)((PDP->PDPE[PDPi] & PG_ADDRESS_1G) | ((uintptr_t)virtualAddress & (PG_HUGE_PAGE_SIZE - 1) & PG_ADDRESS));
+	if(PD->PDE[PDi] & PG_PS)
+		return (paddr_t)((PD->PDE[PDi] & PG_ADDRESS_2M) | ((uintptr_t)virtualAddress & (PG_LARGE_PAGE_SIZE - 1) & PG_ADDRESS));
+
+	return (paddr_t)(PT->PTE[PTi] & PG_ADDRESS);
+}
+
+/*
+ * Auslagerung: Alle Kontexte des Userspaces sind in einer Liste, über die beim Auslagern
+ * reihum gegangen wird. In jedem Kontext läuft ein Zeiger wie bei einer Uhr (CLOCK) über die
+ * Pages. Hat die CPU seit dem letzten Durchgang auf eine Page zugegriffen, wird nur ihr
+ * Accessed-Bit gelöscht, ansonsten wird sie in einen Slot des Auslagerungsbereichs geschrieben.
+ * Ausgelagert werden nur Pages, die genau einem Kontext gehören.
+ */
+#define VMM_RECLAIM_LOW		1024	//Unter so vielen freien Pages wird schon vor dem Allozieren ausgelagert
+#define VMM_RECLAIM_BATCH	32		//Pages, die auf einmal ausgelagert werden
+#define VMM_RECLAIM_SCAN	16		//Einträge, die pro gewünschter Page höchstens geprüft werden
+
+static context_t *vmm_contexts;			//Liste aller Kontexte des Userspaces
+static context_t *vmm_reclaimCursor;	//Kontext, in dem als nächstes ausgelagert wird
+static context_t *vmm_promoteCursor;	//Kontext, in dem als nächstes grosse Pages gebildet werden
+static lock_t vmm_contextsLock = LOCK_UNLOCKED;
+
+/*
+ * Sucht ab einer Adresse im Userspace die nächste vorhandene PT. Der Kontext muss gesperrt sein.
+ * Parameter:	context = Kontext
+ * 				address = Startadresse, bekommt die erste Adresse der gefundenen PT (oder mitten darin)
+ * 				split = grosse Pages wie Pages einer PT behandeln: Wurde seit dem letzten Durchgang
+ * 						darauf zugegriffen, wird nur das Accessed-Bit gelöscht, ansonsten wird sie
+ * 						aufgeteilt. Ohne split werden grosse Pages übersprungen.
+ * Rückgabe:	PT oder NULL, wenn nach address keine PT mehr vorhanden ist
+ */
+static PT_t *vmm_findPT(context_t *context, uintptr_t *address, bool split)
+{
+	uint64_t *PML4 = ((PML4_t*)vmm_PhysToVirt(context->physAddress))->PML4E;
+	uintptr_t a = *address;
+
+	while(a >= USERSPACE_START && a <= USERSPACE_END)
 	{
-		PML4->PML4E[PML4i] &= ~0x1C0;
-		return 1;
+		uint64_t entry = PML4[(a & PG_PML4_INDEX) >> 39];
+		if(!(entry & PG_P) || PG_AVL(entry) == VMM_KERNELSPACE)
+		{
+			a = (a + (1ul << 39)) & ~((1ul << 39) - 1);
+			//Über die Lücke der nicht-kanonischen Adressen springen
+			if(a == 0x800000000000)
+				a = 0xFFFF800000000000;
+			continue;
+		}
+		entry = ((PDP_t*)vmm_PhysToVirt(entry & PG_ADDRESS))->PDPE[(a & PG_PDP_INDEX) >> 30];
+		if(!(entry & PG_P) || (entry & PG_PS))
+		{
+			a = (a + PG_HUGE_PAGE_SIZE) & ~(PG_HUGE_PAGE_SIZE - 1);
+			continue;
+		}
+		uint64_t *PDE = &((PD_t*)vmm_PhysToVirt(entry & PG_ADDRESS))->PDE[(a & PG_PD_INDEX) >> 21];
+		entry = *PDE;
+		if(split && (entry & PG_P) && (entry & PG_PS))
+		{
+			if(entry & PG_A)
+				__sync_bool_compare_and_swap(PDE, entry, entry & ~PG_A);
+			else if(vmm_splitLarge(context, a, PDE))
+				continue;
+		}
+		if(!(entry & PG_P) || (entry & PG_PS))
+		{
+			a = vmm_nextPT(a);
+			continue;
+		}
+		*address = a;
+		return vmm_PhysToVirt(entry & PG_ADDRESS);
 	}
+	return NULL;
+}
 
-	//PDP mappen
-	PDP = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-	vmm_Map(PDP, PML4->PML4E[PML4i], VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
+/*
+ * Schreibt eine Page, deren Eintrag schon als VMM_SWAPOUT_PAGE markiert wurde, in einen Slot
+ * und ersetzt danach den Eintrag. Hat inzwischen jemand auf die Page zugegriffen oder den
+ * Eintrag entfernt, bleibt die Page erhalten und der Slot wird wieder freigegeben.
+ * Parameter:	context = Kontext
+ * 				address = Adresse der Page
+ * 				entry = Eintrag vor dem Markieren
+ * 				slot = belegter Slot
+ * Rückgabe:	true, wenn die Page ausgelagert wurde
+ */
+static bool vmm_swapOut(context_t *context, uintptr_t address, uint64_t entry, uint64_t slot)
+{
+	const uint64_t pending = (entry & ~PG_P) | PG_AVL_BITS(VMM_SWAPOUT_PAGE);
+	const uint64_t swapped = (entry & ~(PG_P | PG_A | PG_D | PG_ADDRESS)) | (slot << 12) | PG_AVL_BITS(VMM_SWAPPED_PAGE);
+	bool written, success = false;
+	PT_t *PT;
 
-	//PDP Tabelle bearbeiten
-	if((PDP->PDPE[PDPi] & PG_P) == 0)		//PDP Eintrag vorhanden?
+	//Danach kann keine CPU mehr in die Page schreiben
+	vmm_invalidate(context, (void*)address);
+	written = swap_Write(slot, entry & PG_ADDRESS);
+
+	vmm_lockTables(context, address);
+	if(vmm_walk(context, address, 0, &PT) == 0)
 	{
-		PDP->PDPE[PDPi] &= ~0x1C0;
-		PML4->PML4E[PML4i] &= ~0x1C0;
-		vmm_UnMap(PDP);
-		return 1;
+		uint64_t *PTE = &PT->PTE[(address & PG_PT_INDEX) >> 12];
+		if(written)
+			success = __sync_bool_compare_and_swap(PTE, pending, swapped);
+		else
+			__sync_bool_compare_and_swap(PTE, pending, entry);
 	}
+	vmm_unlockTables(context, address);
 
-	//PD mappen
-	PD = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-	vmm_Map(PD, PDP->PDPE[PDPi], VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
-
-	//PD Tabelle bearbeiten
-	if((PD->PDE[PDi] & PG_P) == 0)			//PD Eintrag vorhanden?
+	if(success)
 	{
-		PD->PDE[PDi] &= ~0x1C0;
-		PDP->PDPE[PDPi] &= ~0x1C0;
-		PML4->PML4E[PML4i] &= ~0x1C0;
-		vmm_UnMap(PD);
-		vmm_UnMap(PDP);
-		return 1;
+		pmm_Free(entry & PG_ADDRESS);
+		vmm_accountEntry(context, address, pending, swapped);
+		__sync_fetch_and_add(&vmm_faultStats.swapOuts, 1);
 	}
+	else
+		swap_Free(slot);
+	return success;
+}
 
-	//PT mappen
-	PT = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-	vmm_Map(PT, PD->PDE[PDi], VMM_FLAGS_NX | VMM_FLAGS_WRITE, VMM_KERNELSPACE);
+/*
+ * Lagert Pages aus einem Kontext aus
+ * Parameter:	context = Kontext, darf nicht gelöscht werden (swapBusy)
+ * 				pages = Anzahl Pages, die höchstens ausgelagert werden
+ * 				budget = Anzahl Einträge, die noch geprüft werden dürfen
+ * Rückgabe:	Anzahl ausgelagerter Pages
+ */
+static size_t vmm_reclaimContext(context_t *context, size_t pages, size_t *budget)
+{
+	uintptr_t address = context->swapHand;
+	size_t reclaimed = 0;
+	bool wrapped = false;
 
-	//PT Tabelle bearbeiten
-	if((PT->PTE[PTi] & PG_P) == 1)			//Wenn PT Eintrag vorhanden
-	{										//dann lösche ihn
-		if(free_page)
+	if(address < USERSPACE_START || address > USERSPACE_END)
+		address = USERSPACE_START;
+
+	while(reclaimed < pages && *budget > 0)
+	{
+		uint64_t *PTE, entry, slot;
+		PT_t *PT;
+
+		vmm_lockTables(context, USERSPACE_START);
+		if((PT = vmm_findPT(context, &address, true)) == NULL)
 		{
-			paddr_t page_addr = PT->PTE[PTi] & PG_ADDRESS;
-			pmm_Free(page_addr);
+			vmm_unlockTables(context, USERSPACE_START);
+			//Auch leere Kontexte verbrauchen etwas, damit das Auslagern sicher endet
+			(*budget)--;
+			if(wrapped)
+				break;
+			wrapped = true;
+			address = USERSPACE_START;
+			continue;
 		}
-		//Ist dies eine Page des Kernelspaces?
-		if(PG_AVL(PT->PTE[PTi]) == VMM_KERNELSPACE)
-			setPTEntry(PTi, PT, 0, 1, 0, 1, 0, 0, 0, 0, VMM_KERNELSPACE, 0, 0, 0);
-		else
-			clearPTEntry(PTi, PT);
 
-		//Wird die PT noch benötigt?
-		for(i = 0; i < PAGE_ENTRIES; i++)
+		//Nächsten Kandidaten in dieser PT suchen
+		for(PTE = NULL; *budget > 0; address += VMM_SIZE_PER_PAGE)
 		{
-			if((PT->PTE[i] & PG_P) == 1 || PG_AVL(PT->PTE[i]) == VMM_KERNELSPACE || (PG_AVL(PT->PTE[i]) & VMM_UNUSED_PAGE))
+			uint64_t *e = &PT->PTE[(address & PG_PT_INDEX) >> 12];
+			(*budget)--;
+			entry = *e;
+			if((entry & PG_P) && !(PG_AVL(entry) & (VMM_SHARED_PAGE | VMM_COW_PAGE)) && !pmm_isShared(entry & PG_ADDRESS))
 			{
-				PT->PTE[PTi] &= ~0x1C0;
-				PD->PDE[PDi] &= ~0x1C0;
-				PDP->PDPE[PDPi] &= ~0x1C0;
-				PML4->PML4E[PML4i] &= ~0x1C0;
-				vmm_UnMap(PT);
-				vmm_UnMap(PD);
-				vmm_UnMap(PDP);
-				return 0; //Wird die PT noch benötigt, sind wir fertig
+				if(!(entry & PG_A))
+				{
+					PTE = e;
+					break;
+				}
+				__sync_bool_compare_and_swap(e, entry, entry & ~PG_A);
+			}
+			if((address & PG_PT_INDEX) == PG_PT_INDEX)
+			{
+				address += VMM_SIZE_PER_PAGE;
+				break;
 			}
 		}
-		//Ansonsten geben wir den Speicherplatz für die PT frei
-		vmm_SysFree(PT, 1);
-		//und löschen den Eintrag für diese PT in der PD
 
-		//Ist dies eine Page des Kernelspaces?
-		if(PG_AVL(PD->PDE[PDi]) == VMM_KERNELSPACE)
-			setPDEntry(PDi, PD, 0, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, 0);
-		else
-			clearPDEntry(PDi, PD);
+		if(PTE == NULL)
+		{
+			vmm_unlockTables(context, USERSPACE_START);
+			continue;
+		}
+		if((slot = swap_Alloc()) == SWAP_NO_SLOT)
+		{
+			vmm_unlockTables(context, USERSPACE_START);
+			*budget = 0;
+			break;
+		}
+		if(!__sync_bool_compare_and_swap(PTE, entry, (entry & ~PG_P) | PG_AVL_BITS(VMM_SWAPOUT_PAGE)))
+		{
+			vmm_unlockTables(context, USERSPACE_START);
+			swap_Free(slot);
+			continue;
+		}
+		vmm_unlockTables(context, USERSPACE_START);
 
-		//Wird die PD noch benötigt?
-		for(i = 0; i < PAGE_ENTRIES; i++)
+		if(vmm_swapOut(context, address, entry, slot))
+			reclaimed++;
+		address += VMM_SIZE_PER_PAGE;
+	}
+
+	context->swapHand = address;
+	return reclaimed;
+}
+
+/*
+ * Lagert Pages des Userspaces aus, bis genügend Pages frei sind
+ * Parameter:	pages = Anzahl Pages, die frei werden sollen
+ * Rückgabe:	Anzahl ausgelagerter Pages
+ */
+size_t vmm_reclaim(size_t pages)
+{
+	size_t reclaimed = 0;
+	size_t budget = pages * VMM_RECLAIM_SCAN;
+
+	if(!swap_isEnabled())
+		return 0;
+
+	while(reclaimed < pages && budget > 0)
+	{
+		context_t *context;
+
+		lock(&vmm_contextsLock);
+		if(vmm_reclaimCursor == NULL)
+			vmm_reclaimCursor = vmm_contexts;
+		if((context = vmm_reclaimCursor) == NULL)
 		{
-			if((PD->PDE[i] & PG_P) == 1 || PG_AVL(PD->PDE[i]) == VMM_KERNELSPACE)
-			{
-				PD->PDE[PDi] &= ~0x1C0;
-				PDP->PDPE[PDPi] &= ~0x1C0;
-				PML4->PML4E[PML4i] &= ~0x1C0;
-				vmm_UnMap(PD);
-				vmm_UnMap(PDP);
-				return 0; //Wid die PD noch benötigt, sind wir fertig
-			}
+			unlock(&vmm_contextsLock);
+			break;
 		}
-		//Ansonsten geben wir den Speicherplatz für die PD frei
-		vmm_SysFree(PD, 1);
-		//und löschen den Eintrag für diese PD in der PDP
+		vmm_reclaimCursor = context->next;
+		__sync_fetch_and_add(&context->swapBusy, 1);
+		unlock(&vmm_contextsLock);
 
-		//Ist dies eine Page des Kernelspaces?
-		if(PG_AVL(PDP->PDPE[PDPi]) == VMM_KERNELSPACE)
-			setPDPEntry(PDPi, PDP, 0, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, 0);
+		//Jeder Kontext kommt nur mit einem Teil an die Reihe
+		size_t contextBudget = MIN(budget, VMM_RECLAIM_BATCH * VMM_RECLAIM_SCAN);
+		budget -= contextBudget;
+		reclaimed += vmm_reclaimContext(context, pages - reclaimed, &contextBudget);
+		budget += contextBudget;
+
+		__sync_fetch_and_sub(&context->swapBusy, 1);
+	}
+
+	return reclaimed;
+}
+
+/*
+ * Verschiebt eine Page des Userspaces in eine neue Page. Der Eintrag wird dafür wie beim
+ * Auslagern als VMM_SWAPOUT_PAGE markiert, ein Zugriff währenddessen bricht das Verschieben ab.
+ * Parameter:	context = Kontext, darf nicht gelöscht werden (swapBusy)
+ * 				address = Adresse der Page
+ * 				entry = vorhandener Eintrag der Page
+ * Rückgabe:	true, wenn die Page verschoben wurde
+ */
+static bool vmm_migratePage(context_t *context, uintptr_t address, uint64_t entry)
+{
+	const uint64_t pending = (entry & ~PG_P) | PG_AVL_BITS(VMM_SWAPOUT_PAGE);
+	paddr_t old = entry & PG_ADDRESS, new;
+	bool success = false;
+	PT_t *PT;
+
+	//Geteilte Pages müssten in allen Kontexten gleichzeitig umgebogen werden
+	if((PG_AVL(entry) & VMM_SHARED_PAGE) || pmm_isShared(old))
+		return false;
+
+	vmm_lockTables(context, address);
+	if(vmm_walk(context, address, 0, &PT) != 0
+			|| !__sync_bool_compare_and_swap(&PT->PTE[(address & PG_PT_INDEX) >> 12], entry, pending))
+	{
+		vmm_unlockTables(context, address);
+		return false;
+	}
+	vmm_unlockTables(context, address);
+
+	//Danach kann keine CPU mehr in die alte Page schreiben
+	vmm_invalidate(context, (void*)address);
+	if((new = pmm_AllocMovable(false)) != 1)
+		memcpy(vmm_PhysToVirt(new), vmm_PhysToVirt(old), MM_BLOCK_SIZE);
+
+	vmm_lockTables(context, address);
+	if(vmm_walk(context, address, 0, &PT) == 0)
+	{
+		uint64_t *PTE = &PT->PTE[(address & PG_PT_INDEX) >> 12];
+		if(new != 1)
+			success = __sync_bool_compare_and_swap(PTE, pending, (entry & ~PG_ADDRESS) | new);
 		else
-			clearPDPEntry(PDPi, PDP);
+			__sync_bool_compare_and_swap(PTE, pending, entry);
+	}
+	vmm_unlockTables(context, address);
 
-		//Wird die PDP noch benötigt?
-		for(i = 0; i < PAGE_ENTRIES; i++)
+	if(success)
+		pmm_Free(old);
+	else if(new != 1)
+		pmm_Free(new);
+	return success;
+}
+
+/*
+ * Verschiebt alle Pages des Userspaces, die in einem phys. Bereich liegen. Wird vom CMA-Bereich
+ * verwendet, um zusammenhängenden Speicher freizuräumen.
+ * Parameter:	start = phys. Startadresse des Bereichs
+ * 				pages = Anzahl Pages des Bereichs
+ * Rückgabe:	true, wenn alle gefundenen Pages verschoben wurden
+ */
+bool vmm_migrateRange(paddr_t start, size_t pages)
+{
+	const paddr_t end = start + pages * MM_BLOCK_SIZE;
+	bool success = true;
+	size_t index;
+
+	for(index = 0; ; index++)
+	{
+		context_t *context;
+		uintptr_t address = USERSPACE_START;
+		PT_t *PT;
+		size_t i;
+
+		//Die Liste kann sich zwischendurch ändern, deshalb wird jedes Mal neu gezählt
+		lock(&vmm_contextsLock);
+		for(i = 0, context = vmm_contexts; context != NULL && i < index; i++)
+			context = context->next;
+		if(context != NULL)
+			__sync_fetch_and_add(&context->swapBusy, 1);
+		unlock(&vmm_contextsLock);
+		if(context == NULL)
+			break;
+
+		vmm_lockTables(context, USERSPACE_START);
+		//Grosse Pages liegen nie im CMA-Bereich
+		while((PT = vmm_findPT(context, &address, false)) != NULL)
 		{
-			//Wird die PDP noch benötigt, sind wir fertig
-			if((PDP->PDPE[i] & PG_P) == 1 || PG_AVL(PDP->PDPE[i]) == VMM_KERNELSPACE)
+			uint64_t entry;
+			for(; ; address += VMM_SIZE_PER_PAGE)
 			{
-				PDP->PDPE[PDPi] &= ~0x1C0;
-				PML4->PML4E[PML4i] &= ~0x1C0;
-				vmm_UnMap(PDP);
-				return 0;
+				entry = PT->PTE[(address & PG_PT_INDEX) >> 12];
+				if((entry & PG_P) && (entry & PG_ADDRESS) >= start && (entry & PG_ADDRESS) < end)
+					break;
+				if((address & PG_PT_INDEX) == PG_PT_INDEX)
+					break;
+			}
+			if((entry & PG_P) && (entry & PG_ADDRESS) >= start && (entry & PG_ADDRESS) < end)
+			{
+				//Die Tabellen können sich ändern, während die Page verschoben wird
+				vmm_unlockTables(context, USERSPACE_START);
+				success &= vmm_migratePage(context, address, entry);
+				vmm_lockTables(context, USERSPACE_START);
 			}
+			address += VMM_SIZE_PER_PAGE;
 		}
-		//Ansonsten geben wir den Speicherplatz für die PDP frei
-		vmm_SysFree(PDP, 1);
-		//und löschen den Eintrag für diese PDP in der PML4
+		vmm_unlockTables(context, USERSPACE_START);
 
-		//Ist dies eine Page des Kernelspaces?
-		if(PG_AVL(PML4->PML4E[PML4i]) == VMM_KERNELSPACE)
-			setPML4Entry(PML4i, PML4, 0, 1, 0, 1, 0, 0, VMM_KERNELSPACE, 0, 0);
-		else
-			clearPML4Entry(PML4i, PML4);	//PML4 ist immer vorhanden, daher keine Überprüfung
-											//ob sie leer ist (was sehr schlecht sein würde --> PF)
-		//Reserved-Bits zurücksetzen
-		PML4->PML4E[PML4i] &= ~0x1C0;
-		return 0;
+		__sync_fetch_and_sub(&context->swapBusy, 1);
 	}
-	else
+
+	return success;
+}
+
+/*
+ * Zusammenfassen zu grossen Pages: Der Idle-Thread geht wie beim Auslagern reihum über die
+ * Kontexte und sucht PTs, deren Pages alle vorhanden sind, nur diesem Kontext gehören und
+ * dieselben Flags haben. Ihr Inhalt wird in eine grosse Page kopiert und die PT freigegeben.
+ */
+#define VMM_PROMOTE_SCAN	64		//PTs, die pro Aufruf höchstens geprüft werden
+
+/*
+ * Prüft, ob eine PT zu einer grossen Page zusammengefasst werden kann
+ */
+static bool vmm_canPromote(PT_t *PT)
+{
+	const uint64_t flags = PT->PTE[0] & ~(PG_ADDRESS | PG_A | PG_D);
+	uint16_t PTi;
+
+	if(!(flags & PG_P) || (flags & (PG_PAT | PG_G)) || PG_AVL(flags) != 0)
+		return false;
+	for(PTi = 0; PTi < PAGE_ENTRIES; PTi++)
 	{
-		PT->PTE[PTi] &= ~0x1C0;
-		PD->PDE[PDi] &= ~0x1C0;
-		PDP->PDPE[PDPi] &= ~0x1C0;
-		PML4->PML4E[PML4i] &= ~0x1C0;
-		vmm_UnMap(PT);
-		vmm_UnMap(PD);
-		vmm_UnMap(PDP);
-		return 1;
+		uint64_t entry = PT->PTE[PTi];
+		if((entry & ~(PG_ADDRESS | PG_A | PG_D)) != flags || pmm_isShared(entry & PG_ADDRESS))
+			return false;
 	}
+	return true;
 }
 
 /*
- * Sucht die zugehörigen virtuelle Adresse der übergebenen phys. Adresse
- * Parameter:		pAddress = die phys. Addresse der zu suchenden virt. Adresse
- * Rückgabewert:	virtuelle Adresse der phys. Adresse
- * 					0 = phys. Adresse wurde nicht gemappt
+ * Fasst eine PT zu einer grossen Page zusammen. Die Einträge werden vor dem Kopieren als nicht
+ * vorhanden markiert, ein Zugriff währenddessen wartet auf die Sperre des Kontextes.
+ * Parameter:	context = Kontext, darf nicht gelöscht werden (swapBusy)
+ * 				start = Adresse der PT, auf 2MB ausgerichtet
+ * Rückgabe:	true, wenn die grosse Page eingeblendet wurde
  */
-/*uintptr_t vmm_getVirtAddress(uintptr_t pAddress)
+static bool vmm_promotePT(context_t *context, uintptr_t start)
 {
-	register uintptr_t i;
-	for(i = 0; i < VMM_MAX_ADDRESS; i += VMM_SIZE_PER_PAGE)
+	paddr_t page, table;
+	uint64_t *PDE, dirty = 0;
+	PT_t *PT;
+	uint16_t PTi;
+
+	if((page = pmm_AllocLarge()) == 1)
+		return false;
+
+	vmm_lockTablesExclusive(context, start);
+	if(vmm_walk(context, start, 0, &PT) != 0 || !vmm_canPromote(PT) || (PDE = vmm_walkPDE(context, start)) == NULL)
+	{
+		vmm_unlockTablesExclusive(context, start);
+		vmm_freeLarge(page);
+		return false;
+	}
+
+	//Danach kann keine CPU mehr in die alten Pages schreiben
+	for(PTi = 0; PTi < PAGE_ENTRIES; PTi++)
+		dirty |= __sync_fetch_and_and(&PT->PTE[PTi], ~PG_P) & PG_D;
+	vmm_invalidateRange(context, (void*)start, PAGE_ENTRIES);
+	for(PTi = 0; PTi < PAGE_ENTRIES; PTi++)
+		memcpy(vmm_PhysToVirt(page + PTi * MM_BLOCK_SIZE), vmm_PhysToVirt(PT->PTE[PTi] & PG_ADDRESS), MM_BLOCK_SIZE);
+
+	table = *PDE & PG_ADDRESS;
+	*PDE = page | PG_P | PG_PS | PG_A | dirty | (PT->PTE[0] & VMM_LARGE_FLAGS);
+	vmm_invalidateRange(context, (void*)start, PAGE_ENTRIES);
+	for(PTi = 0; PTi < PAGE_ENTRIES; PTi++)
+		pmm_Free(PT->PTE[PTi] & PG_ADDRESS);
+	pmm_Free(table);
+	vmm_accountTables(context, start, -1);
+	vmm_unlockTablesExclusive(context, start);
+
+	__sync_fetch_and_add(&vmm_faultStats.largePromotions, 1);
+	return true;
+}
+
+/*
+ * Sucht in einem Kontext PTs, die zu grossen Pages zusammengefasst werden können
+ * Parameter:	context = Kontext, darf nicht gelöscht werden (swapBusy)
+ * 				budget = Anzahl PTs, die noch geprüft werden dürfen
+ * Rückgabe:	true, wenn eine grosse Page gebildet wurde
+ */
+static bool vmm_promoteContext(context_t *context, size_t *budget)
+{
+	uintptr_t address = context->promoteHand;
+	bool promoted = false, wrapped = false;
+
+	if(address < USERSPACE_START || address > USERSPACE_END)
+		address = USERSPACE_START;
+
+	while(!promoted && *budget > 0)
 	{
-		if(vmm_getPhysAddress(i) == pAddress)
-			return i;
+		bool candidate;
+		PT_t *PT;
+
+		(*budget)--;
+		vmm_lockTables(context, USERSPACE_START);
+		if((PT = vmm_findPT(context, &address, false)) == NULL)
+		{
+			vmm_unlockTables(context, USERSPACE_START);
+			if(wrapped)
+				break;
+			wrapped = true;
+			address = USERSPACE_START;
+			continue;
+		}
+		address &= ~(PG_LARGE_PAGE_SIZE - 1);
+		candidate = vmm_canPromote(PT);
+		vmm_unlockTables(context, USERSPACE_START);
+
+		//Pages in Dateibereichen müssen einzeln bleiben
+		if(candidate && !filemap_overlaps(context, address, address + PG_LARGE_PAGE_SIZE))
+			promoted = vmm_promotePT(context, address);
+		address = vmm_nextPT(address);
 	}
-	return 0;
-}*/
 
-//Hilfsfunktionen
+	context->promoteHand = address;
+	return promoted;
+}
+
 /*
- * Gibt zurück, ob die entsprechende Page belegt ist oder nicht
- * Parameter:		Address = virtuelle Addresse
- * Rückgabewert:	true = Page ist frei
- * 					false = Page ist belegt
+ * Fasst im Idle-Thread vollständig belegte PTs zu grossen Pages zusammen. Pro Aufruf wird nur ein
+ * Kontext bearbeitet.
+ * Rückgabe:	true, wenn eine grosse Page gebildet wurde
  */
-bool vmm_getPageStatus(void *Address)
+bool vmm_promoteLarge(void)
 {
-	PML4_t *PML4 = (PML4_t*)VMM_PML4_ADDRESS;
-	PDP_t *PDP = (PDP_t*)VMM_PDP_ADDRESS;
-	PD_t *PD = (PD_t*)VMM_PD_ADDRESS;
-	PT_t *PT = (PT_t*)VMM_PT_ADDRESS;
-
-	//Einträge in die Page Tabellen
-	const uint16_t PML4i = ((uintptr_t)Address & PG_PML4_INDEX) >> 39;
-	const uint16_t PDPi = ((uintptr_t)Address & PG_PDP_INDEX) >> 30;
-	const uint16_t PDi = ((uintptr_t)Address & PG_PD_INDEX) >> 21;
-	const uint16_t PTi = ((uintptr_t)Address & PG_PT_INDEX) >> 12;
+	size_t budget = VMM_PROMOTE_SCAN;
+	context_t *context;
+	bool promoted;
 
-	PDP = (void*)PDP + (PML4i << 12);
-	PD = (void*)PD + (((uint64_t)PML4i << 21) | (PDPi << 12));
-	PT = (void*)PT + (((uint64_t)PML4i << 30) | ((uint64_t)PDPi << 21) | (PDi << 12));
+	if(pmm_getFreePages() < VMM_LARGE_RESERVE)
+		return false;
 
-	//PML4 Eintrag überprüfen
-	if((PML4->PML4E[PML4i] & PG_P) == 0)	//Wenn PML4-Eintrag vorhanden ist
-		return true;
-	//Ansonsten überprüfe PDP-Eintrag
-	else if((PDP->PDPE[PDPi] & PG_P) == 0)	//Wenn PDP-Eintrag vorhanden ist
-		return true;
-	//Ansonsten überprüfe PD-Eintrag
-	else if((PD->PDE[PDi] & PG_P) == 0)		//Wenn PD-Eintrag vorhanden ist
-		return true;
-	//Ansonsten überprüfe PT-Eintrag
-	else if((PT->PTE[PTi] & PG_P) == 0 && !(PG_AVL(PT->PTE[PTi]) & VMM_UNUSED_PAGE))		//Wenn PT-Eintrag vorhanden ist
-		return true;
-	else									//Ansonsten ist die Page schon belegt
+	lock(&vmm_contextsLock);
+	if(vmm_promoteCursor == NULL)
+		vmm_promoteCursor = vmm_contexts;
+	if((context = vmm_promoteCursor) == NULL)
+	{
+		unlock(&vmm_contextsLock);
 		return false;
+	}
+	vmm_promoteCursor = context->next;
+	__sync_fetch_and_add(&context->swapBusy, 1);
+	unlock(&vmm_contextsLock);
+
+	promoted = vmm_promoteContext(context, &budget);
+
+	__sync_fetch_and_sub(&context->swapBusy, 1);
+	return promoted;
 }
 
-paddr_t vmm_getPhysAddress(void *virtualAddress)
+/*
+ * Gibt Speicher für den Userspace frei. Zuerst werden die Caches des Kernels geschrumpft, erst
+ * wenn das nicht reicht wird ausgelagert.
+ * Parameter:	pages = Anzahl Pages, die frei werden sollen
+ * Rückgabe:	Anzahl freigegebener Pages
+ */
+static size_t vmm_freeMemory(size_t pages)
 {
-	PT_t *PT = (PT_t*)VMM_PT_ADDRESS;
+	size_t freed = shrinker_Shrink(pages);
+	if(freed < pages)
+		freed += vmm_reclaim(pages - freed);
+	return freed;
+}
 
-	if(vmm_getPageStatus(virtualAddress))
-		return 0;
+/*
+ * Alloziiert eine Page für einen Page Fault. Wird der Speicher knapp, werden bei Page Faults im
+ * Usermode Caches geschrumpft und Pages ausgelagert. Im Kernelmode (auch beim Zugriff auf einen
+ * Buffer des Userspaces) können Locks des Kernels gehalten werden, deshalb werden dort nur die
+ * Caches geschrumpft, deren Callbacks nicht blockieren.
+ * Parameter:	address = Adresse, für die die Page verwendet wird
+ * 				zeroed = Page muss mit Nullen gefüllt sein
+ * 				user = Page Fault im Usermode, es darf auch ausgelagert werden
+ * Rückgabe:	phys. Adresse der Page
+ */
+static paddr_t vmm_allocPage(uintptr_t address, bool zeroed, bool user)
+{
+	paddr_t page;
 
-	//Einträge in die Page Tabellen
-	uint16_t PML4i = ((uintptr_t)virtualAddress & PG_PML4_INDEX) >> 39;
-	uint16_t PDPi = ((uintptr_t)virtualAddress & PG_PDP_INDEX) >> 30;
-	uint16_t PDi = ((uintptr_t)virtualAddress & PG_PD_INDEX) >> 21;
-	uint16_t PTi = ((uintptr_t)virtualAddress & PG_PT_INDEX) >> 12;
+	if(address <= KERNELSPACE_END)
+	{
+		if((page = zeroed ? pmm_AllocZeroed() : pmm_Alloc()) == 1)
+			Panic("VMM", "Out of memory!");
+		return page;
+	}
 
-	PT = (void*)PT + ((PML4i << 30) | (PDPi << 21) | (PDi << 12));
+	if(pmm_getFreePages() < VMM_RECLAIM_LOW)
+		user ? vmm_freeMemory(VMM_RECLAIM_BATCH) : shrinker_Shrink(VMM_RECLAIM_BATCH);
 
-	return (paddr_t)(PT->PTE[PTi] & PG_ADDRESS);
+	//Pages des Userspaces werden nur über ihren Eintrag verwendet und dürfen verschoben werden
+	while((page = pmm_AllocMovable(zeroed)) == 1)
+	{
+		if((user ? vmm_freeMemory(VMM_RECLAIM_BATCH) : shrinker_Shrink(VMM_RECLAIM_BATCH)) == 0)
+			Panic("VMM", "Out of memory!");
+	}
+	return page;
 }
 
 void vmm_unusePages(void *virt, size_t pages)
 {
+	context_t *context = vmm_currentContext();
 	void *address = virt;
 
+	vmm_lockTables(context, (uintptr_t)virt);
 	for(; address < virt + pages * VMM_SIZE_PER_PAGE; address += VMM_SIZE_PER_PAGE)
 	{
-		PT_t *PT = (PT_t*)VMM_PT_ADDRESS;
-		//Einträge in die Page Tabellen
-		const uint16_t PML4i = ((uintptr_t)address & PG_PML4_INDEX) >> 39;
-		const uint16_t PDPi = ((uintptr_t)address & PG_PDP_INDEX) >> 30;
-		const uint16_t PDi = ((uintptr_t)address & PG_PD_INDEX) >> 21;
 		const uint16_t PTi = ((uintptr_t)address & PG_PT_INDEX) >> 12;
+		uint64_t entry, newEntry;
+		PT_t *PT;
 
-		PT = (void*)PT + (((uint64_t)PML4i << 30) | ((uint64_t)PDPi << 21) | (PDi << 12));
+		//Grosse Pages werden aufgeteilt, damit einzelne Pages freigegeben werden können
+		if(vmm_walk(context, (uintptr_t)address, VMM_WALK_SPLIT, &PT) != 0 || !VMM_ALLOCATED(PT->PTE[PTi]))
+			continue;
 
-		if(!vmm_getPageStatus(address) && (PG_AVL(PT->PTE[PTi]) & VMM_UNUSED_PAGE) == 0)
+		//Der Eintrag kann sich durch eine Auslagerung gleichzeitig ändern
+		do
 		{
-			paddr_t entry = PT->PTE[PTi];
-			pmm_Free(entry & PG_ADDRESS);
-			setPTEntry(PTi, PT, 0, !!(entry & PG_RW), !!(entry & PG_US), !!(entry & PG_PWT), !!(entry & PG_PCD), !!(entry & PG_A),
-					!!(entry & PG_D), !!(entry & PG_G), PG_AVL(entry) | VMM_UNUSED_PAGE, !!(entry & PG_PAT), !!(entry & PG_NX), 0);
-			InvalidateTLBEntry(address);
+			entry = PT->PTE[PTi];
+			if(PG_AVL(entry) & (VMM_UNUSED_PAGE | VMM_SHARED_PAGE))
+				break;
+			newEntry = (entry & ~(PG_P | PG_ADDRESS | PG_A | PG_D | PG_AVL_BITS(VMM_COW_PAGE | VMM_SWAPPED_PAGE | VMM_SWAPOUT_PAGE)))
+					| PG_AVL_BITS(VMM_UNUSED_PAGE);
+			//Eine kopierte Page darf wieder beschrieben werden
+			if(PG_AVL(entry) & VMM_COW_PAGE)
+				newEntry |= PG_RW;
 		}
+		while(!__sync_bool_compare_and_swap(&PT->PTE[PTi], entry, newEntry));
+		if(PG_AVL(entry) & (VMM_UNUSED_PAGE | VMM_SHARED_PAGE))
+			continue;
+		vmm_accountEntry(context, (uintptr_t)address, entry, newEntry);
+
+		if(entry & PG_P)
+			vmm_invalidate(context, address);
+		if(PG_AVL(entry) & VMM_SWAPPED_PAGE)
+			swap_Free((entry & PG_ADDRESS) >> 12);
+		else
+			pmm_Free(entry & PG_ADDRESS);
 	}
+	vmm_unlockTables(context, (uintptr_t)virt);
 }
 
 void vmm_usePages(void *virt, size_t pages)
 {
+	context_t *context = vmm_currentContext();
 	void *address = (void*)((uintptr_t)virt & ~0xFFF);
 
+	vmm_lockTables(context, (uintptr_t)virt);
 	for(; address < (void*)((uintptr_t)virt & ~0xFFF) + pages * VMM_SIZE_PER_PAGE; address += VMM_SIZE_PER_PAGE)
 	{
 		PT_t *PT = (PT_t*)VMM_PT_ADDRESS;
@@ -1319,17 +2196,310 @@ void vmm_usePages(void *virt, size_t pages)
 		PT = (void*)PT + (((uint64_t)PML4i << 30) | ((uint64_t)PDPi << 21) | (PDi << 12));
 
 		uint64_t entry = PT->PTE[PTi];
-		paddr_t pAddr = pmm_Alloc();
-		if(pAddr == 1)
-			Panic("VMM", "Out of memory!");
+		paddr_t pAddr = vmm_allocPage((uintptr_t)address, true, false);
 
 		setPTEntry(PTi, PT, 1, !!(entry & PG_RW), !!(entry & PG_US), !!(entry & PG_PWT), !!(entry & PG_PCD), !!(entry & PG_A),
 				!!(entry & PG_D), !!(entry & PG_G), PG_AVL(entry) & ~VMM_UNUSED_PAGE, !!(entry & PG_PAT), !!(entry & PG_NX), pAddr);
+		vmm_accountEntry(context, (uintptr_t)address, entry, PT->PTE[PTi]);
 		InvalidateTLBEntry(address);
-		clearPage(address);
 	}
+	vmm_unlockTables(context, (uintptr_t)virt);
+}
+
+/*
+ * Fault-around: Bei einem Page Fault auf eine anonyme, unbenutzte Page werden auch benachbarte
+ * unbenutzte Pages gefüllt. Folgt der Fault direkt auf das vorherige Fenster, wird sequentiell
+ * zugegriffen und das Fenster verdoppelt, ansonsten wird es wieder auf die kleinste Grösse gesetzt.
+ * Das Fenster endet immer an der Grenze der Page Table.
+ */
+#define VMM_FAULT_AROUND_MIN		4		//Pages, auf diese Grösse ausgerichtet
+#define VMM_FAULT_AROUND_MAX		256
+#define VMM_FAULT_AROUND_RESERVE	4096	//Unter so vielen freien Pages wird nur noch eine Page gefüllt
+
+/*
+ * Füllt die unbenutzten Pages um eine Page, auf die gerade zugegriffen wurde
+ * Parameter:	context = Kontext
+ * 				PT = Page Table der Adresse
+ * 				address = Adresse der Page, die schon eingeblendet wurde
+ */
+static void vmm_faultAround(context_t *context, PT_t *PT, uintptr_t address)
+{
+	uintptr_t start, end;
+	size_t window;
+
+	__sync_fetch_and_add(&vmm_faultStats.faults, 1);
+
+	//Die Werte im Kontext sind nur ein Hinweis, gleichzeitige Faults dürfen sich überschreiben
+	if(address == context->faultNext && context->faultWindow >= VMM_FAULT_AROUND_MIN)
+	{
+		__sync_fetch_and_add(&vmm_faultStats.sequentialFaults, 1);
+		window = MIN(context->faultWindow * 2, VMM_FAULT_AROUND_MAX);
+		start = address;
+	}
+	else
+	{
+		window = VMM_FAULT_AROUND_MIN;
+		start = address & ~(VMM_FAULT_AROUND_MIN * VMM_SIZE_PER_PAGE - 1);
+	}
+	end = MIN(start + window * VMM_SIZE_PER_PAGE, vmm_nextPT(address));
+	context->faultWindow = window;
+	context->faultNext = end;
+
+	if(pmm_getFreePages() < VMM_FAULT_AROUND_RESERVE)
+		return;
+	//Pages in Dateibereichen werden beim Zugriff aus der Datei gefüllt
+	if(address > KERNELSPACE_END && filemap_overlaps(context, start, end))
+		return;
+
+	for(; start < end; start += VMM_SIZE_PER_PAGE)
+	{
+		uint64_t *PTE = &PT->PTE[(start & PG_PT_INDEX) >> 12];
+		uint64_t entry = *PTE;
+		paddr_t page;
+
+		if(start == address || (entry & PG_P) || !(PG_AVL(entry) & VMM_UNUSED_PAGE))
+			continue;
+		if((page = (address > KERNELSPACE_END) ? pmm_AllocMovable(true) : pmm_AllocZeroed()) == 1)
+			break;
+		//Nicht vorhandene Einträge sind nicht im TLB, es muss nichts invalidiert werden
+		if(__sync_bool_compare_and_swap(PTE, entry, (entry & ~(PG_ADDRESS | PG_AVL_BITS(VMM_UNUSED_PAGE))) | PG_P | page))
+		{
+			vmm_accountEntry(context, start, entry, *PTE);
+			__sync_fetch_and_add(&vmm_faultStats.faultAroundPages, 1);
+		}
+		else
+			pmm_Free(page);
+	}
+}
+
+/*
+ * Prüft, ob alle Einträge einer PT dieselbe unbenutzte Page beschreiben
+ */
+static bool vmm_isUnusedPT(PT_t *PT, uint64_t entry)
+{
+	uint16_t PTi;
+	for(PTi = 0; PTi < PAGE_ENTRIES; PTi++)
+		if(PT->PTE[PTi] != entry)
+			return false;
+	return true;
+}
+
+/*
+ * Füllt einen noch ganz unbenutzten, anonymen 2MB-Bereich beim ersten Zugriff mit einer grossen
+ * Page. Die PT wird danach nicht mehr gebraucht und freigegeben.
+ * Parameter:	context = Kontext
+ * 				address = Adresse, auf die zugegriffen wurde
+ * 				entry = unbenutzter Eintrag der Page
+ * Rückgabe:	true, wenn die grosse Page eingeblendet wurde
+ */
+static bool vmm_faultLarge(context_t *context, uintptr_t address, uint64_t entry)
+{
+	const uintptr_t start = address & ~(PG_LARGE_PAGE_SIZE - 1);
+	bool success = false;
+	uint64_t *PDE = NULL;
+	paddr_t page;
+	PT_t *PT;
+
+	//Das PAT-Bit liegt in der PD an einer anderen Stelle
+	if((entry & (PG_PAT | PG_G)) || pmm_getFreePages() < VMM_LARGE_RESERVE)
+		return false;
+
+	vmm_lockTables(context, start);
+	success = vmm_walk(context, start, 0, &PT) == 0 && vmm_isUnusedPT(PT, entry);
+	vmm_unlockTables(context, start);
+	if(!success || filemap_overlaps(context, start, start + PG_LARGE_PAGE_SIZE) || (page = pmm_AllocLarge()) == 1)
+		return false;
+	memset(vmm_PhysToVirt(page), 0, PG_LARGE_PAGE_SIZE);
+
+	//Die PT wird freigegeben, deshalb darf niemand mehr darauf zugreifen
+	vmm_lockTablesExclusive(context, start);
+	success = vmm_walk(context, start, 0, &PT) == 0 && vmm_isUnusedPT(PT, entry) && (PDE = vmm_walkPDE(context, start)) != NULL;
+	if(success)
+	{
+		paddr_t table = *PDE & PG_ADDRESS;
+		*PDE = page | PG_P | PG_PS | (entry & VMM_LARGE_FLAGS);
+		vmm_invalidateRange(context, (void*)start, PAGE_ENTRIES);
+		pmm_Free(table);
+		vmm_accountTables(context, start, -1);
+		__sync_fetch_and_add(&context->residentPages, PAGE_ENTRIES);
+	}
+	vmm_unlockTablesExclusive(context, start);
+
+	if(!success)
+	{
+		vmm_freeLarge(page);
+		return false;
+	}
+	__sync_fetch_and_add(&vmm_faultStats.faults, 1);
+	__sync_fetch_and_add(&vmm_faultStats.largeFaults, 1);
+	__sync_fetch_and_add(&context->zeroFillFaults, 1);
+	return true;
+}
+
+/*
+ * Gibt die Zähler des Fault-around zurück
+ */
+void vmm_getFaultStats(vmm_faultStats_t *stats)
+{
+	*stats = vmm_faultStats;
 }
 
+/*
+ * Behandelt einen Page Fault auf eine Page, die erst beim ersten Zugriff angelegt wird. Pages in
+ * einem Bereich einer Datei werden daraus gefüllt, ausgelagerte Pages aus dem Auslagerungsbereich
+ * und alle anderen mit Nullen. Beim ersten
+ * Schreibzugriff auf die gemeinsame Nullpage oder eine gemeinsame Page eines privaten Bereichs
+ * bekommt der Prozess eine eigene Kopie. Das Lesen ausgelagerter Pages und aus Dateien ist auch im
+ * Kernelmode nötig, weil die Daten nur dort vorhanden sind. Ausgelagert wird aber nur bei einem
+ * Page Fault im Usermode.
+ * Parameter:	address = Adresse, auf die zugegriffen wurde
+ * 				write = true bei einem Schreibzugriff
+ * 				user = true, wenn der Page Fault im Usermode aufgetreten ist
+ * Rückgabe:	true, wenn der Zugriff wiederholt werden kann
+ */
+bool vmm_handlePageFault(void *address, bool write, bool user)
+{
+	context_t *context = vmm_currentContext();
+	const uintptr_t page_address = (uintptr_t)address & ~0xFFF;
+	filemap_t *map = NULL;
+	bool shared = false;
+	uint64_t entry, newEntry, slot = SWAP_NO_SLOT;
+	paddr_t page, newPage = 1, oldPage = 1;	//newPage wird verworfen, wenn ein anderer Thread schneller war, oldPage sonst
+	PT_t *PT;
+
+	//Die Tabellen werden nur zum Lesen und zum Eintragen gesperrt, nicht während eine Page gefüllt wird
+	vmm_lockTables(context, page_address);
+	if(vmm_walk(context, page_address, 0, &PT) != 0)
+	{
+		//Eine grosse Page kann gerade von einer anderen CPU eingeblendet worden sein
+		uint64_t *PDE = (page_address > KERNELSPACE_END) ? vmm_walkPDE(context, page_address) : NULL;
+		bool retry = PDE != NULL && (*PDE & PG_P) && (*PDE & PG_PS) && (!write || (*PDE & PG_RW));
+		vmm_unlockTables(context, page_address);
+		return retry;
+	}
+	entry = PT->PTE[(page_address & PG_PT_INDEX) >> 12];
+	vmm_unlockTables(context, page_address);
+
+	if(page_address > KERNELSPACE_END)
+		map = filemap_find(context, page_address);
+
+	if(!(entry & PG_P) && (PG_AVL(entry) & VMM_UNUSED_PAGE))
+	{
+		if(map == NULL && page_address > KERNELSPACE_END && vmm_faultLarge(context, page_address, entry))
+			return true;
+		if(map != NULL)
+			page = filemap_getPage(map, page_address, write, &shared);
+		else
+			page = vmm_allocPage(page_address, true, user);
+		if(page == 1)
+			Panic("VMM", "Out of memory!");
+		newEntry = (entry & ~(PG_ADDRESS | PG_AVL_BITS(VMM_UNUSED_PAGE))) | PG_P | page;
+
+		//Nur gemeinsame Bereiche beschreiben die Pages einer Datei direkt, alle anderen kopieren sie
+		if(shared)
+		{
+			newEntry |= PG_AVL_BITS(VMM_SHARED_PAGE);
+			if(!(map->mode & FILEMAP_SHARED) || filemap_isZeroPage(page))
+				newEntry &= ~PG_RW;
+		}
+		else
+			newPage = page;
+	}
+	else if(!(entry & PG_P) && (PG_AVL(entry) & VMM_SWAPOUT_PAGE))
+	{
+		//Die Page wird gerade ausgelagert, ist aber noch vorhanden. Das Auslagern wird abgebrochen.
+		newEntry = (entry & ~PG_AVL_BITS(VMM_SWAPOUT_PAGE)) | PG_P;
+	}
+	else if(!(entry & PG_P) && (PG_AVL(entry) & VMM_SWAPPED_PAGE))
+	{
+		slot = (entry & PG_ADDRESS) >> 12;
+		newPage = vmm_allocPage(page_address, false, user);
+		if(!swap_Read(slot, newPage))
+			Panic("VMM", "Could not read page from swap!");
+		newEntry = (entry & ~(PG_ADDRESS | PG_AVL_BITS(VMM_SWAPPED_PAGE))) | PG_P | newPage;
+	}
+	else if((entry & PG_P) && write && !(entry & PG_RW) && (PG_AVL(entry) & VMM_COW_PAGE))
+	{
+		paddr_t old = entry & PG_ADDRESS;
+		if(pmm_isShared(old))
+		{
+			//Page wird noch von einem anderen Kontext verwendet
+			newPage = vmm_allocPage(page_address, false, user);
+			memcpy(vmm_PhysToVirt(newPage), vmm_PhysToVirt(old), MM_BLOCK_SIZE);
+			oldPage = old;
+			newEntry = (entry & ~(PG_ADDRESS | PG_AVL_BITS(VMM_COW_PAGE))) | PG_RW | newPage;
+		}
+		else
+		{
+			//Alle anderen Kontexte haben ihre Kopie schon erhalten oder existieren nicht mehr
+			newEntry = (entry & ~PG_AVL_BITS(VMM_COW_PAGE)) | PG_RW;
+		}
+	}
+	else if((entry & PG_P) && write && !(entry & PG_RW) && (PG_AVL(entry) & VMM_SHARED_PAGE)
+			&& map != NULL && (map->flags & VMM_FLAGS_WRITE))
+	{
+		paddr_t old = entry & PG_ADDRESS;
+		if((map->mode & FILEMAP_SHARED) && !filemap_isZeroPage(old))
+		{
+			//Page einer Datei, die z.B. nach mprotect wieder beschrieben werden darf
+			newEntry = entry | PG_RW;
+		}
+		else
+		{
+			//Copy-on-write der Nullpage oder einer Page aus einem Image
+			newPage = vmm_allocPage(page_address, filemap_isZeroPage(old), user);
+			if(!filemap_isZeroPage(old))
+				memcpy(vmm_PhysToVirt(newPage), vmm_PhysToVirt(old), MM_BLOCK_SIZE);
+			newEntry = (entry & ~(PG_ADDRESS | PG_AVL_BITS(VMM_SHARED_PAGE))) | PG_RW | newPage;
+		}
+	}
+	else
+	{
+		filemap_release(map);
+		return false;
+	}
+	filemap_release(map);
+
+	//Wenn ein anderer Thread die Page schon eingeblendet oder der Bereich inzwischen entfernt wurde,
+	//wird die eigene verworfen. Eine kopierte Page, die wieder beschreibbar wird, kann inzwischen
+	//durch fork erneut geteilt worden sein. cloneContext sperrt exklusiv, hier ist das also sicher.
+	vmm_lockTables(context, page_address);
+	if(vmm_walk(context, page_address, 0, &PT) != 0
+			|| ((PG_AVL(entry) & VMM_COW_PAGE) && (newEntry & PG_RW) && (newEntry & PG_ADDRESS) == (entry & PG_ADDRESS)
+				&& pmm_isShared(entry & PG_ADDRESS))
+			|| !__sync_bool_compare_and_swap(&PT->PTE[(page_address & PG_PT_INDEX) >> 12], entry, newEntry))
+	{
+		vmm_unlockTables(context, page_address);
+		if(newPage != 1)
+			pmm_Free(newPage);
+		return true;
+	}
+	vmm_accountEntry(context, page_address, entry, newEntry);
+	if(entry & PG_P)
+		vmm_invalidate(context, (void*)page_address);
+	else if(map == NULL && (PG_AVL(entry) & VMM_UNUSED_PAGE))
+		vmm_faultAround(context, PT, page_address);
+	vmm_unlockTables(context, page_address);
+
+	if(page_address > KERNELSPACE_END)
+	{
+		if(slot != SWAP_NO_SLOT)
+			__sync_fetch_and_add(&context->majorFaults, 1);
+		else if(map == NULL && !(entry & PG_P) && (PG_AVL(entry) & VMM_UNUSED_PAGE))
+			__sync_fetch_and_add(&context->zeroFillFaults, 1);
+		else
+			__sync_fetch_and_add(&context->minorFaults, 1);
+	}
+
+	if(oldPage != 1)
+		pmm_Free(oldPage);
+	if(slot != SWAP_NO_SLOT)
+	{
+		swap_Free(slot);
+		__sync_fetch_and_add(&vmm_faultStats.swapIns, 1);
+	}
+	return true;
+}
 
 //Prozesse
 
@@ -1349,88 +2519,304 @@ bool vmm_userspacePointerValid(const void *ptr, const size_t size)
 context_t *createContext()
 {
 	context_t *context = malloc(sizeof(context_t));
-	PML4_t *newPML4 = memset(vmm_SysAlloc(1), 0, MM_BLOCK_SIZE);
+	paddr_t pAddress = pmm_Alloc();
+	if(pAddress == 1)
+	{
+		free(context);
+		return NULL;
+	}
+	PML4_t *newPML4 = memset(vmm_PhysToVirt(pAddress), 0, MM_BLOCK_SIZE);
 
 	//Kernel in den Adressraum einbinden
 	PML4_t *PML4 = (PML4_t*)VMM_PML4_ADDRESS;
 
 	uint16_t PML4i;
-	for(PML4i = 0; PML4i < PML4e; PML4i++)
+	for(PML4i = 0; PML4i < PAGE_ENTRIES; PML4i++)
 		if(PG_AVL(PML4->PML4E[PML4i]) == VMM_KERNELSPACE || PG_AVL(PML4->PML4E[PML4i]) == VMM_POINTER_TO_PML4)
 			newPML4->PML4E[PML4i] = PML4->PML4E[PML4i];
 
-	context->physAddress = vmm_getPhysAddress(newPML4);
+	context->physAddress = pAddress;
+	vma_initTree(&context->vmas, USERSPACE_START, USERSPACE_END + 1);
+	context->id = __sync_fetch_and_add(&vmm_nextContextId, 1);
+	context->tlbGeneration = 0;
+	context->tablesLock = 0;
+	context->filemaps = NULL;
+	context->faultNext = 0;
+	context->faultWindow = 0;
+	context->swapHand = USERSPACE_START;
+	context->swapBusy = 0;
+	context->promoteHand = USERSPACE_START;
+	context->residentPages = 0;
+	context->mappedPages = 0;
+	context->tablePages = 1;
+	context->minorFaults = 0;
+	context->majorFaults = 0;
+	context->zeroFillFaults = 0;
 	//Den letzten Eintrag verwenden wir als Zeiger auf den Anfang der Tabelle. Das ermöglicht das Editieren derselben.
 	setPML4Entry(511, newPML4, 1, 1, 0, 1, 0, 0, VMM_POINTER_TO_PML4, 1, (uintptr_t)context->physAddress);
 
 	context->virtualAddress = newPML4;
 
+	//In die Liste für das Auslagern eintragen
+	lock(&vmm_contextsLock);
+	context->prev = NULL;
+	context->next = vmm_contexts;
+	if(vmm_contexts != NULL)
+		vmm_contexts->prev = context;
+	vmm_contexts = context;
+	unlock(&vmm_contextsLock);
+
+	return context;
+}
+
+/*
+ * Kopiert eine PT in einen anderen Kontext. Beschreibbare Pages des Prozesses werden in beiden
+ * Kontexten schreibgeschützt und erst beim ersten Schreiben kopiert (copy-on-write). Ausgelagerte
+ * Pages teilen sich den Slot.
+ */
+static void vmm_clonePT(context_t *context, PT_t *dst, PT_t *src)
+{
+	uint16_t PTi;
+	for(PTi = 0; PTi < PAGE_ENTRIES; PTi++)
+	{
+		uint64_t entry;
+		do
+		{
+			entry = src->PTE[PTi];
+			if(!(entry & PG_P) && (PG_AVL(entry) & VMM_SWAPOUT_PAGE))
+			{
+				//Das Auslagern abbrechen, damit die Page wie alle anderen geteilt werden kann
+				__sync_bool_compare_and_swap(&src->PTE[PTi], entry, (entry & ~PG_AVL_BITS(VMM_SWAPOUT_PAGE)) | PG_P);
+				continue;
+			}
+			if(!(entry & PG_P) && (PG_AVL(entry) & VMM_SWAPPED_PAGE))
+			{
+				//Beide Kontexte lesen denselben Slot beim nächsten Zugriff
+				swap_Retain((entry & PG_ADDRESS) >> 12);
+				break;
+			}
+			if(!(entry & PG_P) || (PG_AVL(entry) & VMM_SHARED_PAGE))
+				break;
+			if(entry & PG_RW)
+			{
+				uint64_t cow = (entry & ~PG_RW) | PG_AVL_BITS(VMM_COW_PAGE);
+				if(!__sync_bool_compare_and_swap(&src->PTE[PTi], entry, cow))
+					continue;
+				entry = cow;
+			}
+			pmm_Retain(entry & PG_ADDRESS);
+			break;
+		}
+		while(true);
+		dst->PTE[PTi] = entry;
+		vmm_accountEntry(context, USERSPACE_START, 0, entry);
+	}
+}
+
+/*
+ * Alloziiert eine leere Tabelle für einen Eintrag der Quelltabelle
+ * Rückgabe:	virtuelle Adresse der Tabelle oder NULL, wenn kein Speicher frei ist
+ */
+static void *vmm_cloneTable(context_t *context, uint64_t *dstEntry, uint64_t srcEntry)
+{
+	paddr_t table = pmm_AllocZeroed();
+	if(table == 1)
+		return NULL;
+	*dstEntry = (srcEntry & ~PG_ADDRESS) | table;
+	vmm_accountTables(context, USERSPACE_START, 1);
+	return vmm_PhysToVirt(table);
+}
+
+/*
+ * Erstellt eine Kopie eines Adressraums. Die Pages des Prozesses werden nicht kopiert, sondern
+ * von beiden Kontexten verwendet, bis einer davon sie beschreibt. Die Tabellen werden über die
+ * Direct Map gelesen. Die Quelle wird exklusiv gesperrt, damit kein Page Fault und kein
+ * vmm_ProtectRange eine Page beschreibbar macht, die gerade geteilt wird.
+ * Parameter:	src = zu kopierender Kontext
+ * Rückgabe:	neuer Kontext oder NULL, wenn zu wenig Speicher vorhanden ist
+ */
+context_t *cloneContext(context_t *src)
+{
+	context_t *context = createContext();
+	if(context == NULL)
+		return NULL;
+
+	PML4_t *srcPML4 = src->virtualAddress;
+	PML4_t *dstPML4 = context->virtualAddress;
+	uint16_t PML4i;
+	vmm_lockTablesExclusive(src, USERSPACE_START);
+	for(PML4i = 1; PML4i < PAGE_ENTRIES - 1; PML4i++)
+	{
+		if(!(srcPML4->PML4E[PML4i] & PG_P) || PG_AVL(srcPML4->PML4E[PML4i]) == VMM_KERNELSPACE)
+			continue;
+
+		uint16_t PDPi;
+		PDP_t *srcPDP = vmm_PhysToVirt(srcPML4->PML4E[PML4i] & PG_ADDRESS);
+		PDP_t *dstPDP = vmm_cloneTable(context, &dstPML4->PML4E[PML4i], srcPML4->PML4E[PML4i]);
+		if(dstPDP == NULL)
+			goto fail_locked;
+		for(PDPi = 0; PDPi < PAGE_ENTRIES; PDPi++)
+		{
+			//Im Userspace gibt es keine 1GB-Pages
+			if(!(srcPDP->PDPE[PDPi] & PG_P) || (srcPDP->PDPE[PDPi] & PG_PS))
+				continue;
+
+			uint16_t PDi;
+			PD_t *srcPD = vmm_PhysToVirt(srcPDP->PDPE[PDPi] & PG_ADDRESS);
+			PD_t *dstPD = vmm_cloneTable(context, &dstPDP->PDPE[PDPi], srcPDP->PDPE[PDPi]);
+			if(dstPD == NULL)
+				goto fail_locked;
+			for(PDi = 0; PDi < PAGE_ENTRIES; PDi++)
+			{
+				//Grosse Pages werden aufgeteilt, damit sie Page für Page kopiert werden können
+				uintptr_t address = ((uint64_t)PML4i << 39) | ((uint64_t)PDPi << 30) | ((uint64_t)PDi << 21);
+				if(PML4i >= PAGE_ENTRIES / 2)
+					address |= 0xFFFF000000000000;
+				if((srcPD->PDE[PDi] & PG_P) && (srcPD->PDE[PDi] & PG_PS) && !vmm_splitLarge(src, address, &srcPD->PDE[PDi]))
+					goto fail_locked;
+				if(!(srcPD->PDE[PDi] & PG_P) || (srcPD->PDE[PDi] & PG_PS))
+					continue;
+
+				PT_t *dstPT = vmm_cloneTable(context, &dstPD->PDE[PDi], srcPD->PDE[PDi]);
+				if(dstPT == NULL)
+					goto fail_locked;
+				vmm_clonePT(context, dstPT, vmm_PhysToVirt(srcPD->PDE[PDi] & PG_ADDRESS));
+			}
+		}
+	}
+
+	vmm_unlockTablesExclusive(src, USERSPACE_START);
+
+	//Die Quelle darf ab jetzt nicht mehr über alte TLB-Einträge in geteilte Pages schreiben
+	vmm_invalidateRange(src, (void*)USERSPACE_START, (USERSPACE_END - USERSPACE_START + 1) / MM_BLOCK_SIZE);
+
+	if(!vma_cloneTree(&context->vmas, &src->vmas) || !filemap_cloneAll(context, src))
+		goto fail;
+
 	return context;
+
+fail_locked:
+	vmm_unlockTablesExclusive(src, USERSPACE_START);
+	vmm_invalidateRange(src, (void*)USERSPACE_START, (USERSPACE_END - USERSPACE_START + 1) / MM_BLOCK_SIZE);
+fail:
+	deleteContext(context);
+	return NULL;
 }
 
 /*
- * Löscht einen virtuellen Adressraum
+ * Löscht einen virtuellen Adressraum. Die Tabellen werden über die Direct Map gelesen.
  */
 void deleteContext(context_t *context)
 {
+	//Aus der Liste für das Auslagern entfernen und warten, bis dort niemand mehr darauf zugreift
+	lock(&vmm_contextsLock);
+	if(context->prev != NULL)
+		context->prev->next = context->next;
+	else
+		vmm_contexts = context->next;
+	if(context->next != NULL)
+		context->next->prev = context->prev;
+	if(vmm_reclaimCursor == context)
+		vmm_reclaimCursor = context->next;
+	if(vmm_promoteCursor == context)
+		vmm_promoteCursor = context->next;
+	unlock(&vmm_contextsLock);
+	while(context->swapBusy)
+		yield();
+
+	//Veränderte Pages gemeinsamer Dateibereiche zurückschreiben, solange sie noch eingeblendet sind
+	filemap_unmapAll(context);
+
 	//Erst alle Pages des Kontextes freigeben
 	PML4_t *PML4 = context->virtualAddress;
 	uint16_t PML4i;
 	for(PML4i = 1; PML4i < PAGE_ENTRIES - 1; PML4i++)
 	{
-		//Ist der Eintrag gültig
-		if(PML4->PML4E[PML4i] & PG_P)
+		//Ist der Eintrag gültig und gehört nicht zum Kernel
+		if((PML4->PML4E[PML4i] & PG_P) && PG_AVL(PML4->PML4E[PML4i]) != VMM_KERNELSPACE)
 		{
 			uint16_t PDPi;
-			//PDP mappen
-			PDP_t *PDP = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-			vmm_Map(PDP, PML4->PML4E[PML4i], VMM_FLAGS_NX, VMM_KERNELSPACE);
+			PDP_t *PDP = vmm_PhysToVirt(PML4->PML4E[PML4i] & PG_ADDRESS);
 			for(PDPi = 0; PDPi < PAGE_ENTRIES; PDPi++)
 			{
 				//Ist der Eintrag gültig
-				if(PDP->PDPE[PDPi] & PG_P)
+				if((PDP->PDPE[PDPi] & PG_P) && !(PDP->PDPE[PDPi] & PG_PS))
 				{
 					uint16_t PDi;
-					//PD mappen
-					PD_t *PD = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-					vmm_Map(PD, PDP->PDPE[PDPi], VMM_FLAGS_NX, VMM_KERNELSPACE);
+					PD_t *PD = vmm_PhysToVirt(PDP->PDPE[PDPi] & PG_ADDRESS);
 					for(PDi = 0; PDi < PAGE_ENTRIES; PDi++)
 					{
 						//Ist der Eintrag gültig
-						if(PD->PDE[PDi] & PG_P)
+						if((PD->PDE[PDi] & PG_P) && !(PD->PDE[PDi] & PG_PS))
 						{
 							uint16_t PTi;
-							//PT mappen
-							PT_t *PT = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, 1);
-							vmm_Map(PT, PD->PDE[PDi], VMM_FLAGS_NX, VMM_KERNELSPACE);
+							PT_t *PT = vmm_PhysToVirt(PD->PDE[PDi] & PG_ADDRESS);
 							for(PTi = 0; PTi < PAGE_ENTRIES; PTi++)
 							{
-								//Ist die Page alloziiert
-								if(PT->PTE[PTi] & PG_P)
-									pmm_Free(PT->PTE[PTi] & PG_ADDRESS);
+								uint64_t entry = PT->PTE[PTi];
+								//Ist die Page alloziiert und gehört dem Prozess
+								if((entry & PG_P) && !(PG_AVL(entry) & VMM_SHARED_PAGE))
+									pmm_Free(entry & PG_ADDRESS);
+								else if(!(entry & PG_P) && (PG_AVL(entry) & VMM_SWAPPED_PAGE))
+									swap_Free((entry & PG_ADDRESS) >> 12);
 							}
 							//PT löschen
-							vmm_SysFree(PT, 1);
+							pmm_Free(PD->PDE[PDi] & PG_ADDRESS);
+						}
+						else if(PD->PDE[PDi] & PG_P)
+						{
+							//Grosse Page
+							vmm_freeLarge(PD->PDE[PDi] & PG_ADDRESS_2M);
 						}
 					}
 					//PD löschen
-					vmm_SysFree(PD, 1);
+					pmm_Free(PDP->PDPE[PDPi] & PG_ADDRESS);
 				}
 			}
 			//PDP löschen
-			vmm_SysFree(PDP, 1);
+			pmm_Free(PML4->PML4E[PML4i] & PG_ADDRESS);
 		}
 	}
 
 	//Restliche Datenstrukturen freigeben
-	vmm_SysFree(context->virtualAddress, 1);
+	vma_destroyTree(&context->vmas);
+	pmm_Free(context->physAddress);
 	free(context);
 }
 
 /*
- * Aktiviert einen virtuellen Adressraum
+ * Aktiviert einen virtuellen Adressraum. Mit PCIDs bleiben die TLB-Einträge des Kontextes
+ * erhalten, solange seit dem letzten Aktivieren auf dieser CPU keine Mappings entfernt wurden.
+ * Muss mit deaktivierten Interrupts aufgerufen werden.
  */
 inline void activateContext(context_t *context)
 {
-	asm volatile("mov %0,%%cr3" : : "r"(context->physAddress));
+	uint64_t cr3 = context->physAddress;
+
+	if(cpuInfo.pcid)
+	{
+		vmm_pcids_t *pcids = &vmm_pcids[cpu_getId()];
+		uint64_t generation = context->tlbGeneration;
+		uint8_t slot;
+
+		for(slot = 0; slot < VMM_PCID_SLOTS; slot++)
+			if(pcids->slots[slot].contextId == context->id)
+				break;
+
+		if(slot == VMM_PCID_SLOTS)
+		{
+			//Die älteste Zuordnung ersetzen. Die PCID wird beim Laden von CR3 geleert.
+			slot = pcids->next;
+			pcids->next = (pcids->next + 1) % VMM_PCID_SLOTS;
+			pcids->slots[slot].contextId = context->id;
+		}
+		else if(pcids->slots[slot].tlbGeneration == generation)
+		{
+			cr3 |= VMM_CR3_NOFLUSH;
+		}
+		pcids->slots[slot].tlbGeneration = generation;
+		cr3 |= slot + 1;
+	}
+
+	asm volatile("mov %0,%%cr3" : : "r"(cr3) : "memory");
 }
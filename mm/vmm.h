@@ -14,6 +14,8 @@
 #include "stdbool.h"
 #include "stddef.h"
 #include "list.h"
+#include "memory.h"
+#include "vma.h"
 
 #define VMM_FLAGS_WRITE		(1 << 0)	//Wenn gesetzt, dann kann auf die Page auch geschrieben werden ansonsten nur lesen
 #define VMM_FLAGS_GLOBAL	(1 << 1)	//Bestimmt, ob die Page global ist
@@ -23,13 +25,50 @@
 #define VMM_FLAGS_NO_CACHE	(1 << 5)	//Bestimmt, ob die Page nicht gecacht werden soll
 
 #define VMM_UNUSED_PAGE		0x4		//Marks page as unused by process
+#define VMM_SHARED_PAGE		0x8		//Page gehört nicht dem Prozess und wird beim Entfernen nicht freigegeben
+#define VMM_COW_PAGE		0x20	//Beschreibbare Page, die mit einem anderen Kontext geteilt und beim Schreiben kopiert wird
+#define VMM_SWAPPED_PAGE	0x40	//Page ist ausgelagert, die Adresse enthält die Nummer des Slots
+#define VMM_SWAPOUT_PAGE	0x80	//Page wird gerade ausgelagert oder verschoben, ein Zugriff bricht das ab
 
-typedef struct{
+typedef struct context{
 	paddr_t physAddress;
 	void *virtualAddress;
+	vma_tree_t vmas;			//Belegte Bereiche im Userspace
+	uint64_t id;				//Eindeutige Nummer, über die der Kontext einer PCID zugeordnet wird
+	volatile uint64_t tlbGeneration;	//Wird erhöht, wenn Mappings im Userspace entfernt werden
+	volatile uint64_t tablesLock;	//Anzahl Benutzer der Tabellen, das oberste Bit sperrt exklusiv
+	struct filemap *filemaps;	//Bereiche, die aus Dateien gefüllt werden
+	uintptr_t faultNext;		//Erste Page nach dem zuletzt bei einem Page Fault gefüllten Fenster
+	size_t faultWindow;			//Aktuelle Grösse des Fensters in Pages
+	struct context *prev, *next;	//Liste aller Kontexte des Userspaces, die ausgelagert werden können
+	uintptr_t swapHand;			//Nächste Adresse, die beim Auslagern geprüft wird
+	volatile uint32_t swapBusy;	//Anzahl laufender Auslagerungen aus diesem Kontext
+	uintptr_t promoteHand;		//Nächste Adresse, ab der PTs zu grossen Pages zusammengefasst werden
+	//Speicherverbrauch des Userspaces, wird bei jeder Änderung eines Eintrags nachgeführt
+	volatile uint64_t residentPages;	//Pages, die im phys. Speicher liegen
+	volatile uint64_t mappedPages;		//Belegte Pages inkl. unbenutzter und ausgelagerter
+	volatile uint64_t tablePages;		//Pages für Page-Tabellen
+	volatile uint64_t minorFaults;		//Übrige behandelte Page Faults
+	volatile uint64_t majorFaults;		//Page Faults, die aus dem Auslagerungsbereich gelesen haben
+	volatile uint64_t zeroFillFaults;	//Page Faults, die eine anonyme Page mit Nullen angelegt haben
 }context_t;
 
+//Zähler für die Behandlung von Page Faults auf unbenutzte Pages
+typedef struct{
+	uint64_t faults;			//Page Faults auf anonyme, unbenutzte Pages
+	uint64_t sequentialFaults;	//Davon direkt nach dem vorherigen Fenster
+	uint64_t faultAroundPages;	//Zusätzlich gefüllte Pages
+	uint64_t swapIns;			//Aus dem Auslagerungsbereich gelesene Pages
+	uint64_t swapOuts;			//Ausgelagerte Pages
+	uint64_t largeFaults;		//Page Faults, die mit einer grossen Page gefüllt wurden
+	uint64_t largePromotions;	//PTs, die zu einer grossen Page zusammengefasst wurden
+	uint64_t largeSplits;		//Grosse Pages, die in einzelne Pages aufgeteilt wurden
+}vmm_faultStats_t;
+
+extern bool vmm_directMapReady;
+
 bool vmm_Init();									//Initialisiert virtuelle Speicherverw.
+bool vmm_InitDirectMap();							//Mappt den phys. Speicher in die Direct Map
 void *vmm_Alloc(size_t Size);						//Reserviert eine virtuelle Speicherst.
 void vmm_Free(void *Address, size_t Size);		//Gibt eine Speicherstelle frei
 
@@ -37,25 +76,49 @@ void *vmm_SysAlloc(size_t Length);
 void vmm_SysFree(void *vAddress, size_t Length);
 
 void *vmm_AllocDMA(paddr_t maxAddress, size_t Size, paddr_t *Phys);
+void vmm_FreeDMA(void *vAddress, size_t Size);
 list_t vmm_getTables(context_t *context);
 
 uint8_t vmm_Map(void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t avl);
+uint8_t vmm_MapLarge(void *vAddress, paddr_t pAddress, size_t size, uint8_t flags, uint16_t avl);
 
 void *getFreePages(void *start, void *end, size_t pages);
 
 paddr_t vmm_getPhysAddress(void *virtualAddress);
 uint8_t vmm_ReMap(context_t *src_context, void *src, context_t *dst_context, void *dst, size_t length, uint8_t flags, uint16_t avl);
-uint8_t vmm_ContextMap(context_t *context, void *vAddress, paddr_t pAddress, uint8_t flags, uint16_t avl);
-uint8_t vmm_ContextUnMap(context_t *context, void *vAddress, bool free_page);
+
+uint8_t vmm_MapRange(context_t *context, void *vAddress, paddr_t pAddress, size_t pages, uint8_t flags, uint16_t avl);
+void vmm_UnMapRange(context_t *context, void *vAddress, size_t pages, bool free_pages);
+void vmm_ProtectRange(context_t *context, void *vAddress, size_t pages, uint8_t flags);
+bool vmm_clearDirty(context_t *context, void *vAddress, paddr_t *pAddress);
+uint8_t vmm_MoveRange(context_t *src_context, void *src, context_t *dst_context, void *dst, size_t pages, uint8_t flags, uint16_t avl);
 
 bool vmm_getPageStatus(void *Address);
 
 void vmm_unusePages(void *virt, size_t pages);
 void vmm_usePages(void *virt, size_t pages);
+bool vmm_handlePageFault(void *address, bool write, bool user);
+void vmm_getFaultStats(vmm_faultStats_t *stats);
+size_t vmm_reclaim(size_t pages);
+bool vmm_migrateRange(paddr_t start, size_t pages);
+bool vmm_promoteLarge(void);
 
 bool vmm_userspacePointerValid(const void *ptr, const size_t size);
 
+//Gibt die Adresse einer phys. Speicherstelle in der Direct Map zurück
+static inline void *vmm_PhysToVirt(paddr_t pAddress)
+{
+	return (void*)(DIRECTMAP_START + pAddress);
+}
+
+//Gibt zurück, ob eine Adresse in der Direct Map liegt
+static inline bool vmm_isDirectMapped(const void *vAddress)
+{
+	return DIRECTMAP_START <= (uintptr_t)vAddress && (uintptr_t)vAddress <= DIRECTMAP_END;
+}
+
 context_t *createContext(void);
+context_t *cloneContext(context_t *src);
 void deleteContext(context_t *context);
 void activateContext(context_t *context);
 
@@ -9,10 +9,10 @@
 
 #include "pit.h"
 #include "util.h"
-#include "list.h"
-#include "stdlib.h"
+#include "stddef.h"
 #include "scheduler.h"
 #include "lock.h"
+#include "cpu.h"
 
 #define CH0		0x40
 #define CH1		0x41
@@ -22,20 +22,242 @@
 
 #define FRQB	1193182
 
-typedef struct{
-	thread_t *thread;
-	uint64_t timeout;
-}timer_t;
+//Hierarchisches Timerrad: Stufe n hat 64 Slots zu je 64^n ms. Ein Timer liegt in
+//der untersten Stufe, deren Reichweite für ihn ausreicht, und wird beim Erreichen
+//seines Slots eine Stufe tiefer eingeordnet.
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_RANGE		(1ul << (WHEEL_BITS * WHEEL_LEVELS))	//ca. 4.6 Stunden, längere Timer werden mehrmals eingeordnet
 
-static list_t Timerlist;
-static lock_t Timerlist_lock = LOCK_UNLOCKED;
+static thread_timer_t *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_used[WHEEL_LEVELS];		//Bit n ist gesetzt, wenn wheel[level][n] nicht leer ist
+static uint64_t wheel_time;						//Bis zu diesem Zeitpunkt sind alle Timer abgearbeitet
+static size_t wheel_count;
+static lock_t wheel_lock = LOCK_UNLOCKED;
+static volatile uint64_t nextTimeout = -1ul;	//Zeitpunkt, an dem das Rad das nächste Mal weitergedreht werden muss
+
+bool pit_tickless = false;
+static volatile uint64_t ticks;				//Anzahl Interrupts des PIT im periodischen Modus (ms)
+static uint64_t tsc_base, tsc_perMs;		//TSC beim Stoppen des PIT und Frequenz des TSC
+static uint64_t uptime_base;				//Uptime beim Stoppen des PIT
 
 void pit_Init(uint32_t freq)
 {
 	pit_InitChannel(0, 2, (uint64_t)(FRQB / freq));
 
-	Timerlist = NULL;
-	Uptime = 0;
+	ticks = 0;
+}
+
+/*
+ * Misst die Frequenz des TSC und stoppt danach den periodischen Interrupt des PIT.
+ * Die Zeit wird ab dann über den TSC bestimmt, die Timer müssen über
+ * pit_RunTimers() abgearbeitet werden. Interrupts müssen aktiviert sein.
+ *
+ * Rückgabe:	true, wenn der PIT gestoppt wurde. Ohne konstanten TSC läuft er weiter.
+ */
+bool pit_EnableTickless()
+{
+	uint64_t start, tsc;
+
+	if(!cpuInfo.invariantTSC)
+		return false;
+
+	//Auf den Anfang einer ms warten, damit die Messung genauer wird
+	start = ticks;
+	while(ticks == start) asm volatile("hlt");
+	tsc = cpu_readTSC();
+	start = ticks;
+	while(ticks - start < 10) asm volatile("hlt");
+	tsc_perMs = (cpu_readTSC() - tsc) / 10;
+	if(tsc_perMs == 0)
+		return false;
+
+	bool enabled = cpu_disableInterrupts();
+	tsc_base = cpu_readTSC();
+	uptime_base = ticks;
+	pit_tickless = true;
+	//Im Modus 0 löst der PIT nur noch einen einzigen Interrupt aus
+	pit_InitChannel(0, 0, 0);
+	cpu_restoreInterrupts(enabled);
+
+	return true;
+}
+
+/*
+ * Gibt die Zeit seit dem Starten des Computers zurück
+ *
+ * Rückgabe:	Zeit in Millisekunden
+ */
+uint64_t pit_getUptime()
+{
+	if(!pit_tickless)
+		return ticks;
+
+	//Die TSCs der CPUs können minimal voneinander abweichen
+	uint64_t tsc = cpu_readTSC();
+	if(tsc < tsc_base)
+		tsc = tsc_base;
+	return uptime_base + (tsc - tsc_base) / tsc_perMs;
+}
+
+/*
+ * Gibt den Zeitpunkt zurück, an dem der nächste Timer abläuft. Für lange Timer
+ * kann das auch der Zeitpunkt sein, an dem sie im Rad neu eingeordnet werden.
+ *
+ * Rückgabe:	Uptime in ms, bei der pit_RunTimers() aufgerufen werden muss oder -1
+ */
+uint64_t pit_NextTimeout()
+{
+	return nextTimeout;
+}
+
+/*
+ * Fügt einen Timer in das Rad ein. wheel_lock muss gesperrt sein.
+ */
+static void wheel_insert(thread_timer_t *timer)
+{
+	uint64_t expires = timer->expires;
+	uint64_t delta;
+	uint8_t level = 0;
+
+	if(expires <= wheel_time)
+		expires = wheel_time + 1;
+	delta = expires - wheel_time;
+	if(delta >= WHEEL_RANGE)
+	{
+		delta = WHEEL_RANGE - 1;
+		expires = wheel_time + delta;
+	}
+	while(delta >= 1ul << (WHEEL_BITS * (level + 1)))
+		level++;
+
+	uint8_t index = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	thread_timer_t **slot = &wheel[level][index];
+	timer->next = *slot;
+	if(timer->next != NULL)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+	timer->slot = level * WHEEL_SIZE + index;
+	wheel_used[level] |= 1ul << index;
+	wheel_count++;
+}
+
+/*
+ * Entfernt einen Timer aus dem Rad. wheel_lock muss gesperrt sein.
+ */
+static void wheel_remove(thread_timer_t *timer)
+{
+	uint8_t level = timer->slot / WHEEL_SIZE;
+	uint8_t index = timer->slot % WHEEL_SIZE;
+
+	*timer->pprev = timer->next;
+	if(timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+	if(wheel[level][index] == NULL)
+		wheel_used[level] &= ~(1ul << index);
+	wheel_count--;
+}
+
+/*
+ * Nimmt alle Timer aus einem Slot. wheel_lock muss gesperrt sein.
+ */
+static thread_timer_t *wheel_takeSlot(uint8_t level, uint8_t index)
+{
+	thread_timer_t *timers = wheel[level][index];
+	thread_timer_t *timer;
+
+	wheel[level][index] = NULL;
+	wheel_used[level] &= ~(1ul << index);
+	//pprev bleibt gesetzt, bis der Timer neu eingeordnet oder abgelaufen ist,
+	//damit pit_TimerExpired() zwischendurch nichts Falsches meldet
+	for(timer = timers; timer != NULL; timer = timer->next)
+		wheel_count--;
+	return timers;
+}
+
+/*
+ * Bestimmt den nächsten Zeitpunkt nach wheel_time, an dem ein Slot abgearbeitet
+ * werden muss. wheel_lock muss gesperrt sein.
+ */
+static uint64_t wheel_nextEvent(void)
+{
+	uint64_t next = -1ul;
+	uint8_t level;
+
+	if(wheel_count == 0)
+		return next;
+
+	for(level = 0; level < WHEEL_LEVELS; level++)
+	{
+		uint64_t used = wheel_used[level];
+		if(used == 0)
+			continue;
+
+		//Ersten belegten Slot ab dem nächsten Block dieser Stufe suchen
+		uint8_t shift = WHEEL_BITS * level;
+		uint64_t block = (wheel_time >> shift) + 1;
+		uint8_t start = block & WHEEL_MASK;
+		if(start)
+			used = (used >> start) | (used << (WHEEL_SIZE - start));
+		uint64_t time = (block + __builtin_ctzl(used)) << shift;
+		if(time < next)
+			next = time;
+	}
+	return next;
+}
+
+/*
+ * Dreht das Rad bis now weiter, ordnet die Timer der höheren Stufen neu ein und
+ * weckt die Threads der abgelaufenen Timer auf. Leere Bereiche werden übersprungen.
+ * wheel_lock muss gesperrt sein.
+ */
+static void wheel_advance(uint64_t now)
+{
+	thread_timer_t *timer, *next;
+	uint8_t level;
+
+	while(wheel_time < now)
+	{
+		uint64_t time = wheel_nextEvent();
+		if(time > now)
+		{
+			wheel_time = now;
+			break;
+		}
+		wheel_time = time;
+
+		//Beginnt ein neuer Block einer höheren Stufe, werden dessen Timer neu eingeordnet
+		for(level = 1; level < WHEEL_LEVELS; level++)
+		{
+			uint8_t shift = WHEEL_BITS * level;
+			if(wheel_time & ((1ul << shift) - 1))
+				break;
+			for(timer = wheel_takeSlot(level, (wheel_time >> shift) & WHEEL_MASK); timer; timer = next)
+			{
+				next = timer->next;
+				wheel_insert(timer);
+			}
+		}
+
+		for(timer = wheel_takeSlot(0, wheel_time & WHEEL_MASK); timer; timer = next)
+		{
+			next = timer->next;
+			thread_t *thread = (thread_t*)((uintptr_t)timer - offsetof(thread_t, timer));
+			if(timer->expires > wheel_time)
+			{
+				wheel_insert(timer);
+				continue;
+			}
+			timer->pprev = NULL;
+			//Konnte der Thread nicht eingereiht werden, wird es in der nächsten ms nochmals versucht
+			if(!thread_try_unblock(thread))
+				wheel_insert(timer);
+		}
+	}
 }
 
 void pit_InitChannel(uint8_t channel, uint8_t mode, uint16_t data)
@@ -46,39 +268,59 @@ void pit_InitChannel(uint8_t channel, uint8_t mode, uint16_t data)
 	outb(CH_BASE + channel, data >> 8);
 }
 
-//Registriert einen Timer
-void pit_RegisterTimer(thread_t *thread, uint64_t msec)
+static void pit_AddTimer(thread_timer_t *timer, uint64_t msec)
 {
-	if(msec != 0)
-	{
-		timer_t *Timer;
-		size_t i;
-		uint64_t t;
+	uint64_t t, now = pit_getUptime();
+	bool earlier;
 
-		Timer = malloc(sizeof(timer_t));
+	bool enabled = cpu_disableInterrupts();
+	lock(&wheel_lock);
 
-		Timer->thread = thread;
-		Timer->timeout = ((t = Uptime + msec) < Uptime) ? -1ul : t;
+	if(timer->pprev != NULL)
+		wheel_remove(timer);
+	//Ein leeres Rad muss nicht mehr weitergedreht werden
+	if(wheel_count == 0 && now > wheel_time)
+		wheel_time = now;
 
-		lock(&Timerlist_lock);
-		if(Timerlist == NULL)
-			Timerlist = list_create();
+	timer->expires = ((t = now + msec) < now) ? -1ul : t;
+	wheel_insert(timer);
 
-		//Timerliste sortiere, sodass das Element vorne immer das Element ist, welches
-		//zuerst abläuft
-		timer_t *item;
-		for(i = 0; (item = list_get(Timerlist, i)); i++)
-		{
-			if(item->timeout > Timer->timeout)
-				break;
-		}
+	t = wheel_nextEvent();
+	earlier = t < nextTimeout;
+	nextTimeout = t;
 
-		list_insert(Timerlist, i, Timer);
+	unlock(&wheel_lock);
+	cpu_restoreInterrupts(enabled);
 
-		unlock(&Timerlist_lock);
+	//Der Timer muss früher als bisher geplant abgearbeitet werden
+	if(earlier)
+		scheduler_TimerChanged();
+}
+
+static bool pit_TimerExpired(void *timer)
+{
+	return ((thread_timer_t*)timer)->pprev == NULL;
+}
 
-		//Entsprechenden Thread schlafen legen
-		thread_block_self(NULL, NULL, THREAD_BLOCKED_WAIT_TIMER);
+/*
+ * Legt den aktuellen Thread für msec Millisekunden schlafen
+ *
+ * Parameter:	thread = aktueller Thread
+ * 				msec = Anzahl Millisekunden
+ */
+void pit_RegisterTimer(thread_t *thread, uint64_t msec)
+{
+	if(msec != 0)
+	{
+		pit_AddTimer(&thread->timer, msec);
+
+		//Der Timer kann schon ablaufen, bevor der Thread blockiert ist
+		while(!pit_TimerExpired(&thread->timer))
+		{
+			if(!thread_block_self_unless(pit_TimerExpired, &thread->timer, THREAD_BLOCKED_WAIT_TIMER))
+				break;
+		}
+		pit_CancelTimeout(&thread->timer);
 	}
 	else
 	{
@@ -87,28 +329,64 @@ void pit_RegisterTimer(thread_t *thread, uint64_t msec)
 	}
 }
 
-void pit_Handler(void)
+/*
+ * Registriert einen Timeout, der den Thread nach msec Millisekunden aufweckt, ohne
+ * ihn schlafen zu legen. Der Timeout muss mit pit_CancelTimeout() wieder entfernt
+ * werden, auch wenn er schon abgelaufen ist.
+ *
+ * Parameter:	thread = Thread, der aufgeweckt werden soll
+ * 				msec = Anzahl Millisekunden bis zum Aufwecken
+ * Rückgabewert:	Handle für pit_CancelTimeout()
+ */
+void *pit_RegisterTimeout(thread_t *thread, uint64_t msec)
 {
-	timer_t *Timer;
-	size_t i = 0;
-	Uptime++;
-	if(Timerlist)
+	pit_AddTimer(&thread->timer, msec);
+	return &thread->timer;
+}
+
+/*
+ * Entfernt einen mit pit_RegisterTimeout() registrierten Timeout
+ *
+ * Parameter:	timeout = Handle von pit_RegisterTimeout()
+ */
+void pit_CancelTimeout(void *timeout)
+{
+	thread_timer_t *timer = timeout;
+
+	bool enabled = cpu_disableInterrupts();
+	lock(&wheel_lock);
+	if(timer->pprev != NULL)
 	{
-		if(try_lock(&Timerlist_lock))
-		{
-			while((Timer = list_get(Timerlist, i)))
-			{
-				if(Timer->timeout > Uptime)
-					break;
-				if(thread_try_unblock(Timer->thread))
-					free(list_remove(Timerlist, i));
-				else
-					break;
-				i++;
-			}
-			unlock(&Timerlist_lock);
-		}
+		wheel_remove(timer);
+		nextTimeout = wheel_nextEvent();
 	}
+	unlock(&wheel_lock);
+	cpu_restoreInterrupts(enabled);
+}
+
+/*
+ * Weckt die Threads auf, deren Timer abgelaufen sind
+ */
+void pit_RunTimers(void)
+{
+	uint64_t now = pit_getUptime();
+
+	if(now < nextTimeout)
+		return;
+
+	bool enabled = cpu_disableInterrupts();
+	lock(&wheel_lock);
+	wheel_advance(now);
+	nextTimeout = wheel_nextEvent();
+	unlock(&wheel_lock);
+	cpu_restoreInterrupts(enabled);
+}
+
+void pit_Handler(void)
+{
+	if(!pit_tickless)
+		ticks++;
+	pit_RunTimers();
 }
 
 #endif
@@ -11,12 +11,19 @@
 #define PIT_H_
 
 #include "stdint.h"
+#include "stdbool.h"
 #include "thread.h"
 
-volatile uint64_t Uptime;						//Zeit in Milisekunden seit dem Starten des Computers
+extern bool pit_tickless;						//Der PIT ist gestoppt, die Zeit wird über den TSC gemessen
 
 void pit_Init(uint32_t freq);
+bool pit_EnableTickless(void);
+uint64_t pit_getUptime(void);
+uint64_t pit_NextTimeout(void);
+void pit_RunTimers(void);
 void pit_RegisterTimer(thread_t *thread, uint64_t msec);
+void *pit_RegisterTimeout(thread_t *thread, uint64_t msec);
+void pit_CancelTimeout(void *timeout);
 void pit_InitChannel(uint8_t channel, uint8_t mode, uint16_t data);
 
 #endif /* PIT_H_ */
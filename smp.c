@@ -0,0 +1,452 @@
+/*
+ * smp.c
+ *
+ *  Created on: 17.10.2026
+ */
+
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "tss.h"
+#include "isr.h"
+#include "syscalls.h"
+#include "scheduler.h"
+#include "memory.h"
+#include "mm.h"
+#include "vmm.h"
+#include "paging.h"
+#include "pit.h"
+#include "util.h"
+#include "display.h"
+#include "string.h"
+#include "stdio.h"
+#include "lock.h"
+
+#define SMP_TRAMPOLINE		0x8000		//Hier starten die APs im Real Mode (4kB ausgerichtet, unter 1MB)
+#define SMP_TRAMPOLINE_PML4	0x9000		//Vorübergehende Pagetabellen für den Wechsel in den Long Mode
+#define SMP_TRAMPOLINE_PDP	0xA000
+#define SMP_TRAMPOLINE_PD	0xB000
+#define SMP_TRAMPOLINE_PT	0xC000
+#define SMP_AP_STACK_PAGES	2			//Grösse des Stacks, mit dem eine AP startet
+#define SMP_AP_TIMEOUT		100			//ms, die auf den Start einer AP gewartet wird
+
+//Virtuelle Adressen der Tabellen
+#define VMM_PML4_ADDRESS		0xFFFFFFFFFFFFF000
+#define VMM_PDP_ADDRESS			0xFFFFFFFFFFE00000
+#define VMM_PD_ADDRESS			0xFFFFFFFFC0000000
+#define VMM_PT_ADDRESS			0xFFFFFF8000000000
+
+#define ACPI_MADT_LAPIC			0
+#define ACPI_MADT_LAPIC_ENABLED	(1 << 0)
+
+#define APIC_IPI_INIT			0x4500
+#define APIC_IPI_STARTUP		0x4600
+
+typedef struct{
+	char signature[8];
+	uint8_t checksum;
+	char oem[6];
+	uint8_t revision;
+	uint32_t rsdt;
+	//Ab Revision 2
+	uint32_t length;
+	uint64_t xsdt;
+	uint8_t extChecksum;
+	uint8_t reserved[3];
+}__attribute__((packed)) acpi_rsdp_t;
+
+typedef struct{
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[6];
+	char oemTable[8];
+	uint32_t oemRevision;
+	uint32_t creator;
+	uint32_t creatorRevision;
+}__attribute__((packed)) acpi_header_t;
+
+typedef struct{
+	acpi_header_t header;
+	uint32_t lapicAddress;
+	uint32_t flags;
+	uint8_t entries[];
+}__attribute__((packed)) acpi_madt_t;
+
+typedef struct{
+	uint8_t type;
+	uint8_t length;
+	uint8_t processor;
+	uint8_t apicId;
+	uint32_t flags;
+}__attribute__((packed)) acpi_madt_lapic_t;
+
+//Datenbereich am Ende des Trampolins (siehe smp_trampoline.S)
+typedef struct{
+	uint32_t cr3;
+	uint32_t efer;
+	uint64_t stack;
+	uint64_t entry;
+	uint64_t kernelCR3;
+}__attribute__((packed)) smp_trampoline_data_t;
+
+extern uint8_t smp_trampoline_start, smp_trampoline_data, smp_trampoline_end;
+extern void smp_apEntry(void);
+extern context_t kernel_context;
+
+volatile uint32_t smp_cpuCount = 1;
+static volatile uint32_t smp_onlineMask = 1;	//Bit n ist gesetzt, wenn CPU n läuft
+static uint8_t smp_apicIds[CPU_MAX];
+
+//Übergabe an die gerade startende AP
+static volatile uint32_t smp_bootingCPU;
+static volatile bool smp_bootDone;
+
+//Laufender TLB-Shootdown
+static lock_t tlb_lock = LOCK_UNLOCKED;
+static void *volatile tlb_address;
+static volatile size_t tlb_pages;
+static volatile uint32_t tlb_pending;			//CPUs, die den Bereich noch nicht invalidiert haben
+
+/*
+ * Blendet einen physischen Speicherbereich in den Kernelspace ein
+ * Parameter:	address = physische Adresse
+ * 				size = Grösse des Bereichs
+ * Rückgabe:	virtuelle Adresse des Bereichs oder NULL
+ */
+static void *smp_mapPhysical(paddr_t address, size_t size)
+{
+	paddr_t start = address & ~(paddr_t)(MM_BLOCK_SIZE - 1);
+	size_t pages = (address - start + size + MM_BLOCK_SIZE - 1) / MM_BLOCK_SIZE;
+	size_t i;
+
+	//Was in der Direct Map liegt, muss nicht extra gemappt werden
+	if(address + size <= pmm_getMaxAddress())
+		return vmm_PhysToVirt(address);
+
+	void *virt = getFreePages((void*)KERNELSPACE_START, (void*)KERNELSPACE_END, pages);
+	if(virt == NULL)
+		return NULL;
+
+	for(i = 0; i < pages; i++)
+		vmm_Map(virt + i * MM_BLOCK_SIZE, start + i * MM_BLOCK_SIZE, VMM_FLAGS_GLOBAL | VMM_FLAGS_NX, 0);
+
+	return virt + (address - start);
+}
+
+static bool acpi_checksum(const void *table, size_t length)
+{
+	const uint8_t *bytes = table;
+	uint8_t sum = 0;
+	size_t i;
+
+	for(i = 0; i < length; i++)
+		sum += bytes[i];
+	return sum == 0;
+}
+
+/*
+ * Sucht den RSDP in einem physischen Speicherbereich
+ */
+static acpi_rsdp_t *acpi_searchRSDP(paddr_t start, size_t length)
+{
+	uint8_t *area = smp_mapPhysical(start, length);
+	size_t i;
+
+	if(area == NULL)
+		return NULL;
+
+	for(i = 0; i + sizeof(acpi_rsdp_t) <= length; i += 16)
+	{
+		acpi_rsdp_t *rsdp = (acpi_rsdp_t*)(area + i);
+		if(memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum(rsdp, 20))
+			return rsdp;
+	}
+	return NULL;
+}
+
+/*
+ * Blendet eine ACPI-Tabelle vollständig ein
+ */
+static acpi_header_t *acpi_mapTable(paddr_t address)
+{
+	acpi_header_t *header = smp_mapPhysical(address, sizeof(acpi_header_t));
+	if(header == NULL)
+		return NULL;
+
+	header = smp_mapPhysical(address, header->length);
+	if(header == NULL || !acpi_checksum(header, header->length))
+		return NULL;
+	return header;
+}
+
+/*
+ * Sucht die MADT über RSDT bzw. XSDT
+ */
+static acpi_madt_t *acpi_findMADT(void)
+{
+	acpi_rsdp_t *rsdp;
+	acpi_header_t *sdt;
+	size_t entries, i;
+
+	//Der RSDP liegt in den ersten 1kB der EBDA oder im BIOS-Bereich
+	uint16_t *ebda = smp_mapPhysical(0x40E, sizeof(uint16_t));
+	rsdp = (ebda != NULL && *ebda) ? acpi_searchRSDP((paddr_t)*ebda << 4, 1024) : NULL;
+	if(rsdp == NULL)
+		rsdp = acpi_searchRSDP(0xE0000, 0x20000);
+	if(rsdp == NULL)
+		return NULL;
+
+	bool xsdt = rsdp->revision >= 2 && rsdp->xsdt != 0;
+	sdt = acpi_mapTable(xsdt ? rsdp->xsdt : rsdp->rsdt);
+	if(sdt == NULL)
+		return NULL;
+
+	entries = (sdt->length - sizeof(acpi_header_t)) / (xsdt ? sizeof(uint64_t) : sizeof(uint32_t));
+	for(i = 0; i < entries; i++)
+	{
+		void *pointers = (void*)sdt + sizeof(acpi_header_t);
+		paddr_t address = xsdt ? ((uint64_t*)pointers)[i] : ((uint32_t*)pointers)[i];
+		acpi_header_t *table = smp_mapPhysical(address, sizeof(acpi_header_t));
+		if(table != NULL && memcmp(table->signature, "APIC", 4) == 0)
+			return (acpi_madt_t*)acpi_mapTable(address);
+	}
+	return NULL;
+}
+
+/*
+ * Ermittelt die APIC-IDs aller CPUs. Die BSP bekommt die Nummer 0.
+ * Rückgabe:	Anzahl gefundener CPUs
+ */
+static uint32_t smp_findCPUs(void)
+{
+	acpi_madt_t *madt = acpi_findMADT();
+	uint8_t bsp = apic_getId();
+	uint32_t count = 1;
+	size_t offset;
+
+	smp_apicIds[0] = bsp;
+	if(madt == NULL)
+		return count;
+
+	for(offset = sizeof(acpi_madt_t); offset + 2 <= madt->header.length;)
+	{
+		acpi_madt_lapic_t *entry = (acpi_madt_lapic_t*)((void*)madt + offset);
+		if(entry->length == 0)
+			break;
+
+		if(entry->type == ACPI_MADT_LAPIC && (entry->flags & ACPI_MADT_LAPIC_ENABLED)
+				&& entry->apicId != bsp && count < CPU_MAX)
+			smp_apicIds[count++] = entry->apicId;
+
+		offset += entry->length;
+	}
+	return count;
+}
+
+/*
+ * Baut die Pagetabellen für das Trampolin auf. Sie entsprechen denen des Kernels,
+ * nur die Page des Trampolins ist ausführbar, und die PML4 liegt unter 4GB.
+ */
+static void smp_prepareTables(void)
+{
+	PML4_t *PML4 = (PML4_t*)SMP_TRAMPOLINE_PML4;
+	PDP_t *PDP = (PDP_t*)SMP_TRAMPOLINE_PDP;
+	PD_t *PD = (PD_t*)SMP_TRAMPOLINE_PD;
+	PT_t *PT = (PT_t*)SMP_TRAMPOLINE_PT;
+
+	memset(PML4, 0, sizeof(PML4_t));
+	memcpy(PDP, (void*)VMM_PDP_ADDRESS, sizeof(PDP_t));
+	memcpy(PD, (void*)VMM_PD_ADDRESS, sizeof(PD_t));
+	memcpy(PT, (void*)VMM_PT_ADDRESS, sizeof(PT_t));
+
+	PML4->PML4E[0] = (((PML4_t*)VMM_PML4_ADDRESS)->PML4E[0] & ~PG_ADDRESS) | SMP_TRAMPOLINE_PDP;
+	PDP->PDPE[0] = (PDP->PDPE[0] & ~PG_ADDRESS) | SMP_TRAMPOLINE_PD;
+	PD->PDE[0] = (PD->PDE[0] & ~PG_ADDRESS) | SMP_TRAMPOLINE_PT;
+	PT->PTE[SMP_TRAMPOLINE >> 12] &= ~PG_NX;
+}
+
+/*
+ * Startet eine AP mit INIT-SIPI-SIPI
+ * Parameter:	cpu = Nummer der CPU
+ * 				data = Datenbereich des Trampolins
+ * Rückgabe:	true, wenn die CPU gestartet ist
+ */
+static bool smp_startCPU(uint32_t cpu, smp_trampoline_data_t *data)
+{
+	void *stack;
+	paddr_t phys;
+	uint64_t start;
+	int i;
+
+	if(!TSS_Prepare(cpu))
+		return false;
+	//Die AP hat noch keine IDT und darf deshalb keinen Page Fault auslösen. Der Stack wird
+	//über die Direct Map verwendet, damit seine Pages sicher vorhanden sind.
+	stack = vmm_AllocDMA(-1, SMP_AP_STACK_PAGES, &phys);
+	if(stack == NULL)
+		return false;
+
+	data->stack = (uintptr_t)stack + SMP_AP_STACK_PAGES * MM_BLOCK_SIZE;
+	smp_bootingCPU = cpu;
+	smp_bootDone = false;
+
+	apic_SendIPI(smp_apicIds[cpu], APIC_IPI_INIT);
+	Sleep(10);
+	for(i = 0; i < 2 && !smp_bootDone; i++)
+	{
+		apic_SendIPI(smp_apicIds[cpu], APIC_IPI_STARTUP | (SMP_TRAMPOLINE >> 12));
+		Sleep(1);
+	}
+
+	start = pit_getUptime();
+	while(!smp_bootDone && pit_getUptime() - start < SMP_AP_TIMEOUT)
+		asm volatile("hlt");
+
+	//Der Stack wird nicht freigegeben, weil die CPU eventuell doch noch startet
+	return smp_bootDone;
+}
+
+/*
+ * Einsprungspunkt der APs (aus smp_apEntry). Läuft auf dem Stack aus dem Trampolin.
+ */
+void __attribute__((noreturn)) smp_apMain(void)
+{
+	uint32_t cpu = smp_bootingCPU;
+
+	cpu_InitLocal();
+	fpu_InitLocal();
+	GDT_Load();
+	IDT_Load();
+	TSS_Load(cpu);
+	syscall_InitLocal();
+	apic_InitLocal();
+	scheduler_InitCPU(cpu);
+
+	__sync_fetch_and_or(&smp_onlineMask, 1 << cpu);
+	__sync_fetch_and_add(&smp_cpuCount, 1);
+	smp_bootDone = true;
+
+	asm volatile("sti");
+
+	//Der Scheduler holt die CPU hier ab, sobald es Arbeit für sie gibt
+	while(1) asm volatile("hlt");
+}
+
+/*
+ * Sendet einen Interrupt an eine andere CPU
+ *
+ * Parameter:	cpu = Nummer der Ziel-CPU
+ * 				vector = Interruptvektor
+ */
+void smp_SendIPI(uint32_t cpu, uint8_t vector)
+{
+	//Der ICR wird in zwei Schritten beschrieben und darf nicht unterbrochen werden
+	bool enabled = cpu_disableInterrupts();
+	apic_SendIPI(smp_apicIds[cpu], vector);
+	cpu_restoreInterrupts(enabled);
+}
+
+/*
+ * Invalidiert den angeforderten TLB-Bereich, falls die aktuelle CPU betroffen ist.
+ * Interrupts müssen deaktiviert sein.
+ */
+static void smp_handleTLBShootdown(void)
+{
+	uint32_t mask = 1 << cpu_getId();
+	if(tlb_pending & mask)
+	{
+		InvalidateLocalTLBRange(tlb_address, tlb_pages);
+		__sync_fetch_and_and(&tlb_pending, ~mask);
+	}
+}
+
+static ihs_t *smp_tlbHandler(ihs_t *ihs)
+{
+	smp_handleTLBShootdown();
+	apic_EOI();
+	return ihs;
+}
+
+/*
+ * Invalidiert einen TLB-Eintrag auf allen anderen CPUs und wartet, bis alle
+ * den Eintrag invalidiert haben.
+ * Parameter:	address = virtuelle Adresse
+ */
+void smp_InvalidateTLBEntry(void *address)
+{
+	smp_InvalidateTLBRange(address, 1);
+}
+
+/*
+ * Invalidiert einen Bereich im TLB aller anderen CPUs und wartet, bis alle
+ * den Bereich invalidiert haben. Grosse Bereiche leeren den ganzen TLB.
+ * Parameter:	address = virtuelle Adresse der ersten Page
+ * 				pages = Anzahl Pages
+ */
+void smp_InvalidateTLBRange(void *address, size_t pages)
+{
+	bool enabled = cpu_disableInterrupts();
+	uint32_t others = smp_onlineMask & ~(1 << cpu_getId());
+
+	//Solange eine andere CPU einen Shootdown durchführt, müssen deren Anfragen
+	//bearbeitet werden, sonst warten beide CPUs aufeinander
+	while(!try_lock(&tlb_lock))
+	{
+		smp_handleTLBShootdown();
+		asm volatile("pause");
+	}
+
+	if(others)
+	{
+		tlb_address = address;
+		tlb_pages = pages;
+		tlb_pending = others;
+		apic_BroadcastIPI(SMP_TLB_VECTOR);
+		while(tlb_pending)
+			asm volatile("pause");
+	}
+
+	unlock(&tlb_lock);
+	cpu_restoreInterrupts(enabled);
+}
+
+/*
+ * Sucht die übrigen CPUs und startet sie. Muss mit aktivierten Interrupts
+ * aufgerufen werden, da der PIT zum Warten benutzt wird.
+ */
+void smp_Init()
+{
+	uint32_t count, i;
+
+	count = smp_findCPUs();
+	if(count <= 1)
+	{
+		SysLog("SMP", "Keine weiteren CPUs gefunden");
+		return;
+	}
+
+	isr_setHandler(SMP_TLB_VECTOR, smp_tlbHandler);
+
+	memcpy((void*)SMP_TRAMPOLINE, &smp_trampoline_start, &smp_trampoline_end - &smp_trampoline_start);
+	smp_prepareTables();
+
+	smp_trampoline_data_t *data = (void*)SMP_TRAMPOLINE + (&smp_trampoline_data - &smp_trampoline_start);
+	data->cr3 = SMP_TRAMPOLINE_PML4;
+	data->efer = (1 << 8) | (cpuInfo.nx ? (1 << 11) : 0);	//Long Mode und NX
+	data->entry = (uintptr_t)smp_apEntry;
+	data->kernelCR3 = kernel_context.physAddress;
+
+	for(i = 1; i < count; i++)
+	{
+		if(!smp_startCPU(i, data))
+			printf("SMP: CPU %u (APIC-ID %u) konnte nicht gestartet werden\n", i, smp_apicIds[i]);
+	}
+
+	printf("SMP: %u von %u CPUs laufen\n", smp_cpuCount, count);
+	SysLog("SMP", "Initialisierung abgeschlossen");
+}
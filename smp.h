@@ -0,0 +1,23 @@
+/*
+ * smp.h
+ *
+ *  Created on: 17.10.2026
+ */
+
+#ifndef SMP_H_
+#define SMP_H_
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "stddef.h"
+
+#define SMP_TLB_VECTOR		50		//IPI zum Invalidieren von TLB-Einträgen
+
+extern volatile uint32_t smp_cpuCount;		//Anzahl laufender CPUs
+
+void smp_Init(void);
+void smp_InvalidateTLBEntry(void *address);
+void smp_InvalidateTLBRange(void *address, size_t pages);
+void smp_SendIPI(uint32_t cpu, uint8_t vector);
+
+#endif /* SMP_H_ */
@@ -33,6 +33,9 @@ extern void isr_syscall();
 static void nop();
 static uint64_t createThreadHandler(void *entry, void *arg);
 static void exitThreadHandler();
+static void setTimesliceHandler(uint64_t msec);
+static int setPriorityHandler(uint64_t priority);
+static pid_t forkHandler();
 static void sleepHandler(uint64_t msec);
 
 typedef uint64_t(*syscall)(uint64_t arg, ...);
@@ -41,12 +44,19 @@ static syscall syscalls[_SYSCALL_NUM] = {
 [SYSCALL_ALLOC_PAGES]		(syscall)&mm_Alloc,
 [SYSCALL_FREE_PAGES]		(syscall)&mm_Free,
 [SYSCALL_UNUSE_PAGES]		(syscall)&vmm_unusePages,
+[SYSCALL_MMAP]				(syscall)&mm_syscall_mmap,
+[SYSCALL_MUNMAP]			(syscall)&mm_syscall_munmap,
+[SYSCALL_MPROTECT]			(syscall)&mm_syscall_mprotect,
+[SYSCALL_MSYNC]				(syscall)&mm_syscall_msync,
 
 [SYSCALL_EXEC]				(syscall)&loader_syscall_load,
 [SYSCALL_EXIT]				(syscall)&pm_syscall_exit,
 [SYSCALL_WAIT]				(syscall)&pm_syscall_wait,
 [SYSCALL_THREAD_CREATE]		(syscall)&createThreadHandler,
 [SYSCALL_THREAD_EXIT]		(syscall)&exitThreadHandler,
+[SYSCALL_THREAD_SET_TIMESLICE]	(syscall)&setTimesliceHandler,
+[SYSCALL_THREAD_SET_PRIORITY]	(syscall)&setPriorityHandler,
+[SYSCALL_FORK]				(syscall)&forkHandler,
 
 [SYSCALL_GET_TIMESTAMP]		(syscall)&cmos_syscall_timestamp,
 [SYSCALL_SLEEP]				(syscall)&sleepHandler,
@@ -63,28 +73,37 @@ static syscall syscalls[_SYSCALL_NUM] = {
 [SYSCALL_MOUNT]				(syscall)&vfs_syscall_mount,
 [SYSCALL_UNMOUNT]			(syscall)&vfs_syscall_unmount,
 
-[SYSCALL_SYSINF_GET]		(syscall)&getSystemInformation
+[SYSCALL_SYSINF_GET]		(syscall)&getSystemInformation,
+[SYSCALL_MEMINFO_GET]		(syscall)&pm_syscall_getMemInfo
 };
 
 void syscall_Init()
+{
+	syscall_InitLocal();
+
+	for(size_t i = 0; i < _SYSCALL_NUM; i++)
+	{
+		if(syscalls[i] == NULL)
+			syscalls[i] = (syscall)nop;
+	}
+}
+
+/*
+ * Richtet syscall/sysret auf der aktuellen CPU ein
+ */
+void syscall_InitLocal()
 {
 	//Prüfen, ob syscall/sysret unterstützt wird
 	if(cpuInfo.syscall)
 	{
 		cpu_MSRwrite(STAR, (0x8ul << 32) | (0x13ul << 48));	//Segementregister
 		cpu_MSRwrite(LSTAR, (uintptr_t)isr_syscall);		//Einsprungspunkt
-		cpu_MSRwrite(SFMASK, 0);							//Wir setzen keine Bits zurück (Interrupts bleiben auch aktiviert)
+		cpu_MSRwrite(SFMASK, 1 << 9);						//Interrupts bis zum Wechsel auf den Kernelstack deaktivieren
 
 		//Syscall-Instruktion aktivieren (ansonsten #UD)
 		//Bit 0
 		cpu_MSRwrite(0xC0000080, cpu_MSRread(0xC0000080) | 1);
 	}
-
-	for(size_t i = 0; i < _SYSCALL_NUM; i++)
-	{
-		if(syscalls[i] == NULL)
-			syscalls[i] = (syscall)nop;
-	}
 }
 
 uint64_t syscall_syscallHandler(uint64_t func, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
@@ -99,7 +118,11 @@ uint64_t syscall_syscallHandler(uint64_t func, uint64_t arg1, uint64_t arg2, uin
  */
 ihs_t *syscall_Handler(ihs_t *ihs)
 {
-	ihs->rax = syscall_syscallHandler(ihs->rdi, ihs->rsi, ihs->rdx, ihs->rcx, ihs->r8, ihs->r9);
+	//fork braucht den ganzen Registerzustand, den es nur bei int $0x30 gibt
+	if(ihs->rdi == SYSCALL_FORK)
+		ihs->rax = pm_syscall_fork(ihs);
+	else
+		ihs->rax = syscall_syscallHandler(ihs->rdi, ihs->rsi, ihs->rdx, ihs->rcx, ihs->r8, ihs->r9);
 	return ihs;
 }
 
@@ -121,6 +144,26 @@ static void exitThreadHandler()
 	yield();
 }
 
+//Ein bevorzugter Thread bleibt bis zum Ende seiner Zeitscheibe bevorzugt, deshalb ist ihre Länge begrenzt
+static void setTimesliceHandler(uint64_t msec)
+{
+	thread_setTimeslice(currentThread, (msec > SCHEDULER_TIMESLICE_USER_MAX) ? SCHEDULER_TIMESLICE_USER_MAX : msec);
+}
+
+//Echtzeit-Threads werden nie zurückgestuft und sind deshalb dem Kernel vorbehalten
+static int setPriorityHandler(uint64_t priority)
+{
+	if(priority > THREAD_PRIORITY_IDLE || priority == THREAD_PRIORITY_REALTIME)
+		return -1;
+	return thread_setPriority(currentThread, priority) ? 0 : -1;
+}
+
+//Über den syscall-Befehl wird fork nicht unterstützt
+static pid_t forkHandler()
+{
+	return -1;
+}
+
 static void sleepHandler(uint64_t msec)
 {
 	pit_RegisterTimer(currentThread, msec);
@@ -11,6 +11,7 @@
 #define SYSCALLS_H_
 
 void syscall_Init();
+void syscall_InitLocal();
 
 #endif /* SYSCALLS_H_ */
 
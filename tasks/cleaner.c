@@ -27,7 +27,9 @@ void __attribute__((noreturn)) cleaner()
 					pm_DestroyTask(entry->data);
 				break;
 				case CL_THREAD:
-					while(((thread_t*)entry->data)->Status.status != THREAD_BLOCKED) yield();
+					//Der Stack des Threads darf von keiner CPU mehr benutzt werden
+					while(((thread_t*)entry->data)->Status.status != THREAD_BLOCKED
+							|| ((thread_t*)entry->data)->activeCPU != -1) yield();
 					thread_destroy(entry->data);
 			}
 			free(entry);
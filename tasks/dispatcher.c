@@ -11,6 +11,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <cpu.h>
 
 typedef struct{
 	dispatcher_task_handler_t func;
@@ -71,7 +72,11 @@ ihs_t *dispatcher_dispatch(ihs_t *state)
 			//Interrupt ist beim Schedulen 32
 			.interrupt = 32
 	};
-	static ihs_t new_state;
+	//Wird von der CPU erst nach dem Freigeben des Locks geladen, deshalb hat jede CPU ihren eigenen.
+	//Bei Trap-Gates sind die Interrupts noch aktiv, iretq stellt das Flag wieder her.
+	static ihs_t new_states[CPU_MAX];
+	cpu_disableInterrupts();
+	ihs_t *new_state = &new_states[cpu_getId()];
 
 	if(try_lock(&dispatcher_lock))
 	{
@@ -82,15 +87,15 @@ ihs_t *dispatcher_dispatch(ihs_t *state)
 			if(queue_start == queue_size)
 				queue_start = 0;
 
-			memcpy(&new_state, &init_state, sizeof(ihs_t));
-			new_state.rip = (uintptr_t)dispatch_wrapper;
-			new_state.rsp = (uintptr_t)state - 8;
+			memcpy(new_state, &init_state, sizeof(ihs_t));
+			new_state->rip = (uintptr_t)dispatch_wrapper;
+			new_state->rsp = (uintptr_t)state - 8;
 
-			new_state.rdi = (uintptr_t)state;
-			new_state.rsi = *((uintptr_t*)state - 1);
-			new_state.rdx = (uintptr_t)task->func;
-			new_state.rcx = (uintptr_t)task->opaque;
-			state = &new_state;
+			new_state->rdi = (uintptr_t)state;
+			new_state->rsi = *((uintptr_t*)state - 1);
+			new_state->rdx = (uintptr_t)task->func;
+			new_state->rcx = (uintptr_t)task->opaque;
+			state = new_state;
 		}
 		unlock(&dispatcher_lock);
 	}
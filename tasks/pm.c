@@ -30,7 +30,6 @@ typedef struct{
 static pid_t nextPID = 1;
 static uint64_t numTasks = 0;
 extern process_t kernel_process;				//Handler für idle-Task
-extern thread_t* idleThread;				//Handler für idle-Task
 thread_t* cleanerThread;				//Handler für cleaner-Task
 extern list_t threadList;
 
@@ -39,15 +38,6 @@ static lock_t pm_lock = LOCK_UNLOCKED;
 
 ihs_t *pm_Schedule(ihs_t *cpu);
 
-/*
- * Idle-Task
- * Wird ausgeführt, wenn kein anderer Task ausgeführt wird
- */
-static void idle(void)
-{
-	while(1) asm volatile("hlt");
-}
-
 static int pid_cmp(const void *a, const void *b, void *c)
 {
 	process_t *p1 = (process_t*)a;
@@ -66,6 +56,28 @@ static void pid_visit_count_childs(const void *a, void *b)
 		(*(size_t*)(((void**)b)[1]))++;
 }
 
+static void pm_copyMemInfo(const process_t *process, process_meminfo_t *info)
+{
+	const context_t *context = process->Context;
+	*info = (process_meminfo_t){
+		.residentPages = context->residentPages,
+		.mappedPages = context->mappedPages,
+		.tablePages = context->tablePages,
+		.minorFaults = context->minorFaults,
+		.majorFaults = context->majorFaults,
+		.zeroFillFaults = context->zeroFillFaults
+	};
+}
+
+static void pid_visit_meminfo(const void *a, void *b)
+{
+	const process_t *p = (const process_t*)a;
+	void (*visitor)(const process_t*, const process_meminfo_t*, void*) = ((void**)b)[0];
+	process_meminfo_t info;
+	pm_copyMemInfo(p, &info);
+	visitor(p, &info, ((void**)b)[1]);
+}
+
 static void child_terminated(process_t *parent, process_t *process)
 {
 	lock(&parent->lock);
@@ -102,20 +114,8 @@ void pm_Init()
 	cleaner_Init();
 
 	kernel_process.threads = list_create();
-	idleThread = thread_create(&kernel_process, idle, 0, NULL, true);
+	scheduler_InitCPU(0);
 	cleanerThread = thread_create(&kernel_process, cleaner, 0, NULL, true);
-
-	size_t i = 0;
-	thread_t *t;
-	while((t = list_get(threadList, i)))
-	{
-		if(t == idleThread)
-		{
-			list_remove(threadList, i);
-			break;
-		}
-		i++;
-	}
 }
 
 /*
@@ -192,6 +192,74 @@ process_t *pm_InitTask(process_t *parent, void *entry, char* cmd, const char **e
 	return newProcess;
 }
 
+/*
+ * Erstellt eine Kopie eines Prozesses mit dem aktuellen Thread (fork). Die Pages werden erst
+ * kopiert, wenn einer der beiden Prozesse sie beschreibt.
+ * Parameter:	parent = zu kopierender Prozess, muss der aktuelle Prozess sein
+ * 				state = Registerzustand des aktuellen Threads beim Syscall
+ * Rückgabe:	neuer Prozess oder NULL bei einem Fehler
+ */
+process_t *pm_ForkTask(process_t *parent, ihs_t *state)
+{
+	assert(parent == currentProcess);
+	process_t *newProcess = malloc(sizeof(process_t));
+	if(newProcess == NULL)
+		return NULL;
+
+	newProcess->cmd = strdup(parent->cmd);
+	if(newProcess->cmd == NULL)
+	{
+		free(newProcess);
+		return NULL;
+	}
+
+	newProcess->PID = __sync_fetch_and_add(&nextPID, 1);
+	newProcess->parent = parent;
+
+	newProcess->Context = cloneContext(parent->Context);
+	if(newProcess->Context == NULL)
+	{
+		free(newProcess->cmd);
+		free(newProcess);
+		return NULL;
+	}
+
+	//Die Stacks der anderen Threads bleiben im kopierten Adressraum belegt
+	newProcess->nextThreadStack = parent->nextThreadStack;
+
+	newProcess->threads = list_create();
+
+	newProcess->terminated_childs = list_create();
+	newProcess->waiting_threads = list_create();
+	newProcess->waiting_threads_pid = list_create();
+	newProcess->lock = LOCK_UNLOCKED;
+
+	if(!vfs_cloneUserspace(parent, newProcess) || thread_clone(newProcess, currentThread, state) == NULL)
+	{
+		//Fehler
+		if(newProcess->streams != NULL)
+			vfs_deinitUserspace(newProcess);
+		deleteContext(newProcess->Context);
+		list_destroy(newProcess->threads);
+		list_destroy(newProcess->terminated_childs);
+		list_destroy(newProcess->waiting_threads);
+		list_destroy(newProcess->waiting_threads_pid);
+		free(newProcess->cmd);
+		free(newProcess);
+		return NULL;
+	}
+
+	//Prozess in Liste eintragen
+	bool res = LOCKED_RESULT(pm_lock, avl_add_s(&process_list, newProcess, pid_cmp, NULL));
+	assert(res && "Es gibt schon einen Task mit dieser PID!");
+
+	__sync_fetch_and_add(&numTasks, 1);
+
+	pm_ActivateTask(newProcess);
+
+	return newProcess;
+}
+
 /*
  * Task "zerstören", d.h. in aufräumen
  * Params:	PID = PID des Tasks
@@ -200,6 +268,13 @@ void pm_DestroyTask(process_t *process)
 {
 	if(LOCKED_RESULT(pm_lock, avl_remove_s(&process_list, process, pid_cmp, NULL)))
 	{
+		//Der Kontext darf auf keiner CPU mehr aktiv sein
+		uint32_t i;
+		for(i = 0; i < CPU_MAX; i++)
+		{
+			while(scheduler_cpus[i].process == process) yield();
+		}
+
 		//free all resources of the process
 		deleteContext(process->Context);
 		free(process->cmd);
@@ -295,6 +370,38 @@ process_t *pm_getTask(pid_t PID)
 	return Process;
 }
 
+/*
+ * Gibt den Speicherverbrauch eines Prozesses zurück. Die Zähler werden unter pm_lock gelesen,
+ * damit der Kontext währenddessen nicht gelöscht werden kann.
+ * Parameter:	pid = PID des Prozesses
+ * 				info = Struktur, in die der Verbrauch geschrieben wird
+ * Rückgabe:	false, wenn es keinen Prozess mit dieser PID gibt
+ */
+bool pm_getMemInfo(pid_t pid, process_meminfo_t *info)
+{
+	process_t *process = NULL;
+	process_t dummy = {0};
+	dummy.PID = pid;
+
+	lock(&pm_lock);
+	avl_search_s(process_list, &dummy, pid_cmp, &process);
+	if(process != NULL)
+		pm_copyMemInfo(process, info);
+	unlock(&pm_lock);
+
+	return process != NULL;
+}
+
+/*
+ * Ruft visitor für jeden Prozess mit seinem Speicherverbrauch auf. visitor wird mit gesperrtem
+ * pm_lock aufgerufen und darf deshalb nicht blockieren.
+ */
+void pm_visitMemInfo(void (*visitor)(const process_t *process, const process_meminfo_t *info, void *opaque), void *opaque)
+{
+	void *tmp[2] = {visitor, opaque};
+	LOCKED_TASK(pm_lock, avl_visit_s(process_list, avl_visiting_in_order, pid_visit_meminfo, tmp));
+}
+
 pid_t pm_WaitChild(pid_t pid, int *status)
 {
 	assert(currentProcess != NULL);
@@ -376,6 +483,13 @@ void pm_syscall_exit(int status)
 	pm_ExitTask(status);
 }
 
+pid_t pm_syscall_fork(ihs_t *state)
+{
+	assert(currentThread != NULL);
+	process_t *child = pm_ForkTask(currentProcess, state);
+	return (child != NULL) ? child->PID : (pid_t)-1;
+}
+
 pid_t pm_syscall_wait(pid_t pid, int *status)
 {
 	assert(currentThread != NULL);
@@ -383,3 +497,22 @@ pid_t pm_syscall_wait(pid_t pid, int *status)
 		return 0;
 	return pm_WaitChild(pid, status);
 }
+
+/*
+ * Gibt den Speicherverbrauch eines Prozesses zurück
+ * Parameter:	pid = PID des Prozesses, 0 für den aktuellen Prozess
+ * 				info = Struktur im Userspace
+ * Rückgabe:	0 = Erfolg, -1 = ungültiger Pointer oder PID
+ */
+int pm_syscall_getMemInfo(pid_t pid, process_meminfo_t *info)
+{
+	process_meminfo_t tmp;
+
+	assert(currentThread != NULL);
+	if(!vmm_userspacePointerValid(info, sizeof(*info)))
+		return -1;
+	if(!pm_getMemInfo((pid == 0) ? currentProcess->PID : pid, &tmp))
+		return -1;
+	*info = tmp;
+	return 0;
+}
@@ -15,8 +15,7 @@
 #include "hashmap.h"
 #include "lock.h"
 #include <bits/types.h>
-
-typedef _pid_t pid_t;
+#include <bits/sys_types.h>
 
 typedef struct{
 		uint64_t mmx[6];
@@ -40,19 +39,22 @@ typedef struct process_t{
 		int exit_status;
 }process_t;
 
-extern process_t *currentProcess;			//Aktueller Prozess
-
 void pm_Init(void);
 process_t *pm_InitTask(process_t *parent, void *entry, char* cmd, const char **env, const char *stdin, const char *stdout, const char *stderr);
+process_t *pm_ForkTask(process_t *parent, ihs_t *state);
 void pm_DestroyTask(process_t *process);
 void pm_ExitTask(int code);
 void pm_BlockTask(process_t *process);
 void pm_ActivateTask(process_t *process);
 process_t *pm_getTask(pid_t PID);
 pid_t pm_WaitChild(pid_t pid, int *status);
+bool pm_getMemInfo(pid_t pid, process_meminfo_t *info);
+void pm_visitMemInfo(void (*visitor)(const process_t *process, const process_meminfo_t *info, void *opaque), void *opaque);
 
 //syscalls
 void pm_syscall_exit(int status);
+pid_t pm_syscall_fork(ihs_t *state);
 pid_t pm_syscall_wait(pid_t pid, int *status);
+int pm_syscall_getMemInfo(pid_t pid, process_meminfo_t *info);
 
 #endif /* PM_H_ */
@@ -9,53 +9,265 @@
 #include "ring.h"
 #include "lock.h"
 #include "stdbool.h"
-
-extern thread_t *fpuThread;
+#include "list.h"
+#include "apic.h"
+#include "pit.h"
+#include "smp.h"
+#include "display.h"
+#include "pmm.h"
+#include "shrinker.h"
 
 extern context_t kernel_context;
+extern list_t threadList;
 
 process_t kernel_process = {
 		.Context = &kernel_context,
 		.cmd = "kernel"
 };
-thread_t* idleThread;
 
-static ring_t* scheduleList;
-static lock_t schedule_lock = LOCK_LOCKED;
+scheduler_cpu_t scheduler_cpus[CPU_MAX] = {
+		[0 ... CPU_MAX - 1] = {.lock = LOCK_LOCKED, .level = SCHEDULER_LEVELS}
+};
 static bool active = false;
-thread_t *currentThread;
-process_t *currentProcess;
+static bool timerActive = false;			//Die CPUs planen über ihren APIC-Timer
+static volatile uint32_t idleMask = 0;		//CPUs, die gerade nichts zu tun haben
+
+static ihs_t *scheduler_timerHandler(ihs_t *ihs);
+
+/*
+ * Idle-Task
+ * Wird ausgeführt, wenn kein anderer Task ausgeführt wird. Solange es etwas zu tun gibt, werden
+ * bei Speichermangel die Caches geschrumpft, der Vorrat an gelöschten Pages aufgefüllt und Pages
+ * des Userspaces zu grossen Pages zusammengefasst.
+ */
+static void idle(void)
+{
+	while(1)
+	{
+		if(!shrinker_Balance() && !pmm_ZeroPoolRefill() && !vmm_promoteLarge())
+			asm volatile("hlt");
+	}
+}
 
 /*
  * Initialisiert den Scheduler
  */
 void scheduler_Init()
 {
-	scheduleList = ring_create();
-	//Lock freigeben
-	unlock(&schedule_lock);
+	uint32_t i;
+	for(i = 0; i < CPU_MAX; i++)
+	{
+		uint8_t level;
+		for(level = 0; level < SCHEDULER_LEVELS; level++)
+			scheduler_cpus[i].queue[level] = ring_create();
+		//Lock freigeben
+		unlock(&scheduler_cpus[i].lock);
+	}
 }
 
 /*
- * Aktiviert den Scheduler
+ * Meldet eine CPU beim Scheduler an und erstellt ihren Idle-Thread. Ab jetzt
+ * können Threads auf ihr laufen.
+ *
+ * Parameter:	cpu = Nummer der CPU
+ */
+void scheduler_InitCPU(uint32_t cpu)
+{
+	thread_t *idleThread = thread_create(&kernel_process, idle, 0, NULL, true);
+
+	//Der Idle-Thread ist kein normaler Thread
+	size_t i = 0;
+	thread_t *t;
+	while((t = list_get(threadList, i)))
+	{
+		if(t == idleThread)
+		{
+			list_remove(threadList, i);
+			break;
+		}
+		i++;
+	}
+
+	scheduler_cpus[cpu].idleThread = idleThread;
+	scheduler_cpus[cpu].online = true;
+}
+
+/*
+ * Aktiviert den Scheduler. Jede CPU programmiert ab jetzt ihren APIC-Timer als
+ * One-Shot-Timer auf das Ende der Zeitscheibe, die CPU 0 zusätzlich auf den
+ * nächsten ablaufenden Timer. Interrupts müssen aktiviert sein.
  */
 void scheduler_activate()
 {
+	apic_CalibrateTimer();
+	isr_setHandler(SCHEDULER_TIMER_VECTOR, scheduler_timerHandler);
+	if(pit_EnableTickless())
+		SysLog("SCHEDULER", "PIT gestoppt, Zeitmessung über TSC");
+
+	bool enabled = cpu_disableInterrupts();
 	active = true;
+	timerActive = true;
+	//Alle CPUs holen sich so ihren ersten Thread
+	apic_BroadcastIPI(SCHEDULER_TIMER_VECTOR);
+	apic_SendSelfIPI(SCHEDULER_TIMER_VECTOR);
+	cpu_restoreInterrupts(enabled);
 }
 
 /*
- * Fügt einen Thread der Schedulingliste hinzu
+ * Programmiert den APIC-Timer der aktuellen CPU auf das Ende der Zeitscheibe. Die
+ * CPU 0 wird zusätzlich geweckt, wenn der nächste Timer abläuft. Interrupts
+ * müssen deaktiviert sein.
+ *
+ * Parameter:	cpu = Zustand der aktuellen CPU
+ * 				self = Nummer der aktuellen CPU
+ */
+static void scheduler_armTimer(scheduler_cpu_t *cpu, uint32_t self)
+{
+	uint64_t deadline = cpu->sliceEnd;
+	if(self == 0 && pit_tickless)
+	{
+		uint64_t next = pit_NextTimeout();
+		if(next < deadline)
+			deadline = next;
+	}
+
+	if(deadline == -1ul)
+	{
+		apic_StopTimer();
+		return;
+	}
+
+	uint64_t now = pit_getUptime();
+	apic_StartTimer(SCHEDULER_TIMER_VECTOR, (deadline > now) ? deadline - now : 1);
+}
+
+/*
+ * Muss aufgerufen werden, wenn ein Timer hinzugekommen ist, der vor allen anderen
+ * abläuft. Die CPU 0 programmiert daraufhin ihren APIC-Timer neu.
+ */
+void scheduler_TimerChanged()
+{
+	if(!timerActive || !pit_tickless)
+		return;
+
+	bool enabled = cpu_disableInterrupts();
+	uint32_t self = cpu_getId();
+	if(self == 0)
+		scheduler_armTimer(&scheduler_cpus[0], 0);
+	else
+		smp_SendIPI(0, SCHEDULER_TIMER_VECTOR);
+	cpu_restoreInterrupts(enabled);
+}
+
+/*
+ * Lässt eine CPU nach dem aktuellen Interrupt bzw. sofort neu planen
+ *
+ * Parameter:	cpu = Nummer der CPU
+ * 				self = Nummer der aktuellen CPU
+ */
+static void scheduler_kick(uint32_t cpu, uint32_t self)
+{
+	if(cpu == self)
+		apic_SendSelfIPI(SCHEDULER_TIMER_VECTOR);
+	else
+		smp_SendIPI(cpu, SCHEDULER_TIMER_VECTOR);
+}
+
+/*
+ * Sorgt dafür, dass ein neu hinzugefügter Thread bald läuft. Gibt es eine untätige
+ * CPU, wird sie aufgeweckt, damit sie den Thread übernimmt. Ansonsten wird die CPU
+ * unterbrochen, in deren Liste der Thread liegt, falls er eine höhere Priorität
+ * hat als der dort laufende Thread.
+ *
+ * Parameter:	thread = hinzugefügter Thread
+ * 				id = Nummer der CPU, in deren Liste der Thread liegt
+ */
+static void scheduler_wake(thread_t *thread, uint32_t id)
+{
+	bool enabled = cpu_disableInterrupts();
+	uint32_t self = cpu_getId();
+
+	//Gegenstück zum Setzen von idleMask in scheduler_schedule()
+	__sync_synchronize();
+	uint32_t idle = idleMask;
+	if(idle & (1 << self))
+		scheduler_kick(self, self);
+	else if(idle)
+		scheduler_kick(__builtin_ctz(idle), self);
+	else if(thread->queueLevel < scheduler_cpus[id].level)
+	{
+		scheduler_cpus[id].preempt = true;
+		scheduler_kick(id, self);
+	}
+
+	cpu_restoreInterrupts(enabled);
+}
+
+/*
+ * Bestimmt die Warteschlange, in die ein Thread gehört
+ */
+static uint8_t scheduler_level(thread_t *thread)
+{
+	switch(thread->priority)
+	{
+		case THREAD_PRIORITY_REALTIME:
+			return SCHEDULER_LEVEL_REALTIME;
+		case THREAD_PRIORITY_IDLE:
+			return SCHEDULER_LEVEL_IDLE;
+		default:
+			return thread->boosted ? SCHEDULER_LEVEL_BOOSTED : SCHEDULER_LEVEL_NORMAL;
+	}
+}
+
+/*
+ * Fügt einen Thread in die passende Warteschlange einer CPU ein bzw. entfernt
+ * ihn wieder. Die Liste der CPU muss gesperrt sein.
+ */
+static void scheduler_enqueue(scheduler_cpu_t *cpu, thread_t *thread)
+{
+	uint8_t level = scheduler_level(thread);
+	thread->queueLevel = level;
+	ring_add(cpu->queue[level], &thread->ring_entry);
+	cpu->levelMask |= 1 << level;
+}
+
+static void scheduler_dequeue(scheduler_cpu_t *cpu, thread_t *thread)
+{
+	ring_t *queue = cpu->queue[thread->queueLevel];
+	ring_remove(queue, &thread->ring_entry);
+	if(ring_entries(queue) == 0)
+		cpu->levelMask &= ~(1 << thread->queueLevel);
+}
+
+/*
+ * Fügt einen Thread der Schedulingliste hinzu. Bevorzugt wird die Liste der
+ * aktuellen CPU, ist diese gesperrt wird die einer anderen CPU genommen.
+ * Ist der Thread bereits in einer Liste, passiert nichts.
  *
  * Parameter:	thread = Thread, der hinzugefügt werden soll
  */
 bool scheduler_try_add(thread_t *thread)
 {
-	if(try_lock(&schedule_lock))
+	uint32_t self = cpu_getId();
+	uint32_t i;
+	for(i = 0; i < CPU_MAX; i++)
 	{
-		ring_add(scheduleList, &thread->ring_entry);
-		unlock(&schedule_lock);
-		return true;
+		uint32_t id = (self + i) % CPU_MAX;
+		scheduler_cpu_t *cpu = &scheduler_cpus[id];
+		if(!cpu->online)
+			continue;
+
+		if(try_lock(&cpu->lock))
+		{
+			bool added = __sync_bool_compare_and_swap(&thread->queueCPU, -1, id);
+			if(added)
+				scheduler_enqueue(cpu, thread);
+			unlock(&cpu->lock);
+
+			if(added && timerActive)
+				scheduler_wake(thread, id);
+			return true;
+		}
 	}
 	return false;
 }
@@ -77,10 +289,173 @@ void scheduler_add(thread_t *thread)
  */
 void scheduler_remove(thread_t *thread)
 {
-	lock(&schedule_lock);
-	if(ring_contains(scheduleList, &thread->ring_entry))
-		ring_remove(scheduleList, &thread->ring_entry);
-	unlock(&schedule_lock);
+	while(1)
+	{
+		int32_t id = thread->queueCPU;
+		if(id == -1)
+			return;
+
+		//Der Thread kann in der Zwischenzeit von einer anderen CPU übernommen worden sein
+		scheduler_cpu_t *cpu = &scheduler_cpus[id];
+		lock(&cpu->lock);
+		if(thread->queueCPU == id)
+		{
+			scheduler_dequeue(cpu, thread);
+			thread->queueCPU = -1;
+			unlock(&cpu->lock);
+			return;
+		}
+		unlock(&cpu->lock);
+	}
+}
+
+/*
+ * Verschiebt einen Thread in die Warteschlange, die zu seiner Priorität passt
+ *
+ * Parameter:	thread = Thread
+ * 				wait = true: warten, bis die Liste frei ist
+ * Rückgabe:	false, wenn die Liste gesperrt war und nicht gewartet wurde
+ */
+static bool scheduler_move(thread_t *thread, bool wait)
+{
+	while(1)
+	{
+		int32_t id = thread->queueCPU;
+		//Beim nächsten Einfügen kommt der Thread in die richtige Warteschlange
+		if(id == -1)
+			return true;
+
+		scheduler_cpu_t *cpu = &scheduler_cpus[id];
+		if(wait)
+			lock(&cpu->lock);
+		else if(!try_lock(&cpu->lock))
+			return false;
+		if(thread->queueCPU == id)
+		{
+			if(thread->queueLevel != scheduler_level(thread))
+			{
+				scheduler_dequeue(cpu, thread);
+				scheduler_enqueue(cpu, thread);
+			}
+			unlock(&cpu->lock);
+			return true;
+		}
+		unlock(&cpu->lock);
+	}
+}
+
+/*
+ * Muss aufgerufen werden, wenn sich die Priorität eines Threads geändert hat
+ *
+ * Parameter:	thread = Thread
+ */
+void scheduler_requeue(thread_t *thread)
+{
+	scheduler_move(thread, true);
+}
+
+/*
+ * Sucht in der Schedulingliste einer CPU den nächsten Thread, der auf der
+ * aktuellen CPU laufen kann. Die Liste muss gesperrt sein.
+ *
+ * Parameter:	cpu = CPU, deren Liste durchsucht wird
+ * 				self = Nummer der aktuellen CPU
+ *
+ * Rückgabe:	Gefundener Thread oder NULL
+ */
+static thread_t *scheduler_pick(scheduler_cpu_t *cpu, uint32_t self)
+{
+	uint32_t mask = cpu->levelMask;
+	while(mask)
+	{
+		//Nicht leere Warteschlange mit der höchsten Priorität
+		ring_t *queue = cpu->queue[__builtin_ctz(mask)];
+		mask &= mask - 1;
+
+		size_t count = ring_entries(queue);
+		while(count--)
+		{
+			thread_t *thread = (thread_t*)ring_getNext(queue);
+			//Ein Thread, dessen Stack noch von einer anderen CPU benutzt wird, muss warten
+			if(thread->Status.status == THREAD_RUNNING
+					&& (thread->activeCPU == -1 || thread->activeCPU == (int32_t)self))
+				return thread;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Holt einen Thread aus der Schedulingliste einer anderen CPU. Die Liste der
+ * aktuellen CPU muss gesperrt sein.
+ *
+ * Parameter:	self = Nummer der aktuellen CPU
+ *
+ * Rückgabe:	Übernommener Thread oder NULL
+ */
+static thread_t *scheduler_steal(uint32_t self)
+{
+	uint32_t i;
+	for(i = 1; i < CPU_MAX; i++)
+	{
+		scheduler_cpu_t *victim = &scheduler_cpus[(self + i) % CPU_MAX];
+		if(!victim->online || victim->levelMask == 0)
+			continue;
+
+		//Nicht warten, die andere CPU könnte gerade bei uns stehlen wollen
+		if(try_lock(&victim->lock))
+		{
+			thread_t *thread = scheduler_pick(victim, self);
+			if(thread != NULL)
+			{
+				scheduler_dequeue(victim, thread);
+				thread->queueCPU = self;
+				scheduler_enqueue(&scheduler_cpus[self], thread);
+			}
+			unlock(&victim->lock);
+
+			if(thread != NULL)
+				return thread;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Wechselt auf der aktuellen CPU zu einem anderen Thread
+ *
+ * Parameter:	cpu = Zustand der aktuellen CPU
+ * 				newThread = Thread, der als nächstes ausgeführt wird
+ */
+static void scheduler_switch(scheduler_cpu_t *cpu, thread_t *newThread)
+{
+	thread_t *oldThread = cpu->thread;
+
+	if(oldThread != NULL)
+	{
+		//Der FPU-Zustand muss jetzt gesichert werden, weil der Thread als nächstes
+		//auf einer anderen CPU laufen könnte
+		if(cpu->fpuThread == oldThread)
+		{
+			asm volatile("fxsave (%0)": :"r"((((uintptr_t)oldThread->fpuState) + 15) & ~0xF));
+			cpu->fpuThread = NULL;
+		}
+
+		//Freigegeben wird der Thread erst, wenn die CPU seinen Stack verlassen hat
+		cpu->releaseThread = oldThread;
+	}
+
+	if(cpu->process != newThread->process)
+		activateContext(newThread->process->Context);
+	thread_prepare(newThread);
+
+	cpu->process = newThread->process;
+	cpu->thread = newThread;
+
+	uint64_t cr0;
+	asm volatile("mov %%cr0,%0;": "=r"(cr0));
+	cr0 |= (1 << 3);							//TS-Bit setzen
+	asm volatile("mov %0,%%cr0": : "r"(cr0));
 }
 
 /*
@@ -90,47 +465,116 @@ void scheduler_remove(thread_t *thread)
  */
 ihs_t *scheduler_schedule(ihs_t *state)
 {
+	uint32_t self = cpu_getId();
+	scheduler_cpu_t *cpu = &scheduler_cpus[self];
 	thread_t *newThread;
 
 	if(!active)
 		return state;
 
-	if(currentThread != NULL)
+	if(cpu->thread != NULL)
 	{
-		currentThread->State = state;
+		cpu->thread->State = state;
+
+		//Der Bonus gilt nur, bis der Thread eine ganze Zeitscheibe verbraucht hat
+		if(cpu->thread->boosted && pit_getUptime() >= cpu->sliceEnd)
+		{
+			cpu->thread->boosted = false;
+			if(!scheduler_move(cpu->thread, false))
+				cpu->thread->boosted = true;
+		}
 	}
 
-	if(try_lock((&schedule_lock)))
+	if(try_lock(&cpu->lock))
 	{
-		newThread = (thread_t*)ring_getNext(scheduleList);
+		cpu->preempt = false;
+		newThread = scheduler_pick(cpu, self);
+		if(newThread == NULL)
+			newThread = scheduler_steal(self);
 		if(newThread == NULL)
-			newThread = idleThread;
-		unlock(&schedule_lock);
+		{
+			//Erst als untätig melden und dann nochmals suchen, sonst kann ein
+			//gleichzeitig hinzugefügter Thread übersehen werden (siehe scheduler_wake)
+			__sync_fetch_and_or(&idleMask, 1 << self);
+			newThread = scheduler_pick(cpu, self);
+			if(newThread == NULL)
+				newThread = scheduler_steal(self);
+		}
+		if(newThread != NULL)
+		{
+			if(idleMask & (1 << self))
+				__sync_fetch_and_and(&idleMask, ~(1 << self));
+			newThread->activeCPU = self;
+		}
+		unlock(&cpu->lock);
 
-		if(newThread != currentThread)
+		if(newThread == NULL)
 		{
-			if(currentProcess != newThread->process)
-				activateContext(newThread->process->Context);
-			thread_prepare(newThread);
+			newThread = cpu->idleThread;
+			newThread->activeCPU = self;
+		}
 
-			currentProcess = newThread->process;
-			currentThread = newThread;
+		if(newThread != cpu->thread)
+			scheduler_switch(cpu, newThread);
 
-			if(fpuThread == currentThread)
-			{
-				asm volatile("clts");
-			}
-			else
-			{
-				uint64_t cr0;
-				asm volatile("mov %%cr0,%0;": "=r"(cr0));
-				cr0 |= (1 << 3);							//TS-Bit setzen
-				asm volatile("mov %0,%%cr0": : "r"(cr0));
-			}
+		//Der Idle-Thread läuft, bis die CPU für einen anderen Thread geweckt wird
+		if(newThread == cpu->idleThread)
+		{
+			cpu->sliceEnd = -1ul;
+			cpu->level = SCHEDULER_LEVELS;
+		}
+		else
+		{
+			cpu->sliceEnd = pit_getUptime() + newThread->timeslice;
+			cpu->level = newThread->queueLevel;
 		}
 	}
 
-	return currentThread->State;
+	if(timerActive)
+		scheduler_armTimer(cpu, self);
+
+	return (cpu->thread != NULL) ? cpu->thread->State : state;
+}
+
+/*
+ * Interrupt des APIC-Timers. Wird auch ausgelöst, wenn eine untätige CPU einen
+ * Thread übernehmen soll.
+ */
+static ihs_t *scheduler_timerHandler(ihs_t *ihs)
+{
+	uint32_t self = cpu_getId();
+	scheduler_cpu_t *cpu = &scheduler_cpus[self];
+
+	apic_EOI();
+
+	if(self == 0)
+		pit_RunTimers();
+
+	if(cpu->thread == NULL || cpu->thread == cpu->idleThread || cpu->preempt
+			|| pit_getUptime() >= cpu->sliceEnd)
+		return scheduler_schedule(ihs);
+
+	scheduler_armTimer(cpu, self);
+	return ihs;
+}
+
+/*
+ * Wird am Ende jedes Interrupts aufgerufen. Wurde der Thread gewechselt, gibt die
+ * Funktion die Variable zurück, über die der alte Thread für die anderen CPUs
+ * freigegeben wird. Sie wird erst nach dem Wechsel des Stacks auf -1 gesetzt.
+ *
+ * Rückgabe:	Zeiger auf thread_t.activeCPU des alten Threads oder NULL
+ */
+volatile int32_t *scheduler_pendingRelease()
+{
+	scheduler_cpu_t *cpu = &scheduler_cpus[cpu_getId()];
+	thread_t *thread = cpu->releaseThread;
+
+	if(thread == NULL)
+		return NULL;
+
+	cpu->releaseThread = NULL;
+	return &thread->activeCPU;
 }
 
 /*
@@ -13,18 +13,72 @@
 #include "cpu.h"
 #include "stdbool.h"
 #include "isr.h"
+#include "ring.h"
+#include "lock.h"
+
+#define SCHEDULER_TIMER_VECTOR	49		//APIC-Timer und Aufwecken einer untätigen CPU
+#define SCHEDULER_TIMESLICE		50		//Standardlänge einer Zeitscheibe in ms
+#define SCHEDULER_TIMESLICE_USER_MAX	(4 * SCHEDULER_TIMESLICE)	//Längste Zeitscheibe, die der Userspace festlegen darf
+
+//Warteschlangen pro CPU, nach absteigender Priorität
+#define SCHEDULER_LEVEL_REALTIME	0
+#define SCHEDULER_LEVEL_BOOSTED		1		//Normale Threads, die nach einer Ein-/Ausgabe aufgeweckt wurden
+#define SCHEDULER_LEVEL_NORMAL		2
+#define SCHEDULER_LEVEL_IDLE		3
+#define SCHEDULER_LEVELS			4
+
+//Zustand des Schedulers einer CPU
+typedef struct{
+	ring_t *queue[SCHEDULER_LEVELS];	//Threads, die auf dieser CPU laufen sollen
+	uint32_t levelMask;				//Bit n ist gesetzt, wenn queue[n] nicht leer ist
+	lock_t lock;					//Schützt queue und levelMask
+	bool online;
+	thread_t *thread;				//Aktueller Thread
+	process_t *process;				//Aktueller Prozess
+	thread_t *idleThread;
+	thread_t *fpuThread;			//Thread, dessen FPU-Zustand in den Registern liegt
+	thread_t *releaseThread;		//Thread, dessen Stack noch bis zum Ende des Interrupts benutzt wird
+	uint64_t sliceEnd;				//Ende der Zeitscheibe des aktuellen Threads (Uptime in ms)
+	uint8_t level;					//Warteschlange des aktuellen Threads (SCHEDULER_LEVELS für den Idle-Thread)
+	volatile bool preempt;			//Ein Thread mit höherer Priorität wartet
+}scheduler_cpu_t;
 
 extern process_t kernel_process;
-extern thread_t *currentThread;
-extern process_t *currentProcess;
+extern scheduler_cpu_t scheduler_cpus[CPU_MAX];
+
+//Gibt den aktuellen Thread bzw. Prozess der CPU zurück. Die Interrupts werden kurz
+//deaktiviert, damit der Thread zwischen dem Bestimmen der CPU und dem Lesen nicht
+//auf eine andere CPU wechseln kann.
+static inline thread_t *scheduler_currentThread(void)
+{
+	bool enabled = cpu_disableInterrupts();
+	thread_t *thread = scheduler_cpus[cpu_getId()].thread;
+	cpu_restoreInterrupts(enabled);
+	return thread;
+}
+
+static inline process_t *scheduler_currentProcess(void)
+{
+	bool enabled = cpu_disableInterrupts();
+	process_t *process = scheduler_cpus[cpu_getId()].process;
+	cpu_restoreInterrupts(enabled);
+	return process;
+}
+
+#define currentThread	(scheduler_currentThread())
+#define currentProcess	(scheduler_currentProcess())
 
 void scheduler_Init();
+void scheduler_InitCPU(uint32_t cpu);
 void scheduler_activate();
 void scheduler_add(thread_t *thread);
 bool scheduler_try_add(thread_t *thread);
 void scheduler_remove(thread_t *thread);
+void scheduler_requeue(thread_t *thread);
+void scheduler_TimerChanged(void);
 
 ihs_t *scheduler_schedule(ihs_t *state);
+volatile int32_t *scheduler_pendingRelease(void);
 
 void yield();
 
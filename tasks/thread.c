@@ -16,6 +16,7 @@
 #include "scheduler.h"
 #include "pmm.h"
 #include "assert.h"
+#include "pit.h"
 
 extern context_t kernel_context;
 
@@ -32,10 +33,11 @@ void thread_Init()
 	threadList = list_create();
 }
 
-thread_t *thread_create(process_t *process, void *entry, size_t data_length, void *data, bool kernel)
+//Alloziiert einen Thread und initialisiert die Felder, die nicht vom Registerzustand abhängen
+static thread_t *thread_alloc(process_t *process)
 {
 	thread_t *thread = (thread_t*)malloc(sizeof(thread_t));
-	if(thread == NULL || data_length >= MM_USER_STACK_SIZE)
+	if(thread == NULL)
 		return NULL;
 
 	thread->isMainThread = (process != currentProcess);
@@ -46,6 +48,25 @@ thread_t *thread_create(process_t *process, void *entry, size_t data_length, voi
 
 	thread->Status.block_reason = THREAD_BLOCKED;
 	thread->Status.status = THREAD_BLOCKED_NOT_BLOCKED;
+	thread->queueCPU = -1;
+	thread->activeCPU = -1;
+	thread->timeslice = SCHEDULER_TIMESLICE;
+	thread->priority = THREAD_PRIORITY_NORMAL;
+	thread->boosted = false;
+	thread->timer.pprev = NULL;
+	thread->fpuState = NULL;
+
+	return thread;
+}
+
+thread_t *thread_create(process_t *process, void *entry, size_t data_length, void *data, bool kernel)
+{
+	if(data_length >= MM_USER_STACK_SIZE)
+		return NULL;
+	thread_t *thread = thread_alloc(process);
+	if(thread == NULL)
+		return NULL;
+
 	// CPU-Zustand für den neuen Task festlegen
 	ihs_t new_state = {
 			.cs = (kernel) ? 0x8 : 0x20 + 3,	//Kernel- oder Userspace
@@ -76,8 +97,6 @@ thread_t *thread_create(process_t *process, void *entry, size_t data_length, voi
 		memcpy(thread->State, &new_state, sizeof(ihs_t));
 	}
 
-	thread->fpuState = NULL;
-
 	//Stack mappen
 	if(!kernel)
 	{
@@ -91,6 +110,7 @@ thread_t *thread_create(process_t *process, void *entry, size_t data_length, voi
 	}
 	else
 	{
+		thread->userStackBottom = NULL;
 		thread->kernelStackBottom = mm_SysAlloc(1);
 		new_state.rsp = (uintptr_t)thread->kernelStackBottom + MM_BLOCK_SIZE;
 		thread->State = (ihs_t*)(new_state.rsp - sizeof(ihs_t));
@@ -105,8 +125,65 @@ thread_t *thread_create(process_t *process, void *entry, size_t data_length, voi
 	return thread;
 }
 
+/*
+ * Erstellt eine Kopie eines Userspace-Threads in einem neuen Prozess (fork). Der Userstack
+ * liegt im kopierten Adressraum schon an derselben Adresse.
+ * Parameter:	process = neuer Prozess
+ * 				thread = zu kopierender Thread, muss der aktuelle Thread sein
+ * 				state = Registerzustand, mit dem der neue Thread fortfährt. Er bekommt 0 als
+ * 						Rückgabewert des Syscalls.
+ * Rückgabe:	neuer Thread oder NULL, wenn zu wenig Speicher vorhanden ist
+ */
+thread_t *thread_clone(process_t *process, thread_t *thread, const ihs_t *state)
+{
+	assert(thread == currentThread && thread->userStackBottom != NULL);
+	thread_t *clone = thread_alloc(process);
+	if(clone == NULL)
+		return NULL;
+
+	clone->timeslice = thread->timeslice;
+	clone->priority = thread->priority;
+
+	if(thread->fpuState != NULL)
+	{
+		if((clone->fpuState = malloc(512 + 16)) == NULL)
+		{
+			free(clone);
+			return NULL;
+		}
+
+		//Liegt der FPU-Zustand noch in den Registern, muss er zuerst gesichert werden
+		bool enabled = cpu_disableInterrupts();
+		if(cpuInfo.fxsr && scheduler_cpus[cpu_getId()].fpuThread == thread)
+			asm volatile("fxsave (%0)": :"r"((((uintptr_t)thread->fpuState) + 15) & ~0xF) : "memory");
+		memcpy((void*)((((uintptr_t)clone->fpuState) + 15) & ~0xF), (void*)((((uintptr_t)thread->fpuState) + 15) & ~0xF), 512);
+		cpu_restoreInterrupts(enabled);
+	}
+
+	clone->kernelStackBottom = mm_SysAlloc(1);
+	if(clone->kernelStackBottom == NULL)
+	{
+		free(clone->fpuState);
+		free(clone);
+		return NULL;
+	}
+	clone->kernelStack = clone->kernelStackBottom + MM_BLOCK_SIZE;
+	clone->State = (ihs_t*)(clone->kernelStack - sizeof(ihs_t));
+	memcpy(clone->State, state, sizeof(ihs_t));
+	clone->State->rax = 0;
+	clone->State->interrupt = 32;
+
+	clone->userStackBottom = thread->userStackBottom;
+
+	list_push(process->threads, clone);
+	list_push(threadList, clone);
+
+	return clone;
+}
+
 void thread_destroy(thread_t *thread)
 {
+	pit_CancelTimeout(&thread->timer);
 	mm_SysFree(thread->kernelStackBottom, 1);
 
 	//Thread aus Listen entfernen
@@ -133,8 +210,9 @@ void thread_destroy(thread_t *thread)
 		i++;
 	}
 
-	//Userstack freigeben
-	vmm_ContextUnMap(thread->process->Context, thread->userStackBottom, true);
+	//Userstack freigeben (Kernelthreads haben keinen)
+	if(thread->userStackBottom != NULL)
+		vmm_UnMapRange(thread->process->Context, thread->userStackBottom, MM_USER_STACK_SIZE / MM_BLOCK_SIZE, true);
 
 	free(thread->fpuState);
 	free(thread);
@@ -152,23 +230,47 @@ bool thread_block(thread_t *thread, thread_block_reason_t reason)
 	if(__sync_bool_compare_and_swap(&thread->Status.full_status, expected.full_status, newStatus.full_status))
 	{
 		scheduler_remove(thread);
+		//Wurde der Thread inzwischen wieder aufgeweckt, hat das Einfügen in die
+		//Schedulingliste nichts bewirkt, weil er noch drin war
+		if(thread->Status.status != THREAD_BLOCKED)
+			scheduler_add(thread);
 		return true;
 	}
 	return false;
 }
 
-bool thread_block_self(thread_bail_out_t bail, void *context, thread_block_reason_t reason)
+/*
+ * Blockiert den aktuellen Thread, ausser cond(context) ist erfüllt. Die Bedingung
+ * wird erst geprüft, nachdem der Thread als blockiert markiert wurde. Damit geht
+ * kein Aufwecken verloren, das zwischen Prüfen und Blockieren (z.B. auf einer
+ * anderen CPU) passiert.
+ * Parameter:	cond = Bedingung oder NULL
+ * 				context = Parameter für cond
+ * 				reason = Grund für die Blockierung
+ * Rückgabe:	false, wenn der Prozess nicht mehr läuft
+ */
+bool thread_block_self_unless(bool (*cond)(void*), void *context, thread_block_reason_t reason)
 {
-	assert(currentThread != NULL);
+	thread_t *thread = currentThread;
+	assert(thread != NULL);
 	const thread_status_t expected = {{THREAD_RUNNING, THREAD_BLOCKED_NOT_BLOCKED}};
 	thread_status_t newStatus = {{THREAD_BLOCKED, reason}};
-	if(__sync_bool_compare_and_swap(&currentThread->Status.full_status, expected.full_status, newStatus.full_status))
+	if(__sync_bool_compare_and_swap(&thread->Status.full_status, expected.full_status, newStatus.full_status))
 	{
-		scheduler_remove(currentThread);
-		while(currentThread->Status.status == THREAD_BLOCKED) yield();
+		scheduler_remove(thread);
+		if(cond != NULL && cond(context))
+			__sync_bool_compare_and_swap(&thread->Status.full_status, newStatus.full_status, expected.full_status);
+		if(thread->Status.status != THREAD_BLOCKED)
+			scheduler_add(thread);
+		while(thread->Status.status == THREAD_BLOCKED) yield();
 	}
 
-	if(currentProcess->Status != PM_RUNNING)
+	return currentProcess->Status == PM_RUNNING;
+}
+
+bool thread_block_self(thread_bail_out_t bail, void *context, thread_block_reason_t reason)
+{
+	if(!thread_block_self_unless(NULL, NULL, reason))
 	{
 		if(bail != NULL)
 			bail(context);
@@ -178,6 +280,19 @@ bool thread_block_self(thread_bail_out_t bail, void *context, thread_block_reaso
 	return true;
 }
 
+/*
+ * Gibt einem Thread, der auf eine Ein-/Ausgabe oder eine Semaphore gewartet hat,
+ * einen Bonus, damit er nicht hinter rechenintensiven Threads warten muss.
+ * Parameter:	thread = Thread, der gerade aufgeweckt wird
+ * 				reason = Grund, warum er blockiert war
+ */
+static void thread_boost(thread_t *thread, thread_block_reason_t reason)
+{
+	if(reason == THREAD_BLOCKED_USER_IO || reason == THREAD_BLOCKED_SEMAPHORE
+			|| reason == THREAD_BLOCKED_WAIT_IRQ)
+		thread->boosted = true;
+}
+
 bool thread_try_unblock(thread_t *thread)
 {
 	assert(thread != NULL);
@@ -185,6 +300,7 @@ bool thread_try_unblock(thread_t *thread)
 	const thread_status_t newStatus = {{THREAD_RUNNING, THREAD_BLOCKED_NOT_BLOCKED}};
 	if(__sync_bool_compare_and_swap(&thread->Status.full_status, expected.full_status, newStatus.full_status))
 	{
+		thread_boost(thread, expected.block_reason);
 		if(!scheduler_try_add(thread))
 		{
 			thread->Status.block_reason = expected.block_reason;
@@ -208,6 +324,7 @@ void thread_unblock(thread_t *thread)
 	{
 		assert(++try_count > 1000 && "Thread could not been unblocked");
 	}
+	thread_boost(thread, expected.block_reason);
 	scheduler_add(thread);
 }
 
@@ -215,3 +332,32 @@ void thread_waitUserIO()
 {
 	thread_block_self(NULL, NULL, THREAD_BLOCKED_USER_IO);
 }
+
+/*
+ * Legt die Länge der Zeitscheibe eines Threads fest. Sie gilt ab dem nächsten
+ * Mal, wenn der Thread ausgewählt wird.
+ * Parameter:	thread = Thread
+ * 				msec = Länge der Zeitscheibe in ms (mindestens 1)
+ */
+void thread_setTimeslice(thread_t *thread, uint32_t msec)
+{
+	assert(thread != NULL);
+	thread->timeslice = msec ? : 1;
+}
+
+/*
+ * Ändert die Priorität eines Threads
+ * Parameter:	thread = Thread
+ * 				priority = neue Priorität
+ * Rückgabe:	false, wenn die Priorität ungültig ist
+ */
+bool thread_setPriority(thread_t *thread, thread_priority_t priority)
+{
+	assert(thread != NULL);
+	if(priority > THREAD_PRIORITY_IDLE)
+		return false;
+
+	thread->priority = priority;
+	scheduler_requeue(thread);
+	return true;
+}
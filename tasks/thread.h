@@ -19,6 +19,7 @@
 #include "stdbool.h"
 #include "ring.h"
 #include <bits/types.h>
+#include <bits/sys_types.h>
 
 typedef _tid_t tid_t;
 
@@ -46,6 +47,11 @@ typedef enum{
 	 */
 	THREAD_BLOCKED_SEMAPHORE,
 
+	/**
+	 * Thread is waiting for an IRQ
+	 */
+	THREAD_BLOCKED_WAIT_IRQ,
+
 	/**
 	 * Thread is waiting for unknown reason
 	 */
@@ -90,6 +96,31 @@ typedef union{
 	uint64_t full_status;
 }thread_status_t __attribute__((aligned(16)));
 
+/**
+ * \brief Node of the timer wheel in pit.c. Every thread can have one pending timer.
+ */
+typedef struct thread_timer_s{
+	/**
+	 * The next timer in the same slot of the wheel.
+	 */
+	struct thread_timer_s *next;
+
+	/**
+	 * The pointer which points to this timer or NULL if the timer is not pending.
+	 */
+	struct thread_timer_s **pprev;
+
+	/**
+	 * The uptime in ms at which the timer expires.
+	 */
+	uint64_t expires;
+
+	/**
+	 * The slot of the wheel the timer is in.
+	 */
+	uint16_t slot;
+}thread_timer_t;
+
 /**
  * \brief Structure describing a thread.
  */
@@ -138,18 +169,60 @@ typedef struct{
 	 * Determines if the thread is the main thread of the process.
 	 */
 	bool isMainThread;
+
+	/**
+	 * The cpu in whose scheduler queue the thread is (-1 if not queued).
+	 */
+	volatile int32_t queueCPU;
+
+	/**
+	 * The cpu which runs or last ran on the kernel stack of the thread and has
+	 * not yet left it (-1 if none). Only this cpu may resume the thread.
+	 */
+	volatile int32_t activeCPU;
+
+	/**
+	 * The length of the time slice of the thread in ms.
+	 */
+	uint32_t timeslice;
+
+	/**
+	 * The scheduling priority of the thread.
+	 */
+	thread_priority_t priority;
+
+	/**
+	 * Set when the thread was woken from an I/O or semaphore wait. A boosted
+	 * normal thread runs before the other normal threads until it has used up
+	 * a whole time slice.
+	 */
+	bool boosted;
+
+	/**
+	 * The level of the scheduler queue the thread is in.
+	 */
+	uint8_t queueLevel;
+
+	/**
+	 * The timer used for sleeping and timeouts.
+	 */
+	thread_timer_t timer;
 }thread_t;
 
 typedef void(*thread_bail_out_t)(void*);
 
 void thread_Init();
 thread_t *thread_create(process_t *process, void *entry, size_t data_length, void *data, bool kernel);
+thread_t *thread_clone(process_t *process, thread_t *thread, const ihs_t *state);
 void thread_destroy(thread_t *thread);
 void thread_prepare(thread_t *thread);
 bool thread_block(thread_t *thread, thread_block_reason_t reason);
 bool thread_block_self(thread_bail_out_t bail, void *context, thread_block_reason_t reason);
+bool thread_block_self_unless(bool (*cond)(void*), void *context, thread_block_reason_t reason);
 bool thread_try_unblock(thread_t *thread);
 void thread_unblock(thread_t *thread);
 void thread_waitUserIO();
+void thread_setTimeslice(thread_t *thread, uint32_t msec);
+bool thread_setPriority(thread_t *thread, thread_priority_t priority);
 
 #endif /* THREAD_H_ */
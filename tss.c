@@ -9,32 +9,72 @@
 
 #include "tss.h"
 #include "gdt.h"
+#include "cpu.h"
 #include "string.h"
+#include "stdlib.h"
 
-#define SELECTOR	5
+#define KERNEL_GS_BASE	0xC0000102
 
-tss_entry_t tss;
+tss_entry_t tss;									//TSS der BSP
+static tss_entry_t *tss_cpus[CPU_MAX] = {&tss};		//TSS jeder CPU
 
 void TSS_Init()
 {
+	TSS_Prepare(0);
+	TSS_Load(0);
+}
+
+/*
+ * Legt die TSS einer CPU an und trägt sie in die GDT ein. Muss vor dem Starten
+ * der entsprechenden CPU aufgerufen werden.
+ * Parameter:	cpu = Nummer der CPU
+ * Rückgabe:	false, wenn kein Speicher für die TSS reserviert werden konnte
+ */
+bool TSS_Prepare(uint32_t cpu)
+{
+	tss_entry_t *entry = tss_cpus[cpu];
+	if(entry == NULL)
+	{
+		entry = calloc(1, sizeof(tss_entry_t));
+		if(entry == NULL)
+			return false;
+		tss_cpus[cpu] = entry;
+	}
+
 	//GDT-Eintrag erstellen
-	GDT_SetSystemDescriptor(SELECTOR, (uintptr_t)&tss, sizeof(tss), 0x89, 0x0);
+	GDT_SetSystemDescriptor(CPU_TSS_ENTRY + 2 * cpu, (uintptr_t)entry, sizeof(tss_entry_t), 0x89, 0x0);
+
+	//TSS initialisieren
+	entry->MapBaseAddress = 0x96;
+	memset(entry->IOPD, 0, 8192);
+
+	return true;
+}
 
+/*
+ * Lädt die TSS einer CPU. Muss auf der CPU selber aufgerufen werden.
+ * Parameter:	cpu = Nummer der CPU
+ */
+void TSS_Load(uint32_t cpu)
+{
 	//Task-Segment Selector
 	tr_t tr;
-	tr.Selector = SELECTOR << 3;
-
-	//TSS initialisieren
-	tss.MapBaseAddress = 0x96;
-	memset(tss.IOPD, 0, 8192);
+	tr.Selector = (CPU_TSS_ENTRY + 2 * cpu) << 3;
 
 	//Taskergister laden
 	asm volatile("ltr %0" : : "m"(tr));
+
+	//Der Syscall-Handler holt sich den Kernelstack über swapgs aus der TSS
+	cpu_MSRwrite(KERNEL_GS_BASE, (uintptr_t)tss_cpus[cpu]);
 }
 
+/*
+ * Setzt den Kernelstack der aktuellen CPU. Interrupts müssen deaktiviert sein.
+ * Parameter:	stack = Stackpointer, der beim Wechsel in den Kernel geladen wird
+ */
 void TSS_setStack(void *stack)
 {
-	tss.rsp0 = (uint64_t)stack;
+	tss_cpus[cpu_getId()]->rsp0 = (uint64_t)stack;
 }
 
 #endif
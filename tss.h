@@ -10,6 +10,7 @@
 #ifndef TSS_H_
 #define TSS_H_
 #include "stdint.h"
+#include "stdbool.h"
 
 typedef struct{
 		uint16_t Selector;
@@ -35,6 +36,8 @@ typedef struct{
 }__attribute__((packed))tss_entry_t;
 
 void TSS_Init(void);
+bool TSS_Prepare(uint32_t cpu);
+void TSS_Load(uint32_t cpu);
 void TSS_setStack(void *stack);
 
 #endif /* TSS_H_ */
@@ -7,15 +7,130 @@
 
 #include "system.h"
 #include "pmm.h"
+#include "pit.h"
+#include "mm.h"
+#include "swap.h"
+#include "vfs.h"
+#include "pm.h"
+#include "cache.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define MEMINFO_BUFFER_SIZE		16384	//Maximale Grösse des Textes von /dev/meminfo
+
+typedef struct{
+	char *buffer;
+	size_t pos;
+}meminfo_text_t;
+
+static size_t meminfo_readHandler(void *opaque, uint64_t start, size_t length, void *buffer);
+static void *meminfo_functionHandler(void *opaque, vfs_device_function_t function, ...);
+static vfs_device_capabilities_t meminfo_getCapabilitiesHandler(void *opaque);
+
+static vfs_device_t meminfo_device = {
+	.read = meminfo_readHandler,
+	.function = meminfo_functionHandler,
+	.getCapabilities = meminfo_getCapabilitiesHandler
+};
+
+/*
+ * Registriert die Gerätedatei /dev/meminfo. Das VFS muss initialisiert sein.
+ */
+void system_Init()
+{
+	vfs_RegisterDevice(&meminfo_device);
+}
 
-extern uint64_t Uptime;
 /*
  * Speichert Systeminformationen in die übergebene Struktur
  * Parameter:	Adresse auf die Systeminformationen-Struktur
  */
 void getSystemInformation(SIS *Struktur)
 {
+	size_t heapSize, heapUsed, swapSlots, swapUsed;
+
+	mm_getHeapInfo(&heapSize, &heapUsed);
+	swap_getInfo(&swapSlots, &swapUsed);
+
 	Struktur->physSpeicher = pmm_getTotalPages() * 4096;
 	Struktur->physFree = pmm_getFreePages() * 4096;
-	Struktur->Uptime = Uptime;
+	Struktur->Uptime = pit_getUptime();
+	Struktur->heapSize = heapSize;
+	Struktur->heapUsed = heapUsed;
+	Struktur->blockCache = cdi_cache_getTotalSize();
+	Struktur->vfsResources = vfs_getLoadedResources();
+	Struktur->swapTotal = swapSlots * 4096;
+	Struktur->swapUsed = swapUsed * 4096;
+}
+
+//Wird mit gesperrtem pm_lock aufgerufen
+static void meminfo_visitProcess(const process_t *process, const process_meminfo_t *info, void *opaque)
+{
+	meminfo_text_t *text = opaque;
+
+	if(text->pos >= MEMINFO_BUFFER_SIZE)
+		return;
+	text->pos += snprintf(text->buffer + text->pos, MEMINFO_BUFFER_SIZE - text->pos,
+			"%5lu %10lu %10lu %8lu %10lu %8lu %10lu %s\n", process->PID,
+			info->residentPages * 4, info->mappedPages * 4, info->tablePages * 4,
+			info->minorFaults, info->majorFaults, info->zeroFillFaults, process->cmd ? : "");
+}
+
+/*
+ * Erzeugt den Text von /dev/meminfo bei jedem Lesen neu
+ */
+static size_t meminfo_readHandler(void *opaque __attribute__((unused)), uint64_t start, size_t length, void *buffer)
+{
+	meminfo_text_t text;
+	SIS info;
+
+	text.buffer = malloc(MEMINFO_BUFFER_SIZE);
+	if(text.buffer == NULL)
+		return 0;
+
+	getSystemInformation(&info);
+	text.pos = snprintf(text.buffer, MEMINFO_BUFFER_SIZE,
+			"MemTotal:     %10lu kB\n"
+			"MemFree:      %10lu kB\n"
+			"KernelHeap:   %10lu kB\n"
+			"HeapUsed:     %10lu kB\n"
+			"BlockCache:   %10lu kB\n"
+			"VfsResources: %10lu\n"
+			"SwapTotal:    %10lu kB\n"
+			"SwapFree:     %10lu kB\n"
+			"\n"
+			"  PID   Resident     Mapped   Tables      Minor    Major   ZeroFill Command\n",
+			info.physSpeicher / 1024, info.physFree / 1024, info.heapSize / 1024, info.heapUsed / 1024,
+			info.blockCache / 1024, info.vfsResources, info.swapTotal / 1024, (info.swapTotal - info.swapUsed) / 1024);
+	pm_visitMemInfo(meminfo_visitProcess, &text);
+	if(text.pos > MEMINFO_BUFFER_SIZE - 1)
+		text.pos = MEMINFO_BUFFER_SIZE - 1;
+
+	if(start >= text.pos)
+		length = 0;
+	else if(length > text.pos - start)
+		length = text.pos - start;
+	memcpy(buffer, text.buffer + start, length);
+
+	free(text.buffer);
+	return length;
+}
+
+static void *meminfo_functionHandler(void *opaque __attribute__((unused)), vfs_device_function_t function, ...)
+{
+	switch(function)
+	{
+		case VFS_DEV_FUNC_TYPE:
+			return (void*)VFS_DEVICE_VIRTUAL;
+		case VFS_DEV_FUNC_NAME:
+			return "meminfo";
+		default:
+			return NULL;
+	}
+}
+
+static vfs_device_capabilities_t meminfo_getCapabilitiesHandler(void *opaque __attribute__((unused)))
+{
+	return 0;
 }
@@ -10,6 +10,7 @@
 
 #include <bits/sys_types.h>
 
+void system_Init(void);
 void getSystemInformation(SIS *Struktur);
 
 #endif /* SYSTEM_H_ */
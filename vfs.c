@@ -17,12 +17,15 @@
 #include "stdio.h"
 #include "lock.h"
 #include "assert.h"
+#include "scheduler.h"
 #include "pm.h"
 #include "hashmap.h"
 #include "ctype.h"
 #include "path.h"
+#include "shrinker.h"
 
-#define MAX_RES_BUFFER	100		//Anzahl an Ressourcen, die maximal geladen werden. Wenn der Buffer voll ist werden nicht benötigte Ressourcen überschrieben
+#define MAX_RES_BUFFER	100		//So viele Ressourcen dürfen immer geladen sein, darüber nur bei genügend freiem Speicher. Sonst werden nicht benötigte Ressourcen entladen
+#define RES_PER_PAGE	4		//Geschätzte Anzahl geladener Ressourcen, die zusammen eine Page belegen
 
 struct vfs_stream;
 
@@ -60,8 +63,16 @@ typedef struct{
 	vfs_mode_t mode;
 }vfs_userspace_stream_t;
 
+//Geladene Ressource mit ihrem Dateisystem, das zum Entladen benötigt wird
+typedef struct{
+	struct cdi_fs_res *res;
+	struct cdi_fs_filesystem *fs;
+}vfs_loaded_res_t;
+
 static vfs_node_t root;
-static list_t res_list;
+static list_t res_list;			//vfs_loaded_res_t
+static lock_t res_lock = LOCK_UNLOCKED;
+static shrinker_t res_shrinker;
 static hashmap_t *streams = NULL;	//geöffnete Streams
 static lock_t vfs_lock = LOCK_LOCKED;
 
@@ -101,23 +112,95 @@ static void freeDirs(char ***Dirs, size_t size)
 
 static void removeChilds(cdi_list_t childs)
 {
-	struct cdi_fs_res *res, *res2;
+	struct cdi_fs_res *res;
 	size_t i = 0;
 	while((res = cdi_list_get(childs, i++)))
 	{
-		removeChilds(res->children);
+		vfs_loaded_res_t *loaded;
 		size_t j = 0;
-		while((res2 = list_get(res_list, j)))
+		removeChilds(res->children);
+		while((loaded = list_get(res_list, j)))
 		{
-			if(res2 == res)
-				list_remove(res_list, j);
-			j++;
+			if(loaded->res == res)
+				free(list_remove(res_list, j));
+			else
+				j++;
+		}
+	}
+}
+
+/*
+ * Entlädt Ressourcen, die nirgends verwendet werden. res_lock muss gesperrt sein.
+ * Parameter:	count = Anzahl Ressourcen, die höchstens entladen werden
+ * Rückgabe:	Anzahl entladener Ressourcen
+ */
+static size_t unloadRes(size_t count)
+{
+	vfs_loaded_res_t *loaded;
+	size_t i = 0, unloaded = 0;
+	while(unloaded < count && (loaded = list_get(res_list, i)) != NULL)
+	{
+		struct cdi_fs_res *res = loaded->res;
+
+		//Wenn die Ressource nicht geladen ist löschen wir sie einfach aus der Liste
+		if(!res->loaded)
+		{
+			free(list_remove(res_list, i));
+			unloaded++;
+			continue;
+		}
+
+		//Wenn die Ressource nirgends verwendet wird, können wir sie entladen
+		if(res->stream_cnt <= 0)
+		{
+			struct cdi_fs_stream unload_stream = {
+					.fs = loaded->fs,
+					.res = res
+			};
+
+			//Erst müssen wir alle Kinder noch von der Liste entfernen, da diese auch zerstört werden
+			removeChilds(res->children);
+
+			if(res->res->unload(&unload_stream))
+			{
+				//Die Liste kann sich durch removeChilds verschoben haben
+				i = 0;
+				while((loaded = list_get(res_list, i)) != NULL && loaded->res != res)
+					i++;
+				if(loaded != NULL)
+					free(list_remove(res_list, i));
+				unloaded++;
+				continue;
+			}
 		}
+		i++;
 	}
+	return unloaded;
+}
+
+static size_t res_shrink_count(void *opaque __attribute__((unused)))
+{
+	return list_size(res_list) / RES_PER_PAGE;
+}
+
+static size_t res_shrink_scan(size_t pages, void *opaque __attribute__((unused)))
+{
+	size_t unloaded;
+	if(!try_lock(&res_lock))
+		return 0;
+	unloaded = unloadRes(pages * RES_PER_PAGE);
+	unlock(&res_lock);
+	return (unloaded + RES_PER_PAGE - 1) / RES_PER_PAGE;
+}
+
+/*
+ * Gibt die Anzahl geladener Ressourcen zurück
+ */
+size_t vfs_getLoadedResources(void)
+{
+	return list_size(res_list);
 }
 
-//TODO: Wenn der RAM voll ist werden weniger Ressourcen gecacht
-//TODO: Wenn der RAM knapp wird kann die Speicherverwaltung das VFS auffordern den RAM ein bisschen frei zu machen
 /*
  * Lädt wenn nötig eine Ressource
  * Parameter:	res = Ressource, die geladen werden soll
@@ -132,50 +215,30 @@ static bool loadRes(struct cdi_fs_res *res, struct cdi_fs_stream *stream)
 			.res = res
 	};
 
+	lock(&res_lock);
 	if(!res->loaded)
 	{
-		if(list_size(res_list) >= MAX_RES_BUFFER)
-		{
-			struct cdi_fs_res *tmpRes;
-			size_t i = 0;
-			while((tmpRes = list_get(res_list, i)) != NULL)
-			{
-				//Wenn die Ressource nicht geladen ist löschen wir sie einfach aus der Liste
-				if(!tmpRes->loaded)
-				{
-					list_remove(res_list, i);
-					break;
-				}
-
-				//Wenn die Ressource nirgends verwendet wird, können wir sie entladen
-				if(tmpRes->stream_cnt <= 0)
-				{
-					struct cdi_fs_stream unload_stream = {
-							.fs = stream->fs,
-							.res = res
-					};
+		vfs_loaded_res_t *loaded;
 
-					//Erst müssen wir alle Kinder noch von der Liste entfernen, da diese auch zerstört werden
-					removeChilds(tmpRes->children);
-
-					if(tmpRes->res->unload(&unload_stream))
-					{
-						list_remove(res_list, i);
-						break;
-					}
-				}
-				i++;
-			}
-			//Wenn keine Ressource freigegeben werden konnte, dann kann die neue Ressource nicht geladen werden
-			if(i >= list_size(res_list))
-				return false;
+		//Wenn der Speicher knapp ist, muss eine andere Ressource Platz machen
+		if(list_size(res_list) >= MAX_RES_BUFFER && !shrinker_canGrow() && unloadRes(1) == 0)
+		{
+			unlock(&res_lock);
+			return false;
 		}
 
-		if(!res->res->load(&tmpStream))
+		if((loaded = malloc(sizeof(*loaded))) == NULL || !res->res->load(&tmpStream))
+		{
+			free(loaded);
+			unlock(&res_lock);
 			return false;
-		list_push(res_list, res);
+		}
+		loaded->res = res;
+		loaded->fs = stream->fs;
+		list_push(res_list, loaded);
 	}
 	res->stream_cnt++;
+	unlock(&res_lock);
 	return true;
 }
 
@@ -703,6 +766,12 @@ static int createDirEntry(const char *path, vfs_node_type_t type)
 void vfs_Init(void)
 {
 	res_list = list_create();
+	res_shrinker = (shrinker_t){
+		.name = "vfs_res",
+		.count = res_shrink_count,
+		.scan = res_shrink_scan
+	};
+	shrinker_Register(&res_shrinker);
 	streams = hashmap_create(streamid_hash, streamid_hash, streamid_equal, NULL, vfs_stream_free, NULL, NULL, 3);
 	assert(streams != NULL);
 
@@ -1168,6 +1237,63 @@ int vfs_initUserspace(process_t *parent, process_t *p, const char *stdin, const
 	return 1;
 }
 
+typedef struct{
+	hashmap_t *streams;
+	bool success;
+}vfs_clone_context_t;
+
+static void vfs_cloneStream(__attribute__((unused)) const void *key, const void *obj, void *context)
+{
+	const vfs_userspace_stream_t *stream = obj;
+	vfs_clone_context_t *clone = context;
+
+	if(!clone->success)
+		return;
+
+	vfs_userspace_stream_t *copy = malloc(sizeof(vfs_userspace_stream_t));
+	if(copy == NULL)
+	{
+		clone->success = false;
+		return;
+	}
+	copy->id = stream->id;
+	copy->mode = stream->mode;
+	copy->stream = vfs_Reopen(stream->stream, stream->mode);
+	if(copy->stream == -1ul)
+	{
+		free(copy);
+		clone->success = false;
+		return;
+	}
+	hashmap_set(clone->streams, (void*)copy->id, copy);
+}
+
+/*
+ * Übernimmt alle Streams eines Prozesses mit denselben IDs in einen neuen Prozess (z.B. bei fork)
+ * Parameter:	parent = Prozess, dessen Streams kopiert werden
+ * 				p = neuer Prozess
+ * Rückgabe:	false, wenn nicht alle Streams geöffnet werden konnten
+ */
+bool vfs_cloneUserspace(process_t *parent, process_t *p)
+{
+	assert(parent != NULL && p != NULL);
+	if((p->streams = hashmap_create(streamid_hash, streamid_hash, streamid_equal, NULL, vfs_userspace_stream_free, NULL, NULL, 3)) == NULL)
+		return false;
+
+	vfs_clone_context_t clone = {
+			.streams = p->streams,
+			.success = true
+	};
+	LOCKED_TASK(parent->lock, hashmap_visit(parent->streams, vfs_cloneStream, &clone));
+	if(!clone.success)
+	{
+		hashmap_destroy(p->streams);
+		p->streams = NULL;
+		return false;
+	}
+	return true;
+}
+
 void vfs_deinitUserspace(process_t *p)
 {
 	assert(p != NULL);
@@ -1234,6 +1360,24 @@ uint64_t vfs_getFileinfo(vfs_file_t streamid, vfs_fileinfo_t info)
 	return 0;
 }
 
+/**
+ * Returns an identifier of the file opened by a stream. All streams of the same file return the
+ * same identifier as long as one of them is open.
+ * \param streamid Stream of the file
+ * \return Identifier or NULL if the stream is not a regular file
+ */
+const void *vfs_getResource(vfs_file_t streamid)
+{
+	vfs_stream_t *stream;
+
+	if(!LOCKED_RESULT(vfs_lock, hashmap_search(streams, (void*)streamid, (void**)&stream)))
+		return NULL;
+
+	if(stream->node->type == TYPE_MOUNT && stream->stream.res->file != NULL)
+		return stream->stream.res;
+	return NULL;
+}
+
 /**
  * Sets metainformations of a file
  * \param stream Stream of which the metainformation should be set
@@ -1460,6 +1604,22 @@ void vfs_RegisterDevice(vfs_device_t *dev)
 	}
 }
 
+/*
+ * Gibt den Stream des Kernels zu einem Stream des aktuellen Prozesses zurück
+ * Parameter:	streamid = ID des Streams im Prozess
+ * 				mode = bekommt den Modus, mit dem der Prozess den Stream geöffnet hat
+ * Rückgabe:	ID des Streams im Kernel oder -1
+ */
+vfs_file_t vfs_getUserspaceStream(vfs_file_t streamid, vfs_mode_t *mode)
+{
+	vfs_userspace_stream_t *stream;
+	assert(currentProcess != NULL);
+	if(!LOCKED_RESULT(currentProcess->lock, hashmap_search(currentProcess->streams, (void*)streamid, (void**)&stream)))
+		return -1;
+	*mode = stream->mode;
+	return stream->stream;
+}
+
 //Syscalls
 //TODO: Define errors correctly via macros
 vfs_file_t vfs_syscall_open(const char *path, vfs_mode_t mode)
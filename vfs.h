@@ -168,9 +168,13 @@ size_t vfs_Write(vfs_file_t streamid, uint64_t start, size_t length, const void
  * 				1: Fehler
  */
 int vfs_initUserspace(process_t *parent, process_t *p, const char *stdin, const char *stdout, const char *stderr);
+bool vfs_cloneUserspace(process_t *parent, process_t *p);
 void vfs_deinitUserspace(process_t *p);
 
 uint64_t vfs_getFileinfo(vfs_file_t streamid, vfs_fileinfo_t info);
+const void *vfs_getResource(vfs_file_t streamid);
+size_t vfs_getLoadedResources(void);
+vfs_file_t vfs_getUserspaceStream(vfs_file_t streamid, vfs_mode_t *mode);
 
 int vfs_truncate(const char *path, size_t size);
 